@@ -0,0 +1,634 @@
+﻿#include <Kamilo.h>
+#include <stdarg.h>
+#include <algorithm>
+
+using namespace Kamilo;
+
+// xlsx2txt のベンチマーク。
+// KZipper で合成したワークブックを使い、変換の各段階を別々に計測する。
+// 乱数の種を固定しているので、同じ引数で実行すれば常に同じワークブックができる
+
+
+// 終了コード
+enum {
+	EXITCODE_OK    = 0,
+	EXITCODE_ERROR = 1,
+	EXITCODE_USAGE = 2,
+};
+
+
+// 合成するワークブックの形
+struct SBookParams {
+	int sheets;      // シート数
+	int rows;        // シートあたりの行数
+	int cols;        // シートあたりの列数
+	float sparsity;  // 値を入れないセルの割合 (0..1)
+	float shared;    // 値の入っているセルのうち、共有文字列を参照するセルの割合 (0..1)。残りは数値セル
+	float unique;    // 共有文字列を参照するセルの数に対する、共有文字列の種類の割合 (0..1)
+	float rich;      // 共有文字列のうち、リッチテキスト (<r> の並び) で書く割合 (0..1)
+	int level;       // ZIP の圧縮レベル (0..9)
+	uint32_t seed;   // 乱数の種
+
+	SBookParams() {
+		sheets = 4;
+		rows = 10000;
+		cols = 20;
+		sparsity = 0.2f;
+		shared = 0.5f;
+		unique = 0.3f;
+		rich = 0.1f;
+		level = 5;
+		seed = 12345;
+	}
+};
+
+
+// 合成したワークブック
+struct SBook {
+	std::string zip;      // .xlsx ファイルの中身
+	int64_t xml_bytes;    // 展開後の全エントリのバイト数
+	int64_t cells;        // 値の入っているセルの数
+	int num_strings;      // 共有文字列の種類
+
+	SBook() {
+		xml_bytes = 0;
+		cells = 0;
+		num_strings = 0;
+	}
+};
+
+
+// 計測結果
+struct SStage {
+	std::string name;
+	double best_sec;  // 最速の回の秒数
+	double mean_sec;  // 平均の秒数
+	int64_t bytes;    // 1回あたりに処理したバイト数。MB/s の計算に使う
+	int64_t cells;    // 1回あたりに処理したセルの数。0 ならば cells/s を出さない
+};
+
+
+// 書き込んだバイト数を数えるだけで、どこにも書き込まない出力先。
+// 書き出しの計測で、メモリの確保やディスクへの書き込みを含めないようにする
+class CNullOutput: public KOutputStream::Impl {
+	int64_t m_Size;
+public:
+	CNullOutput() {
+		m_Size = 0;
+	}
+	virtual int write(const void *buf, int size) override { m_Size += size; return size; }
+	virtual int64_t tell() override { return m_Size; }
+	virtual void seek(int64_t pos) override { m_Size = pos; }
+	virtual bool close() override { return true; }
+	virtual bool isOpen() override { return true; }
+};
+
+
+// 何もしないセルのコールバック。
+// 展開と解析だけを計測するときに使う
+class CNullCellCallback: public KXlsxCallback {
+public:
+	int64_t m_Cells;
+	CNullCellCallback() {
+		m_Cells = 0;
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		m_Cells++;
+	}
+};
+
+
+static void _Log(KLogLv lv, const char *fmt, ...) {
+	char s[1024];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(s, sizeof(s), fmt, args);
+	va_end(args);
+	KLogger::get()->emit(lv, s);
+}
+
+
+static double _Now() {
+	return KClock::getSystemTimeNano64() / 1000000000.0;
+}
+
+
+#pragma region Generator
+static const char *XML_HEADER = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n";
+static const char *NS_MAIN = "http://schemas.openxmlformats.org/spreadsheetml/2006/main";
+static const char *NS_REL = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
+static const char *NS_PKG_REL = "http://schemas.openxmlformats.org/package/2006/relationships";
+
+
+// 長さ 3～20 の単語を空白でつないだ文字列を作る。XML で実体参照になる文字も混ぜる
+static std::string _RandomText(KXorShift &rnd) {
+	static const char *WORDS[] = {
+		"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+		"india", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa",
+		"A&amp;B", "&lt;tag&gt;", "x &quot;y&quot;", u8"日本語", u8"テキスト", u8"値",
+	};
+	static const int NUM_WORDS = sizeof(WORDS) / sizeof(WORDS[0]);
+	std::string s;
+	int n = rnd.randIntRange(1, 4);
+	for (int i=0; i<n; i++) {
+		if (i > 0) s += ' ';
+		s += WORDS[rnd.randInt(NUM_WORDS)];
+	}
+	s += K::str_sprintf(" %u", rnd.random() % 100000);
+	return s;
+}
+
+
+// xl/sharedStrings.xml
+static std::string _MakeSharedStrings(const SBookParams &params, int num_strings, int64_t num_refs, KXorShift &rnd) {
+	std::string xml = XML_HEADER;
+	xml += K::str_sprintf("<sst xmlns=\"%s\" count=\"%lld\" uniqueCount=\"%d\">", NS_MAIN, (long long)num_refs, num_strings);
+	for (int i=0; i<num_strings; i++) {
+		std::string text = _RandomText(rnd);
+		if (rnd.randFloatExcl01() < params.rich) {
+			// リッチテキスト。途中で書式が変わる文字列は <r> の並びになる
+			size_t half = text.find(' ');
+			if (half == std::string::npos) half = text.size();
+			xml += "<si><r><rPr><b/><sz val=\"11\"/></rPr><t>";
+			xml += text.substr(0, half);
+			xml += "</t></r><r><rPr><sz val=\"11\"/></rPr><t xml:space=\"preserve\">";
+			xml += text.substr(half);
+			xml += "</t></r></si>";
+		} else {
+			xml += "<si><t>" + text + "</t></si>";
+		}
+	}
+	xml += "</sst>";
+	return xml;
+}
+
+
+// xl/worksheets/sheetN.xml
+static std::string _MakeSheet(const SBookParams &params, int num_strings, KXorShift &rnd, int64_t *p_cells, int64_t *p_refs) {
+	std::string xml = XML_HEADER;
+	xml += K::str_sprintf("<worksheet xmlns=\"%s\" xmlns:r=\"%s\">", NS_MAIN, NS_REL);
+	xml += K::str_sprintf("<dimension ref=\"A1:%s\"/>", KDataGrid::encodeCellCoord(params.cols-1, params.rows-1).c_str());
+	xml += "<sheetData>";
+	for (int row=0; row<params.rows; row++) {
+		xml += K::str_sprintf("<row r=\"%d\">", 1+row);
+		for (int col=0; col<params.cols; col++) {
+			if (rnd.randFloatExcl01() < params.sparsity) {
+				continue;
+			}
+			std::string ref = KDataGrid::encodeCellCoord(col, row);
+			if (num_strings > 0 && rnd.randFloatExcl01() < params.shared) {
+				xml += K::str_sprintf("<c r=\"%s\" t=\"s\"><v>%d</v></c>", ref.c_str(), rnd.randInt(num_strings));
+				(*p_refs)++;
+			} else {
+				double val = (rnd.randInt(2000000) - 1000000) / 100.0;
+				xml += K::str_sprintf("<c r=\"%s\"><v>%s</v></c>", ref.c_str(), KDataGrid::formatNumber(val).c_str());
+			}
+			(*p_cells)++;
+		}
+		xml += "</row>";
+	}
+	xml += "</sheetData></worksheet>";
+	return xml;
+}
+
+
+static bool _AddEntry(KZipper &zw, SBook *book, const char *name, const std::string &data) {
+	book->xml_bytes += data.size();
+	return zw.addEntry(name, data.data(), (int)data.size(), nullptr, 0);
+}
+
+
+// ワークブックを合成する
+static bool _MakeBook(const SBookParams &params, SBook *book) {
+	K__ASSERT(book);
+	KXorShift rnd;
+	rnd.init(params.seed);
+
+	// 共有文字列の種類は、共有文字列を参照するセル数の見込みから決める
+	double expected_refs = (double)params.sheets * params.rows * params.cols * (1.0 - params.sparsity) * params.shared;
+	int num_strings = 0;
+	if (expected_refs > 0 && params.shared > 0) {
+		num_strings = std::max(1, (int)(expected_refs * params.unique));
+	}
+
+	// ワークシートを先に作り、共有文字列を参照した回数を数える
+	std::vector<std::string> sheets(params.sheets);
+	int64_t num_refs = 0;
+	for (int i=0; i<params.sheets; i++) {
+		sheets[i] = _MakeSheet(params, num_strings, rnd, &book->cells, &num_refs);
+	}
+
+	KOutputStream output = KOutputStream::fromMemory(&book->zip);
+	KZipper zw(output);
+	zw.setCompressLevel(params.level);
+
+	std::string types = XML_HEADER;
+	types += "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">";
+	types += "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>";
+	types += "<Default Extension=\"xml\" ContentType=\"application/xml\"/>";
+	types += "<Override PartName=\"/xl/workbook.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.sheet.main+xml\"/>";
+	for (int i=0; i<params.sheets; i++) {
+		types += K::str_sprintf("<Override PartName=\"/xl/worksheets/sheet%d.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.worksheet+xml\"/>", 1+i);
+	}
+	if (num_strings > 0) {
+		types += "<Override PartName=\"/xl/sharedStrings.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.sharedStrings+xml\"/>";
+	}
+	types += "</Types>";
+	if (!_AddEntry(zw, book, "[Content_Types].xml", types)) {
+		return false;
+	}
+
+	std::string rels = XML_HEADER;
+	rels += K::str_sprintf("<Relationships xmlns=\"%s\">", NS_PKG_REL);
+	rels += "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument\" Target=\"xl/workbook.xml\"/>";
+	rels += "</Relationships>";
+	if (!_AddEntry(zw, book, "_rels/.rels", rels)) {
+		return false;
+	}
+
+	std::string wb = XML_HEADER;
+	wb += K::str_sprintf("<workbook xmlns=\"%s\" xmlns:r=\"%s\"><sheets>", NS_MAIN, NS_REL);
+	std::string wb_rels = XML_HEADER;
+	wb_rels += K::str_sprintf("<Relationships xmlns=\"%s\">", NS_PKG_REL);
+	for (int i=0; i<params.sheets; i++) {
+		wb += K::str_sprintf("<sheet name=\"Sheet%d\" sheetId=\"%d\" r:id=\"rId%d\"/>", 1+i, 1+i, 1+i);
+		wb_rels += K::str_sprintf("<Relationship Id=\"rId%d\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/worksheet\" Target=\"worksheets/sheet%d.xml\"/>", 1+i, 1+i);
+	}
+	if (num_strings > 0) {
+		wb_rels += K::str_sprintf("<Relationship Id=\"rId%d\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/sharedStrings\" Target=\"sharedStrings.xml\"/>", 1+params.sheets);
+	}
+	wb += "</sheets></workbook>";
+	wb_rels += "</Relationships>";
+	if (!_AddEntry(zw, book, "xl/workbook.xml", wb) || !_AddEntry(zw, book, "xl/_rels/workbook.xml.rels", wb_rels)) {
+		return false;
+	}
+
+	if (num_strings > 0) {
+		if (!_AddEntry(zw, book, "xl/sharedStrings.xml", _MakeSharedStrings(params, num_strings, num_refs, rnd))) {
+			return false;
+		}
+	}
+	for (int i=0; i<params.sheets; i++) {
+		std::string name = K::str_sprintf("xl/worksheets/sheet%d.xml", 1+i);
+		if (!_AddEntry(zw, book, name.c_str(), sheets[i])) {
+			return false;
+		}
+		sheets[i].clear();
+		sheets[i].shrink_to_fit();
+	}
+	zw.finalize(nullptr, 0);
+	book->num_strings = num_strings;
+	return true;
+}
+#pragma endregion // Generator
+
+
+
+
+#pragma region Stages
+// 各段階の処理。1回分の処理を行い、成功したら true を返す
+class CBench {
+public:
+	const SBook &m_Book;
+	int m_Threads;
+	std::vector<std::string> m_Entries; // 展開済みのエントリ。XML 解析の計測に使う
+
+	CBench(const SBook &book, int threads): m_Book(book), m_Threads(threads) {
+	}
+
+	// セントラルディレクトリの読み取り
+	bool centralDirectory() {
+		KInputStream input = KInputStream::fromMemory(m_Book.zip.data(), (int)m_Book.zip.size());
+		KUnzipper zr(input);
+		return zr.isOpen() && zr.getEntryCount() > 0;
+	}
+
+	// 全エントリの展開
+	bool inflate() {
+		KInputStream input = KInputStream::fromMemory(m_Book.zip.data(), (int)m_Book.zip.size());
+		KUnzipper zr(input);
+		m_Entries.resize(zr.getEntryCount());
+		for (int i=0; i<zr.getEntryCount(); i++) {
+			if (!zr.getEntryData(i, "", &m_Entries[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// 展開済みの XML のトークン分割とテキストの取り出し。inflate() の後で呼ぶ
+	bool parseXml() {
+		std::string text;
+		for (size_t i=0; i<m_Entries.size(); i++) {
+			KXmlReader xr(m_Entries[i].data(), m_Entries[i].size());
+			KXmlReader::Token tk;
+			do {
+				tk = xr.next();
+				if (tk == KXmlReader::TK_TEXT) {
+					text.clear();
+					xr.appendText(&text);
+				}
+			} while (tk != KXmlReader::TK_EOF && tk != KXmlReader::TK_ERROR);
+			if (tk == KXmlReader::TK_ERROR) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// 比較用。展開済みの XML から KXmlElement のツリーを作る。inflate() の後で呼ぶ
+	bool parseXmlDom() {
+		for (size_t i=0; i<m_Entries.size(); i++) {
+			KXmlElement *elm = KXmlElement::createFromString(m_Entries[i], "bench.xml");
+			if (elm == nullptr) {
+				return false;
+			}
+			elm->drop();
+		}
+		return true;
+	}
+
+	// セルを取り出すところまで (セントラルディレクトリ, 展開, 解析, セル値の復号)。KDataGrid は作らない
+	bool scan() {
+		KInputStream input = KInputStream::fromMemory(m_Book.zip.data(), (int)m_Book.zip.size());
+		CNullCellCallback cb;
+		if (!KXlsxFile::scanFromStream(input, "bench.xlsx", &cb)) {
+			return false;
+		}
+		return cb.m_Cells == m_Book.cells;
+	}
+
+	// KDataGrid を作るところまで
+	bool load(KExcelFile *ef) {
+		KXlsxLoadParams params;
+		params.num_threads = m_Threads;
+		return ef->loadFromMemory(m_Book.zip.data(), m_Book.zip.size(), "bench.xlsx", &params);
+	}
+
+	// 書き出し
+	bool exportTo(KExcelFile &ef, KExcelFormat format, int64_t *p_bytes) {
+		CNullOutput *impl = new CNullOutput();
+		KOutputStream output(impl);
+		KExcelWriterParams params;
+		params.format = format;
+		params.sheet_column = true;
+		std::shared_ptr<KExcelWriter> writer = KExcelWriter::create(output, &params);
+		if (!ef.exportTo(writer.get())) {
+			return false;
+		}
+		*p_bytes = impl->tell();
+		return true;
+	}
+};
+
+
+// fn を iterations 回実行して計測する
+template <typename FN> static bool _Measure(const char *name, int iterations, int64_t bytes, int64_t cells, std::vector<SStage> &stages, FN fn) {
+	SStage st;
+	st.name = name;
+	st.best_sec = 0;
+	st.mean_sec = 0;
+	st.bytes = bytes;
+	st.cells = cells;
+	double total = 0;
+	for (int i=0; i<iterations; i++) {
+		double t0 = _Now();
+		if (!fn()) {
+			_Log(KLogLv_ERROR, "Stage failed: %s", name);
+			return false;
+		}
+		double sec = _Now() - t0;
+		total += sec;
+		if (i == 0 || sec < st.best_sec) {
+			st.best_sec = sec;
+		}
+	}
+	st.mean_sec = total / iterations;
+	stages.push_back(st);
+	return true;
+}
+#pragma endregion // Stages
+
+
+
+
+#pragma region Report
+static double _PerSec(double amount, double sec) {
+	return (sec > 0) ? amount / sec : 0;
+}
+
+static void _PrintStages(const std::vector<SStage> &stages) {
+	_Log(KLogLv_NONE, "%-20s %10s %10s %10s %14s", "stage", "best ms", "mean ms", "MB/s", "cells/s");
+	for (size_t i=0; i<stages.size(); i++) {
+		const SStage &st = stages[i];
+		std::string cps = st.cells ? K::str_sprintf("%.0f", _PerSec((double)st.cells, st.best_sec)) : "-";
+		_Log(KLogLv_NONE, "%-20s %10.2f %10.2f %10.1f %14s",
+			st.name.c_str(), st.best_sec * 1000, st.mean_sec * 1000, _PerSec(st.bytes / (1024.0 * 1024.0), st.best_sec), cps.c_str());
+	}
+}
+
+// 結果を JSON で書き出す。
+// 前回の結果と比較できるよう、ワークブックの形と乱数の種も記録する
+static bool _SaveJson(const std::string &filename, const SBookParams &params, const SBook &book, int iterations, int threads, const std::vector<SStage> &stages) {
+	std::string s = "{\n";
+	s += K::str_sprintf("  \"version\": 1,\n");
+	s += K::str_sprintf("  \"build_date\": \"%s\",\n", __DATE__);
+	s += K::str_sprintf("  \"params\": {\"sheets\": %d, \"rows\": %d, \"cols\": %d, \"sparsity\": %g, \"shared\": %g, \"unique\": %g, \"rich\": %g, \"level\": %d, \"seed\": %u},\n",
+		params.sheets, params.rows, params.cols, params.sparsity, params.shared, params.unique, params.rich, params.level, params.seed);
+	s += K::str_sprintf("  \"book\": {\"zip_bytes\": %lld, \"xml_bytes\": %lld, \"cells\": %lld, \"shared_strings\": %d},\n",
+		(long long)book.zip.size(), (long long)book.xml_bytes, (long long)book.cells, book.num_strings);
+	s += K::str_sprintf("  \"iterations\": %d,\n", iterations);
+	s += K::str_sprintf("  \"threads\": %d,\n", threads);
+	s += "  \"stages\": [\n";
+	for (size_t i=0; i<stages.size(); i++) {
+		const SStage &st = stages[i];
+		s += K::str_sprintf("    {\"name\": \"%s\", \"best_sec\": %.6f, \"mean_sec\": %.6f, \"bytes\": %lld, \"cells\": %lld, \"mb_per_sec\": %.3f, \"cells_per_sec\": %.0f}%s\n",
+			st.name.c_str(), st.best_sec, st.mean_sec, (long long)st.bytes, (long long)st.cells,
+			_PerSec(st.bytes / (1024.0 * 1024.0), st.best_sec), _PerSec((double)st.cells, st.best_sec),
+			(i + 1 < stages.size()) ? "," : "");
+	}
+	s += "  ]\n";
+	s += "}\n";
+	KOutputStream output = KOutputStream::fromFileName(filename);
+	if (!output.isOpen() || output.write(s.data(), (int)s.size()) != (int)s.size()) {
+		_Log(KLogLv_ERROR, "Failed to write results: %s", filename.c_str());
+		return false;
+	}
+	return true;
+}
+#pragma endregion // Report
+
+
+
+
+static void _PrintUsage() {
+	_Log(KLogLv_NONE,
+		"Usage: xlsx2txt_bench [options]\n"
+		"  --sheets N      Number of sheets (default 4)\n"
+		"  --rows N        Rows per sheet (default 10000)\n"
+		"  --cols N        Columns per sheet (default 20)\n"
+		"  --sparsity F    Fraction of empty cells, 0..1 (default 0.2)\n"
+		"  --shared F      Fraction of filled cells that are shared strings, 0..1 (default 0.5)\n"
+		"  --unique F      Distinct shared strings per shared-string cell, 0..1 (default 0.3)\n"
+		"  --rich F        Fraction of shared strings written as rich-text runs, 0..1 (default 0.1)\n"
+		"  --level N       Zip compression level, 0..9 (default 5)\n"
+		"  --seed N        Random seed (default 12345)\n"
+		"  -n N            Iterations per stage; the best time is reported (default 5)\n"
+		"  -j N            Threads for loading sheets. 0 = number of cores (default 1)\n"
+		"  -o FILE         Write results as JSON to FILE\n"
+		"  -w FILE         Save the generated workbook to FILE\n"
+	);
+}
+
+
+static bool _ParseArgs(const std::vector<std::string> &args, SBookParams *params, int *iterations, int *threads, std::string *json, std::string *xlsx) {
+	for (size_t i=0; i<args.size(); i++) {
+		const std::string &key = args[i];
+		if (key == "-h" || key == "--help") {
+			return false;
+		}
+		if (i + 1 >= args.size()) {
+			_Log(KLogLv_ERROR, "Missing value for option: %s", key.c_str());
+			return false;
+		}
+		const std::string &val = args[++i];
+		bool ok = true;
+		if (key == "--sheets") {
+			ok = K::strToInt(val, &params->sheets) && params->sheets > 0;
+		} else if (key == "--rows") {
+			ok = K::strToInt(val, &params->rows) && 0 < params->rows && params->rows <= KDataGrid::ROW_LIMIT;
+		} else if (key == "--cols") {
+			ok = K::strToInt(val, &params->cols) && 0 < params->cols && params->cols <= KDataGrid::COL_LIMIT;
+		} else if (key == "--sparsity") {
+			ok = K::strToFloat(val, &params->sparsity);
+		} else if (key == "--shared") {
+			ok = K::strToFloat(val, &params->shared);
+		} else if (key == "--unique") {
+			ok = K::strToFloat(val, &params->unique);
+		} else if (key == "--rich") {
+			ok = K::strToFloat(val, &params->rich);
+		} else if (key == "--level") {
+			ok = K::strToInt(val, &params->level) && 0 <= params->level && params->level <= 9;
+		} else if (key == "--seed") {
+			ok = K::strToUInt32(val, &params->seed);
+		} else if (key == "-n") {
+			ok = K::strToInt(val, iterations) && *iterations > 0;
+		} else if (key == "-j") {
+			ok = K::strToInt(val, threads);
+		} else if (key == "-o") {
+			*json = val;
+		} else if (key == "-w") {
+			*xlsx = val;
+		} else {
+			_Log(KLogLv_ERROR, "Unknown option: %s", key.c_str());
+			return false;
+		}
+		if (!ok) {
+			_Log(KLogLv_ERROR, "Invalid value for %s: %s", key.c_str(), val.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static int _Run(const SBookParams &params, int iterations, int threads, const std::string &json, const std::string &xlsx) {
+	_Log(KLogLv_NONE, "Generating workbook: %d sheets x %d rows x %d cols, seed %u", params.sheets, params.rows, params.cols, params.seed);
+	SBook book;
+	if (!_MakeBook(params, &book)) {
+		_Log(KLogLv_ERROR, "Failed to generate workbook");
+		return EXITCODE_ERROR;
+	}
+	_Log(KLogLv_NONE, "  zip %.1f MB, xml %.1f MB, %lld cells, %d shared strings",
+		book.zip.size() / (1024.0 * 1024.0), book.xml_bytes / (1024.0 * 1024.0), (long long)book.cells, book.num_strings);
+	if (!xlsx.empty()) {
+		KOutputStream output = KOutputStream::fromFileName(xlsx);
+		if (!output.isOpen() || output.write(book.zip.data(), (int)book.zip.size()) != (int)book.zip.size()) {
+			_Log(KLogLv_ERROR, "Failed to write workbook: %s", xlsx.c_str());
+			return EXITCODE_ERROR;
+		}
+	}
+
+	CBench bench(book, threads);
+	std::vector<SStage> stages;
+	int64_t zip_bytes = (int64_t)book.zip.size();
+	bool ok = true;
+
+	// 各段階を単独で計測する
+	ok = ok && _Measure("central_directory", iterations, zip_bytes, 0, stages, [&]() { return bench.centralDirectory(); });
+	ok = ok && _Measure("inflate", iterations, book.xml_bytes, 0, stages, [&]() { return bench.inflate(); });
+	ok = ok && _Measure("xml_parse", iterations, book.xml_bytes, book.cells, stages, [&]() { return bench.parseXml(); });
+	ok = ok && _Measure("xml_dom", iterations, book.xml_bytes, book.cells, stages, [&]() { return bench.parseXmlDom(); });
+	bench.m_Entries.clear();
+
+	// セルを取り出すまでと KDataGrid を作るまでを計測し、その差をグリッド構築の時間とする。
+	// scan は常に 1 スレッドで読み取るので、load を複数のスレッドで行う場合は差に意味が無い。その場合は grid_build を出さない
+	ok = ok && _Measure("scan", iterations, book.xml_bytes, book.cells, stages, [&]() { return bench.scan(); });
+	ok = ok && _Measure("load", iterations, book.xml_bytes, book.cells, stages, [&]() { KExcelFile ef; return bench.load(&ef); });
+	if (ok && threads == 1) {
+		const SStage &scan = stages[stages.size() - 2];
+		const SStage &load = stages[stages.size() - 1];
+		SStage st;
+		st.name = "grid_build";
+		st.best_sec = std::max(0.0, load.best_sec - scan.best_sec);
+		st.mean_sec = std::max(0.0, load.mean_sec - scan.mean_sec);
+		st.bytes = book.xml_bytes;
+		st.cells = book.cells;
+		stages.push_back(st);
+	}
+
+	// 書き出し。読み込んだブックを形式ごとに書き出す
+	KExcelFile ef;
+	ok = ok && bench.load(&ef);
+	struct { const char *name; KExcelFormat format; } formats[] = {
+		{"export_text",  KExcelFormat_TEXT},
+		{"export_csv",   KExcelFormat_CSV},
+		{"export_tsv",   KExcelFormat_TSV},
+		{"export_jsonl", KExcelFormat_JSONL},
+		{"export_xml",   KExcelFormat_XML},
+	};
+	for (int i=0; ok && i<(int)(sizeof(formats)/sizeof(formats[0])); i++) {
+		int64_t bytes = 0;
+		ok = bench.exportTo(ef, formats[i].format, &bytes); // 出力サイズを得るために一度書き出しておく
+		ok = ok && _Measure(formats[i].name, iterations, bytes, book.cells, stages, [&]() { int64_t n; return bench.exportTo(ef, formats[i].format, &n); });
+	}
+	if (!ok) {
+		return EXITCODE_ERROR;
+	}
+
+	_PrintStages(stages);
+	if (!json.empty()) {
+		if (!_SaveJson(json, params, book, iterations, threads, stages)) {
+			return EXITCODE_ERROR;
+		}
+		_Log(KLogLv_NONE, "Results: %s", json.c_str());
+	}
+	return EXITCODE_OK;
+}
+
+
+int main(int argc, char **argv) {
+	std::vector<std::string> args;
+	for (int i=1; i<argc; i++) {
+		args.push_back(argv[i]);
+	}
+
+	KLogger::init();
+	KLogger::get()->getEmitter()->setConsoleOutput(true);
+
+	SBookParams params;
+	int iterations = 5;
+	int threads = 1;
+	std::string json;
+	std::string xlsx;
+	int exitcode;
+	if (!_ParseArgs(args, &params, &iterations, &threads, &json, &xlsx)) {
+		_PrintUsage();
+		exitcode = EXITCODE_USAGE;
+	} else {
+		exitcode = _Run(params, iterations, threads, json, xlsx);
+	}
+
+	KLogger::shutdown();
+	return exitcode;
+}
@@ -1,64 +1,856 @@
 ﻿#include <Kamilo.h>
+#include <stdarg.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 
 using namespace Kamilo;
 
 
-/// XLSX 内のテキストを抜き出す
-static bool _ExportTextFromXLSX(const std::string &inpath, const std::string &outpath) {
+// 変換結果の形式を変えたら上げる。マニフェストの版と一致しなければ全て変換しなおす
+#define XLSX2TXT_VERSION "1"
+
+// 出力先ディレクトリに置くマニフェストのファイル名
+#define XLSX2TXT_MANIFEST "xlsx2txt.manifest"
+
+
+// 終了コード
+enum {
+	EXITCODE_OK     = 0, // 全てのファイルを変換できた
+	EXITCODE_FAILED = 1, // 変換できなかったファイルがある
+	EXITCODE_USAGE  = 2, // コマンドラインが正しくない、または変換するファイルが一つもない
+};
+
+
+// 出力形式
+struct SFormat {
+	const char *name;      // -t で指定する名前
+	KExcelFormat format;
+	const char *ext;       // 出力ファイルの拡張子
+	const char *sheet_ext; // シートごとに出力する場合 (-s) の拡張子
+};
+
+static const SFormat g_Formats[] = {
+	{"text",  KExcelFormat_TEXT,  ".xlsx2txt", ".txt"},
+	{"csv",   KExcelFormat_CSV,   ".csv",      ".csv"},
+	{"tsv",   KExcelFormat_TSV,   ".tsv",      ".tsv"},
+	{"jsonl", KExcelFormat_JSONL, ".jsonl",    ".jsonl"},
+	{"xml",   KExcelFormat_XML,   ".xml",      ".xml"},
+};
+
+static const SFormat * _FindFormat(const std::string &name) {
+	for (size_t i=0; i<sizeof(g_Formats)/sizeof(g_Formats[0]); i++) {
+		if (name == g_Formats[i].name) {
+			return &g_Formats[i];
+		}
+	}
+	return nullptr;
+}
+
+
+// コマンドライン引数
+struct SOptions {
+	std::vector<std::string> inputs;   // 入力ファイルまたはディレクトリ
+	std::vector<std::string> includes; // 変換するファイル名のパターン。空ならば "*.xlsx"
+	std::vector<std::string> excludes; // 変換しないファイル名のパターン
+	std::vector<std::string> sheets;   // 変換するシート名のパターン。空ならば全てのシート
+	std::string output_dir;            // 出力先ディレクトリ。空ならば入力ファイルと同じ場所に出力する
+	std::string manifest;              // マニフェストファイル。空ならば出力先ディレクトリ（なければカレントディレクトリ）の XLSX2TXT_MANIFEST
+	int num_jobs;                      // 同時に変換するファイル数。0 以下ならば CPU の論理コア数
+	bool quiet;                        // 変換したファイルごとのメッセージを出さない
+	bool force;                        // マニフェストを無視して全て変換する
+	const SFormat *format;             // 出力形式
+	bool split;                        // シートごとに別のファイルに出力する
+	bool stats;                        // 処理の段階ごとの時間と量を表示する
+	std::string stats_json;            // 処理の段階ごとの時間と量を JSON で書き出すファイル。空ならば書き出さない
+
+	SOptions() {
+		num_jobs = 0;
+		quiet = false;
+		force = false;
+		format = &g_Formats[0];
+		split = false;
+		stats = false;
+	}
+};
+
+
+// マニフェストに記録する、変換済みの入力ファイルの情報
+struct SManifestEntry {
+	int64_t size;       // 入力ファイルのバイト数
+	time_t mtime;       // 入力ファイルの最終更新日時
+	uint32_t hash;      // ZIP のセントラルディレクトリにある各エントリの名前、CRC32、展開後サイズから求めたハッシュ
+	std::string input;  // 入力ファイル
+
+	SManifestEntry() {
+		size = 0;
+		mtime = 0;
+		hash = 0;
+	}
+};
+
+// 出力ファイル名をキーにしたマニフェスト
+typedef std::map<std::string, SManifestEntry> SManifest;
+
+
+// --stats で表示する、1ファイル分の統計
+struct SJobStats {
+	KXlsxStats xlsx;      // 読み取りの統計
+	double load_sec;      // 読み取り全体にかかった秒数
+	double export_sec;    // 書き出しにかかった秒数。遅延ロードしたシートの読み取り時間は含まない
+	int64_t output_bytes; // 書き出したバイト数
+
+	SJobStats() {
+		load_sec = 0;
+		export_sec = 0;
+		output_bytes = 0;
+	}
+};
+
+
+// 変換するファイル
+struct SJob {
+	std::string input;          // 入力ファイル
+	std::string output;         // 出力ファイル
+	const SManifestEntry *prev; // 前回変換したときの情報。なければ nullptr
+	SManifestEntry info;        // 今回の入力ファイルの情報
+	bool ok;                    // 変換できたかどうか（変更がなくて省略した場合も含む）
+	bool skipped;               // 変更がなかったので変換を省略したかどうか
+	SJobStats stats;            // 処理の統計。--stats または --stats-json を指定した場合だけ集計する
+};
+
+
+// KLogger はスレッドセーフではないので、ワーカースレッドからの出力はこれで排他する。
+// ライブラリ内の K__ERROR なども _InstallLogHooks で同じ排他を通す。
+// 出力中にさらにエラーが報告されることがあるので、再帰的にロックできるものを使う
+static std::recursive_mutex g_LogMutex;
+
+static void _Emit(KLogLv lv, const char *s) {
+	std::lock_guard<std::recursive_mutex> lock(g_LogMutex);
+	KLogger::get()->emit(lv, s);
+}
+
+static void _Log(KLogLv lv, const char *fmt, ...) {
+	char s[1024];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(s, sizeof(s), fmt, args);
+	va_end(args);
+	_Emit(lv, s);
+}
+
+static void _DebugHook(const char *u8)   { _Emit(KLogLv_DEBUG, u8); }
+static void _PrintHook(const char *u8)   { _Emit(KLogLv_NONE, u8); }
+static void _WarningHook(const char *u8) { _Emit(KLogLv_WARNING, u8); }
+static void _ErrorHook(const char *u8)   { _Emit(KLogLv_ERROR, u8); }
+
+// K::print, K::warning, K::error などの出力先を、排他付きで KLogger に送るものに置き換える。
+// KLogger::init が設定する出力先は排他しないので、ワーカースレッドを作る前に呼ぶこと
+static void _InstallLogHooks() {
+	K::setDebugPrintHook(_DebugHook);
+	K::setPrintHook(_PrintHook);
+	K::setWarningHook(_WarningHook);
+	K::setErrorHook(_ErrorHook);
+}
+
+
+static void _PrintUsage() {
+	_Log(KLogLv_NONE,
+		"Usage: xlsx2txt [options] <file or directory>...\n"
+		"  Directories are scanned recursively.\n"
+		"  -o DIR    Write output files under DIR, mirroring the input tree.\n"
+		"            Default: next to each input file.\n"
+		"  -i GLOB   Convert only files matching GLOB (repeatable). Default: *.xlsx\n"
+		"  -x GLOB   Skip files matching GLOB (repeatable).\n"
+		"  -j N      Convert N files in parallel. 0 = number of cores (default).\n"
+		"  -q        Print errors and the summary only.\n"
+		"  -t FMT    Output format: text (default), csv, tsv, jsonl or xml.\n"
+		"            csv and tsv put the sheet name in the first column unless -s is given.\n"
+		"  -s        Write each sheet to its own file, in a <name>.sheets directory.\n"
+		"  -w SHEET  Convert only sheets whose name matches SHEET (repeatable, wildcards allowed).\n"
+		"            Shared strings not used by those sheets are skipped.\n"
+		"  --stats   Print time and volume per stage and per sheet.\n"
+		"  --stats-json FILE\n"
+		"            Write the same statistics as JSON to FILE.\n"
+		"  -f        Convert every file, even if the manifest says it is unchanged.\n"
+		"  -m FILE   Manifest of converted files. Default: " XLSX2TXT_MANIFEST " in the -o directory,\n"
+		"            or in the current directory without -o.\n"
+		"  -h        Show this help.\n"
+		"  GLOB is matched against the file name and the path relative to the input directory.\n"
+		"Exit status: 0 = all files converted, 1 = some files failed, 2 = usage error or no input files.\n"
+	);
+}
+
+
+// コマンドライン引数を解析する。引数が正しくなければ false を返す
+static bool _ParseArgs(const std::vector<std::string> &args, SOptions *opt) {
+	K__ASSERT(opt);
+	bool no_more_options = false;
+	for (size_t i=0; i<args.size(); i++) {
+		const std::string &arg = args[i];
+		if (no_more_options || arg.size() < 2 || arg[0] != '-') {
+			opt->inputs.push_back(arg);
+			continue;
+		}
+		if (arg == "--") {
+			no_more_options = true;
+			continue;
+		}
+		if (arg == "-h" || arg == "--help") {
+			return false;
+		}
+		if (arg == "-q") {
+			opt->quiet = true;
+			continue;
+		}
+		if (arg == "-f") {
+			opt->force = true;
+			continue;
+		}
+		if (arg == "-s") {
+			opt->split = true;
+			continue;
+		}
+		if (arg == "--stats") {
+			opt->stats = true;
+			continue;
+		}
+		if (arg == "--stats-json") {
+			if (i + 1 >= args.size()) {
+				_Log(KLogLv_ERROR, "Missing value for option: %s", arg.c_str());
+				return false;
+			}
+			opt->stats_json = args[++i];
+			continue;
+		}
+		// 値を取るオプション。"-j 4" と "-j4" のどちらでも良い
+		char key = arg[1];
+		if (key != 'o' && key != 'i' && key != 'x' && key != 'j' && key != 'm' && key != 't' && key != 'w') {
+			_Log(KLogLv_ERROR, "Unknown option: %s", arg.c_str());
+			return false;
+		}
+		std::string val;
+		if (arg.size() > 2) {
+			val = arg.substr(2);
+		} else if (i + 1 < args.size()) {
+			val = args[++i];
+		} else {
+			_Log(KLogLv_ERROR, "Missing value for option: %s", arg.c_str());
+			return false;
+		}
+		switch (key) {
+		case 'o':
+			opt->output_dir = val;
+			break;
+		case 'm':
+			opt->manifest = val;
+			break;
+		case 't':
+			opt->format = _FindFormat(val);
+			if (opt->format == nullptr) {
+				_Log(KLogLv_ERROR, "Unknown format for -t: %s", val.c_str());
+				return false;
+			}
+			break;
+		case 'i':
+			opt->includes.push_back(val);
+			break;
+		case 'x':
+			opt->excludes.push_back(val);
+			break;
+		case 'w':
+			opt->sheets.push_back(val);
+			break;
+		case 'j':
+			if (!K::strToInt(val, &opt->num_jobs)) {
+				_Log(KLogLv_ERROR, "Invalid number for -j: %s", val.c_str());
+				return false;
+			}
+			break;
+		}
+	}
+	if (opt->includes.empty()) {
+		opt->includes.push_back("*.xlsx");
+	}
+	if (opt->manifest.empty()) {
+		opt->manifest = opt->output_dir.empty() ? XLSX2TXT_MANIFEST : K::pathJoin(opt->output_dir, XLSX2TXT_MANIFEST);
+	}
+	return !opt->inputs.empty();
+}
+
+
+// パターンのどれかに一致するかどうか。
+// ファイル名と、入力ディレクトリからの相対パスのそれぞれと比較する
+static bool _MatchAny(const std::vector<std::string> &patterns, const std::string &relpath, const std::string &name) {
+	for (size_t i=0; i<patterns.size(); i++) {
+		if (K::pathGlob(name, patterns[i]) || K::pathGlob(relpath, patterns[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// 入力ファイルを集める
+class CJobCollector: public KDirectoryWalker::Callback {
+public:
+	CJobCollector(const SOptions &opt, std::vector<SJob> &jobs): m_Opt(opt), m_Jobs(jobs) {
+	}
+
+	// root にある relpath を変換対象に加える
+	void add(const std::string &root, const std::string &relpath) {
+		std::string name = K::pathGetLast(relpath);
+		if (!_MatchAny(m_Opt.includes, relpath, name)) return;
+		if (_MatchAny(m_Opt.excludes, relpath, name)) return;
+		SJob job;
+		job.input = K::pathJoin(root, relpath);
+		// シートごとに出力する場合は、出力ファイルを入れるディレクトリ
+		const char *ext = m_Opt.split ? ".sheets" : m_Opt.format->ext;
+		if (m_Opt.output_dir.empty()) {
+			job.output = job.input + ext;
+		} else {
+			job.output = K::pathJoin(m_Opt.output_dir, relpath) + ext;
+		}
+		job.prev = nullptr;
+		job.ok = false;
+		job.skipped = false;
+		m_Jobs.push_back(job);
+	}
+
+	// dir 以下を再帰的に探す
+	void walk(const std::string &dir) {
+		m_Root = dir;
+		KDirectoryWalker::walk(dir, this);
+	}
+
+	virtual void onFile(const std::string &name_u8, const std::string &parent_u8) override {
+		add(m_Root, K::pathJoin(parent_u8, name_u8));
+	}
+	virtual void onDir(const std::string &name_u8, const std::string &parent_u8, bool *p_enter) override {
+		*p_enter = true;
+	}
+
+private:
+	const SOptions &m_Opt;
+	std::vector<SJob> &m_Jobs;
+	std::string m_Root;
+};
+
+
+// dir とその親ディレクトリを全て作成する
+static bool _MakeDirTree(const std::string &dir) {
+	if (dir.empty() || K::pathIsDir(dir)) {
+		return true;
+	}
+	std::string parent = K::pathGetParent(dir);
+	if (parent != dir && !_MakeDirTree(parent)) {
+		return false;
+	}
+	return K::fileMakeDir(dir);
+}
+
+
+// 出力に影響するオプションを文字列にしたもの。
+// マニフェストに記録したものと一致しなければ全て変換しなおす
+static std::string _GetOptionsSignature(const SOptions &opt) {
+	return K::str_sprintf("format=%s;split=%d;sheets=%s", opt.format->name, opt.split ? 1 : 0, K::strJoin(opt.sheets, ",").c_str());
+}
+
+
+// マニフェストの1行目。変換プログラムの版と、出力に影響するオプションを含む
+static std::string _GetManifestHeader(const SOptions &opt) {
+	return K::str_sprintf("xlsx2txt-manifest\t%s\t%s", XLSX2TXT_VERSION, _GetOptionsSignature(opt).c_str());
+}
+
+
+// マニフェストを読む。
+// ファイルがない場合や、版またはオプションが今回と異なる場合は空のままにする
+static void _LoadManifest(const SOptions &opt, SManifest *manifest) {
+	K__ASSERT(manifest);
+	manifest->clear();
+	if (opt.force || !K::pathIsFile(opt.manifest)) {
+		return;
+	}
+	std::vector<std::string> lines = K::strSplitLines(K::fileLoadString(opt.manifest), true, false);
+	if (lines.empty() || lines[0] != _GetManifestHeader(opt)) {
+		if (!opt.quiet) {
+			_Log(KLogLv_NONE, "Manifest is out of date, converting all files: %s", opt.manifest.c_str());
+		}
+		return;
+	}
+	// 各行は "size<TAB>mtime<TAB>hash<TAB>output<TAB>input"
+	for (size_t i=1; i<lines.size(); i++) {
+		const std::string &line = lines[i];
+		size_t tab[4];
+		size_t pos = 0;
+		int n = 0;
+		for (; n<4; n++) {
+			tab[n] = line.find('\t', pos);
+			if (tab[n] == std::string::npos) break;
+			pos = tab[n] + 1;
+		}
+		if (n < 4) {
+			continue; // 壊れた行は無視する
+		}
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+		uint32_t hash = 0;
+		if (!K::strToUInt64(line.substr(0, tab[0]), &size)) continue;
+		if (!K::strToUInt64(line.substr(tab[0]+1, tab[1]-tab[0]-1), &mtime)) continue;
+		if (!K::strToUInt32(line.substr(tab[1]+1, tab[2]-tab[1]-1), &hash)) continue;
+		SManifestEntry entry;
+		entry.size = (int64_t)size;
+		entry.mtime = (time_t)mtime;
+		entry.hash = hash;
+		entry.input = line.substr(tab[3]+1);
+		(*manifest)[line.substr(tab[2]+1, tab[3]-tab[2]-1)] = entry;
+	}
+}
+
+
+// マニフェストを書き出す
+static bool _SaveManifest(const SOptions &opt, const SManifest &manifest) {
+	std::string text = _GetManifestHeader(opt) + "\n";
+	for (auto it=manifest.begin(); it!=manifest.end(); ++it) {
+		const SManifestEntry &entry = it->second;
+		text += K::str_sprintf("%lld\t%lld\t%u\t%s\t%s\n",
+			(long long)entry.size, (long long)entry.mtime, entry.hash, it->first.c_str(), entry.input.c_str());
+	}
+	KOutputStream output = KOutputStream::fromFileName(opt.manifest);
+	if (!output.isOpen() || output.write(text.data(), (int)text.size()) != (int)text.size()) {
+		_Log(KLogLv_ERROR, "Failed to write manifest: %s", opt.manifest.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+// XLSX (ZIP) のセントラルディレクトリだけを読み、中身のハッシュを求める。
+// 各エントリの CRC32 は ZIP に記録済みなので、エントリを展開しなくても中身の変更を検出できる
+static bool _GetXlsxHash(const std::string &inpath, uint32_t *p_hash) {
+	K__ASSERT(p_hash);
 	KInputStream input = KInputStream::fromFileName(inpath);
 	if (!input.isOpen()) {
-		KLogger::get()->emitf(KLogLv_ERROR, "Failed to open: %s", inpath.c_str());
 		return false;
 	}
-	KExcelFile ef;
-	ef.loadFromStream(input, inpath);
-	if (ef.empty()) {
-		KLogger::get()->emitf(KLogLv_ERROR, "Invalid excel file: %s", inpath.c_str());
+	KUnzipper zr(input);
+	if (!zr.isOpen()) {
+		return false;
+	}
+	uint32_t crc = KCrc32::INIT;
+	int num = zr.getEntryCount();
+	for (int i=0; i<num; i++) {
+		std::string name;
+		zr.getEntryName(i, &name);
+		uint64_t vals[2] = {
+			(uint64_t)zr.getEntryParamInt64(i, KUnzipper::DATA_CRC32),
+			(uint64_t)zr.getEntryParamInt64(i, KUnzipper::UNZIP_SIZE),
+		};
+		// 名前の終端も含めて混ぜる
+		for (size_t j=0; j<=name.size(); j++) {
+			crc = KCrc32::fromByte((uint8_t)name.c_str()[j], crc);
+		}
+		for (int v=0; v<2; v++) {
+			for (int b=0; b<8; b++) {
+				crc = KCrc32::fromByte((uint8_t)(vals[v] >> (b * 8)), crc);
+			}
+		}
+	}
+	*p_hash = ~crc;
+	return true;
+}
+
+
+// 前回の変換から入力ファイルが変わっていなければ true を返す。
+// job->info に今回の入力ファイルの情報をセットする
+static bool _IsUnchanged(SJob *job) {
+	K__ASSERT(job);
+	if (!K::fileGetSizeAndTime(job->input, &job->info.size, &job->info.mtime)) {
+		return false;
+	}
+	job->info.input = job->input;
+	const SManifestEntry *prev = job->prev;
+	bool has_output = prev && K::pathExists(job->output);
+
+	// サイズと更新日時が同じならば、ファイルを開かずに変更なしとみなす
+	if (has_output && prev->size == job->info.size && prev->mtime == job->info.mtime) {
+		job->info.hash = prev->hash;
+		return true;
+	}
+
+	// 日時だけが変わった場合（コピーや上書き保存など）は、セントラルディレクトリの CRC32 で比べる
+	if (!_GetXlsxHash(job->input, &job->info.hash)) {
 		return false;
 	}
+	return has_output && prev->hash == job->info.hash;
+}
 
-	std::string text_u8 = ef.exportText();
 
-	// 書き出す
-	KOutputStream output = KOutputStream::fromFileName(outpath);
+// シート名をファイル名に使えるようにする
+static std::string _SheetNameToFileName(const std::string &name) {
+	std::string s = name;
+	for (size_t i=0; i<s.size(); i++) {
+		if ((unsigned char)s[i] < 0x20 || strchr("\\/:*?\"<>|", s[i])) {
+			s[i] = '_';
+		}
+	}
+	return s;
+}
+
+
+static double _Now() {
+	return K::clockNano64() / 1000000000.0;
+}
+
+
+// XLSX の内容を outpath に書き出す。
+// sheet が負ならば全てのシートを書き出す。
+// stats が nullptr でなければ、書き出しにかかった時間と書き出したバイト数を加算する
+static bool _WriteXLSX(KExcelFile &ef, int sheet, const std::string &outpath, const SOptions &opt, SJobStats *stats) {
+	// 書き出しとファイルへの書き込みを並行して行う
+	KOutputBufferParams buffer_params;
+	buffer_params.async = true;
+	KOutputStream output = KOutputStream::fromFileNameBuffered(outpath, &buffer_params);
 	if (!output.isOpen()) {
-		KLogger::get()->emitf(KLogLv_ERROR, "Failed to open output: %s", outpath.c_str());
+		_Log(KLogLv_ERROR, "Failed to open output: %s", outpath.c_str());
+		return false;
+	}
+	KExcelWriterParams params;
+	params.format = opt.format->format;
+	params.sheet_column = !opt.split;
+	std::shared_ptr<KExcelWriter> writer = KExcelWriter::create(output, &params);
+	double t0 = 0;
+	double load0 = 0;
+	if (stats) {
+		t0 = _Now();
+		load0 = stats->xlsx.sheets_sec + stats->xlsx.shared_strings_sec;
+	}
+	bool ok = (sheet < 0) ? ef.exportTo(writer.get()) : ef.exportSheetTo(sheet, writer.get());
+	if (stats) {
+		// 遅延ロードの場合は書き出しの途中でシートを読み取るので、その時間を除く
+		double load_sec = stats->xlsx.sheets_sec + stats->xlsx.shared_strings_sec - load0;
+		stats->export_sec += std::max(0.0, _Now() - t0 - load_sec);
+		stats->load_sec += load_sec;
+		stats->output_bytes += output.tell();
+	}
+	// バッファに残っている内容は閉じるときに書き込むので、閉じるまで成功とはしない
+	if (!output.close()) {
+		ok = false;
+	}
+	if (!ok) {
+		_Log(KLogLv_ERROR, "Failed to write output: %s", outpath.c_str());
+		return false;
+	}
+	if (!opt.quiet) {
+		_Log(KLogLv_NONE, "Output: %s", outpath.c_str());
+	}
+	return true;
+}
+
+
+/// XLSX 内のテキストを抜き出す。
+/// stats が nullptr でなければ処理の統計を記録する
+static bool _ExportXLSX(const std::string &inpath, const std::string &outpath, const SOptions &opt, SJobStats *stats) {
+	KExcelFile ef;
+	KXlsxLoadParams params;
+	// シートごとに出力する場合は、書き出したシートから順に破棄してメモリを節約する
+	params.lazy = opt.split;
+	// 一部のシートだけを変換する場合は、そのシートが使っている共有文字列だけを読み取る
+	params.sheet_filter = opt.sheets;
+	params.used_strings_only = !opt.sheets.empty();
+	params.stats = stats ? &stats->xlsx : nullptr;
+	double t0 = stats ? _Now() : 0;
+	// -w で指定したシートが一つも無いブックは、空の出力にする
+	if (!ef.loadFromFileName(inpath, &params) || (ef.empty() && opt.sheets.empty())) {
+		_Log(KLogLv_ERROR, "Invalid excel file: %s", inpath.c_str());
+		return false;
+	}
+	if (stats) {
+		stats->load_sec += _Now() - t0;
+	}
+	if (!opt.split) {
+		return _WriteXLSX(ef, -1, outpath, opt, stats);
+	}
+	if (!K::pathIsDir(outpath) && !K::fileMakeDir(outpath)) {
+		_Log(KLogLv_ERROR, "Failed to create output directory: %s", outpath.c_str());
 		return false;
 	}
-	output.write(text_u8.data(), text_u8.size());
-	KLogger::get()->emitf(KLogLv_NONE, "Output: %s\n", outpath.c_str());
+	for (int i=0; i<ef.getSheetCount(); i++) {
+		std::string name = _SheetNameToFileName(ef.getSheetName(i)) + opt.format->sheet_ext;
+		if (!_WriteXLSX(ef, i, K::pathJoin(outpath, name), opt, stats)) {
+			return false;
+		}
+		ef.unloadSheet(i);
+	}
 	return true;
 }
 
 
-void GameMain(const char *args_ansi) {
-	std::string args_u8 = K::strAnsiToUtf8(args_ansi, "");
-	K::sysSetCurrentDir(K::sysGetCurrentExecDir()); // exe の場所をカレントディレクトリにする
-	K::win32_AllocConsole();
+// 全てのファイルを変換する。
+// 1ファイルの変換は1スレッドで行い、複数のファイルを並列に変換する
+static void _RunJobs(std::vector<SJob> &jobs, const SOptions &opt) {
+	int num_jobs = (int)jobs.size();
+	int num_threads = opt.num_jobs;
+	if (num_threads <= 0) {
+		num_threads = (int)std::thread::hardware_concurrency();
+		if (num_threads <= 0) {
+			num_threads = 1;
+		}
+	}
+	if (num_threads > num_jobs) {
+		num_threads = num_jobs;
+	}
+	std::atomic<int> next_job(0);
+	auto worker = [&]() {
+		while (1) {
+			int i = next_job++;
+			if (i >= num_jobs) break;
+			if (_IsUnchanged(&jobs[i])) {
+				jobs[i].ok = true;
+				jobs[i].skipped = true;
+			} else {
+				bool with_stats = opt.stats || !opt.stats_json.empty();
+				jobs[i].ok = _ExportXLSX(jobs[i].input, jobs[i].output, opt, with_stats ? &jobs[i].stats : nullptr);
+			}
+		}
+	};
+	// 呼び出し元のスレッドもワーカーとして働く
+	std::vector<std::thread> threads;
+	for (int t=1; t<num_threads; t++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+	for (size_t t=0; t<threads.size(); t++) {
+		threads[t].join();
+	}
+}
+
+
+static double _MBytes(int64_t bytes) {
+	return bytes / (1024.0 * 1024.0);
+}
+
+// 全ファイルの合計。peak_arena_bytes はファイルごとの最大値
+static SJobStats _SumStats(const std::vector<SJob> &jobs) {
+	SJobStats sum;
+	for (size_t i=0; i<jobs.size(); i++) {
+		const SJobStats &st = jobs[i].stats;
+		sum.load_sec += st.load_sec;
+		sum.export_sec += st.export_sec;
+		sum.output_bytes += st.output_bytes;
+		sum.xlsx.open_sec += st.xlsx.open_sec;
+		sum.xlsx.workbook_sec += st.xlsx.workbook_sec;
+		sum.xlsx.shared_strings_sec += st.xlsx.shared_strings_sec;
+		sum.xlsx.sheets_sec += st.xlsx.sheets_sec;
+		sum.xlsx.inflated_bytes += st.xlsx.inflated_bytes;
+		sum.xlsx.xml_nodes += st.xlsx.xml_nodes;
+		sum.xlsx.cells += st.xlsx.cells;
+		sum.xlsx.shared_strings += st.xlsx.shared_strings;
+		sum.xlsx.peak_arena_bytes = std::max(sum.xlsx.peak_arena_bytes, st.xlsx.peak_arena_bytes);
+	}
+	return sum;
+}
+
+// --stats の表の1行
+static void _PrintStatsRow(const char *name, const SJobStats &st) {
+	_Log(KLogLv_NONE, "%-32s %8.1f %8.1f %8.1f %8.1f %8.1f %9.2f %10lld %10lld %9lld %9.2f",
+		name,
+		st.xlsx.open_sec * 1000, st.xlsx.workbook_sec * 1000, st.xlsx.shared_strings_sec * 1000, st.xlsx.sheets_sec * 1000, st.export_sec * 1000,
+		_MBytes(st.xlsx.inflated_bytes), (long long)st.xlsx.xml_nodes, (long long)st.xlsx.cells, (long long)st.xlsx.shared_strings,
+		_MBytes((int64_t)st.xlsx.peak_arena_bytes));
+}
+
+// 処理の統計を表にして表示する
+static void _PrintStats(const std::vector<SJob> &jobs) {
+	_Log(KLogLv_NONE, "%-32s %8s %8s %8s %8s %8s %9s %10s %10s %9s %9s",
+		"file / sheet", "open ms", "book ms", "sst ms", "sheet ms", "out ms", "xml MB", "nodes", "cells", "strings", "arena MB");
+	for (size_t i=0; i<jobs.size(); i++) {
+		const SJob &job = jobs[i];
+		if (job.skipped || !job.ok) continue;
+		_PrintStatsRow(K::pathGetLast(job.input).c_str(), job.stats);
+		for (size_t s=0; s<job.stats.xlsx.sheets.size(); s++) {
+			const KXlsxSheetStats &sh = job.stats.xlsx.sheets[s];
+			_Log(KLogLv_NONE, "  %-30s %8s %8s %8s %8.1f %8s %9.2f %10lld %10lld   (inflate %.1f ms, parse %.1f ms)",
+				sh.name.c_str(), "", "", "", (sh.inflate_sec + sh.parse_sec) * 1000, "",
+				_MBytes(sh.xml_bytes), (long long)sh.xml_nodes, (long long)sh.cells, sh.inflate_sec * 1000, sh.parse_sec * 1000);
+		}
+	}
+	SJobStats sum = _SumStats(jobs);
+	_PrintStatsRow("TOTAL", sum);
+	double sec = sum.load_sec + sum.export_sec;
+	if (sec > 0) {
+		_Log(KLogLv_NONE, "Throughput: %.1f MB/s, %.0f cells/s (CPU time summed over files)",
+			_MBytes(sum.xlsx.inflated_bytes) / sec, sum.xlsx.cells / sec);
+	}
+}
+
+// 文字列を JSON の文字列にする
+static std::string _JsonString(const std::string &s) {
+	std::string out = "\"";
+	for (size_t i=0; i<s.size(); i++) {
+		unsigned char c = (unsigned char)s[i];
+		switch (c) {
+		case '"':  out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				out += K::str_sprintf("\\u%04x", c);
+			} else {
+				out += (char)c;
+			}
+			break;
+		}
+	}
+	out += "\"";
+	return out;
+}
+
+static std::string _StatsToJson(const SJobStats &st) {
+	return K::str_sprintf(
+		"\"load_sec\": %.6f, \"export_sec\": %.6f, \"output_bytes\": %lld, "
+		"\"open_sec\": %.6f, \"workbook_sec\": %.6f, \"shared_strings_sec\": %.6f, \"sheets_sec\": %.6f, "
+		"\"inflated_bytes\": %lld, \"xml_nodes\": %lld, \"cells\": %lld, \"shared_strings\": %lld, \"peak_arena_bytes\": %lld",
+		st.load_sec, st.export_sec, (long long)st.output_bytes,
+		st.xlsx.open_sec, st.xlsx.workbook_sec, st.xlsx.shared_strings_sec, st.xlsx.sheets_sec,
+		(long long)st.xlsx.inflated_bytes, (long long)st.xlsx.xml_nodes, (long long)st.xlsx.cells, (long long)st.xlsx.shared_strings,
+		(long long)st.xlsx.peak_arena_bytes);
+}
+
+// 処理の統計を JSON で書き出す
+static bool _SaveStatsJson(const std::string &filename, const std::vector<SJob> &jobs) {
+	std::string s = "{\n";
+	s += "  \"version\": " + _JsonString(XLSX2TXT_VERSION) + ",\n";
+	s += "  \"files\": [\n";
+	for (size_t i=0; i<jobs.size(); i++) {
+		const SJob &job = jobs[i];
+		s += "    {\"input\": " + _JsonString(job.input) + ", \"output\": " + _JsonString(job.output);
+		s += K::str_sprintf(", \"ok\": %s, \"skipped\": %s, ", job.ok ? "true" : "false", job.skipped ? "true" : "false");
+		s += _StatsToJson(job.stats);
+		s += ", \"sheets\": [";
+		for (size_t k=0; k<job.stats.xlsx.sheets.size(); k++) {
+			const KXlsxSheetStats &sh = job.stats.xlsx.sheets[k];
+			s += (k > 0) ? ",\n      " : "\n      ";
+			s += "{\"name\": " + _JsonString(sh.name);
+			s += K::str_sprintf(", \"xml_bytes\": %lld, \"xml_nodes\": %lld, \"cells\": %lld, \"arena_bytes\": %lld, \"inflate_sec\": %.6f, \"parse_sec\": %.6f}",
+				(long long)sh.xml_bytes, (long long)sh.xml_nodes, (long long)sh.cells, (long long)sh.arena_bytes, sh.inflate_sec, sh.parse_sec);
+		}
+		s += "]}";
+		s += (i + 1 < jobs.size()) ? ",\n" : "\n";
+	}
+	s += "  ],\n";
+	s += "  \"total\": {" + _StatsToJson(_SumStats(jobs)) + "}\n";
+	s += "}\n";
+	KOutputStream output = KOutputStream::fromFileName(filename);
+	if (!output.isOpen() || output.write(s.data(), (int)s.size()) != (int)s.size()) {
+		_Log(KLogLv_ERROR, "Failed to write statistics: %s", filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+int GameMain(int argc, char **argv) {
+	std::vector<std::string> args;
+	for (int i=1; i<argc; i++) {
+		#ifdef _WIN32
+		args.push_back(K::strAnsiToUtf8(argv[i], ""));
+		#else
+		args.push_back(argv[i]);
+		#endif
+	}
 
 	KLogger::init();
 	KLogger::get()->getEmitter()->setConsoleOutput(true);
-	KLogger::get()->emitf(KLogLv_NONE, "***");
-	KLogger::get()->emitf(KLogLv_NONE, "*** XLSX2TXT (%s) ***", __DATE__);
-	KLogger::get()->emitf(KLogLv_NONE, "***");
-	KLogger::get()->emitf(KLogLv_NONE, "");
-	KLogger::get()->emitf(KLogLv_NONE, "ARGS=%s\n", args_u8.c_str());
-
-	{
-		auto tok = K::strSplitQuotedText(args_u8);
-		for (int i=0; i<tok.size(); i++) {
-			const std::string &in = tok[i];
-			if (K::pathHasExtension(in, ".xlsx")) {
-				KLogger::get()->emitf(KLogLv_NONE, "[%d] %s\n", i, tok[i].c_str());
-				std::string out = in + ".xlsx2txt";
-				_ExportTextFromXLSX(in, out);
+	_InstallLogHooks();
+
+	int exitcode = EXITCODE_OK;
+	SOptions opt;
+	if (!_ParseArgs(args, &opt)) {
+		_PrintUsage();
+		exitcode = EXITCODE_USAGE;
+	} else {
+		if (!opt.quiet) {
+			_Log(KLogLv_NONE, "*** XLSX2TXT (%s) ***", __DATE__);
+		}
+
+		// 入力ファイルを集める
+		std::vector<SJob> jobs;
+		CJobCollector collector(opt, jobs);
+		int num_missing = 0;
+		for (size_t i=0; i<opt.inputs.size(); i++) {
+			const std::string &in = opt.inputs[i];
+			if (K::pathIsDir(in)) {
+				collector.walk(in);
+			} else if (K::pathIsFile(in)) {
+				collector.add(K::pathGetParent(in), K::pathGetLast(in));
+			} else {
+				_Log(KLogLv_ERROR, "Not found: %s", in.c_str());
+				num_missing++;
+			}
+		}
+
+		// 前回の変換結果。ワーカーからは読み取るだけなので排他しない
+		SManifest manifest;
+		_LoadManifest(opt, &manifest);
+		for (size_t i=0; i<jobs.size(); i++) {
+			auto it = manifest.find(jobs[i].output);
+			if (it != manifest.end() && it->second.input == jobs[i].input) {
+				jobs[i].prev = &it->second;
 			}
 		}
-	}
 
-	printf("[Hit enter key]\n");
-	getchar();
+		// 出力先のディレクトリは、ワーカーを起動する前にまとめて作っておく
+		int num_failed = num_missing;
+		int num_skipped = 0;
+		for (size_t i=0; i<jobs.size(); i++) {
+			if (!_MakeDirTree(K::pathGetParent(jobs[i].output))) {
+				_Log(KLogLv_ERROR, "Failed to create output directory for: %s", jobs[i].output.c_str());
+			}
+		}
+		if (!_MakeDirTree(K::pathGetParent(opt.manifest))) {
+			_Log(KLogLv_ERROR, "Failed to create directory for manifest: %s", opt.manifest.c_str());
+		}
+
+		_RunJobs(jobs, opt);
+
+		// 変換できなかったファイルはマニフェストから外し、次回も変換しなおす。
+		// 今回の入力に含まれていないファイルの記録はそのまま残す
+		SManifest next = manifest;
+		for (size_t i=0; i<jobs.size(); i++) {
+			if (jobs[i].ok) {
+				next[jobs[i].output] = jobs[i].info;
+			} else {
+				next.erase(jobs[i].output);
+				_Log(KLogLv_ERROR, "Failed: %s", jobs[i].input.c_str());
+				num_failed++;
+			}
+			if (jobs[i].skipped) {
+				num_skipped++;
+			}
+		}
+		if (!jobs.empty()) {
+			_SaveManifest(opt, next);
+		}
+		if (opt.stats) {
+			_PrintStats(jobs);
+		}
+		if (!opt.stats_json.empty()) {
+			_SaveStatsJson(opt.stats_json, jobs);
+		}
+		_Log(KLogLv_NONE, "Converted %d of %d files (%d unchanged)", (int)jobs.size() + num_missing - num_failed, (int)jobs.size() + num_missing, num_skipped);
+
+		if (jobs.empty() && num_missing == 0) {
+			_Log(KLogLv_ERROR, "No input files");
+			exitcode = EXITCODE_USAGE;
+		} else if (num_failed > 0) {
+			exitcode = EXITCODE_FAILED;
+		}
+	}
 
 	KLogger::shutdown();
-	K::win32_FreeConsole();
+	return exitcode;
 }
@@ -1,2 +1,3 @@
 ﻿#pragma once
-void GameMain(const char *args);
+/// コマンドラインから実行する。終了コードを返す
+int GameMain(int argc, char **argv);
@@ -1,4 +1,7 @@
 ﻿#include "KDataGrid.h"
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
 #include "KInternal.h"
 
 namespace Kamilo {
@@ -6,67 +9,90 @@ namespace Kamilo {
 
 // 0 起算の列・行番号を "A10" や "C7" などのセル位置文字列に変換する
 std::string KDataGrid::encodeCellCoord(int col, int row) {
-	if (col < 0) return "";
-	if (row < 0) return "";
-	if (col < COL_ALPHABETS) { // A～Z
-		char c = (char)('A' + col);
-		char s[256];
-		sprintf_s(s, sizeof(s), "%c%d", c, 1+row);
-		return s;
-	}
-	if (col < COL_ALPHABETS*COL_ALPHABETS) { // AA～ZZ
-		int off = col - COL_ALPHABETS; // AA=0 としたときのカラム番号
-		char c1 = (char)('A' + (off / COL_ALPHABETS));
-		char c2 = (char)('A' + (off % COL_ALPHABETS));
-		char s[256];
-		K__ASSERT(isalpha(c1));
-		K__ASSERT(isalpha(c2));
-		sprintf_s(s, sizeof(s), "%c%c%d", c1, c2, 1+row);
-		return s;
+	if (col < 0 || COL_LIMIT <= col) return "";
+	if (row < 0 || ROW_LIMIT <= row) return "";
+
+	// 列番号は A=1, Z=26, AA=27 ... となる「0 を使わない 26 進数」で表す
+	char letters[4];
+	int n = 0;
+	for (int c=col+1; c>0; c=(c-1)/COL_ALPHABETS) {
+		letters[n++] = (char)('A' + (c - 1) % COL_ALPHABETS);
 	}
-	return "";
+	// 行番号は 1 起算の 10 進数。書き出しではセルごとに呼ばれるので、書式文字列は使わずに列と同じく下の桁から求める
+	char digits[8];
+	int m = 0;
+	for (int r=row+1; r>0; r/=10) {
+		digits[m++] = (char)('0' + r % 10);
+	}
+	char s[16];
+	int i = 0;
+	while (n > 0) {
+		s[i++] = letters[--n];
+	}
+	while (m > 0) {
+		s[i++] = digits[--m];
+	}
+	return std::string(s, i);
 }
 
 // "A2" や "AM244" などのセル番号を 0 起算の行と列の値にデコードする
 bool KDataGrid::decodeCellCoord(const std::string &s, int *col, int *row) {
-	if (s.empty()) return false;
-	int c = -1;
-	int r = -1;
-
-	if (isalpha(s[0]) && isdigit(s[1])) {
-		// セル番号が [A-Z][0-9].* にマッチしている。
-		// 例えば "A1" や "Z42" など。
-		c = toupper(s[0]) - 'A';
-		K__ASSERT(0 <= c && c < COL_ALPHABETS);
-		r = strtol(s.c_str() + 1, nullptr, 0);
-		r--; // １起算 --> 0起算
-
-	} else if (isalpha(s[0]) && isalpha(s[1]) && isdigit(s[2])) {
-		// セル番号が [A-Z][A-Z][0-9].* にマッチしている。
-		// 例えば "AA42" や "KZ1217" など
-		int idx1 = toupper(s[0]) - 'A';
-		int idx2 = toupper(s[1]) - 'A';
-		K__ASSERT(0 <= idx1 && idx1 < COL_ALPHABETS);
-		K__ASSERT(0 <= idx2 && idx2 < COL_ALPHABETS);
-		// AA は A～Z の次の要素(26番目)なので、26からカウントする
-		c = COL_ALPHABETS + idx1 * COL_ALPHABETS + idx2;
-		r = strtol(s.c_str() + 2, nullptr, 0);
-		r--; // １起算 --> 0起算
-	}
-	if (c >= 0 && r >= 0) {
-		// ここで、セル範囲として 0xFFFFF が入る可能性に注意。(LibreOffice Calc で現象を確認）
-		// 0xFFFFF 以上の値が入っていたら範囲取得失敗とみなす
-		if (r >= 0xFFFFF) {
-			return false;
-		}
-		K__ASSERT(0 <= c && c < COL_LIMIT);
-		K__ASSERT(0 <= r && r < ROW_LIMIT);
-		if (col) *col = c;
-		if (row) *row = r;
-		return true;
+	return decodeCellCoord(s.data(), s.size(), col, row);
+}
+bool KDataGrid::decodeCellCoord(const char *s, size_t len, int *col, int *row) {
+	if (s == nullptr) return false;
+	const char *p = s;
+	const char *end = s + len;
+
+	// 列。A～XFD (最大3文字)
+	int c = 0;
+	int nalpha = 0;
+	while (p < end && nalpha < 3) {
+		unsigned int d = (unsigned int)((*p | 0x20) - 'a'); // 大文字小文字を区別しない
+		if (d >= COL_ALPHABETS) break;
+		c = c * COL_ALPHABETS + (int)d + 1;
+		nalpha++;
+		p++;
 	}
+	if (nalpha == 0) return false;
 
-	return false;
+	// 行。1～1048576 (最大7桁)
+	int r = 0;
+	int ndigit = 0;
+	while (p < end && ndigit < 7) {
+		unsigned int d = (unsigned int)(*p - '0');
+		if (d >= 10) break;
+		r = r * 10 + (int)d;
+		ndigit++;
+		p++;
+	}
+	if (ndigit == 0 || p != end) return false; // 数字が無い、または余計な文字がある
+
+	c--; // 1起算 --> 0起算
+	r--; // 1起算 --> 0起算
+	if (c < 0 || COL_LIMIT <= c) return false;
+	if (r < 0 || ROW_LIMIT <= r) return false;
+	if (col) *col = c;
+	if (row) *row = r;
+	return true;
+}
+
+
+
+
+// 数値を文字列にする。buf は 32 バイト以上必要。戻り値は文字列のバイト数
+static size_t _FormatNumber(double value, char *buf, size_t bufsize) {
+	int n = snprintf(buf, bufsize, "%.15g", value);
+	if (strtod(buf, nullptr) != value) {
+		n = snprintf(buf, bufsize, "%.17g", value); // 15 桁では元の値に戻らない
+	}
+	return (n > 0) ? (size_t)n : 0;
+}
+
+std::string KDataGrid::formatNumber(double value) {
+	char s[32];
+	size_t len = _FormatNumber(value, s, sizeof(s));
+	return std::string(s, len);
 }
 
 
@@ -77,17 +103,22 @@ KDataGrid::KDataGrid() {
 	clear();
 }
 bool KDataGrid::empty() const {
-	return m_RowLines.empty();
+	return m_Rows.empty();
+}
+size_t KDataGrid::getArenaSize() const {
+	return m_Strings.getArenaSize();
 }
 void KDataGrid::clear() {
 	m_Col0 = m_Col1 = -1;
 	m_Row0 = m_Row1 = -1;
-	m_RecalcDim = false;
 	m_Name.clear();
 	m_SourceLoc.clear();
 	m_SourceCol = 0;
 	m_SourceRow = 0;
-	m_RowLines.clear();
+	m_Rows.clear();
+	m_Strings.clear();
+	m_SharedStrings = nullptr;
+	m_Index = nullptr;
 }
 const std::string & KDataGrid::getName() const {
 	return m_Name;
@@ -105,50 +136,175 @@ void KDataGrid::setSourceLocation(const std::string &loc, int col, int row) {
 	m_SourceCol = col;
 	m_SourceRow = row;
 }
-void KDataGrid::setCell(int col, int row, const std::string &s) {
-	std::string ss = s;
-	K::strTrim(ss);
-	if (ss.empty() == false) {
-		if (m_RowLines.size() <= row) {
-			m_RowLines.resize(row + 1);
-		}
-		if (m_RowLines[row].size() <= col) {
-			m_RowLines[row].resize(col + 1);
-		}
-		m_RowLines[row][col] = ss;
-		m_RecalcDim = true;
+const KDataGrid::ROW * KDataGrid::findRow(int row) const {
+	auto it = std::lower_bound(m_Rows.begin(), m_Rows.end(), row, [](const ROW &line, int r) {
+		return line.row < r;
+	});
+	if (it != m_Rows.end() && it->row == row) {
+		return &(*it);
 	}
+	return nullptr;
 }
-bool KDataGrid::getDimension(int *p_col, int *p_row, int *p_colcount, int *p_rowcount) const {
-	if (m_RecalcDim) {
-		m_RecalcDim = false;
-		m_Col0 = m_Col1 = -1;
-		m_Row0 = m_Row1 = -1;
-		for (int r=0; r<m_RowLines.size(); r++) {
-			if (m_RowLines[r].empty()) continue;
-			m_Row0 = r;
-			break;
-		}
-		m_Row1 = (int)m_RowLines.size() - 1;
-
-		for (int r=m_Row0; r<=m_Row1; r++) {
-			const auto &line = m_RowLines[r];
-			for (int c=0; c<line.size(); c++) {
-				if (line[c].empty()) continue;
-				if (m_Col0 < 0 || c < m_Col0) {
-					m_Col0 = c;
-				}
-				break;
-			}
-			for (int c=line.size()-1; c>=m_Col0; c--) {
-				if (line[c].empty()) continue;
-				if (m_Col1 < 0 || m_Col1 < c) {
-					m_Col1 = c;
-				}
-				break;
-			}
+const KDataGrid::CELL * KDataGrid::findCellInRowData(const ROW &line, int col) const {
+	auto it = std::lower_bound(line.cells.begin(), line.cells.end(), col, [](const CELL &cell, int c) {
+		return cell.col < c;
+	});
+	if (it != line.cells.end() && it->col == col) {
+		return &(*it);
+	}
+	return nullptr;
+}
+const KDataGrid::CELL * KDataGrid::findCellData(int col, int row) const {
+	const ROW *line = findRow(row);
+	if (line) {
+		return findCellInRowData(*line, col);
+	}
+	return nullptr;
+}
+
+// セルの文字列を得る。
+// 数値と真偽値は buf (32 バイト以上) に書き込んでそのポインタを返す。戻り値はヌル終端している
+const char * KDataGrid::getCellString(const CELL &cell, char *buf, size_t *p_len) const {
+	switch (cell.type) {
+	case T_TEXT:
+	case T_ERROR:
+		return m_Strings.getString(cell.sid, p_len);
+	case T_SHARED:
+		return m_SharedStrings->getString(cell.sid, p_len);
+	case T_NUMBER:
+		*p_len = _FormatNumber(cell.num, buf, 32);
+		return buf;
+	case T_BOOL:
+		buf[0] = cell.sid ? '1' : '0';
+		buf[1] = '\0';
+		*p_len = 1;
+		return buf;
+	}
+	*p_len = 0;
+	return "";
+}
+bool KDataGrid::matchCell(const CELL &cell, const std::string &s) const {
+	char buf[32];
+	size_t len = 0;
+	const char *t = getCellString(cell, buf, &len);
+	return len == s.size() && memcmp(t, s.data(), len) == 0;
+}
+
+// (col, row) のセルを得る。セルが無ければ追加する
+KDataGrid::CELL * KDataGrid::allocCell(int col, int row) {
+	K__ASSERT(col >= 0);
+	K__ASSERT(row >= 0);
+
+	// セルの位置や値が変わるので、索引は作り直す
+	m_Index = nullptr;
+
+	// 行を探す。
+	// ファイルからのロード時は行番号の昇順でセルが追加されるので、末尾の行を先に調べる
+	ROW *line = nullptr;
+	if (m_Rows.empty() || m_Rows.back().row < row) {
+		ROW newline;
+		newline.row = row;
+		m_Rows.push_back(newline);
+		line = &m_Rows.back();
+	} else if (m_Rows.back().row == row) {
+		line = &m_Rows.back();
+	} else {
+		auto it = std::lower_bound(m_Rows.begin(), m_Rows.end(), row, [](const ROW &line, int r) {
+			return line.row < r;
+		});
+		if (it == m_Rows.end() || it->row != row) {
+			ROW newline;
+			newline.row = row;
+			it = m_Rows.insert(it, newline);
 		}
+		line = &(*it);
+	}
+
+	// 範囲を更新する。セルが削除されることは無いので、広げる方向にだけ更新すればよい
+	if (m_Col0 < 0 || col < m_Col0) m_Col0 = col;
+	if (m_Col1 < 0 || m_Col1 < col) m_Col1 = col;
+	if (m_Row0 < 0 || row < m_Row0) m_Row0 = row;
+	if (m_Row1 < 0 || m_Row1 < row) m_Row1 = row;
+
+	// 行内のセルを探す。ここでも列番号の昇順で追加されることが多いので、末尾を先に調べる。
+	// 既存のセルを上書きする場合、古い文字列は m_Strings に残ったままになる
+	std::vector<CELL> &cells = line->cells;
+	if (cells.empty() || cells.back().col < col) {
+		CELL cell;
+		cell.col = col;
+		cells.push_back(cell);
+		return &cells.back();
 	}
+	auto it = std::lower_bound(cells.begin(), cells.end(), col, [](const CELL &cell, int c) {
+		return cell.col < c;
+	});
+	if (it == cells.end() || it->col != col) {
+		CELL cell;
+		cell.col = col;
+		it = cells.insert(it, cell);
+	}
+	return &(*it);
+}
+const char * KDataGrid::trimCellText(const char *s, size_t len, size_t *p_len) {
+	while (len > 0 && isblank((unsigned char)s[0])) { s++; len--; }
+	while (len > 0 && isblank((unsigned char)s[len-1])) { len--; }
+	*p_len = len;
+	return s;
+}
+void KDataGrid::setCell(int col, int row, const std::string &s) {
+	// 前後の空白を除いた範囲を得る
+	size_t len = 0;
+	const char *str = trimCellText(s.c_str(), s.size(), &len);
+	if (len == 0) {
+		return;
+	}
+	CELL *cell = allocCell(col, row);
+	cell->type = T_TEXT;
+	cell->sid = m_Strings.add(str, len);
+}
+void KDataGrid::setCellNumber(int col, int row, double value) {
+	CELL *cell = allocCell(col, row);
+	cell->type = T_NUMBER;
+	cell->num = value;
+}
+void KDataGrid::setCellBool(int col, int row, bool value) {
+	CELL *cell = allocCell(col, row);
+	cell->type = T_BOOL;
+	cell->sid = value ? 1 : 0;
+}
+void KDataGrid::setCellError(int col, int row, const std::string &s) {
+	if (s.empty()) {
+		return;
+	}
+	CELL *cell = allocCell(col, row);
+	cell->type = T_ERROR;
+	cell->sid = m_Strings.add(s);
+}
+void KDataGrid::setSharedStrings(const std::shared_ptr<const KStringTable> &table) {
+	m_SharedStrings = table;
+}
+void KDataGrid::setCellSharedString(int col, int row, int sid) {
+	K__ASSERT(m_SharedStrings);
+	size_t len = 0;
+	const char *s = m_SharedStrings->getString(sid, &len);
+	size_t trimmed_len = 0;
+	const char *trimmed = trimCellText(s, len, &trimmed_len);
+	if (trimmed_len == 0) {
+		return; // 空文字列のセルは存在しないものとして扱う
+	}
+	if (trimmed_len != len) {
+		// getCell は前後の空白を取り除いた文字列を返すことになっているので、
+		// そのままでは共有できない。取り除いた文字列をこのシートにコピーする
+		CELL *cell = allocCell(col, row);
+		cell->type = T_TEXT;
+		cell->sid = m_Strings.add(trimmed, trimmed_len);
+		return;
+	}
+	CELL *cell = allocCell(col, row);
+	cell->type = T_SHARED;
+	cell->sid = sid;
+}
+bool KDataGrid::getDimension(int *p_col, int *p_row, int *p_colcount, int *p_rowcount) const {
 	if (empty()) return false;
 	if (p_col) *p_col = m_Col0;
 	if (p_row) *p_row = m_Row0;
@@ -157,109 +313,308 @@ bool KDataGrid::getDimension(int *p_col, int *p_row, int *p_colcount, int *p_row
 	return true;
 }
 bool KDataGrid::getCell(int col, int row, std::string *p_val) const {
-	if (row < m_RowLines.size()) {
-		const auto &line = m_RowLines[row];
-		if (col < line.size()) {
-			const std::string &t = line[col];
-			if (t.empty() == false) {
-				if (p_val) *p_val = t;
-				return true;
-			}
+	const CELL *cell = findCellData(col, row);
+	if (cell) {
+		if (p_val) {
+			char buf[32];
+			size_t len = 0;
+			const char *s = getCellString(*cell, buf, &len);
+			p_val->assign(s, len);
+		}
+		return true;
+	}
+	return false;
+}
+KDataGrid::CellType KDataGrid::getCellType(int col, int row) const {
+	const CELL *cell = findCellData(col, row);
+	if (cell) {
+		switch (cell->type) {
+		case T_TEXT:   return CELL_TEXT;
+		case T_SHARED: return CELL_TEXT;
+		case T_NUMBER: return CELL_NUMBER;
+		case T_BOOL:   return CELL_BOOL;
+		case T_ERROR:  return CELL_ERROR;
 		}
 	}
+	return CELL_EMPTY;
+}
+bool KDataGrid::getCellNumber(int col, int row, double *p_val) const {
+	const CELL *cell = findCellData(col, row);
+	if (cell && cell->type == T_NUMBER) {
+		if (p_val) *p_val = cell->num;
+		return true;
+	}
 	return false;
 }
+std::shared_ptr<const KDataGrid::INDEX> KDataGrid::getIndex() const {
+	// 複数のスレッドから同時に呼ばれた場合は、それぞれが索引を作るかもしれないが、
+	// どれも同じ内容なので、どれが残っても構わない
+	std::shared_ptr<const INDEX> index = std::atomic_load(&m_Index);
+	if (index) {
+		return index;
+	}
+	std::shared_ptr<INDEX> p = std::make_shared<INDEX>();
+	size_t num = 0;
+	for (auto it=m_Rows.begin(); it!=m_Rows.end(); ++it) {
+		num += it->cells.size();
+	}
+	K__ASSERT(num <= 0x7FFFFFFF);
+
+	// バケット数はセル数以上の 2 のべき乗にする
+	size_t numbuckets = 1;
+	while (numbuckets < num) {
+		numbuckets *= 2;
+	}
+	p->mask = numbuckets - 1;
+
+	// セルの文字列のハッシュ値を求めて、バケットごとのセル数を数える
+	std::vector<uint64_t> hashes(num);
+	p->buckets.assign(numbuckets + 1, 0);
+	char buf[32];
+	size_t k = 0;
+	for (auto rit=m_Rows.begin(); rit!=m_Rows.end(); ++rit) {
+		for (auto cit=rit->cells.begin(); cit!=rit->cells.end(); ++cit) {
+			size_t len = 0;
+			const char *str = getCellString(*cit, buf, &len);
+			uint64_t h = KStringTable::hash(str, len);
+			hashes[k++] = h;
+			p->buckets[(h & p->mask) + 1]++;
+		}
+	}
+	for (size_t b=0; b<numbuckets; b++) {
+		p->buckets[b + 1] += p->buckets[b];
+	}
+
+	// 行優先の順番でバケットに入れる。バケット内も行優先の順番に並ぶ
+	std::vector<uint32_t> pos(p->buckets.begin(), p->buckets.end() - 1);
+	p->entries.resize(num);
+	k = 0;
+	for (size_t ri=0; ri<m_Rows.size(); ri++) {
+		for (size_t ci=0; ci<m_Rows[ri].cells.size(); ci++) {
+			uint64_t h = hashes[k++];
+			INDEX::ENTRY &e = p->entries[pos[h & p->mask]++];
+			e.ri = (uint32_t)ri;
+			e.ci = (uint32_t)ci;
+			e.tag = (uint32_t)(h >> 32);
+		}
+	}
+	index = p;
+	std::atomic_store(&m_Index, index);
+	return index;
+}
+
+// 文字列 s と同じバケットに入っているセルの範囲を得る。
+// 戻り値が先頭、*p_end が末尾の次。*p_tag には s のハッシュ値の上位 32 ビットが入る
+const KDataGrid::INDEX::ENTRY * KDataGrid::lookupIndex(const INDEX &index, const std::string &s, const INDEX::ENTRY **p_end, uint32_t *p_tag) const {
+	uint64_t h = KStringTable::hash(s.data(), s.size());
+	size_t b = (size_t)(h & index.mask);
+	const INDEX::ENTRY *entries = index.entries.data();
+	*p_end = entries + index.buckets[b + 1];
+	*p_tag = (uint32_t)(h >> 32);
+	return entries + index.buckets[b];
+}
 bool KDataGrid::findCell(const std::string &s, int *p_col, int *p_row) const {
-	int col, row, ncol, nrow;
-	if (getDimension(&col, &row, &ncol, &nrow)) {
-		for (int r=row; r<row+nrow; r++) {
-			for (int c=col; c<col+ncol; c++) {
-				std::string t;
-				if (getCell(c, r, &t)) {
-					if (t == s) {
-						if (p_col) *p_col = c;
-						if (p_row) *p_row = r;
-						return true;
-					}
-				}
-			}
+	std::shared_ptr<const INDEX> index = getIndex();
+	const INDEX::ENTRY *end = nullptr;
+	uint32_t tag = 0;
+	for (const INDEX::ENTRY *it=lookupIndex(*index, s, &end, &tag); it!=end; ++it) {
+		if (it->tag != tag) continue;
+		const ROW &line = m_Rows[it->ri];
+		const CELL &cell = line.cells[it->ci];
+		if (matchCell(cell, s)) {
+			if (p_col) *p_col = cell.col;
+			if (p_row) *p_row = line.row;
+			return true;
 		}
 	}
 	return false;
 }
 int KDataGrid::findCellInRow(int row, const std::string &s, int col_start) const {
-	int col, ncol;
-	if (getDimension(&col, nullptr, &ncol, nullptr)) {
-		int col0 = K::max(col, col_start);
-		int col1 = col + ncol;
-		for (int c=col0; c<col1; c++) {
-			std::string t;
-			if (getCell(c, row, &t)) {
-				if (t == s) {
-					return c;
-				}
-			}
+	const ROW *line = findRow(row);
+	if (line == nullptr) {
+		return -1;
+	}
+	std::shared_ptr<const INDEX> index = getIndex();
+	const INDEX::ENTRY *end = nullptr;
+	uint32_t tag = 0;
+	const INDEX::ENTRY *it = lookupIndex(*index, s, &end, &tag);
+
+	// バケット内は行優先の順番に並んでいるので、この行のセルだけを調べる
+	uint32_t ri = (uint32_t)(line - m_Rows.data());
+	it = std::lower_bound(it, end, ri, [](const INDEX::ENTRY &e, uint32_t r) {
+		return e.ri < r;
+	});
+	for (; it!=end && it->ri==ri; ++it) {
+		if (it->tag != tag) continue;
+		const CELL &cell = line->cells[it->ci];
+		if (cell.col >= col_start && matchCell(cell, s)) {
+			return cell.col;
 		}
 	}
 	return -1;
 }
 int KDataGrid::findCellInCol(int col, const std::string &s, int row_start) const {
-	int row, nrow;
-	if (getDimension(nullptr, &row, nullptr, &nrow)) {
-		int row0 = K::max(row, row_start);
-		int row1 = row + nrow;
-		for (int r=row0; r<row1; r++) {
-			std::string t;
-			if (getCell(col, r, &t)) {
-				if (t == s) {
-					return r;
-				}
-			}
+	std::shared_ptr<const INDEX> index = getIndex();
+	const INDEX::ENTRY *end = nullptr;
+	uint32_t tag = 0;
+	const INDEX::ENTRY *it = lookupIndex(*index, s, &end, &tag);
+
+	// row_start 行目以降のセルだけを調べる
+	uint32_t ri = (uint32_t)(std::lower_bound(m_Rows.begin(), m_Rows.end(), row_start, [](const ROW &line, int r) {
+		return line.row < r;
+	}) - m_Rows.begin());
+	it = std::lower_bound(it, end, ri, [](const INDEX::ENTRY &e, uint32_t r) {
+		return e.ri < r;
+	});
+	for (; it!=end; ++it) {
+		if (it->tag != tag) continue;
+		const ROW &line = m_Rows[it->ri];
+		const CELL &cell = line.cells[it->ci];
+		if (cell.col == col && matchCell(cell, s)) {
+			return line.row;
 		}
 	}
 	return -1;
 }
 void KDataGrid::scanCells(KDataGridCallback *cb) const {
-	int col, row, ncol, nrow;
-	if (getDimension(&col, &row, &ncol, &nrow)) {
-		for (int r=row; r<row+nrow; r++) {
-			for (int c=col; c<col+ncol; c++) {
-				std::string t;
-				if (getCell(c, r, &t)) {
-					cb->onCell(c, r, t);
+	// 値の入っているセルだけを行優先の順番で巡回する
+	std::string t;
+	char buf[32];
+	for (auto rit=m_Rows.begin(); rit!=m_Rows.end(); ++rit) {
+		for (auto cit=rit->cells.begin(); cit!=rit->cells.end(); ++cit) {
+			size_t len = 0;
+			const char *s = getCellString(*cit, buf, &len);
+			t.assign(s, len);
+			cb->onCell(cit->col, rit->row, t);
+		}
+	}
+}
+void KDataGrid::scanCellsInRow(int row, KDataGridCallback *cb) const {
+	const ROW *line = findRow(row);
+	if (line == nullptr) {
+		return;
+	}
+	std::string t;
+	char buf[32];
+	for (auto it=line->cells.begin(); it!=line->cells.end(); ++it) {
+		size_t len = 0;
+		const char *s = getCellString(*it, buf, &len);
+		t.assign(s, len);
+		cb->onCell(it->col, row, t);
+	}
+}
+void KDataGrid::getRowHashes(std::vector<RowHash> *hashes) const {
+	K__ASSERT(hashes);
+	hashes->resize(m_Rows.size());
+	for (size_t i=0; i<m_Rows.size(); i++) {
+		const ROW &line = m_Rows[i];
+		uint64_t h = KStringTable::HASH_BASIS;
+		for (auto it=line.cells.begin(); it!=line.cells.end(); ++it) {
+			h = KStringTable::hash(&it->col, sizeof(it->col), h);
+			switch (it->type) {
+			case T_TEXT:
+			case T_SHARED:
+			case T_ERROR:
+				{
+					// 共有文字列と、シートにコピーした文字列は区別しない
+					uint8_t tag = (it->type == T_ERROR) ? T_ERROR : T_TEXT;
+					size_t len = 0;
+					const char *s = (it->type == T_SHARED) ? m_SharedStrings->getString(it->sid, &len) : m_Strings.getString(it->sid, &len);
+					uint32_t len32 = (uint32_t)len;
+					h = KStringTable::hash(&tag, sizeof(tag), h);
+					h = KStringTable::hash(&len32, sizeof(len32), h);
+					h = KStringTable::hash(s, len, h);
+					break;
 				}
+			case T_NUMBER:
+				{
+					double num = (it->num == 0) ? 0.0 : it->num; // -0 と 0 は同じ文字列になるので区別しない
+					h = KStringTable::hash(&it->type, sizeof(it->type), h);
+					h = KStringTable::hash(&num, sizeof(num), h);
+					break;
+				}
+			case T_BOOL:
+				h = KStringTable::hash(&it->type, sizeof(it->type), h);
+				h = KStringTable::hash(&it->sid, sizeof(it->sid), h);
+				break;
 			}
 		}
+		(*hashes)[i].row = line.row;
+		(*hashes)[i].hash = h;
 	}
 }
 bool KDataGrid::getCellInt(int col, int row, int *p_val) const {
-	std::string s;
-	if (getCell(col, row, &s)) {
-		if (K::strToInt(s, p_val)) {
+	const CELL *cell = findCellData(col, row);
+	if (cell == nullptr) {
+		return false;
+	}
+	if (cell->type == T_NUMBER) {
+		// 整数値で、かつ int の範囲に収まる場合だけ成功する
+		double num = cell->num;
+		if (INT_MIN <= num && num <= INT_MAX && num == (double)(int)num) {
+			if (p_val) *p_val = (int)num;
 			return true;
 		}
+		return false;
 	}
-	return false;
+	if (cell->type == T_BOOL) {
+		if (p_val) *p_val = cell->sid;
+		return true;
+	}
+	char buf[32];
+	size_t len = 0;
+	const char *s = getCellString(*cell, buf, &len);
+	return K::strToInt(std::string(s, len), p_val);
 }
 bool KDataGrid::getCellFloat(int col, int row, float *p_val) const {
-	std::string s;
-	if (getCell(col, row, &s)) {
-		if (K::strToFloat(s, p_val)) {
-			return true;
-		}
+	const CELL *cell = findCellData(col, row);
+	if (cell == nullptr) {
+		return false;
 	}
-	return false;
+	if (cell->type == T_NUMBER) {
+		if (p_val) *p_val = (float)cell->num;
+		return true;
+	}
+	if (cell->type == T_BOOL) {
+		if (p_val) *p_val = (float)cell->sid;
+		return true;
+	}
+	char buf[32];
+	size_t len = 0;
+	const char *s = getCellString(*cell, buf, &len);
+	return K::strToFloat(std::string(s, len), p_val);
+}
+
+// src のセル cell を、このシートの (col, row) にコピーする
+void KDataGrid::copyCell(int col, int row, const KDataGrid &src, const CELL &cell) {
+	if (cell.type == T_TEXT) {
+		setCell(col, row, src.m_Strings.getString(cell.sid));
+		return;
+	}
+	if (cell.type == T_ERROR) {
+		setCellError(col, row, src.m_Strings.getString(cell.sid));
+		return;
+	}
+	// 数値と真偽値はそのままコピーできる。
+	// 共有文字列は前後の空白が無いことを確認済みなので、ID だけをコピーすればよい
+	K__ASSERT(cell.type != T_SHARED || m_SharedStrings == src.m_SharedStrings);
+	CELL *dst = allocCell(col, row);
+	*dst = cell;
+	dst->col = col;
 }
 KDataGrid KDataGrid::copy(int col, int row, int colcount, int rowcount) const {
 	KDataGrid subgrid;
 	subgrid.setSourceLocation(getSourceLocation(), m_SourceCol + col, m_SourceRow + row);
 	subgrid.setName(getName());
-	for (int r=0; r<rowcount; r++) {
-		for (int c=0; c<colcount; c++) {
-			std::string s;
-			if (getCell(col+c, row+r, &s)) {
-				subgrid.setCell(c, r, s);
-			}
+	subgrid.setSharedStrings(m_SharedStrings);
+	auto rit = std::lower_bound(m_Rows.begin(), m_Rows.end(), row, [](const ROW &line, int r) {
+		return line.row < r;
+	});
+	for (; rit!=m_Rows.end() && rit->row < row + rowcount; ++rit) {
+		for (auto cit=rit->cells.begin(); cit!=rit->cells.end(); ++cit) {
+			if (cit->col < col) continue;
+			if (cit->col >= col + colcount) break;
+			subgrid.copyCell(cit->col - col, rit->row - row, *this, *cit);
 		}
 	}
 	return subgrid;
@@ -267,4 +622,109 @@ KDataGrid KDataGrid::copy(int col, int row, int colcount, int rowcount) const {
 #pragma endregion // KDataGrid
 
 
+namespace Test {
+void Test_datagrid() {
+	int col, row;
+	K__VERIFY(KDataGrid::encodeCellCoord(0, 0) == "A1");
+	K__VERIFY(KDataGrid::encodeCellCoord(25, 9) == "Z10");
+	K__VERIFY(KDataGrid::encodeCellCoord(26, 0) == "AA1");
+	K__VERIFY(KDataGrid::encodeCellCoord(701, 0) == "ZZ1");
+	K__VERIFY(KDataGrid::encodeCellCoord(702, 0) == "AAA1");
+	K__VERIFY(KDataGrid::encodeCellCoord(16383, 1048575) == "XFD1048576");
+	K__VERIFY(KDataGrid::encodeCellCoord(16384, 0) == "");
+
+	K__VERIFY(KDataGrid::decodeCellCoord("A1", &col, &row) && col == 0 && row == 0);
+	K__VERIFY(KDataGrid::decodeCellCoord("ab12", &col, &row) && col == 27 && row == 11);
+	K__VERIFY(KDataGrid::decodeCellCoord("AAA1", &col, &row) && col == 702 && row == 0);
+	K__VERIFY(KDataGrid::decodeCellCoord("XFD1048576", &col, &row) && col == 16383 && row == 1048575);
+	K__VERIFY(!KDataGrid::decodeCellCoord("XFE1", &col, &row));
+	K__VERIFY(!KDataGrid::decodeCellCoord("A1048577", &col, &row));
+	K__VERIFY(!KDataGrid::decodeCellCoord("A0", &col, &row));
+	K__VERIFY(!KDataGrid::decodeCellCoord("AAAA1", &col, &row));
+	K__VERIFY(!KDataGrid::decodeCellCoord("A1:B2", &col, &row));
+	K__VERIFY(!KDataGrid::decodeCellCoord("", &col, &row));
+	K__VERIFY(KDataGrid::decodeCellCoord("B3:C4", 2, &col, &row) && col == 1 && row == 2);
+
+	K__VERIFY(KDataGrid::formatNumber(1) == "1");
+	K__VERIFY(KDataGrid::formatNumber(0.001) == "0.001");
+	K__VERIFY(KDataGrid::formatNumber(0.1 + 0.2) == "0.30000000000000004");
+
+	std::shared_ptr<KStringTable> strings = std::make_shared<KStringTable>();
+	strings->add("shared");
+	strings->add(" padded ");
+	KDataGrid grid;
+	grid.setSharedStrings(strings);
+	grid.setCellNumber(0, 0, 42);
+	grid.setCellNumber(1, 0, 2.5);
+	grid.setCellBool(2, 0, true);
+	grid.setCellError(3, 0, "#N/A");
+	grid.setCellSharedString(0, 1, 0);
+	grid.setCellSharedString(1, 1, 1);
+	std::string s;
+	int i = 0;
+	float f = 0;
+	double d = 0;
+	K__VERIFY(grid.getCellType(0, 0) == KDataGrid::CELL_NUMBER);
+	K__VERIFY(grid.getCellInt(0, 0, &i) && i == 42);
+	K__VERIFY(!grid.getCellInt(1, 0, &i));
+	K__VERIFY(grid.getCellFloat(1, 0, &f) && f == 2.5f);
+	K__VERIFY(grid.getCellNumber(1, 0, &d) && d == 2.5);
+	K__VERIFY(grid.getCell(1, 0, &s) && s == "2.5");
+	K__VERIFY(grid.getCellType(2, 0) == KDataGrid::CELL_BOOL);
+	K__VERIFY(grid.getCell(2, 0, &s) && s == "1");
+	K__VERIFY(grid.getCellType(3, 0) == KDataGrid::CELL_ERROR);
+	K__VERIFY(grid.getCell(3, 0, &s) && s == "#N/A");
+	K__VERIFY(grid.getCell(0, 1, &s) && s == "shared");
+	K__VERIFY(grid.getCell(1, 1, &s) && s == "padded");
+	K__VERIFY(grid.findCell("42", &col, &row) && col == 0 && row == 0);
+	K__VERIFY(grid.getCellType(5, 5) == KDataGrid::CELL_EMPTY);
+
+	// 内容が同じ行は行番号が違っても同じハッシュ値になる
+	KDataGrid moved;
+	moved.setSharedStrings(strings);
+	moved.setCellNumber(0, 5, 42);
+	moved.setCellNumber(1, 5, 2.5);
+	moved.setCellBool(2, 5, true);
+	moved.setCellError(3, 5, "#N/A");
+	moved.setCell(0, 6, "shared");
+	moved.setCellSharedString(1, 6, 1);
+	std::vector<KDataGrid::RowHash> h1, h2;
+	grid.getRowHashes(&h1);
+	moved.getRowHashes(&h2);
+	K__VERIFY(h1.size() == 2 && h2.size() == 2);
+	K__VERIFY(h1[0].row == 0 && h2[0].row == 5 && h1[0].hash == h2[0].hash);
+	K__VERIFY(h1[1].row == 1 && h2[1].row == 6 && h1[1].hash == h2[1].hash);
+	K__VERIFY(h1[0].hash != h1[1].hash);
+
+	// 索引を使った検索
+	KDataGrid table;
+	table.setCell(0, 0, "@BEGIN");
+	table.setCell(1, 0, "name");
+	table.setCell(2, 0, "value");
+	table.setCell(3, 0, "name");
+	table.setCellNumber(1, 1, 42);
+	table.setCell(0, 3, "@END");
+	K__VERIFY(table.findCell("@END", &col, &row) && col == 0 && row == 3);
+	K__VERIFY(table.findCell("42", &col, &row) && col == 1 && row == 1);
+	K__VERIFY(!table.findCell("@end", &col, &row));
+	K__VERIFY(!table.findCell("", &col, &row));
+	K__VERIFY(table.findCellInRow(0, "name") == 1);
+	K__VERIFY(table.findCellInRow(0, "name", 2) == 3);
+	K__VERIFY(table.findCellInRow(1, "name") == -1);
+	K__VERIFY(table.findCellInCol(0, "@END") == 3);
+	K__VERIFY(table.findCellInCol(0, "@END", 4) == -1);
+	K__VERIFY(table.findCellInCol(1, "@END") == -1);
+	table.setCell(0, 2, "@END"); // セルを変更したら索引を作り直す
+	K__VERIFY(table.findCellInCol(0, "@END") == 2);
+	KDataGrid table2 = table;
+	K__VERIFY(table2.findCell("value", &col, &row) && col == 2 && row == 0);
+
+	KDataGrid sub = grid.copy(0, 0, 2, 2);
+	K__VERIFY(sub.getCellNumber(0, 0, &d) && d == 42);
+	K__VERIFY(sub.getCell(0, 1, &s) && s == "shared");
+	K__VERIFY(!sub.getCell(2, 0, &s));
+}
+} // Test
+
+
 } // Kamilo
@@ -1,6 +1,9 @@
 ﻿#pragma once
 #include <string>
+#include <vector>
 #include <unordered_map>
+#include <memory>
+#include "KStringTable.h"
 
 namespace Kamilo {
 
@@ -16,22 +19,48 @@ public:
 
 class KDataGrid {
 public:
+	/// セルの値の種類
+	enum CellType {
+		CELL_EMPTY,  ///< 値が入っていない
+		CELL_TEXT,   ///< 文字列
+		CELL_NUMBER, ///< 数値
+		CELL_BOOL,   ///< 真偽値。文字列としては "1" または "0" になる
+		CELL_ERROR,  ///< エラー値 ("#DIV/0!" など)
+	};
+
 	static constexpr int COL_ALPHABETS = 26; // A～Z
-	static constexpr int COL_LIMIT     = COL_ALPHABETS + COL_ALPHABETS * COL_ALPHABETS; // A～Z + AA～ZZ
-	static constexpr int ROW_LIMIT     = 1024 * 8;
+	static constexpr int COL_LIMIT     = 16384; // A～XFD (Excel 2007 以降の最大列数)
+	static constexpr int ROW_LIMIT     = 1048576; // 1～1048576 (Excel 2007 以降の最大行数)
 
 	/// 行列インデックス（0起算）から "A1" や "AB12" などのセル名を得る
-	/// 列の表記は A から ZZ まで対応する（A～Z, AA～ZZ)
+	/// 列の表記は A から XFD まで対応する（A～Z, AA～ZZ, AAA～XFD)
 	static std::string encodeCellCoord(int col, int row);
 
 	/// "A1" や "AB12" などのセル名から、行列インデックス（0起算）を取得する
-	/// 列の表記は A から ZZ まで対応する（A～Z, AA～ZZ)
+	/// 列の表記は A から XFD まで、行番号は 1 から 1048576 まで対応する。
+	/// 範囲外のセル名や、セル名の後ろに余計な文字がある場合は false を返す
 	static bool decodeCellCoord(const std::string &s, int *col, int *row);
 
+	/// decodeCellCoord と同じだが、ヌル終端していない文字列 s から len バイトを読み取る。
+	/// XML の属性値などを std::string にコピーせずに直接デコードするときに使う
+	static bool decodeCellCoord(const char *s, size_t len, int *col, int *row);
+
+	/// 数値セルを文字列にするときの書式。
+	/// Excel と同じく有効数字 15 桁で表し、それで元の値に戻らない場合だけ 17 桁で表す
+	static std::string formatNumber(double value);
+
+	/// セルに格納する文字列の範囲を得る。
+	/// 前後の空白 (isblank) を取り除いた範囲の先頭を返し、その長さを p_len にセットする。長さが 0 なら値の無いセルとして扱う。
+	/// setCell などはこの規則で文字列を格納するので、KDataGrid を作らずにセルの値を得る場合も同じ規則を使うこと
+	static const char * trimCellText(const char *s, size_t len, size_t *p_len);
+
 public:
 	KDataGrid();
 	bool empty() const;
 	void clear();
+
+	/// このシートが持つ文字列バッファのバイト数。共有文字列テーブルは含まない
+	size_t getArenaSize() const;
 	const std::string & getName() const;
 	void setName(const std::string &name);
 	const std::string & getSourceLocation(int *col=nullptr, int *row=nullptr) const;
@@ -39,23 +68,119 @@ public:
 	bool getDimension(int *p_col, int *p_row, int *p_colcount, int *p_rowcount) const;
 	bool getCell(int col, int row, std::string *p_val) const;
 	void setCell(int col, int row, const std::string &s);
+
+	/// 数値、真偽値、エラー値をセルに入れる。
+	/// 数値は文字列に変換せずにそのまま保持し、getCell で文字列が必要になった時に formatNumber で変換する
+	void setCellNumber(int col, int row, double value);
+	void setCellBool(int col, int row, bool value);
+	void setCellError(int col, int row, const std::string &s);
+
+	/// 共有文字列テーブルを設定する。
+	/// 同じテーブルを複数のシートで共有し、setCellSharedString では文字列をコピーせずに ID だけを保持する
+	void setSharedStrings(const std::shared_ptr<const KStringTable> &table);
+
+	/// 共有文字列テーブルの sid 番目の文字列をセルに入れる。
+	/// 前後に空白がある場合は、空白を取り除いた文字列をこのシートにコピーする
+	void setCellSharedString(int col, int row, int sid);
+
+	/// セルの値の種類を得る
+	CellType getCellType(int col, int row) const;
+
+	/// 数値セルの値を得る。数値セルでなければ false を返す
+	bool getCellNumber(int col, int row, double *p_val) const;
+
+	/// 文字列 s と完全一致するセルを探す。
+	/// 初めて呼ばれたときに、セルの文字列から位置を引く索引を作る。
+	/// 以降はセルを変更するまで索引を使うので、何度呼んでも全てのセルを調べ直すことはない。
+	/// findCell は行優先の順番で最初に見つかったセルを返す
 	bool findCell(const std::string &s, int *p_col, int *p_row) const;
 	int  findCellInRow(int row, const std::string &s, int col_start=0) const;
 	int  findCellInCol(int col, const std::string &s, int row_start=0) const;
 	void scanCells(KDataGridCallback *cb) const;
+
+	/// row 行目の値の入っているセルだけを、列番号の昇順で巡回する
+	void scanCellsInRow(int row, KDataGridCallback *cb) const;
+
+	/// 値の入っている行のハッシュ値
+	struct RowHash {
+		int row;       ///< 行番号（0起算）
+		uint64_t hash; ///< 行内の全セルの列番号と値から求めたハッシュ値
+	};
+
+	/// 値の入っている行ごとのハッシュ値を、行番号の昇順に並べて得る。
+	/// 行番号はハッシュ値に含めないので、内容が同じ行は別の行番号でも同じハッシュ値になる。
+	/// 数値セルは文字列に変換せず、値そのものからハッシュ値を求める
+	void getRowHashes(std::vector<RowHash> *hashes) const;
 	bool getCellInt(int col, int row, int *p_val) const;
 	bool getCellFloat(int col, int row, float *p_val) const;
 	KDataGrid copy(int col, int row, int colcount, int rowcount) const;
 
 
 private:
-	std::vector<std::vector<std::string>> m_RowLines; // [row][col] 行方向にイテレートしたいときに使う
+	// セルの格納形式
+	enum {
+		T_TEXT,   // 文字列。sid は m_Strings での文字列ID
+		T_SHARED, // 共有文字列。sid は m_SharedStrings での文字列ID
+		T_NUMBER, // 数値。num に値が入っている
+		T_BOOL,   // 真偽値。sid が 0 または 1
+		T_ERROR,  // エラー値。sid は m_Strings での文字列ID
+	};
+
+	// 値の入っているセル。16 バイトに収まるようにしている
+	struct CELL {
+		int col;
+		uint8_t type; // T_TEXT など
+		union {
+			double num;
+			int sid;
+		};
+	};
+	// 値の入っているセルを一つ以上含む行
+	struct ROW {
+		int row;
+		std::vector<CELL> cells; // 列番号の昇順
+	};
+	// 文字列からセルを探すための索引。
+	// セルの文字列のハッシュ値でバケットに分け、バケットごとに行優先の順番でセルを並べる
+	struct INDEX {
+		struct ENTRY {
+			uint32_t ri;  // m_Rows でのインデックス
+			uint32_t ci;  // ROW::cells でのインデックス
+			uint32_t tag; // ハッシュ値の上位 32 ビット。文字列を比べる前にこれで候補を絞る
+		};
+		std::vector<uint32_t> buckets; // buckets[b] から buckets[b+1] の手前までが、バケット b のセル
+		std::vector<ENTRY> entries;
+		uint64_t mask;                 // ハッシュ値からバケット番号を得るためのマスク
+	};
+	std::shared_ptr<const INDEX> getIndex() const;
+	const INDEX::ENTRY * lookupIndex(const INDEX &index, const std::string &s, const INDEX::ENTRY **p_end, uint32_t *p_tag) const;
+	const ROW * findRow(int row) const;
+	const CELL * findCellInRowData(const ROW &line, int col) const;
+	const CELL * findCellData(int col, int row) const;
+	CELL * allocCell(int col, int row);
+	const char * getCellString(const CELL &cell, char *buf, size_t *p_len) const;
+	bool matchCell(const CELL &cell, const std::string &s) const;
+	void copyCell(int col, int row, const KDataGrid &src, const CELL &cell);
+
+	// 値の入っている行とセルだけを保持する疎な格納方式。
+	// 空の行、空のセルはメモリを消費しない
+	std::vector<ROW> m_Rows; // 行番号の昇順
+	KStringTable m_Strings;  // セルの文字列
+	std::shared_ptr<const KStringTable> m_SharedStrings; // 共有文字列テーブル。他のシートと共有している
 	std::string m_Name;
 	std::string m_SourceLoc;
 	int m_SourceCol, m_SourceRow;
-	mutable int m_Col0, m_Col1;
-	mutable int m_Row0, m_Row1;
-	mutable bool m_RecalcDim;
+	int m_Col0, m_Col1; // 値の入っているセルの範囲。セルを追加するたびに更新する
+	int m_Row0, m_Row1;
+
+	// findCell などで使う索引。必要になったときに作り、セルを変更したら破棄する。
+	// 作り終えた索引は変更しないので、同じシートを複製した KDataGrid とも共有できる
+	mutable std::shared_ptr<const INDEX> m_Index;
 };
 
+
+namespace Test {
+void Test_datagrid();
+}
+
 } // Kamilo
@@ -824,7 +824,7 @@ bool KEdgePalReader::loadFromStream(KInputStream &file) {
 	K__ASSERT(uzsize > 0);
 
 	// 圧縮データ
-	int zsize = file.size() - file.tell();
+	int zsize = (int)(file.size() - file.tell());
 	KEdgeBin zbin = file.readBin(zsize);
 	K__ASSERT(zsize > 0);
 	K__ASSERT(! zbin.empty());
@@ -904,7 +904,7 @@ KEdgeBin KEdgeRawReader::unzip(KInputStream &file, uint16_t *zflag) {
 	K__ASSERT(uzsize > 0);
 
 	// 圧縮データ
-	int zsize = file.size() - file.tell();
+	int zsize = (int)(file.size() - file.tell());
 	KEdgeBin zbin = file.readBin(zsize);
 	K__ASSERT(zsize > 0);
 	K__ASSERT(! zbin.empty());
@@ -1,10 +1,27 @@
 ﻿#include "KExcel.h"
 
 #include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
 #include "KStream.h"
 #include "KInternal.h"
 #include "KZip.h"
 #include "KXml.h"
+#include "KXmlReader.h"
+#include "KStringTable.h"
+
+// 書き出す文字列のエスケープに SSE2 を使う（KXmlReader.cpp と同じ条件）
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define K_EXCEL_SSE2 1
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#else
+#	define K_EXCEL_SSE2 0
+#endif
 
 
 
@@ -19,31 +36,85 @@ namespace Kamilo {
 
 
 #pragma region KExcel
+// 生存期間中の経過秒数を *dest に加算するタイマー。
+// dest が nullptr ならば時刻の取得もしない
+class CStatTimer {
+	double *m_Dest;
+	uint64_t m_Start;
+public:
+	explicit CStatTimer(double *dest) {
+		m_Dest = dest;
+		m_Start = dest ? K::clockNano64() : 0;
+	}
+	~CStatTimer() {
+		stop();
+	}
+	void stop() {
+		if (m_Dest) {
+			*m_Dest += (K::clockNano64() - m_Start) / 1000000000.0;
+			m_Dest = nullptr;
+		}
+	}
+};
+
+// 別の入力ストリームからの読み取りにかかった時間を *dest に加算する。
+// 展開しながら読むストリームに被せて、展開にかかった時間を XML の解析時間と分けて計測する
+class CTimedInputImpl: public KInputStream::Impl {
+	KInputStream m_Input;
+	double *m_Dest;
+public:
+	CTimedInputImpl(KInputStream &input, double *dest): m_Input(input), m_Dest(dest) {
+	}
+	virtual int read(void *buf, int size) override {
+		CStatTimer timer(m_Dest);
+		return m_Input.read(buf, size);
+	}
+	virtual int64_t tell() override { return m_Input.tell(); }
+	virtual int64_t size() override { return m_Input.size(); }
+	virtual void seek(int64_t pos) override { m_Input.seek(pos); }
+	virtual bool eof() override { return m_Input.eof(); }
+	virtual void close() override { m_Input.close(); }
+	virtual bool isOpen() override { return m_Input.isOpen(); }
+};
+
 
 class CXlsxImpl {
+	friend class CCoreExcelReader2;
 public:
-	static bool loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result) {
-		KUnzipper zr(file);
-		return loadFromZipAsXlsx(zr, xlsx_name, result);
+	static bool loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
+		KUnzipper zr;
+		{
+			CStatTimer timer(params && params->stats ? &params->stats->open_sec : nullptr);
+			zr.open(file);
+		}
+		return loadFromZipAsXlsx(zr, xlsx_name, result, params);
 	}
-	static bool loadFromFileName(const std::string &filename, std::vector<KDataGrid> &result) {
+	static bool loadFromFileName(const std::string &filename, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
 		KInputStream file;
-		if (file.openFileName(filename)) {
-			if (loadFromStream(file, filename, result)) {
+		if (file.openFileNameMapped(filename)) {
+			if (loadFromStream(file, filename, result, params)) {
 				return true;
 			}
 		}
 		return false;
 	}
-	static bool loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result) {
+	static bool loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
 		KInputStream file;
 		if (file.openMemory(bin, size)) {
-			if (loadFromStream(file, name, result)) {
+			if (loadFromStream(file, name, result, params)) {
 				return true;
 			}
 		}
 		return false;
 	}
+	static bool scanFromStream(KInputStream &file, const std::string &xlsx_name, KXlsxCallback *cb, const KXlsxLoadParams *params) {
+		KUnzipper zr;
+		{
+			CStatTimer timer(params && params->stats ? &params->stats->open_sec : nullptr);
+			zr.open(file);
+		}
+		return scanZipAsXlsx(zr, xlsx_name, cb, params);
+	}
 private:
 	// 文字列 s をエスケープする必要がある？
 	static bool shouldEscapeString(const std::string &_s) {
@@ -51,19 +122,6 @@ private:
 		return HAS_CHAR(s, '<') || HAS_CHAR(s, '>') || HAS_CHAR(s, '"') || HAS_CHAR(s, '\'') || HAS_CHAR(s, '\n');
 	}
 
-	// ZIP 内のファイルを探してインデックスを返す
-	static int findZipEntry(KUnzipper &zr, const std::string &name) {
-		int num = zr.getEntryCount();
-		for (int i=0; i<num; i++) {
-			std::string s;
-			zr.getEntryName(i, &s);
-			if (s.compare(name) == 0) {
-				return i;
-			}
-		}
-		return -1;
-	}
-
 	static KXmlElement * loadXmlFromZip(KUnzipper &zr, const std::string &zip_name, const std::string &entry_name) {
 		if (!zr.isOpen()) {
 			K__ERROR("E_INVALID_ARGUMENT");
@@ -71,7 +129,7 @@ private:
 		}
 
 		// XLSX の XML は常に UTF-8 で書いてある。それを信用する
-		int fileid = findZipEntry(zr, entry_name);
+		int fileid = zr.findEntry(entry_name);
 		if (fileid < 0) {
 			K__ERROR("E_FILE: Failed to open file '%s' from archive '%s'", entry_name.c_str(), zip_name.c_str());
 			return nullptr;
@@ -91,221 +149,785 @@ private:
 		return xdoc;
 	}
 
-	enum EType {
-		T_NODATA,
-		T_NUMBER,
-		T_STRINGID,
-		T_LITERAL,
-		T_OTHER,
+	// scanSheetData が読み取ったセルを、値の種類ごとに受け取る
+	class CCellSink {
+	public:
+		virtual void onText(int col, int row, const std::string &s) = 0;
+		virtual void onSharedString(int col, int row, int sid) = 0;
+		virtual void onNumber(int col, int row, double value) = 0;
+		virtual void onBool(int col, int row, bool value) = 0;
+		virtual void onError(int col, int row, const std::string &s) = 0;
 	};
 
-	// 無変換のセルデータを得る。得られた文字列が何を表しているかは type によって異なる
-	static EType getCellData(const KXmlElement *cell_xml, std::string *p_text, int *p_sid) {
-		// cell_xml の入力例:
-		// <c r="B1" s="0" t="n">
-		// 	<v>12</v>
-		// </c>
+	// 読み取ったセルを、値の種類を保ったまま一枚のシートに格納する。
+	// 共有文字列はコピーせず、ワークブックの共有文字列テーブルをシートと共有する
+	class CSheetBuilder: public CCellSink {
+		KDataGrid &m_Grid;
+	public:
+		CSheetBuilder(KDataGrid &grid, const std::shared_ptr<KStringTable> &string_table): m_Grid(grid) {
+			m_Grid.setSharedStrings(string_table);
+		}
+		virtual void onText(int col, int row, const std::string &s) override {
+			m_Grid.setCell(col, row, s);
+		}
+		virtual void onSharedString(int col, int row, int sid) override {
+			m_Grid.setCellSharedString(col, row, sid);
+		}
+		virtual void onNumber(int col, int row, double value) override {
+			m_Grid.setCellNumber(col, row, value);
+		}
+		virtual void onBool(int col, int row, bool value) override {
+			m_Grid.setCellBool(col, row, value);
+		}
+		virtual void onError(int col, int row, const std::string &s) override {
+			m_Grid.setCellError(col, row, s);
+		}
+	};
 
-		// データ文字列
-		const KXmlElement *v_elm = cell_xml->findNode("v");
-		if (v_elm == nullptr) return T_NODATA;
+	// 読み取ったセルを文字列にして KDataGridCallback に渡す。
+	// KDataGrid にロードしてから KDataGrid::scanCells した場合と同じセルになるよう、
+	// 数値は KDataGrid::getCell と同じ書式で文字列にし、文字列は KDataGrid::trimCellText と同じ規則で前後の空白を除く。
+	// 共有文字列の場合はテーブル内の文字列を m_Text にコピーして渡すので、セルごとのメモリ確保は発生しない
+	class CTextSink: public CCellSink {
+		KDataGridCallback *m_CB;
+		const KStringTable &m_Table;
+		std::string m_Text;
+	public:
+		CTextSink(KDataGridCallback *cb, const KStringTable &string_table): m_CB(cb), m_Table(string_table) {
+		}
+		virtual void onText(int col, int row, const std::string &s) override {
+			size_t len = 0;
+			const char *trimmed = KDataGrid::trimCellText(s.data(), s.size(), &len);
+			if (len == 0) {
+				return;
+			}
+			if (len == s.size()) {
+				m_CB->onCell(col, row, s);
+			} else {
+				m_Text.assign(trimmed, len);
+				m_CB->onCell(col, row, m_Text);
+			}
+		}
+		virtual void onSharedString(int col, int row, int sid) override {
+			size_t len = 0;
+			const char *s = m_Table.getString(sid, &len);
+			s = KDataGrid::trimCellText(s, len, &len);
+			if (len > 0) {
+				m_Text.assign(s, len);
+				m_CB->onCell(col, row, m_Text);
+			}
+		}
+		virtual void onNumber(int col, int row, double value) override {
+			m_Text = KDataGrid::formatNumber(value);
+			m_CB->onCell(col, row, m_Text);
+		}
+		virtual void onBool(int col, int row, bool value) override {
+			m_Text = value ? "1" : "0";
+			m_CB->onCell(col, row, m_Text);
+		}
+		virtual void onError(int col, int row, const std::string &s) override {
+			if (!s.empty()) { // KDataGrid::setCellError と同じく、空のエラー値は無視する
+				m_CB->onCell(col, row, s);
+			}
+		}
+	};
 
-		const char *v = v_elm->getText();
-		if (v == nullptr) return T_NODATA;
+	// ワークブック内のシート
+	struct SHEET {
+		std::string name; // シート名
+		std::string file; // ZIP 内でのシートのファイル名 ("xl/worksheets/sheet1.xml" など)
+		int index;        // ワークブック内でのシート番号（ゼロ起算）
+	};
 
-		// データ型
-		const char *s = cell_xml->getAttrString("s");
-		const char *t = cell_xml->getAttrString("t");
-		if (t && strcmp(t, "n") == 0) {
-			*p_text = v;
-			return T_NUMBER; // <v> には数値が指定されている
+	// 共有文字列 ID の集合。ID ごとに 1 ビットを使う
+	struct IDSET {
+		std::vector<uint64_t> bits;
+		int count = 0; // 集合に含まれる ID の数
+
+		void add(int id) {
+			if (id < 0) return;
+			size_t w = (size_t)id / 64;
+			if (w >= bits.size()) {
+				bits.resize(w + 1, 0);
+			}
+			uint64_t mask = 1ULL << (id % 64);
+			if ((bits[w] & mask) == 0) {
+				bits[w] |= mask;
+				count++;
+			}
+		}
+		bool has(int id) const {
+			if (id < 0) return false;
+			size_t w = (size_t)id / 64;
+			return w < bits.size() && (bits[w] & (1ULL << (id % 64))) != 0;
+		}
+	};
+
+	// ワークブック全体で共有する情報
+	struct WORKBOOK {
+		std::shared_ptr<KStringTable> string_table = std::make_shared<KStringTable>(); // 共有文字列テーブル。読み取ったシートからも参照される
+		std::vector<SHEET> sheets; // 読み取り対象のシート
+	};
+
+	static bool loadFromZipAsXlsx(KUnzipper &zr, const std::string &xlsx_name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
+		int num_threads = params ? params->num_threads : 1;
+		if (num_threads <= 0) {
+			num_threads = (int)std::thread::hardware_concurrency();
+		}
+		WORKBOOK wb;
+		if (!loadWorkbook(zr, xlsx_name, params, &wb)) {
+			return false;
 		}
-		if (t && strcmp(t, "s") == 0) {
-			int n = 0;
-			K::strToInt(v, &n);
-			*p_sid = n;
-			return T_STRINGID; // <v> には文字列IDが指定されている
+		int num_sheets = (int)wb.sheets.size();
+		if (num_threads > num_sheets) {
+			num_threads = num_sheets;
 		}
-		if (t && strcmp(t, "str") == 0) {
-			*p_text = v;
-			return T_LITERAL; // <v> には文字列が直接指定されている
+		KXlsxStats *stats = params ? params->stats : nullptr;
+		std::vector<KXlsxSheetStats> sheet_stats(stats ? num_sheets : 0); // ワーカーはそれぞれのシートの位置にだけ書き込む
+		CStatTimer sheets_timer(stats ? &stats->sheets_sec : nullptr);
+
+		// num_threads が 1 以下ならば、呼び出し元のスレッドだけで順番に読み取る。
+		// 各シートは ZIP 内の独立したファイルなので、並列に展開・解析できる。
+		// ワーカーは空いたら次のシートを取りに行く。
+		// 共有文字列テーブルは読み取り専用で共有する。
+		// 結果はシート番号の位置に格納するため、ワークブック内の順番が保たれる
+		std::vector<KDataGrid> grids(num_sheets);
+		std::vector<char> succeeded(num_sheets, 0);
+		std::atomic<int> next_sheet(0);
+		auto worker = [&]() {
+			while (1) {
+				int i = next_sheet++;
+				if (i >= num_sheets) break;
+				CSheetBuilder builder(grids[i], wb.string_table);
+				succeeded[i] = scanSheet(zr, xlsx_name, wb, wb.sheets[i], &builder, stats ? &sheet_stats[i] : nullptr) ? 1 : 0;
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int t=1; t<num_threads; t++) {
+			threads.push_back(std::thread(worker));
 		}
-		if (t) {
-			*p_text = v;
-			return T_OTHER; // それ以外の値が入っている
+		worker(); // 呼び出し元のスレッドも処理に参加する
+		for (auto it=threads.begin(); it!=threads.end(); ++it) {
+			it->join();
+		}
+		sheets_timer.stop();
+
+		if (stats) {
+			// 全てのシートが同時にメモリ上にある
+			size_t arena = wb.string_table->getArenaSize();
+			for (int i=0; i<num_sheets; i++) {
+				sheet_stats[i].arena_bytes = grids[i].getArenaSize();
+				arena += sheet_stats[i].arena_bytes;
+				addSheetStats(stats, sheet_stats[i]);
+			}
+			stats->peak_arena_bytes = std::max(stats->peak_arena_bytes, arena);
+		}
+
+		for (int i=0; i<num_sheets; i++) {
+			if (!succeeded[i]) {
+				return false;
+			}
+			grids[i].setSourceLocation(xlsx_name, 0, 0);
+			grids[i].setName(wb.sheets[i].name);
+			result.push_back(std::move(grids[i]));
+		}
+		return true;
+	}
+
+	static bool scanZipAsXlsx(KUnzipper &zr, const std::string &xlsx_name, KXlsxCallback *cb, const KXlsxLoadParams *params) {
+		WORKBOOK wb;
+		if (!loadWorkbook(zr, xlsx_name, params, &wb)) {
+			return false;
+		}
+		KXlsxStats *stats = params ? params->stats : nullptr;
+		if (stats) {
+			// シートは作らないので、メモリ上にあるのは共有文字列テーブルだけ
+			stats->peak_arena_bytes = std::max(stats->peak_arena_bytes, wb.string_table->getArenaSize());
+		}
+		CStatTimer sheets_timer(stats ? &stats->sheets_sec : nullptr);
+		for (size_t i=0; i<wb.sheets.size(); i++) {
+			const SHEET &sheet = wb.sheets[i];
+			cb->onSheet(sheet.index, sheet.name);
+			CTextSink sink(cb, *wb.string_table);
+			KXlsxSheetStats st;
+			bool ok = scanSheet(zr, xlsx_name, wb, sheet, &sink, stats ? &st : nullptr);
+			if (stats) {
+				addSheetStats(stats, st);
+			}
+			if (!ok) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// シート一覧と共有文字列テーブルを読み取る。
+	// params->sheet_filter が指定されている場合、それに一致しないシートは wb->sheets に含めない
+	static bool loadWorkbook(KUnzipper &zr, const std::string &xlsx_name, const KXlsxLoadParams *params, WORKBOOK *wb) {
+		KXlsxStats *stats = params ? params->stats : nullptr;
+		{
+			CStatTimer timer(stats ? &stats->workbook_sec : nullptr);
+			if (!loadFilteredSheetList(zr, xlsx_name, params, &wb->sheets)) {
+				return false;
+			}
+		}
+		if (wb->sheets.empty()) {
+			return true; // 読み取るシートが無い。共有文字列も不要
+		}
+		// 共有文字列テーブルが途中までしか無いと、それ以降の文字列を参照するセルが全て空になるので失敗とする
+		IDSET ids;
+		if (params && params->used_strings_only && collectAllSharedStringIds(zr, xlsx_name, wb->sheets, &ids, stats)) {
+			return loadSharedStrings(zr, xlsx_name, wb->string_table.get(), stats, &ids);
 		} else {
-			// t 属性がない
-			*p_text = v;
-			return T_LITERAL;
+			return loadSharedStrings(zr, xlsx_name, wb->string_table.get(), stats);
 		}
 	}
 
-	static bool getCellText(const KXmlElement *cell_xml, std::string *p_text, const std::unordered_map<int, std::string> &string_table) {
-		std::string data;
-		int sid = -1;
-		switch (getCellData(cell_xml, &data, &sid)) {
-		case T_STRINGID:
-			{
-				auto it = string_table.find(sid);
-				if (it != string_table.end()) {
-					if (it->second.empty() == false) {
-						*p_text = it->second;
-						return true;
-					}
-				}
+	// 全てのシートについて collectSharedStringIds を呼ぶ。
+	// 一つでも走査できないシートがあれば false を返す。その場合 ids は不完全なので、共有文字列テーブルを全て読み取ること
+	static bool collectAllSharedStringIds(KUnzipper &zr, const std::string &xlsx_name, const std::vector<SHEET> &sheets, IDSET *ids, KXlsxStats *stats=nullptr) {
+		for (size_t i=0; i<sheets.size(); i++) {
+			if (!collectSharedStringIds(zr, xlsx_name, sheets[i], ids, stats)) {
 				return false;
 			}
-		case T_NUMBER:
-		case T_LITERAL:
-		case T_OTHER:
-			{
-				if (data.empty() == false) {
-					*p_text = data;
-					return true;
-				}
+		}
+		return true;
+	}
+
+	// ワークシートを走査して、共有文字列を参照しているセル (t="s") の文字列 ID を ids に加える。
+	// セルの位置や他の値は解釈しない
+	static bool collectSharedStringIds(KUnzipper &zr, const std::string &xlsx_name, const SHEET &sheet, IDSET *ids, KXlsxStats *stats=nullptr) {
+		int fileid = zr.findEntry(sheet.file);
+		if (fileid < 0) {
+			return false; // エラーはシートを読み取るときに報告する
+		}
+		CStatTimer timer(stats ? &stats->shared_strings_sec : nullptr);
+		KXmlReader xr;
+		KInputStream entry;
+		openEntryXml(zr, fileid, xr, entry, nullptr);
+		bool shared = false; // 共有文字列のセル <c t="s"> の中にいる
+		std::string value;
+		while (1) {
+			KXmlReader::Token tk = xr.next();
+			if (tk == KXmlReader::TK_EOF) {
+				return true;
+			}
+			if (tk == KXmlReader::TK_ERROR) {
+				K__ERROR("E_XML: Failed to read xml document: '%s' from archive '%s'", sheet.file.c_str(), xlsx_name.c_str());
 				return false;
 			}
+			if (tk == KXmlReader::TK_OPEN) {
+				if (xr.hasTag("c")) {
+					const char *t = nullptr;
+					size_t len = 0;
+					shared = xr.getAttrRaw("t", &t, &len) && len == 1 && t[0] == 's';
+				} else if (shared && xr.hasTag("v")) {
+					int sid = -1;
+					if (xr.readText(&value) && K::strToInt(value, &sid)) {
+						ids->add(sid);
+					}
+				}
+			} else if (tk == KXmlReader::TK_CLOSE && xr.hasTag("c")) {
+				shared = false;
+			}
+		}
+	}
+
+	// シートの統計を合計に加える
+	static void addSheetStats(KXlsxStats *stats, const KXlsxSheetStats &st) {
+		stats->inflated_bytes += st.xml_bytes;
+		stats->xml_nodes += st.xml_nodes;
+		stats->cells += st.cells;
+		stats->sheets.push_back(st);
+	}
+
+	// ZIP 内のファイルの展開後のサイズ。見つからなければ 0
+	static int64_t getEntrySize(KUnzipper &zr, const char *entry_name) {
+		int fileid = zr.findEntry(entry_name);
+		return (fileid >= 0) ? zr.getEntryParamInt64(fileid, KUnzipper::UNZIP_SIZE) : 0;
+	}
+
+	// シート一覧のうち、params->sheet_filter に一致するものだけを得る
+	static bool loadFilteredSheetList(KUnzipper &zr, const std::string &xlsx_name, const KXlsxLoadParams *params, std::vector<SHEET> *sheets) {
+		std::vector<SHEET> all_sheets;
+		if (!loadSheetList(zr, xlsx_name, &all_sheets)) {
+			return false;
+		}
+		for (size_t i=0; i<all_sheets.size(); i++) {
+			if (params == nullptr || matchSheetFilter(all_sheets[i].name, params->sheet_filter)) {
+				sheets->push_back(all_sheets[i]);
+			}
+		}
+		return true;
+	}
+
+	// シート名 name がフィルタ filter に一致するか調べる。
+	// filter が空ならば全てのシートが一致する。
+	// filter の各要素はシート名そのもの、または "Data*" などのワイルドカードを含むパターン
+	static bool matchSheetFilter(const std::string &name, const std::vector<std::string> &filter) {
+		if (filter.empty()) {
+			return true;
+		}
+		for (size_t i=0; i<filter.size(); i++) {
+			if (filter[i].compare(name) == 0) {
+				return true;
+			}
+			if (K::pathGlob(name, filter[i])) {
+				return true;
+			}
 		}
 		return false;
 	}
 
-	static bool loadFromZipAsXlsx(KUnzipper &zr, const std::string &xlsx_name, std::vector<KDataGrid> &result) {
-		// 文字列テーブルを取得
-		std::unordered_map<int, std::string> string_table;
-		{
-			const KXmlElement *strings_doc = loadXmlFromZip(zr, xlsx_name, "xl/sharedStrings.xml");
-			if (strings_doc) {
-				int string_id = 0;
-				const KXmlElement *string_elm = strings_doc->getChild(0);
-				for (int si=0; si<string_elm->getChildCount(); si++) {
-					const KXmlElement *si_elm = string_elm->getChild(si);
-					if (!si_elm->hasTag("si")) continue;
-
-					// パターンA
-					// <si>
-					//   <t>テキスト</t>
-					// </si>
-					const KXmlElement *t_elm = si_elm->findNode("t");
-					if (t_elm) {
-						const char *s = t_elm->getText("");
-						string_table[string_id] = s;
-						string_id++;
-						continue;
-					}
+	// ZIP 内のパッケージパートを基準パート base_part からの相対パス target で指定したときのパート名を返す。
+	// target が "/" で始まっている場合はパッケージのルートからの絶対パスとして扱う
+	// 例: base_part="xl/workbook.xml" target="worksheets/sheet1.xml" ==> "xl/worksheets/sheet1.xml"
+	// 例: base_part="xl/workbook.xml" target="/xl/worksheets/sheet1.xml" ==> "xl/worksheets/sheet1.xml"
+	static std::string resolvePartName(const std::string &base_part, const std::string &target) {
+		std::vector<std::string> names;
+		if (target.empty() || target[0] != '/') {
+			names = K::strSplit(base_part, "/", 0, true, false);
+			if (!names.empty()) names.pop_back(); // ファイル名部分を取り除く
+		}
+		std::vector<std::string> tok = K::strSplit(target, "/", 0, true, false);
+		for (size_t i=0; i<tok.size(); i++) {
+			if (tok[i].empty() || tok[i].compare(".") == 0) {
+				continue;
+			}
+			if (tok[i].compare("..") == 0) {
+				if (!names.empty()) names.pop_back();
+				continue;
+			}
+			names.push_back(tok[i]);
+		}
+		return K::strJoin(names, "/");
+	}
 
-					// パターンB（テキストの途中でスタイル変更がある場合にこうなる？）
-					// <si>
-					//   <rPr>スタイル情報いろいろ</rPr>
-					//   <r><t>テキスト1</t></r>
-					//   <r><t>テキスト2</t></r>
-					//   ....
-					// </si>
-					std::string s;
-					for (int r=0; r<si_elm->getChildCount(); r++) {
-						const KXmlElement *r_elm = si_elm->getChild(r);
-						if (r_elm->hasTag("r")) {
-							const KXmlElement *t_xml = r_elm->findNode("t");
-							if (t_xml) {
-								s += t_xml->getText("");
-							}
-						}
-					}
-					if (!s.empty()) {
-						string_table[string_id] = s;
-						string_id++;
-						continue;
+	// シート名と、シートのファイル名の一覧を得る
+	static bool loadSheetList(KUnzipper &zr, const std::string &xlsx_name, std::vector<SHEET> *sheets) {
+		const char *WORKBOOK_PART = "xl/workbook.xml";
+
+		// リレーションシップを取得
+		// <Relationships>
+		//   <Relationship Id="rId1" Type="http://.../worksheet" Target="worksheets/sheet1.xml"/>
+		//   ...
+		// </Relationships>
+		std::unordered_map<std::string, std::string> rels; // Id --> ZIP 内のファイル名
+		if (zr.findEntry("xl/_rels/workbook.xml.rels") >= 0) {
+			const KXmlElement *xDoc = loadXmlFromZip(zr, xlsx_name, "xl/_rels/workbook.xml.rels");
+			if (xDoc) {
+				const KXmlElement *xRoot = xDoc->getChild(0);
+				for (int i=xRoot->findChildByTag("Relationship"); i>=0; i=xRoot->findChildByTag("Relationship", i+1)) {
+					const KXmlElement *elm = xRoot->getChild(i);
+					const char *id = elm->getAttrString("Id");
+					const char *target = elm->getAttrString("Target");
+					const char *mode = elm->getAttrString("TargetMode");
+					if (id && target && (mode == nullptr || strcmp(mode, "External") != 0)) {
+						rels[id] = resolvePartName(WORKBOOK_PART, target);
 					}
-
-					// その他のパターン。解析できず。
-					// 文字列IDだけを進めておく
-					string_id++;
 				}
-				strings_doc->drop();
+				xDoc->drop();
 			}
 		}
 
 		// ワークシートの枚数とシート名を取得
-		std::vector<std::string> sheet_names;
-		{
-			const KXmlElement *xDoc = loadXmlFromZip(zr, xlsx_name, "xl/workbook.xml");
-			const KXmlElement *xRoot = xDoc->getChild(0);
-			const KXmlElement *xSheets = xRoot->findNode("sheets");
+		// <sheets>
+		//   <sheet name="Sheet1" sheetId="1" r:id="rId1"/>
+		//   ...
+		// </sheets>
+		const KXmlElement *xDoc = loadXmlFromZip(zr, xlsx_name, WORKBOOK_PART);
+		if (xDoc == nullptr) {
+			return false;
+		}
+		const KXmlElement *xRoot = xDoc->getChild(0);
+		const KXmlElement *xSheets = xRoot->findNode("sheets");
+		if (xSheets) {
 			for (int i=xSheets->findChildByTag("sheet"); i>=0; i=xSheets->findChildByTag("sheet", i+1)) {
 				const KXmlElement *elm = xSheets->getChild(i);
-				const char *s = elm->getAttrString("name");
-				K__ASSERT(s);
-				sheet_names.push_back(s);
+				const char *name = elm->getAttrString("name");
+				const char *rid = elm->getAttrString("r:id");
+				K__ASSERT(name);
+				SHEET sheet;
+				sheet.name = name;
+				sheet.index = (int)sheets->size();
+				auto it = rid ? rels.find(rid) : rels.end();
+				if (it != rels.end()) {
+					sheet.file = it->second;
+				} else {
+					// リレーションシップが見つからない。
+					// シートの並び順とファイル名の番号が一致していると仮定する
+					K__WARNING("E_XLSX: No relationship for sheet '%s' in '%s'", name, xlsx_name.c_str());
+					sheet.file = K::str_sprintf("xl/worksheets/sheet%d.xml", 1+sheet.index);
+				}
+				sheets->push_back(sheet);
 			}
-			xDoc->drop();
 		}
+		xDoc->drop();
+		return true;
+	}
 
-		// ワークシートの中身を取得
-		struct CELL {
-			int row, col;
-			std::string str;
-		};
-		for (int i=0; i<(int)sheet_names.size(); i++) {
-			std::vector<CELL> cells;
-			{
-				const std::string filename = K::str_sprintf("xl/worksheets/sheet%d.xml", 1+i);
-				const KXmlElement *xDoc = loadXmlFromZip(zr, xlsx_name, filename);
-				const KXmlElement *xRoot = xDoc->getChild(0);
-				const KXmlElement *xSheetData = xRoot->findNode("sheetData");
-				for (int r=0; r<xSheetData->getChildCount(); r++) {
-					const KXmlElement *xRow = xSheetData->getChild(r);
-					if (!xRow->hasTag("row")) continue;
-
-					for (int c=0; c<xRow->getChildCount(); c++) {
-						const KXmlElement *xCell = xRow->getChild(c);
-						if (!xCell->hasTag("c")) continue;
-
-						// とんでもないセル番号が入っている場合がある "ZA1" とか
-						// しかし実際には空文字列が入っているだけだったりするので、
-						// 有効な文字列が入っているかどうかを先に調べる。
-						// 空文字列のセルだった場合は存在しないものとして扱う
-						std::string str;
-						if (getCellText(xCell, &str, string_table)) {
-							const char *coord = xCell->getAttrString("r");
-							int col = -1;
-							int row = -1;
-							if (KDataGrid::decodeCellCoord(coord, &col, &row)) {
-								CELL cell;
-								cell.col = col;
-								cell.row = row;
-								cell.str = str;
-								cells.push_back(cell);
-							}
+	// ZIP 内の fileid 番目のファイルを xr で読めるようにする。
+	// 無圧縮で格納されていて、ZIP 全体がメモリ上にある（マップしたファイルなど）場合は、XML を直接読む。
+	// そうでなければ entry に展開用のストリームを開き、少しずつ展開しながら読む。
+	// inflate_sec が nullptr でなければ、展開にかかった時間を分けて計測し、加算する
+	static void openEntryXml(KUnzipper &zr, int fileid, KXmlReader &xr, KInputStream &entry, double *inflate_sec) {
+		const void *xml_ptr = nullptr;
+		int xml_size = 0;
+		if (zr.getEntryDataPtr(fileid, &xml_ptr, &xml_size)) {
+			xr.open((const char *)xml_ptr, xml_size);
+			return;
+		}
+		entry = zr.openEntryStream(fileid, "");
+		if (inflate_sec) {
+			entry = KInputStream(new CTimedInputImpl(entry, inflate_sec));
+		}
+		xr.open(entry);
+	}
+
+	// 共有文字列テーブルを読み取る。
+	// stats が nullptr でなければ統計を記録する。
+	// used が nullptr でなければ、used に含まれる ID の文字列だけを格納し、それ以外は空文字列にする。
+	// 途中で読み取りに失敗した場合は false を返す。その場合、テーブルにはそこまでの文字列しか入っていない
+	static bool loadSharedStrings(KUnzipper &zr, const std::string &xlsx_name, KStringTable *p_table, KXlsxStats *stats=nullptr, const IDSET *used=nullptr) {
+		// 共有文字列を一つも使っていないブックには sharedStrings.xml が存在しない
+		if (zr.findEntry("xl/sharedStrings.xml") < 0) {
+			return true;
+		}
+		CStatTimer timer(stats ? &stats->shared_strings_sec : nullptr);
+		if (stats) {
+			stats->inflated_bytes += getEntrySize(zr, "xl/sharedStrings.xml");
+		}
+		KStringTable &string_table = *p_table;
+
+		// 巨大になる場合があるので DOM は作らず、KXmlReader で読みながら直接 string_table に格納する。
+		// <sst uniqueCount="3">
+		//   <si><t>テキスト</t></si>
+		//   <si><r><rPr>スタイル情報いろいろ</rPr><t>テキスト1</t></r><r><t>テキスト2</t></r></si>
+		//   <si><t>漢字</t><rPh sb="0" eb="2"><t>カンジ</t></rPh><phoneticPr fontId="1"/></si>
+		// </sst>
+		// <si> 内の <t> を全て連結したものを一つの文字列とする。ふりがな <rPh> の中の <t> は含めない。
+		// <t> が無い <si> は空文字列になる。文字列IDだけが進む
+		KXmlReader xr;
+		KInputStream entry;
+		openEntryXml(zr, zr.findEntry("xl/sharedStrings.xml"), xr, entry, nullptr);
+
+		// 同じ文字列が何度も現れることが多いので、重複をまとめてメモリを節約する
+		string_table.setInterning(true);
+		int si_depth = -1; // <si> の深さ。<si> の外側にいるなら -1
+		int t_depth = -1;  // <t> の深さ。<t> の外側にいるなら -1
+		int sid = 0;       // 次の <si> の文字列 ID
+		std::string text;  // 実体参照を展開したテキスト
+		bool ok = true;
+		while (ok) {
+			KXmlReader::Token tk = xr.next();
+			if (tk == KXmlReader::TK_EOF) {
+				break;
+			}
+			if (tk == KXmlReader::TK_ERROR) {
+				ok = false;
+				break;
+			}
+			if (tk == KXmlReader::TK_OPEN) {
+				if (si_depth < 0) {
+					if (xr.hasTag("si")) {
+						if (used && !used->has(sid)) {
+							// 参照されていない文字列。中身は解釈せずに ID だけを進める
+							sid++;
+							ok = string_table.add("", 0) >= 0 && xr.skipElement();
+							continue;
+						}
+						sid++;
+						si_depth = xr.getDepth();
+						string_table.beginString();
+					} else if (xr.hasTag("sst")) {
+						std::string count;
+						int n = 0;
+						if (xr.getAttr("uniqueCount", &count) && K::strToInt(count, &n) && n > 0) {
+							string_table.reserve(n, 0);
 						}
 					}
+				} else if (xr.hasTag("rPh")) {
+					ok = xr.skipElement();
+				} else if (xr.hasTag("t")) {
+					t_depth = xr.getDepth();
+				}
+				continue;
+			}
+			if (tk == KXmlReader::TK_TEXT) {
+				if (t_depth >= 0 && xr.getDepth() == t_depth) {
+					// 実体参照も改行コードの変換も無ければ、そのまま連結する
+					if (xr.isPlainText()) {
+						size_t len = 0;
+						const char *raw = xr.getTextRaw(&len);
+						string_table.appendString(raw, len);
+					} else {
+						text.clear();
+						xr.appendText(&text);
+						string_table.appendString(text.data(), text.size());
+					}
+				}
+				continue;
+			}
+			if (tk == KXmlReader::TK_CLOSE) {
+				if (t_depth >= 0 && xr.getDepth() == t_depth) {
+					t_depth = -1;
+				} else if (si_depth >= 0 && xr.getDepth() == si_depth) {
+					si_depth = -1;
+					if (string_table.endString() < 0) {
+						ok = false; // 文字列表が一杯。これ以降の文字列 ID がずれるので読み取りをやめる
+					}
 				}
-				xDoc->drop();
 			}
+		}
+		if (si_depth >= 0) {
+			string_table.endString(); // 読み取りの途中で失敗した
+		}
+		string_table.setInterning(false);
+		if (!ok) {
+			K__ERROR("E_XML: Failed to read xml document: '%s' from archive '%s'", "xl/sharedStrings.xml", xlsx_name.c_str());
+		}
+		if (stats) {
+			stats->shared_strings += string_table.size();
+		}
+		return ok;
+	}
 
-			// シートに対応する DataGrid を作成する
-			{
-				KDataGrid data_grid;
-				data_grid.setSourceLocation(xlsx_name, 0, 0);
-				data_grid.setName(sheet_names[i]);
-				for (auto it=cells.begin(); it!=cells.end(); ++it) {
-					data_grid.setCell(it->col, it->row, it->str);
+	// ワークシートの中身を取得し、値の入っているセルを cb に渡す。
+	// シートは巨大になる場合があるため DOM は作らず、KXmlReader で読みながらセルを直接 cb に渡す。
+	// wb と zr しか参照しないので、別々のシートであれば複数のスレッドから同時に呼び出してもよい。
+	// st が nullptr でなければ、このシートの統計を記録する
+	static bool scanSheet(KUnzipper &zr, const std::string &xlsx_name, const WORKBOOK &wb, const SHEET &sheet, CCellSink *cb, KXlsxSheetStats *st=nullptr) {
+		int fileid = zr.findEntry(sheet.file);
+		if (fileid < 0) {
+			K__ERROR("E_FILE: Failed to open file '%s' from archive '%s'", sheet.file.c_str(), xlsx_name.c_str());
+			return false;
+		}
+		double total_sec = 0;
+		CStatTimer timer(st ? &total_sec : nullptr);
+		if (st) {
+			st->name = sheet.name;
+			st->xml_bytes = zr.getEntryParamInt64(fileid, KUnzipper::UNZIP_SIZE);
+		}
+		// シート全体を展開したバッファは作らない
+		KXmlReader xr;
+		KInputStream entry;
+		openEntryXml(zr, fileid, xr, entry, st ? &st->inflate_sec : nullptr);
+		bool ok = scanSheetData(xr, cb, st);
+		timer.stop();
+		if (st) {
+			st->parse_sec = std::max(0.0, total_sec - st->inflate_sec);
+		}
+		if (!ok) {
+			K__ERROR("E_XML: Failed to read xml document: '%s' from archive '%s'", sheet.file.c_str(), xlsx_name.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// ワークシートの XML を先頭から読み、値の入っているセルを cb に渡す。
+	// セルの値は t 属性に従って解釈し、数値は読み取り時に一度だけ double に変換する。
+	// <sheetData> の入力例:
+	// <sheetData>
+	//   <row r="1">
+	//     <c r="A1" t="s"><v>0</v></c>
+	//     <c r="B1" s="0" t="n"><v>12</v></c>
+	//     <c r="C1" t="inlineStr"><is><t>テキスト</t></is></c>
+	//   </row>
+	// </sheetData>
+	// st が nullptr でなければ、トークン数とセル数を記録する
+	static bool scanSheetData(KXmlReader &xr, CCellSink *cb, KXlsxSheetStats *st=nullptr) {
+		int64_t num_nodes = 0;
+		int64_t num_cells = 0;
+		bool ok = scanSheetDataImpl(xr, cb, &num_nodes, &num_cells);
+		if (st) {
+			st->xml_nodes += num_nodes;
+			st->cells += num_cells;
+		}
+		return ok;
+	}
+	static bool scanSheetDataImpl(KXmlReader &xr, CCellSink *cb, int64_t *p_nodes, int64_t *p_cells) {
+		bool in_sheetdata = false;
+		int cell_depth = -1; // <c> の深さ。<c> の外側にいるなら -1
+		int is_depth = -1; // <is> の深さ。<is> の外側にいるなら -1
+		int cur_row = -1; // 現在の <row> の行番号（ゼロ起算）
+		int cur_col = -1; // 直前の <c> の列番号（ゼロ起算）
+		int cell_col = -1;
+		int cell_row = -1;
+		bool cell_valid = false;
+		std::string type;
+		std::string value;
+		std::string text;
+		bool has_value = false;
+		while (1) {
+			KXmlReader::Token tk = xr.next();
+			(*p_nodes)++;
+			switch (tk) {
+			case KXmlReader::TK_EOF:
+				(*p_nodes)--; // 終端はトークンに数えない
+				return true;
+
+			case KXmlReader::TK_ERROR:
+				return false;
+
+			case KXmlReader::TK_OPEN:
+				if (!in_sheetdata) {
+					if (xr.hasTag("sheetData")) {
+						in_sheetdata = true;
+					}
+					break;
+				}
+				if (cell_depth < 0) {
+					if (xr.hasTag("row")) {
+						// r 属性は省略される場合がある。その場合は直前の行の次の行とみなす
+						const char *r = nullptr;
+						size_t len = 0;
+						int n = 0;
+						if (xr.getAttrRaw("r", &r, &len) && parseRowNumber(r, len, &n)) {
+							cur_row = n - 1; // １起算 --> 0起算
+						} else {
+							cur_row++;
+						}
+						cur_col = -1;
+						break;
+					}
+					if (xr.hasTag("c")) {
+						cell_depth = xr.getDepth();
+						is_depth = -1;
+						has_value = false;
+						value.clear();
+						if (!xr.getAttr("t", &type)) type.clear();
+
+						// r 属性は省略される場合がある。その場合は直前のセルの右隣のセルとみなす
+						const char *r = nullptr;
+						size_t len = 0;
+						if (xr.getAttrRaw("r", &r, &len)) {
+							cell_valid = KDataGrid::decodeCellCoord(r, len, &cell_col, &cell_row);
+							cur_col = cell_valid ? cell_col : cur_col + 1;
+						} else {
+							cur_col++;
+							cell_col = cur_col;
+							cell_row = K::max(cur_row, 0);
+							cell_valid = cell_col < KDataGrid::COL_LIMIT && cell_row < KDataGrid::ROW_LIMIT;
+						}
+					}
+					break;
+				}
+				if (xr.getDepth() == cell_depth + 1) {
+					if (xr.hasTag("v")) {
+						if (!xr.readText(&value)) return false;
+						has_value = true;
+					} else if (xr.hasTag("is")) {
+						is_depth = xr.getDepth();
+					}
+					break;
 				}
-				result.push_back(data_grid);
+				if (is_depth >= 0) {
+					// インライン文字列。<is><t>...</t></is> または <is><r><t>...</t></r>...</is>
+					// ふりがな <rPh> の中にも <t> があるが、それは含めない
+					if (xr.hasTag("rPh")) {
+						if (!xr.skipElement()) return false;
+					} else if (xr.hasTag("t")) {
+						if (!xr.readText(&text)) return false;
+						value += text;
+						has_value = true;
+					}
+				}
+				break;
+
+			case KXmlReader::TK_CLOSE:
+				if (!in_sheetdata) {
+					break;
+				}
+				if (cell_depth >= 0 && xr.getDepth() == cell_depth) {
+					cell_depth = -1;
+					// とんでもないセル番号が入っている場合がある "ZA1" とか
+					// しかし実際には空文字列が入っているだけだったりするので、
+					// 有効な文字列が入っているかどうかを先に調べる。
+					// 空文字列のセルだった場合は存在しないものとして扱う
+					if (cell_valid && has_value && !value.empty()) {
+						emitCell(cell_col, cell_row, type, value, cb);
+						(*p_cells)++;
+					}
+					break;
+				}
+				if (is_depth >= 0 && xr.getDepth() == is_depth) {
+					is_depth = -1;
+					break;
+				}
+				if (xr.hasTag("sheetData")) {
+					in_sheetdata = false;
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+
+	// セルの値 v を t 属性に従って解釈し、cb に渡す
+	static void emitCell(int col, int row, const std::string &t, const std::string &v, CCellSink *cb) {
+		if (t.empty() || t.compare("n") == 0) {
+			// 数値。t 属性が省略されている場合も数値とみなす
+			const char *s = v.c_str();
+			char *end = nullptr;
+			double num = strtod(s, &end);
+			if (end == s + v.size()) {
+				cb->onNumber(col, row, num);
+			} else {
+				cb->onText(col, row, v); // 数値として解釈できなかった。そのまま文字列として扱う
+			}
+			return;
+		}
+		if (t.compare("s") == 0) {
+			// <v> には共有文字列テーブルの文字列IDが指定されている
+			int sid = -1;
+			if (K::strToInt(v, &sid)) {
+				cb->onSharedString(col, row, sid);
 			}
+			return;
+		}
+		if (t.compare("b") == 0) {
+			cb->onBool(col, row, v.compare("0") != 0);
+			return;
+		}
+		if (t.compare("e") == 0) {
+			cb->onError(col, row, v);
+			return;
+		}
+		// 数式の結果の文字列 (str)、インライン文字列 (inlineStr)、日付 (d) など
+		cb->onText(col, row, v);
+	}
+
+	// <row> の r 属性の値 (1起算の行番号) を得る
+	static bool parseRowNumber(const char *s, size_t len, int *p_row) {
+		if (len == 0 || len > 7) return false;
+		int n = 0;
+		for (size_t i=0; i<len; i++) {
+			unsigned int d = (unsigned int)(s[i] - '0');
+			if (d >= 10) return false;
+			n = n * 10 + (int)d;
 		}
+		if (n < 1 || KDataGrid::ROW_LIMIT < n) return false;
+		*p_row = n;
 		return true;
 	}
 };
 
 
 
-bool KXlsxFile::loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result) {
-	return CXlsxImpl::loadFromStream(file, xlsx_name, result);
+bool KXlsxFile::loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
+	return CXlsxImpl::loadFromStream(file, xlsx_name, result, params);
+}
+bool KXlsxFile::loadFromFileName(const std::string &xlsx_name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
+	return CXlsxImpl::loadFromFileName(xlsx_name, result, params);
 }
-bool KXlsxFile::loadFromFileName(const std::string &xlsx_name, std::vector<KDataGrid> &result) {
-	return CXlsxImpl::loadFromFileName(xlsx_name, result);
+bool KXlsxFile::loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params) {
+	return CXlsxImpl::loadFromMemory(bin, size, name, result, params);
 }
-bool KXlsxFile::loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result) {
-	return CXlsxImpl::loadFromMemory(bin, size, name, result);
+bool KXlsxFile::scanFromStream(KInputStream &file, const std::string &xlsx_name, KXlsxCallback *cb, const KXlsxLoadParams *params) {
+	K__ASSERT(cb);
+	return CXlsxImpl::scanFromStream(file, xlsx_name, cb, params);
 }
 
 #pragma endregion // KExcel
@@ -315,10 +937,26 @@ bool KXlsxFile::loadFromMemory(const void *bin, size_t size, const std::string &
 
 class CCoreExcelReader2 {
 public:
-	std::vector<KDataGrid> m_Sheets;
+	mutable std::vector<KDataGrid> m_Sheets;
 	std::string m_FileName;
 
+	// 遅延ロード用
+	mutable KUnzipper m_Zip;
+	mutable CXlsxImpl::WORKBOOK m_Book; // シート一覧と共有文字列テーブル
+	mutable std::vector<char> m_Loaded; // m_Sheets[i] の中身が読み取り済みなら m_Loaded[i] が 1 になる
+	mutable std::vector<char> m_LoadFailed; // m_Sheets[i] の読み取りに失敗していれば m_LoadFailed[i] が 1 になる
+	mutable bool m_StringsLoaded;
+	mutable bool m_StringsFailed; // 共有文字列テーブルの読み取りに失敗した。全てのシートの読み取りを失敗とする
+	mutable std::mutex m_LoadMutex; // const なアクセス関数からシートを読み取るので、複数のスレッドから呼ばれても一つずつ読み取る
+	KXlsxStats *m_Stats; // 遅延ロードしたシートの統計の記録先。KXlsxLoadParams::stats
+	bool m_UsedStringsOnly; // 共有文字列テーブルに m_StringIds の文字列だけを格納する (KXlsxLoadParams::used_strings_only)
+	CXlsxImpl::IDSET m_StringIds; // 読み取るシート全てが参照している文字列 ID。openLazy で一度だけ集める
+
 	CCoreExcelReader2() {
+		m_StringsLoaded = false;
+		m_StringsFailed = false;
+		m_Stats = nullptr;
+		m_UsedStringsOnly = false;
 	}
 	virtual ~CCoreExcelReader2() {
 		clear();
@@ -326,6 +964,15 @@ public:
 	void clear() {
 		m_Sheets.clear();
 		m_FileName.clear();
+		m_Zip = KUnzipper();
+		m_Book = CXlsxImpl::WORKBOOK();
+		m_Loaded.clear();
+		m_LoadFailed.clear();
+		m_StringsLoaded = false;
+		m_StringsFailed = false;
+		m_Stats = nullptr;
+		m_UsedStringsOnly = false;
+		m_StringIds = CXlsxImpl::IDSET();
 	}
 	bool empty() const {
 		return m_Sheets.empty();
@@ -348,72 +995,449 @@ public:
 		return -1;
 	}
 	bool getSheetDimension(int sheet, int *col, int *row, int *colcount, int *rowcount) const {
-		return m_Sheets[sheet].getDimension(col, row, colcount, rowcount);
+		return getSheet(sheet).getDimension(col, row, colcount, rowcount);
 	}
 	std::string getDataString(int sheet, int col, int row) const {
 		std::string s;
-		m_Sheets[sheet].getCell(col, row, &s);
+		getSheet(sheet).getCell(col, row, &s);
 		return s;
 	}
 	bool getCellByText(int sheet, const std::string &s, int *col, int *row) const {
-		return m_Sheets[sheet].findCell(s, col, row);
+		return getSheet(sheet).findCell(s, col, row);
 	}
 	void scanCells(int sheet, KDataGridCallback *cb) const {
-		m_Sheets[sheet].scanCells(cb);
+		getSheet(sheet).scanCells(cb);
+	}
+	const std::vector<KDataGrid> & getSheets() const {
+		for (int i=0; i<(int)m_Sheets.size(); i++) {
+			loadSheet(i);
+		}
+		return m_Sheets;
+	}
+	const KDataGrid & getSheet(int sheet) const {
+		loadSheet(sheet);
+		return m_Sheets[sheet];
+	}
+	bool isSheetLoaded(int sheet) const {
+		std::lock_guard<std::mutex> lock(m_LoadMutex);
+		return m_Loaded[sheet] != 0;
 	}
-	bool loadFromFile(KInputStream &file, const std::string &xlsx_name) {
+	// シートの中身を読み取る。
+	// 読み取りに失敗した場合は false を返す。失敗したシートは読み取れた所までの内容になる
+	bool loadSheet(int sheet) const {
+		if (!m_Zip.isOpen()) {
+			return true; // 遅延ロードでなければ全て読み取り済み。ロックしない
+		}
+		std::lock_guard<std::mutex> lock(m_LoadMutex);
+		if (!m_Loaded[sheet]) {
+			loadSheetUnlocked(sheet);
+		}
+		return !m_LoadFailed[sheet];
+	}
+	void unloadSheet(int sheet) {
+		if (!m_Zip.isOpen()) {
+			return; // 遅延ロードでなければ読み直すことができないので、破棄しない
+		}
+		std::lock_guard<std::mutex> lock(m_LoadMutex);
+		if (m_Loaded[sheet]) {
+			// 中身を空にした KDataGrid と入れ替えてメモリを解放する
+			KDataGrid empty_grid;
+			empty_grid.setSourceLocation(m_FileName, 0, 0);
+			empty_grid.setName(m_Sheets[sheet].getName());
+			std::swap(m_Sheets[sheet], empty_grid);
+			m_Loaded[sheet] = 0;
+			m_LoadFailed[sheet] = 0; // 次にアクセスしたときに読み取りなおす
+		}
+		// 共有文字列テーブルは次に読み取るシートでも使うので残しておく。
+		// 解放して読み直すと、シートを一つずつ読み取っては破棄する場合に sharedStrings.xml を毎回展開することになる
+	}
+	bool loadFromFile(KInputStream &file, const std::string &xlsx_name, const KXlsxLoadParams *params) {
 		clear();
-		if (CXlsxImpl::loadFromStream(file, xlsx_name, m_Sheets)) {
+		if (params && params->lazy) {
+			return openLazy(file, xlsx_name, params);
+		}
+		if (CXlsxImpl::loadFromStream(file, xlsx_name, m_Sheets, params)) {
 			m_FileName = xlsx_name;
+			m_Loaded.assign(m_Sheets.size(), 1);
+			m_LoadFailed.assign(m_Sheets.size(), 0);
 			return true;
 		} else {
 			clear();
 			return false;
 		}
 	}
-};
-
-
-
-
-
-
-
-
+private:
+	// ZIP の中央ディレクトリとシート一覧だけを読み取る。
+	// シートの中身は最初にアクセスしたときに読み取る
+	bool openLazy(KInputStream &file, const std::string &xlsx_name, const KXlsxLoadParams *params) {
+		KXlsxStats *stats = params->stats;
+		{
+			CStatTimer timer(stats ? &stats->open_sec : nullptr);
+			m_Zip.open(file);
+		}
+		if (!m_Zip.isOpen()) {
+			clear();
+			return false;
+		}
+		{
+			CStatTimer timer(stats ? &stats->workbook_sec : nullptr);
+			if (!CXlsxImpl::loadFilteredSheetList(m_Zip, xlsx_name, params, &m_Book.sheets)) {
+				clear();
+				return false;
+			}
+		}
+		m_Stats = stats;
+		m_UsedStringsOnly = false;
+		if (params->used_strings_only && !m_Book.sheets.empty()) {
+			// 読み取る可能性のあるシート全てについて参照している文字列 ID を先に集めておき、
+			// 共有文字列テーブルは最初のシートを読み取るときに一度だけ作る
+			m_UsedStringsOnly = CXlsxImpl::collectAllSharedStringIds(m_Zip, xlsx_name, m_Book.sheets, &m_StringIds, stats);
+			if (!m_UsedStringsOnly) {
+				m_StringIds = CXlsxImpl::IDSET(); // 不完全なので使わない。共有文字列テーブルを全て読み取る
+			}
+		}
+		m_FileName = xlsx_name;
+		m_Sheets.resize(m_Book.sheets.size());
+		m_Loaded.assign(m_Book.sheets.size(), 0);
+		m_LoadFailed.assign(m_Book.sheets.size(), 0);
+		for (size_t i=0; i<m_Book.sheets.size(); i++) {
+			m_Sheets[i].setSourceLocation(xlsx_name, 0, 0);
+			m_Sheets[i].setName(m_Book.sheets[i].name);
+		}
+		return true;
+	}
+	// m_LoadMutex をロックした状態で呼ぶ
+	void loadSheetUnlocked(int sheet) const {
+		K__ASSERT(!m_Loaded[sheet]);
+		m_Loaded[sheet] = 1; // 読み取りに失敗した場合も、読み取れた所までの内容で読み取り済みとする
+		if (!m_StringsLoaded) {
+			m_StringsFailed = !CXlsxImpl::loadSharedStrings(m_Zip, m_FileName, m_Book.string_table.get(), m_Stats, m_UsedStringsOnly ? &m_StringIds : nullptr);
+			m_StringsLoaded = true;
+		}
+		if (m_StringsFailed) {
+			m_LoadFailed[sheet] = 1; // 共有文字列を参照するセルが欠けている可能性がある
+		}
+		CXlsxImpl::CSheetBuilder builder(m_Sheets[sheet], m_Book.string_table);
+		KXlsxSheetStats st;
+		{
+			CStatTimer timer(m_Stats ? &m_Stats->sheets_sec : nullptr);
+			if (!CXlsxImpl::scanSheet(m_Zip, m_FileName, m_Book, m_Book.sheets[sheet], &builder, m_Stats ? &st : nullptr)) {
+				m_LoadFailed[sheet] = 1;
+			}
+		}
+		if (m_Stats) {
+			// 読み取り済みのシートと共有文字列テーブルがメモリ上にある
+			st.arena_bytes = m_Sheets[sheet].getArenaSize();
+			size_t arena = m_Book.string_table->getArenaSize();
+			for (size_t i=0; i<m_Sheets.size(); i++) {
+				if (m_Loaded[i]) arena += m_Sheets[i].getArenaSize();
+			}
+			m_Stats->peak_arena_bytes = std::max(m_Stats->peak_arena_bytes, arena);
+			CXlsxImpl::addSheetStats(m_Stats, st);
+		}
+	}
+};
+
+
+
+
 
 
 
 
-// 文字列 s を xml に組み込めるようにする
-static void _EscapeString(std::string &s) {
-	K::strReplace(s, "\\", "\\\\");
-	K::strReplace(s, "\"", "\\\"");
-	K::strReplace(s, "\n", "\\n");
-	K::strReplace(s, "\r", "");
-	if (s.find(',') != std::string::npos) {
-		s.insert(0, "\"");
-		s.append("\"");
+
+
+
+
+#if K_EXCEL_SSE2
+// 立っている最下位ビットの位置。x は 0 以外であること
+static int _LowestBit(uint32_t x) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+#endif
+
+// 文字列をエスケープしながら書き出すときに、エスケープの対象になる文字を探す。
+// 対象の文字はめったに現れないので、SSE2 が使える場合は 16 バイトずつまとめて調べて読み飛ばす。
+// 書式ごとに一つ作って使い回す
+class CEscapeChars {
+	static const int MAX_CHARS = 8;
+#if K_EXCEL_SSE2
+	__m128i m_Vec[MAX_CHARS];
+	int m_NumChars;
+	bool m_Ctrl;
+#else
+	bool m_Table[256]; // 対象の文字なら true（0x80 以上は含まない）
+#endif
+public:
+	// chars: 対象の文字
+	// ctrl: 0x20 未満の文字もすべて対象にする
+	CEscapeChars(const char *chars, bool ctrl) {
+		K__ASSERT(strlen(chars) <= MAX_CHARS);
+#if K_EXCEL_SSE2
+		m_NumChars = (int)strlen(chars);
+		for (int i=0; i<m_NumChars; i++) {
+			m_Vec[i] = _mm_set1_epi8(chars[i]);
+		}
+		m_Ctrl = ctrl;
+#else
+		for (int c=0; c<256; c++) {
+			m_Table[c] = ctrl && c < 0x20;
+		}
+		for (const char *p=chars; *p; p++) {
+			m_Table[(unsigned char)*p] = true;
+		}
+#endif
 	}
+
+	// [s, end) で最初の対象の文字を探す。見つからなければ end を返す。
+	// high が true ならば 0x80 以上の文字も対象にする（UTF-8 として検査するとき）
+	const char * find(const char *s, const char *end, bool high) const {
+#if K_EXCEL_SSE2
+		const char *start = s;
+		while (s < end) {
+			uint32_t bits;
+			size_t rest = end - s;
+			if (rest >= 16) {
+				bits = match(_mm_loadu_si128((const __m128i *)s), high);
+			} else if (end - start >= 16) {
+				// 16 バイトに満たない末尾は、末尾から 16 バイト前を読んで調べ済みの部分を捨てる
+				bits = match(_mm_loadu_si128((const __m128i *)(end - 16)), high) >> (16 - rest);
+			} else {
+				// 全体が 16 バイトに満たなければ、ゼロで埋めた一時領域で調べる
+				char tmp[16] = {0};
+				memcpy(tmp, s, rest);
+				bits = match(_mm_loadu_si128((const __m128i *)tmp), high) & ((1u << rest) - 1);
+			}
+			if (bits) {
+				return s + _LowestBit(bits);
+			}
+			s += 16;
+		}
+		return end;
+#else
+		for (; s < end; s++) {
+			unsigned char c = (unsigned char)*s;
+			if (m_Table[c] || (high && c >= 0x80)) break;
+		}
+		return s;
+#endif
+	}
+
+private:
+#if K_EXCEL_SSE2
+	// v の各バイトのうち、対象の文字の位置のビットを立てて返す
+	uint32_t match(__m128i v, bool high) const {
+		__m128i m = _mm_setzero_si128();
+		for (int i=0; i<m_NumChars; i++) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, m_Vec[i]));
+		}
+		if (m_Ctrl) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v)); // v <= 0x1F
+		}
+		uint32_t bits = (uint32_t)_mm_movemask_epi8(m);
+		if (high) {
+			bits |= (uint32_t)_mm_movemask_epi8(v); // 最上位ビットが立っている = 0x80 以上
+		}
+		return bits;
+	}
+#endif
+};
+
+// s から始まる UTF-8 の一文字のバイト数を返す。s[0] は 0x80 以上であること。
+// 不正なバイト列（冗長表現、サロゲート、U+10FFFF を超える値、途切れたバイト列を含む）ならば 0 を返す
+static int _Utf8CharLen(const char *s, const char *end) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t avail = end - s;
+	unsigned char c = u[0];
+	int len;
+	unsigned char lo = 0x80, hi = 0xBF; // 2バイト目の範囲
+	if (c >= 0xC2 && c <= 0xDF) {
+		len = 2;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		len = 3;
+		if (c == 0xE0) lo = 0xA0;
+		if (c == 0xED) hi = 0x9F;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		len = 4;
+		if (c == 0xF0) lo = 0x90;
+		if (c == 0xF4) hi = 0x8F;
+	} else {
+		return 0;
+	}
+	if (avail < (size_t)len) return 0;
+	if (u[1] < lo || u[1] > hi) return 0;
+	for (int i=2; i<len; i++) {
+		if ((u[i] & 0xC0) != 0x80) return 0;
+	}
+	return len;
 }
 
-// 文字列 s をエスケープする必要がある？
-static bool _ShouldEscapeString(const std::string &ss) {
-	const char *s = ss.c_str();
-	return HAS_CHAR(s, '<') || HAS_CHAR(s, '>') || HAS_CHAR(s, '"') || HAS_CHAR(s, '\'') || HAS_CHAR(s, '\n');
+// 文字列 s を ec に従ってエスケープしながら out の末尾に追加する。
+// 対象の文字が現れるたびに、そこまでの部分をまとめてコピーしてから rep(out, c) で置換後の文字列を書く。
+// p_invalid が nullptr でなければ UTF-8 として正しいかどうかも同じ走査で調べ、
+// 不正なバイトを U+FFFD に置き換えて、置き換えがあれば *p_invalid に 1 を足す
+template <typename REPLACE> static void _AppendEscaped(std::string &out, const char *s, size_t len, const CEscapeChars &ec, int *p_invalid, REPLACE rep) {
+	bool high = p_invalid != nullptr;
+	const char *end = s + len;
+	const char *run = s; // まだコピーしていない部分の先頭
+	bool invalid = false;
+	const char *p = s;
+	while ((p = ec.find(p, end, high)) < end) {
+		if ((unsigned char)*p >= 0x80) {
+			int n = _Utf8CharLen(p, end);
+			if (n > 0) {
+				p += n; // 正しい UTF-8 の文字はそのまま
+				continue;
+			}
+			out.append(run, p - run);
+			out += "\xEF\xBF\xBD"; // U+FFFD
+			invalid = true;
+		} else {
+			out.append(run, p - run);
+			rep(out, *p);
+		}
+		p++;
+		run = p;
+	}
+	out.append(run, end - run);
+	if (invalid) (*p_invalid)++;
 }
 
-// ZIP 内のファイルを探してインデックスを返す
-static int _FindZipEntry(KUnzipper &zr, const std::string &name) {
-	int num = zr.getEntryCount();
-	for (int i=0; i<num; i++) {
-		std::string s;
-		zr.getEntryName(i, &s);
-		if (s.compare(name) == 0) {
-			return i;
+// 文字列 s をテキスト出力用にエスケープして out の末尾に追加する。
+// \ --> \\, " --> \", 改行 --> \n に置換し、\r は取り除く。
+// カンマを含む場合は全体を "" で囲む。カンマは置換と同じ走査で見つけ、見つけた時点で先頭に " を挿入する
+static void _AppendEscapedString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec("\\\"\n\r,", false);
+	size_t start = out.size();
+	bool quote = false;
+	_AppendEscaped(out, s, len, ec, p_invalid, [&](std::string &o, char c) {
+		switch (c) {
+		case '\\': o += "\\\\"; break;
+		case '"':  o += "\\\""; break;
+		case '\n': o += "\\n"; break;
+		case '\r': break;
+		case ',':  o += ','; quote = true; break;
 		}
+	});
+	if (quote) {
+		out.insert(start, 1, '"');
+		out += '"';
 	}
-	return -1;
 }
+
+// 文字列 s を RFC 4180 形式の CSV フィールドにして out の末尾に追加する。
+// カンマ、ダブルクォート、改行を含む場合だけ全体を "" で囲み、" は "" にする
+static void _AppendCsvString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec(",\"\n\r", false);
+	size_t start = out.size();
+	bool quote = false;
+	_AppendEscaped(out, s, len, ec, p_invalid, [&](std::string &o, char c) {
+		if (c == '"') {
+			o += "\"\"";
+		} else {
+			o += c;
+		}
+		quote = true;
+	});
+	if (quote) {
+		out.insert(start, 1, '"');
+		out += '"';
+	}
+}
+
+// 文字列 s を TSV フィールドにして out の末尾に追加する。
+// \ --> \\, タブ --> \t, CR --> \r, LF --> \n に置換する
+static void _AppendTsvString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec("\\\t\r\n", false);
+	_AppendEscaped(out, s, len, ec, p_invalid, [](std::string &o, char c) {
+		switch (c) {
+		case '\\': o += "\\\\"; break;
+		case '\t': o += "\\t"; break;
+		case '\r': o += "\\r"; break;
+		case '\n': o += "\\n"; break;
+		}
+	});
+}
+
+// 文字列 s を JSON 文字列にして out の末尾に追加する。
+// " と \ と制御文字をエスケープし、全体を "" で囲む。UTF-8 の文字はそのまま書く
+static void _AppendJsonString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec("\"\\", true);
+	out += '"';
+	_AppendEscaped(out, s, len, ec, p_invalid, [](std::string &o, char c) {
+		switch (c) {
+		case '"':  o += "\\\""; break;
+		case '\\': o += "\\\\"; break;
+		case '\n': o += "\\n"; break;
+		case '\r': o += "\\r"; break;
+		case '\t': o += "\\t"; break;
+		default:
+			{
+				char u[8];
+				snprintf(u, sizeof(u), "\\u%04x", (unsigned char)c);
+				o += u;
+			}
+			break;
+		}
+	});
+	out += '"';
+}
+
+// 文字列 s を XML の属性値としてエスケープし、out の末尾に追加する
+static void _AppendXmlAttrString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec("&<>\"'", false);
+	_AppendEscaped(out, s, len, ec, p_invalid, [](std::string &o, char c) {
+		switch (c) {
+		case '&':  o += "&amp;"; break;
+		case '<':  o += "&lt;"; break;
+		case '>':  o += "&gt;"; break;
+		case '"':  o += "&quot;"; break;
+		case '\'': o += "&apos;"; break;
+		}
+	});
+}
+
+// 文字列 s を CDATA セクションにして out の末尾に追加する。
+// s が "]]>" を含む場合は、そこで CDATA セクションを分割する
+static void _AppendCDataString(std::string &out, const char *s, size_t len) {
+	out += "<![CDATA[";
+	const char *end = s + len;
+	const char *run = s;
+	for (const char *p=s; p+2<end; p++) {
+		if (p[0] == ']' && p[1] == ']' && p[2] == '>') {
+			out.append(run, p + 2 - run); // "]]" まで書いて閉じ、">" から次のセクションを始める
+			out += "]]><![CDATA[";
+			run = p + 2;
+		}
+	}
+	out.append(run, end - run);
+	out += "]]>";
+}
+
+// 文字列 s を XML の要素の内容として out の末尾に追加する。
+// XML で特別な意味を持つ文字が含まれていなければそのまま書き、含まれていれば CDATA セクションにする。
+// 文字の確認とコピーは一度の走査で行い、CDATA にする必要があった場合だけ書き直す
+static void _AppendXmlTextString(std::string &out, const char *s, size_t len, int *p_invalid) {
+	static const CEscapeChars ec("&<>\"'\n", false);
+	size_t start = out.size();
+	bool cdata = false;
+	_AppendEscaped(out, s, len, ec, p_invalid, [&](std::string &o, char c) {
+		o += c;
+		cdata = true;
+	});
+	if (cdata) {
+		std::string text = out.substr(start); // U+FFFD への置き換えを済ませた内容
+		out.resize(start);
+		_AppendCDataString(out, text.data(), text.size());
+	}
+}
+
 static KXmlElement * _LoadXmlFromZip(KUnzipper &zr, const std::string &zip_name, const std::string &entry_name) {
 	if (!zr.isOpen()) {
 		K__ERROR("E_INVALID_ARGUMENT");
@@ -421,7 +1445,7 @@ static KXmlElement * _LoadXmlFromZip(KUnzipper &zr, const std::string &zip_name,
 	}
 
 	// XLSX の XML は常に UTF-8 で書いてある。それを信用する
-	int fileid = _FindZipEntry(zr, entry_name);
+	int fileid = zr.findEntry(entry_name);
 	if (fileid < 0) {
 		K__ERROR("E_FILE: Failed to open file '%s' from archive '%s'", entry_name.c_str(), zip_name.c_str());
 		return nullptr;
@@ -445,6 +1469,7 @@ static KXmlElement * _LoadXmlFromZip(KUnzipper &zr, const std::string &zip_name,
 
 class CCoreExcelReader {
 	static const int ROW_LIMIT = 10000;
+	static const int LIBREOFFICE_LAST_COL = 1023; // AMJ
 
 	enum Type {
 		TP_NUMBER,
@@ -455,7 +1480,7 @@ class CCoreExcelReader {
 	std::string m_FileName;
 	KXmlElement *m_WorkBookDoc;
 	std::vector<KXmlElement *> m_WorkSheets;
-	std::unordered_map<int, std::string> m_Strings;
+	KStringTable m_Strings;
 	typedef std::unordered_map<int, const KXmlElement*> Int_Elms;
 	typedef std::unordered_map<const KXmlElement*, Int_Elms> Sheet_RowElms;
 	mutable Sheet_RowElms m_RowElements;
@@ -560,8 +1585,11 @@ public:
 			const char *maxpos = colon + 1;
 
 			// セル番号から行列インデックスを得る
+			// ここで、セル範囲として 0xFFFFF が入る可能性に注意。(LibreOffice Calc で現象を確認）
+			// 最終行 (1048576行目) や LibreOffice の最終列 (AMJ) が指定されている場合は、
+			// 実際の範囲ではない可能性が高いので自力で取得する
 			int L=0, R=0, T=0, B=0;
-			if (parse_cell_position(minpos, &L, &T) && parse_cell_position(maxpos, &R, &B)) {
+			if (parse_cell_position(minpos, &L, &T) && parse_cell_position(maxpos, &R, &B) && B < 0xFFFFF && R != LIBREOFFICE_LAST_COL) {
 				if (col) *col = L;
 				if (row) *row = T;
 				if (colcount) *colcount = R - L + 1;
@@ -638,7 +1666,8 @@ public:
 			scan_cells(sheet_xml, cb);
 		}
 	}
-	bool loadFromFile(KInputStream &file, const std::string &xlsx_name) {
+	bool loadFromFile(KInputStream &file, const std::string &xlsx_name, const KXlsxLoadParams *params) {
+		// params は無視する。この実装は常に単一スレッドで読み取る
 		m_RowElements.clear();
 
 		if (!file.isOpen()) {
@@ -659,8 +1688,8 @@ public:
 		// 文字列テーブルを取得
 		const KXmlElement *strings_doc = _LoadXmlFromZip(zr, xlsx_name, "xl/sharedStrings.xml");
 		if (strings_doc) {
-			int stringId = 0;
 			const KXmlElement *string_elm = strings_doc->getChild(0);
+			m_Strings.reserve(string_elm->getChildCount(), 0);
 
 			for (int si=0; si<string_elm->getChildCount(); si++) {
 				const KXmlElement *si_elm = string_elm->getChild(si);
@@ -673,8 +1702,7 @@ public:
 				const KXmlElement *t_elm = si_elm->findNode("t");
 				if (t_elm) {
 					const char *s = t_elm->getText("");
-					m_Strings[stringId] = s;
-					stringId++;
+					m_Strings.add(s, strlen(s));
 					continue;
 				}
 
@@ -685,25 +1713,19 @@ public:
 				//   <r><t>テキスト2</t></r>
 				//   ....
 				// </si>
-				std::string s;
+				// その他のパターンは解析できないので空文字列になる。文字列IDだけが進む
+				m_Strings.beginString();
 				for (int r=0; r<si_elm->getChildCount(); r++) {
 					const KXmlElement *r_elm = si_elm->getChild(r);
 					if (r_elm->hasTag("r")) {
 						const KXmlElement *t_xml = r_elm->findNode("t");
 						if (t_xml) {
-							s += t_xml->getText("");
+							const char *s = t_xml->getText("");
+							m_Strings.appendString(s, strlen(s));
 						}
 					}
 				}
-				if (!s.empty()) {
-					m_Strings[stringId] = s;
-					stringId++;
-					continue;
-				}
-
-				// その他のパターン。解析できず。
-				// 文字列IDだけを進めておく
-				stringId++;
+				m_Strings.endString();
 			}
 			strings_doc->drop();
 		}
@@ -715,7 +1737,7 @@ public:
 		for (int i=1; ; i++) {
 			char s[256];
 			sprintf_s(s, sizeof(s), "xl/worksheets/sheet%d.xml", i);
-			if (_FindZipEntry(zr, s) < 0) break;
+			if (zr.findEntry(s) < 0) break;
 			KXmlElement *sheet_doc = _LoadXmlFromZip(zr, xlsx_name, s);
 			if (sheet_doc == nullptr) {
 				K__ERROR("E_XLSX: Failed to load document: '%s' in xlsx file.", s);
@@ -780,11 +1802,7 @@ private:
 			int sid = -1;
 			K::strToInt(val, &sid);
 			K__ASSERT(sid >= 0);
-			auto it = m_Strings.find(sid);
-			if (it != m_Strings.end()) {
-				return it->second.c_str();
-			}
-			return "";
+			return m_Strings.getString(sid); // 見つからなければ "" が返る
 		}
 		if (tp == TP_LITERAL) {
 			// val は文字列そのものを表している
@@ -995,6 +2013,555 @@ private:
 
 
 
+#pragma region KExcelWriter
+// 書き出す内容をバッファにため、一定量たまるごとに出力先に書き込む
+class CBufferedExcelWriter: public KExcelWriter {
+	static const size_t CHUNK_SIZE = 64 * 1024;
+	KOutputStream &m_Output;
+	bool m_Failed;
+	bool m_ValidateUtf8;
+	int m_InvalidStrings; // 不正な UTF-8 を含んでいた文字列の数
+protected:
+	std::string m_Buf;
+public:
+	CBufferedExcelWriter(KOutputStream &output): m_Output(output) {
+		m_Buf.reserve(CHUNK_SIZE * 2);
+		m_Failed = false;
+		m_ValidateUtf8 = false;
+		m_InvalidStrings = 0;
+	}
+	void setValidateUtf8(bool value) {
+		m_ValidateUtf8 = value;
+	}
+	virtual bool endBook() override {
+		flush();
+		if (!m_Output.flush()) { // 出力先が書き込みバッファを持っている場合、ここで書き込みの失敗が分かる
+			m_Failed = true;
+		}
+		if (m_InvalidStrings > 0) {
+			K__WARNING("E_UTF8: Replaced invalid UTF-8 sequences with U+FFFD in %d strings", m_InvalidStrings);
+		}
+		return !m_Failed;
+	}
+	// エスケープ関数に渡すカウンタ。UTF-8 を検査しないなら nullptr
+	int * invalidCounter() {
+		return m_ValidateUtf8 ? &m_InvalidStrings : nullptr;
+	}
+	// バッファが一定量を超えていたら書き込む
+	void flushIfFull() {
+		if (m_Buf.size() >= CHUNK_SIZE) {
+			flush();
+		}
+	}
+	void flush() {
+		if (!m_Buf.empty()) {
+			if (m_Output.write(m_Buf.data(), (int)m_Buf.size()) != (int)m_Buf.size()) {
+				m_Failed = true;
+			}
+			m_Buf.clear();
+		}
+	}
+};
+
+
+// KExcelFormat_TEXT
+class CTextWriter: public CBufferedExcelWriter {
+	int m_LastRow;
+	bool m_HasCell;
+public:
+	CTextWriter(KOutputStream &output): CBufferedExcelWriter(output) {
+		m_LastRow = -1;
+		m_HasCell = false;
+	}
+	virtual void beginSheet(const std::string &name, int left, int top, int cols, int rows) override {
+		m_Buf += "\n";
+		m_Buf += "============================================================================\n";
+		m_Buf += name + "\n";
+		m_Buf += "============================================================================\n";
+		m_LastRow = -1;
+		m_HasCell = false;
+	}
+	virtual void endSheet() override {
+		if (m_HasCell) {
+			m_Buf += "\n"; // 最終行を閉じる
+		}
+		flush();
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		if (s.empty()) return;
+		if (m_LastRow != row) {
+			K__ASSERT(m_LastRow < row); // 行番号は必ず前回よりも大きくなる
+			if (m_HasCell) {
+				m_Buf += "\n"; // 前の行を閉じる
+				if (m_LastRow + 1 < row) {
+					m_Buf += "\n"; // 空行が何行続いても、空行一つにまとめる
+				}
+			}
+			m_LastRow = row;
+			m_HasCell = false;
+		}
+		if (m_HasCell) m_Buf += ", ";
+		_AppendEscapedString(m_Buf, s.data(), s.size(), invalidCounter());
+		m_HasCell = true;
+		flushIfFull();
+	}
+};
+
+
+// KExcelFormat_CSV, KExcelFormat_TSV
+// 値の入っているセルの範囲を表として書き出す。
+// どの行も同じ列数になるように空のフィールドで埋め、途中の空行も空のレコードとして書き出す
+class CDelimitedWriter: public CBufferedExcelWriter {
+	bool m_Tsv;
+	bool m_SheetColumn;
+	std::string m_SheetField; // シート名の列に書き出す内容（エスケープ済み）
+	int m_Left, m_Cols;
+	int m_Row; // 書き出し中の行。まだ行を書き出していなければ -1
+	int m_Col; // 次に書き出す列
+public:
+	CDelimitedWriter(KOutputStream &output, bool tsv, bool sheet_column): CBufferedExcelWriter(output) {
+		m_Tsv = tsv;
+		m_SheetColumn = sheet_column;
+		m_Left = m_Cols = 0;
+		m_Row = -1;
+		m_Col = 0;
+	}
+	virtual void beginSheet(const std::string &name, int left, int top, int cols, int rows) override {
+		m_SheetField.clear();
+		appendField(m_SheetField, name);
+		m_Left = left;
+		m_Cols = cols;
+		m_Row = -1;
+		m_Col = 0;
+	}
+	virtual void endSheet() override {
+		if (m_Row >= 0) {
+			endRecord();
+		}
+		flush();
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		if (s.empty()) return;
+		if (m_Row != row) {
+			K__ASSERT(m_Row < row); // 行番号は必ず前回よりも大きくなる
+			if (m_Row >= 0) {
+				endRecord();
+				// 途中の空行
+				for (int r=m_Row+1; r<row; r++) {
+					beginRecord();
+					endRecord();
+				}
+			}
+			m_Row = row;
+			beginRecord();
+		}
+		while (m_Col < col - m_Left) {
+			nextField();
+		}
+		appendField(m_Buf, s);
+		nextField();
+		flushIfFull();
+	}
+private:
+	char delim() const {
+		return m_Tsv ? '\t' : ',';
+	}
+	void beginRecord() {
+		if (m_SheetColumn) {
+			m_Buf += m_SheetField;
+			m_Buf += delim();
+		}
+		m_Col = 0;
+	}
+	// 次のフィールドへ進む
+	void nextField() {
+		m_Col++;
+		if (m_Col < m_Cols) {
+			m_Buf += delim();
+		}
+	}
+	// 残りのフィールドを空で埋めてレコードを閉じる
+	void endRecord() {
+		while (m_Col < m_Cols) {
+			nextField();
+		}
+		m_Buf += m_Tsv ? "\n" : "\r\n";
+	}
+	void appendField(std::string &out, const std::string &s) {
+		if (m_Tsv) {
+			_AppendTsvString(out, s.data(), s.size(), invalidCounter());
+		} else {
+			_AppendCsvString(out, s.data(), s.size(), invalidCounter());
+		}
+	}
+};
+
+
+// KExcelFormat_JSONL
+class CJsonlWriter: public CBufferedExcelWriter {
+	std::string m_RowHead; // 行の先頭。{"sheet":"シート名","row":
+	int m_Row;
+public:
+	CJsonlWriter(KOutputStream &output): CBufferedExcelWriter(output) {
+		m_Row = -1;
+	}
+	virtual void beginSheet(const std::string &name, int left, int top, int cols, int rows) override {
+		m_RowHead = "{\"sheet\":";
+		_AppendJsonString(m_RowHead, name.data(), name.size(), invalidCounter());
+		m_RowHead += ",\"row\":";
+		m_Row = -1;
+	}
+	virtual void endSheet() override {
+		if (m_Row >= 0) {
+			m_Buf += "}}\n"; // 最終行を閉じる
+		}
+		flush();
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		if (s.empty()) return;
+		if (m_Row != row) {
+			K__ASSERT(m_Row < row); // 行番号は必ず前回よりも大きくなる
+			if (m_Row >= 0) {
+				m_Buf += "}}\n"; // 前の行を閉じる
+			}
+			m_Buf += m_RowHead;
+			m_Buf += K::str_sprintf("%d,\"cells\":{", 1+row); // 行番号は Excel の表示と同じく 1 起算
+			m_Row = row;
+		} else {
+			m_Buf += ',';
+		}
+		// 列名をキーにする。"A1" から行番号を取り除いて "A" にする
+		std::string name = KDataGrid::encodeCellCoord(col, 0);
+		m_Buf += '"';
+		m_Buf.append(name, 0, name.size() - 1);
+		m_Buf += "\":";
+		_AppendJsonString(m_Buf, s.data(), s.size(), invalidCounter());
+		flushIfFull();
+	}
+};
+
+
+// KExcelFormat_XML
+class CXmlWriter: public CBufferedExcelWriter {
+	bool m_WithHeader;
+	bool m_WithComment;
+	std::string m_SheetName;
+	int m_LastRow;
+	int m_LastCol;
+public:
+	CXmlWriter(KOutputStream &output, bool with_header, bool with_comment): CBufferedExcelWriter(output) {
+		m_WithHeader = with_header;
+		m_WithComment = with_comment;
+		m_LastRow = -1;
+		m_LastCol = -1;
+	}
+	virtual void beginBook(int numsheets) override {
+		if (m_WithHeader) {
+			m_Buf += "<?xml version='1.0' encoding='utf-8'?>\n";
+		}
+		if (m_WithComment) {
+			m_Buf += u8"<!-- <sheet> タグは「シート」に対応する。 left, top, cols, rows 属性にはそれぞれ、シート内で値が入っているセル範囲の左、上、行数、列数が入る -->\n";
+			m_Buf += u8"<!-- <row> タグは各シートの「行」に対応する。 <row> の r 属性には 0 起算での行番号が入る。ただし直前の <row> の次の行だった場合 r 属性は省略される -->\n";
+			m_Buf += u8"<!-- <c> タグは、それぞれの行 <row> 内にある「セル」に対応する。 i 属性には 0 起算での列番号が入る。ただし、直前の <c> の次の列だった場合 i 属性は省略される -->\n";
+		}
+		m_Buf += K::str_sprintf("<excel numsheets='%d'>\n", numsheets);
+	}
+	virtual void beginSheet(const std::string &name, int left, int top, int cols, int rows) override {
+		m_SheetName = name;
+		m_Buf += "<sheet name='";
+		_AppendXmlAttrString(m_Buf, name.data(), name.size(), invalidCounter());
+		m_Buf += K::str_sprintf("' left='%d' top='%d' cols='%d' rows='%d'>\n", left, top, cols, rows);
+		m_LastRow = -1;
+		m_LastCol = -1;
+	}
+	virtual void endSheet() override {
+		if (m_LastRow >= 0) {
+			m_Buf += "</row>\n"; // 最終行を閉じる
+		} else {
+			// セルを一つも出力していないので <row> を閉じる必要もない
+		}
+		m_Buf += "</sheet>";
+		if (m_WithComment && m_SheetName.find("--") == std::string::npos) { // "--" はコメント内に書けない
+			m_Buf += "<!-- " + m_SheetName + " -->";
+		}
+		m_Buf += "\n\n";
+		flush();
+	}
+	virtual bool endBook() override {
+		m_Buf += "</excel>\n";
+		return CBufferedExcelWriter::endBook();
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		if (s.empty()) return;
+		K__ASSERT(m_LastRow <= row); // 行番号は必ず前回と等しいか、大きくなる
+		if (m_LastRow != row) {
+			if (m_LastRow >= 0) { // 行タグを閉じる
+				m_Buf += "</row>\n";
+			}
+			if (m_LastRow < 0 || m_LastRow + 1 < row) {
+				// 行番号が飛んでいる場合のみ列番号を付加する
+				m_Buf += K::str_sprintf("\t<row r='%d'>", row);
+			} else {
+				// インクリメントで済む場合は行番号を省略
+				m_Buf += "\t<row>";
+			}
+			m_LastRow = row;
+			m_LastCol = -1;
+		}
+		if (m_LastCol < 0 || m_LastCol + 1 < col) {
+			// 列番号が飛んでいる場合のみ列番号を付加する
+			m_Buf += K::str_sprintf("<c i='%d'>", col);
+		} else {
+			// インクリメントで済む場合は列番号を省略
+			m_Buf += "<c>";
+		}
+		_AppendXmlTextString(m_Buf, s.data(), s.size(), invalidCounter()); // xml禁止文字が含まれているなら CDATA 使う
+		m_Buf += "</c>";
+		m_LastCol = col;
+		flushIfFull();
+	}
+};
+
+
+std::shared_ptr<KExcelWriter> KExcelWriter::create(KOutputStream &output, const KExcelWriterParams *params) {
+	KExcelWriterParams def;
+	if (params == nullptr) params = &def;
+	std::shared_ptr<CBufferedExcelWriter> writer;
+	switch (params->format) {
+	case KExcelFormat_TEXT:
+		writer = std::make_shared<CTextWriter>(output);
+		break;
+	case KExcelFormat_CSV:
+		writer = std::make_shared<CDelimitedWriter>(output, false, params->sheet_column);
+		break;
+	case KExcelFormat_TSV:
+		writer = std::make_shared<CDelimitedWriter>(output, true, params->sheet_column);
+		break;
+	case KExcelFormat_JSONL:
+		writer = std::make_shared<CJsonlWriter>(output);
+		break;
+	case KExcelFormat_XML:
+		writer = std::make_shared<CXmlWriter>(output, true, true);
+		break;
+	default:
+		K__ERROR("E_INVALID_ARGUMENT");
+		return nullptr;
+	}
+	writer->setValidateUtf8(params->validate_utf8);
+	return writer;
+}
+
+
+// シートを一つ writer に書き出す
+// シートを書き出す。
+// 遅延ロードしたシートの読み取りに失敗した場合は、読み取れた所までを書き出して false を返す
+static bool _ExportSheet(const KExcelFile &ef, int sheet, KExcelWriter *writer) {
+	bool loaded = ef.loadSheet(sheet);
+	int col=0, row=0, nCol=0, nRow=0;
+	if (!ef.getSheetDimension(sheet, &col, &row, &nCol, &nRow)) {
+		col = row = nCol = nRow = 0;
+	}
+	writer->beginSheet(ef.getSheetName(sheet), col, row, nCol, nRow);
+	ef.scanCells(sheet, writer);
+	writer->endSheet();
+	return loaded;
+}
+#pragma endregion // KExcelWriter
+
+
+
+
+
+
+
+#pragma region KExcelDiff
+// 1行分のセルを列番号の昇順に集める
+class CRowCellCollector: public KDataGridCallback {
+public:
+	std::vector<int> m_Cols;
+	std::vector<std::string> m_Values;
+
+	void collect(const KDataGrid &grid, int row) {
+		m_Cols.clear();
+		m_Values.clear();
+		if (row >= 0) {
+			grid.scanCellsInRow(row, this);
+		}
+	}
+	virtual void onCell(int col, int row, const std::string &s) override {
+		m_Cols.push_back(col);
+		m_Values.push_back(s);
+	}
+};
+
+static void _AddCellDiff(KExcelSheetDiff *result, KExcelDiffType type, int col, int old_row, int new_row, const std::string &old_value, const std::string &new_value) {
+	KExcelCellDiff cd;
+	cd.type = type;
+	cd.col = col;
+	cd.old_row = old_row;
+	cd.new_row = new_row;
+	cd.old_value = old_value;
+	cd.new_value = new_value;
+	result->cells.push_back(cd);
+}
+
+// 古いシートの old_row 行と新しいシートの new_row 行をセル単位で比べる。
+// old_row が -1 ならば行ごと追加、new_row が -1 ならば行ごと削除されたものとする
+static void _DiffRow(const KDataGrid &old_grid, int old_row, const KDataGrid &new_grid, int new_row, CRowCellCollector *a, CRowCellCollector *b, KExcelSheetDiff *result) {
+	static const std::string EMPTY;
+	a->collect(old_grid, old_row);
+	b->collect(new_grid, new_row);
+	size_t i = 0;
+	size_t j = 0;
+	while (i < a->m_Cols.size() || j < b->m_Cols.size()) {
+		if (j >= b->m_Cols.size() || (i < a->m_Cols.size() && a->m_Cols[i] < b->m_Cols[j])) {
+			_AddCellDiff(result, KExcelDiff_REMOVED, a->m_Cols[i], old_row, new_row, a->m_Values[i], EMPTY);
+			i++;
+		} else if (i >= a->m_Cols.size() || b->m_Cols[j] < a->m_Cols[i]) {
+			_AddCellDiff(result, KExcelDiff_ADDED, b->m_Cols[j], old_row, new_row, EMPTY, b->m_Values[j]);
+			j++;
+		} else {
+			if (a->m_Values[i] != b->m_Values[j]) {
+				_AddCellDiff(result, KExcelDiff_CHANGED, a->m_Cols[i], old_row, new_row, a->m_Values[i], b->m_Values[j]);
+			}
+			i++;
+			j++;
+		}
+	}
+}
+
+// seq の中から、値が増加する最長の部分列を選び、選んだ要素の in_order を 1 にする。
+// 値が負の要素は選ばない。O(n log n)
+static void _LongestIncreasing(const std::vector<int> &seq, std::vector<char> *in_order) {
+	std::vector<int> tails; // tails[k] は長さ k+1 の部分列の末尾の候補のうち、値が最小の要素の位置
+	std::vector<int> prev(seq.size(), -1); // 部分列の中で一つ前の要素の位置
+	for (int i=0; i<(int)seq.size(); i++) {
+		if (seq[i] < 0) continue;
+		auto it = std::lower_bound(tails.begin(), tails.end(), seq[i], [&seq](int t, int v) {
+			return seq[t] < v;
+		});
+		if (it != tails.begin()) {
+			prev[i] = *(it - 1);
+		}
+		if (it == tails.end()) {
+			tails.push_back(i);
+		} else {
+			*it = i;
+		}
+	}
+	in_order->assign(seq.size(), 0);
+	for (int i=tails.empty() ? -1 : tails.back(); i>=0; i=prev[i]) {
+		(*in_order)[i] = 1;
+	}
+}
+
+static void _DiffSheet(const KDataGrid &old_grid, const KDataGrid &new_grid, KExcelSheetDiff *result) {
+	result->unchanged_rows = 0;
+	result->moved_rows.clear();
+	result->cells.clear();
+
+	std::vector<KDataGrid::RowHash> a;
+	std::vector<KDataGrid::RowHash> b;
+	old_grid.getRowHashes(&a);
+	new_grid.getRowHashes(&b);
+	const int na = (int)a.size();
+	const int nb = (int)b.size();
+
+	// 先頭と末尾で内容の一致する行を除く。
+	// ほとんどの行が変わっていなければ、ここで O(行数) のまま終わる
+	int head = 0;
+	while (head < na && head < nb && a[head].hash == b[head].hash) {
+		head++;
+	}
+	int tail = 0;
+	while (tail < na - head && tail < nb - head && a[na-1-tail].hash == b[nb-1-tail].hash) {
+		tail++;
+	}
+	result->unchanged_rows = head + tail;
+	const int a0 = head, a1 = na - tail;
+	const int b0 = head, b1 = nb - tail;
+	if (a0 == a1 && b0 == b1) {
+		return;
+	}
+
+	// 残りの行をハッシュ値で対応付ける。
+	// 同じハッシュ値の行が複数あれば、古いシートで上にある行から順に使う
+	std::unordered_map<uint64_t, int> first; // ハッシュ値 --> そのハッシュ値を持つ、まだ対応付けていない最初の古い行
+	std::vector<int> next(a1 - a0, -1);      // 同じハッシュ値を持つ次の古い行
+	first.reserve(a1 - a0);
+	for (int i=a1-1; i>=a0; i--) {
+		auto it = first.find(a[i].hash);
+		if (it != first.end()) {
+			next[i - a0] = it->second;
+			it->second = i;
+		} else {
+			first[a[i].hash] = i;
+		}
+	}
+	std::vector<int> match(b1 - b0, -1); // 新しい行に対応する古い行。無ければ -1
+	std::vector<char> used(a1 - a0, 0);  // 古い行が対応付け済みなら 1
+	for (int j=b0; j<b1; j++) {
+		auto it = first.find(b[j].hash);
+		if (it != first.end() && it->second >= 0) {
+			int i = it->second;
+			match[j - b0] = i;
+			used[i - a0] = 1;
+			it->second = next[i - a0];
+		}
+	}
+
+	// 対応付けた行のうち、前後の順序を保っている最大の組は変更なしとする（行番号のずれは問わない）。
+	// それ以外は移動した行とする
+	std::vector<char> in_order;
+	_LongestIncreasing(match, &in_order);
+
+	// 変更なしの行で区切った区間ごとに、対応の無い行同士を上から順に組にしてセル単位で比べる。
+	// 組にならずに余った行は、行ごと追加または削除されたものとする
+	CRowCellCollector ca, cb;
+	std::vector<int> olds;
+	std::vector<int> news;
+	int i = a0;
+	int j = b0;
+	while (1) {
+		int jn = j;
+		while (jn < b1 && !in_order[jn - b0]) {
+			jn++;
+		}
+		int in = (jn < b1) ? match[jn - b0] : a1;
+		olds.clear();
+		news.clear();
+		for (int k=i; k<in; k++) {
+			if (!used[k - a0]) olds.push_back(a[k].row);
+		}
+		for (int k=j; k<jn; k++) {
+			if (match[k - b0] >= 0) {
+				KExcelRowMove mv;
+				mv.old_row = a[match[k - b0]].row;
+				mv.new_row = b[k].row;
+				result->moved_rows.push_back(mv);
+			} else {
+				news.push_back(b[k].row);
+			}
+		}
+		size_t n = std::max(olds.size(), news.size());
+		for (size_t k=0; k<n; k++) {
+			int old_row = (k < olds.size()) ? olds[k] : -1;
+			int new_row = (k < news.size()) ? news[k] : -1;
+			_DiffRow(old_grid, old_row, new_grid, new_row, &ca, &cb, result);
+		}
+		if (jn >= b1) {
+			break;
+		}
+		result->unchanged_rows++;
+		i = in + 1;
+		j = jn + 1;
+	}
+}
+#pragma endregion // KExcelDiff
+
+
+
+
 #pragma region KExcelFile
 std::string KExcelFile::encodeCellName(int col, int row) {
 	return KDataGrid::encodeCellCoord(col, row);
@@ -1020,25 +2587,27 @@ void KExcelFile::clear() {
 std::string KExcelFile::getFileName() const {
 	return m_Impl->getFileName();
 }
-bool KExcelFile::loadFromStream(KInputStream &file, const std::string &xlsx_name) {
-	return m_Impl->loadFromFile(file, xlsx_name);
+bool KExcelFile::loadFromStream(KInputStream &file, const std::string &xlsx_name, const KXlsxLoadParams *params) {
+	return m_Impl->loadFromFile(file, xlsx_name, params);
 }
-bool KExcelFile::loadFromFileName(const std::string &name) {
+bool KExcelFile::loadFromFileName(const std::string &name, const KXlsxLoadParams *params) {
 	bool ok = false;
 	KInputStream file;
-	if (file.openFileName(name)) {
-		ok = m_Impl->loadFromFile(file, name);
+	if (file.openFileNameMapped(name)) {
+		ok = m_Impl->loadFromFile(file, name, params);
 	}
 	if (!ok) {
 		m_Impl->clear();
 	}
 	return ok;
 }
-bool KExcelFile::loadFromMemory(const void *bin, size_t size, const std::string &name) {
+bool KExcelFile::loadFromMemory(const void *bin, size_t size, const std::string &name, const KXlsxLoadParams *params) {
 	bool ok = false;
 	KInputStream file;
-	if (file.openMemory(bin, size)) {
-		ok = m_Impl->loadFromFile(file, name);
+	// 遅延ロードの場合はロード後にも入力データを参照するため、コピーしておく
+	bool opened = (params && params->lazy) ? file.openMemoryCopy(bin, size) : file.openMemory(bin, size);
+	if (opened) {
+		ok = m_Impl->loadFromFile(file, name, params);
 	}
 	if (!ok) {
 		m_Impl->clear();
@@ -1063,156 +2632,622 @@ std::string KExcelFile::getDataString(int sheet, int col, int row) const {
 bool KExcelFile::getCellByText(int sheet, const std::string &s, int *col, int *row) const {
 	return m_Impl->getCellByText(sheet, s, col, row);
 }
+bool KExcelFile::getCellByTextInBook(const std::string &s, int *sheet, int *col, int *row) const {
+	for (int i=0; i<m_Impl->getSheetCount(); i++) {
+		if (m_Impl->getCellByText(i, s, col, row)) {
+			if (sheet) *sheet = i;
+			return true;
+		}
+	}
+	return false;
+}
 void KExcelFile::scanCells(int sheet, KDataGridCallback *cb) const {
 	m_Impl->scanCells(sheet, cb);
 }
 const std::vector<KDataGrid> & KExcelFile::getSheets() const {
-	return m_Impl->m_Sheets;
+	return m_Impl->getSheets();
 }
 const KDataGrid & KExcelFile::getSheet(int i) const {
-	return m_Impl->m_Sheets[i];
+	return m_Impl->getSheet(i);
 }
 const KDataGrid * KExcelFile::findSheet(const std::string &name) const {
-	for (auto it=m_Impl->m_Sheets.begin(); it!=m_Impl->m_Sheets.end(); ++it) {
-		if (it->getName().compare(name) == 0) {
-			return &(*it);
-		}
+	int i = m_Impl->getSheetByName(name);
+	if (i >= 0) {
+		return &m_Impl->getSheet(i);
 	}
 	return nullptr; 
 }
+bool KExcelFile::isSheetLoaded(int sheet) const {
+	return m_Impl->isSheetLoaded(sheet);
+}
+bool KExcelFile::loadSheet(int sheet) const {
+	return m_Impl->loadSheet(sheet);
+}
+void KExcelFile::unloadSheet(int sheet) {
+	m_Impl->unloadSheet(sheet);
+}
 
 
 
+bool KExcelFile::exportTo(KExcelWriter *writer) {
+	if (writer == nullptr) {
+		K__ERROR("E_INVALID_ARGUMENT");
+		return false;
+	}
+	int numsheets = getSheetCount();
+	writer->beginBook(numsheets);
+	bool ok = true;
+	for (int iSheet=0; iSheet<numsheets; iSheet++) {
+		if (!_ExportSheet(*this, iSheet, writer)) {
+			ok = false;
+		}
+	}
+	return writer->endBook() && ok;
+}
+bool KExcelFile::exportSheetTo(int sheet, KExcelWriter *writer) {
+	if (writer == nullptr || sheet < 0 || getSheetCount() <= sheet) {
+		K__ERROR("E_INVALID_ARGUMENT");
+		return false;
+	}
+	writer->beginBook(1);
+	bool ok = _ExportSheet(*this, sheet, writer);
+	return writer->endBook() && ok;
+}
 std::string KExcelFile::exportXmlString(bool with_header, bool with_comment) {
-	class CB: public KDataGridCallback {
-	public:
-		std::string &dest_;
-		int last_row_;
-		int last_col_;
-		
-		CB(std::string &s): dest_(s) {
-			last_row_ = -1;
-			last_col_ = -1;
+	if (empty()) return "";
+	std::string s;
+	KOutputStream output = KOutputStream::fromMemory(&s);
+	CXmlWriter writer(output, with_header, with_comment);
+	exportTo(&writer);
+	return s;
+}
+bool KExcelFile::exportText(KOutputStream &output) {
+	if (!output.isOpen()) {
+		K__ERROR("E_INVALID_ARGUMENT");
+		return false;
+	}
+	CTextWriter writer(output);
+	return exportTo(&writer);
+}
+std::string KExcelFile::exportText() {
+	std::string s;
+	KOutputStream output = KOutputStream::fromMemory(&s);
+	exportText(output);
+	return s;
+}
+bool KExcelFile::diff(const KExcelFile &old_file, const KExcelFile &new_file, KExcelDiff *result) {
+	if (result == nullptr) {
+		K__ERROR("E_INVALID_ARGUMENT");
+		return false;
+	}
+	result->sheets.clear();
+	KDataGrid empty_sheet;
+
+	// 新しいブックのシートを、古いブックの同じ名前のシートと比べる
+	for (int s=0; s<new_file.getSheetCount(); s++) {
+		result->sheets.push_back(KExcelSheetDiff());
+		KExcelSheetDiff &sd = result->sheets.back();
+		sd.name = new_file.getSheetName(s);
+		sd.old_sheet = old_file.getSheetByName(sd.name);
+		sd.new_sheet = s;
+		const KDataGrid &old_sheet = (sd.old_sheet >= 0) ? old_file.getSheet(sd.old_sheet) : empty_sheet;
+		bool changed = diffSheet(old_sheet, new_file.getSheet(s), &sd);
+		if (!changed && sd.old_sheet >= 0) {
+			result->sheets.pop_back();
 		}
-		virtual void onCell(int col, int row, const std::string &s) override {
-			if (s.empty()) return;
-			K__ASSERT(last_row_ <= row); // 行番号は必ず前回と等しいか、大きくなる
-			if (last_row_ != row) {
-				if (last_row_ >= 0) { // 行タグを閉じる
-					dest_ += "</row>\n";
-				}
-				if (last_row_ < 0 || last_row_ + 1 < row) {
-					// 行番号が飛んでいる場合のみ列番号を付加する
-					dest_ += K::str_sprintf("\t<row r='%d'>", row);
-				} else {
-					// インクリメントで済む場合は行番号を省略
-					dest_ += "\t<row>";
-				}
-				last_row_ = row;
-				last_col_ = -1;
-			}
-			if (last_col_ < 0 || last_col_ + 1 < col) {
-				// 列番号が飛んでいる場合のみ列番号を付加する
-				dest_ += K::str_sprintf("<c i='%d'>", col);
-			} else {
-				// インクリメントで済む場合は列番号を省略
-				dest_ += "<c>";
-			}
-			if (_ShouldEscapeString(s)) { // xml禁止文字が含まれているなら CDATA 使う
-				dest_ += K::str_sprintf("<![CDATA[%s]]>", s.c_str());
-			} else {
-				dest_ += s;
+	}
+
+	// 古いブックにだけあるシート
+	for (int s=0; s<old_file.getSheetCount(); s++) {
+		std::string name = old_file.getSheetName(s);
+		if (new_file.getSheetByName(name) >= 0) continue;
+		result->sheets.push_back(KExcelSheetDiff());
+		KExcelSheetDiff &sd = result->sheets.back();
+		sd.name = name;
+		sd.old_sheet = s;
+		sd.new_sheet = -1;
+		diffSheet(old_file.getSheet(s), empty_sheet, &sd);
+	}
+	return !result->empty();
+}
+bool KExcelFile::diffSheet(const KDataGrid &old_sheet, const KDataGrid &new_sheet, KExcelSheetDiff *result) {
+	if (result == nullptr) {
+		K__ERROR("E_INVALID_ARGUMENT");
+		return false;
+	}
+	_DiffSheet(old_sheet, new_sheet, result);
+	return !result->empty();
+}
+
+#pragma endregion // KExcelFile
+
+
+
+
+
+
+
+
+
+namespace Test {
+
+// エスケープ関数。
+// SSE2 の場合は 16 バイト単位、16 バイトに満たない末尾、全体が 16 バイトに満たない場合で処理が分かれるので、
+// 長さと対象の文字の位置を一通り変えて確認する
+static void Test_excel_escape() {
+	const std::string FFFD = "\xEF\xBF\xBD";
+	std::string out;
+	int invalid = 0;
+	for (int len=0; len<=40; len++) {
+		const std::string plain(len, 'a');
+		out.clear();
+		_AppendTsvString(out, plain.data(), plain.size(), nullptr);
+		K__VERIFY(out == plain);
+		out.clear();
+		_AppendCsvString(out, plain.data(), plain.size(), nullptr);
+		K__VERIFY(out == plain);
+		out.clear();
+		_AppendXmlTextString(out, plain.data(), plain.size(), nullptr);
+		K__VERIFY(out == plain);
+		for (int pos=0; pos<len; pos++) {
+			const std::string head = plain.substr(0, pos);
+			const std::string tail = plain.substr(pos + 1);
+			std::string s = plain;
+
+			s[pos] = '\t';
+			out.clear();
+			_AppendTsvString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == head + "\\t" + tail);
+
+			s[pos] = ',';
+			out.clear();
+			_AppendCsvString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == "\"" + s + "\"");
+			out.clear();
+			_AppendEscapedString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == "\"" + s + "\"");
+
+			s[pos] = '"';
+			out.clear();
+			_AppendCsvString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == "\"" + head + "\"\"" + tail + "\"");
+
+			s[pos] = '<';
+			out.clear();
+			_AppendXmlTextString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == "<![CDATA[" + s + "]]>");
+			out.clear();
+			_AppendXmlAttrString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == head + "&lt;" + tail);
+
+			s[pos] = '\x01';
+			out.clear();
+			_AppendJsonString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == "\"" + head + "\\u0001" + tail + "\"");
+
+			// 不正な UTF-8 は検査する場合だけ置き換える
+			s[pos] = '\xFF';
+			out.clear();
+			_AppendTsvString(out, s.data(), s.size(), nullptr);
+			K__VERIFY(out == s);
+			out.clear();
+			invalid = 0;
+			_AppendTsvString(out, s.data(), s.size(), &invalid);
+			K__VERIFY(out == head + FFFD + tail);
+			K__VERIFY(invalid == 1);
+
+			// 正しい UTF-8 の文字はそのまま
+			if (pos + 3 <= len) {
+				std::string u8 = head + "\xE6\xBC\xA2" + plain.substr(pos + 3);
+				out.clear();
+				invalid = 0;
+				_AppendTsvString(out, u8.data(), u8.size(), &invalid);
+				K__VERIFY(out == u8);
+				K__VERIFY(invalid == 0);
 			}
-			dest_ += "</c>";
-			last_col_ = col;
 		}
+	}
+
+	// "]]>" はどの位置にあっても CDATA セクションを分割する
+	for (int pos=0; pos+3<=40; pos++) {
+		std::string head(pos, 'a');
+		std::string tail(37 - pos, 'b');
+		std::string s = head + "]]>" + tail;
+		out.clear();
+		_AppendXmlTextString(out, s.data(), s.size(), nullptr);
+		K__VERIFY(out == "<![CDATA[" + head + "]]]]><![CDATA[>" + tail + "]]>");
+	}
+
+	// 不正な UTF-8。置き換えは 1 バイトずつ行う
+	struct UTF8CASE { const char *in; const char *out; };
+	const UTF8CASE cases[] = {
+		{"\xC0\x80",         "\xEF\xBF\xBD\xEF\xBF\xBD"},                         // 冗長表現 (U+0000)
+		{"\xE0\x80\xAF",     "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD"},             // 冗長表現 (U+002F)
+		{"\xED\xA0\x80",     "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD"},             // サロゲート (U+D800)
+		{"\xF4\x90\x80\x80", "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD"}, // U+10FFFF を超える
+		{"\xE6\xBCz",        "\xEF\xBF\xBD\xEF\xBF\xBDz"},                        // 途中で途切れた
+		{"z\xF0\x9F\x98",    "z\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD"},             // 末尾で途切れた
+		{"\xF0\x9F\x98\x80", "\xF0\x9F\x98\x80"},                                 // 正しい 4 バイト文字
 	};
-	if (empty()) return "";
-	
-	std::string s;
-	if (with_header) {
-		s += "<?xml version='1.0' encoding='utf-8'>\n";
-	}
-	if (with_comment) {
-		s += u8"<!-- <sheet> タグは「シート」に対応する。 left, top, cols, rows 属性にはそれぞれ、シート内で値が入っているセル範囲の左、上、行数、列数が入る -->\n";
-		s += u8"<!-- <row> タグは各シートの「行」に対応する。 <row> の r 属性には 0 起算での行番号が入る。ただし直前の <row> の次の行だった場合 r 属性は省略される -->\n";
-		s += u8"<!-- <c> タグは、それぞれの行 <row> 内にある「セル」に対応する。 i 属性には 0 起算での列番号が入る。ただし、直前の <c> の次の列だった場合 i 属性は省略される -->\n";
-	}
-	s += K::str_sprintf("<excel numsheets='%d'>\n", getSheetCount());
-	for (int iSheet=0; iSheet<getSheetCount(); iSheet++) {
-		int col=0, row=0, nCol=0, nRow=0;
-		std::string sheet_name = getSheetName(iSheet);
-		getSheetDimension(iSheet, &col, &row, &nCol, &nRow);
-		s += K::str_sprintf("<sheet name='%s' left='%d' top='%d' cols='%d' rows='%d'>\n", sheet_name.c_str(), col, row, nCol, nRow);
-		{
-			CB cb(s);
-			scanCells(iSheet, &cb);
-			if (cb.last_row_ >= 0) {
-				s += "</row>\n"; // 最終行を閉じる
+	for (int pad=0; pad<=32; pad+=16) {
+		for (size_t i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+			std::string s = std::string(pad, 'a') + cases[i].in;
+			out.clear();
+			invalid = 0;
+			_AppendTsvString(out, s.data(), s.size(), &invalid);
+			K__VERIFY(out == std::string(pad, 'a') + cases[i].out);
+			K__VERIFY(invalid == (strcmp(cases[i].in, cases[i].out) != 0 ? 1 : 0));
+		}
+	}
+}
+
+// writer に 1 シート分のセルを書き出し、出力内容を返す
+struct TESTCELL { int col, row; const char *s; };
+static std::string _TestWrite(KExcelWriter *writer, std::string &dest, const char *name, int left, int top, int cols, int rows, const TESTCELL *cells, int count) {
+	writer->beginBook(1);
+	writer->beginSheet(name, left, top, cols, rows);
+	for (int i=0; i<count; i++) {
+		writer->onCell(cells[i].col, cells[i].row, cells[i].s);
+	}
+	writer->endSheet();
+	K__VERIFY(writer->endBook());
+	return dest;
+}
+static std::string _TestWriteFormat(KExcelFormat format, bool sheet_column, const char *name, int left, int top, int cols, int rows, const TESTCELL *cells, int count) {
+	std::string dest;
+	KOutputStream output = KOutputStream::fromMemory(&dest);
+	KExcelWriterParams params;
+	params.format = format;
+	params.sheet_column = sheet_column;
+	std::shared_ptr<KExcelWriter> writer = KExcelWriter::create(output, &params);
+	return _TestWrite(writer.get(), dest, name, left, top, cols, rows, cells, count);
+}
+
+// 書き出し形式ごとの出力内容
+static void Test_excel_writers() {
+	// 値のある範囲は B1:D3。2 行目は空行
+	const TESTCELL cells[] = {
+		{1, 0, "a"},
+		{3, 0, "x,y"},
+		{2, 2, "q\"r"},
+	};
+	// CSV: どの行も 3 列に揃え、空行も空のレコードにする。改行は CRLF
+	K__VERIFY(_TestWriteFormat(KExcelFormat_CSV, false, "S", 1, 0, 3, 3, cells, 3) ==
+		"a,,\"x,y\"\r\n"
+		",,\r\n"
+		",\"q\"\"r\",\r\n");
+	// CSV: 各レコードの先頭にシート名の列を加える
+	K__VERIFY(_TestWriteFormat(KExcelFormat_CSV, true, "S,1", 1, 0, 3, 3, cells, 3) ==
+		"\"S,1\",a,,\"x,y\"\r\n"
+		"\"S,1\",,,\r\n"
+		"\"S,1\",,\"q\"\"r\",\r\n");
+
+	// TSV: タブ、改行、\ をエスケープする。改行は LF
+	const TESTCELL tsv_cells[] = {
+		{0, 0, "a\tb"},
+		{1, 0, "c\\d"},
+		{0, 1, "e\r\nf"},
+	};
+	K__VERIFY(_TestWriteFormat(KExcelFormat_TSV, false, "S", 0, 0, 2, 2, tsv_cells, 3) ==
+		"a\\tb\tc\\\\d\n"
+		"e\\r\\nf\t\n");
+
+	// JSONL: 行ごとに 1 行。行番号は 1 起算、キーは列名
+	const TESTCELL jsonl_cells[] = {
+		{0, 0, "v"},
+		{27, 0, "w"},
+		{1, 4, "x\"y"},
+	};
+	K__VERIFY(_TestWriteFormat(KExcelFormat_JSONL, false, "S\"1", 0, 0, 28, 5, jsonl_cells, 3) ==
+		"{\"sheet\":\"S\\\"1\",\"row\":1,\"cells\":{\"A\":\"v\",\"AB\":\"w\"}}\n"
+		"{\"sheet\":\"S\\\"1\",\"row\":5,\"cells\":{\"B\":\"x\\\"y\"}}\n");
+
+	// XML: 宣言は ?> で閉じる。シート名は属性値としてエスケープし、]]> を含むセルは CDATA セクションを分割する
+	const TESTCELL xml_cells[] = {
+		{0, 0, "x]]>y"},
+		{1, 0, "z"},
+		{1, 2, "w"},
+	};
+	{
+		std::string dest;
+		KOutputStream output = KOutputStream::fromMemory(&dest);
+		CXmlWriter writer(output, true, false);
+		K__VERIFY(_TestWrite(&writer, dest, "a<'b'>", 0, 0, 2, 3, xml_cells, 3) ==
+			"<?xml version='1.0' encoding='utf-8'?>\n"
+			"<excel numsheets='1'>\n"
+			"<sheet name='a&lt;&apos;b&apos;&gt;' left='0' top='0' cols='2' rows='3'>\n"
+			"\t<row r='0'><c i='0'><![CDATA[x]]]]><![CDATA[>y]]></c><c>z</c></row>\n"
+			"\t<row r='2'><c i='1'>w</c></row>\n"
+			"</sheet>\n\n"
+			"</excel>\n");
+	}
+}
+
+// テスト用のシートを作る。
+// text は行を '\n'、列を '\t' で区切ったセルの値。空の値のセルは作らない
+static void _TestMakeGrid(KDataGrid &grid, const char *text) {
+	grid.clear();
+	int col = 0;
+	int row = 0;
+	std::string val;
+	for (const char *p=text; ; p++) {
+		if (*p == '\t' || *p == '\n' || *p == '\0') {
+			if (!val.empty()) {
+				grid.setCell(col, row, val);
+				val.clear();
+			}
+			if (*p == '\0') break;
+			if (*p == '\t') {
+				col++;
 			} else {
-				// セルを一つも出力していないので <row> を閉じる必要もない
+				col = 0;
+				row++;
 			}
+		} else {
+			val += *p;
 		}
-		s += "</sheet>";
-		if (with_comment) {
-			s += K::str_sprintf("<!-- %s -->", sheet_name.c_str());
-		}
-		s += "\n\n";
 	}
-	s += "</excel>\n";
-	return s;
 }
-std::string KExcelFile::exportText() {
-	if (empty()) return "";
-	std::string s;
-	for (int iSheet=0; iSheet<getSheetCount(); iSheet++) {
-		int col=0, row=0, nCol=0, nRow=0;
-		std::string sheet_name = getSheetName(iSheet);
-		getSheetDimension(iSheet, &col, &row, &nCol, &nRow);
-		s += "\n";
-		s += "============================================================================\n";
-		s += sheet_name + "\n";
-		s += "============================================================================\n";
-		int blank_lines = 0;
-		for (int r=row; r<row+nRow; r++) {
-			bool has_cell = false;
-			for (int c=col; c<col+nCol; c++) {
-				std::string str = getDataString(iSheet, c, r);
-				if (str.empty() == false) {
-					if (blank_lines >= 1) {
-						s += "\n";
-						blank_lines = 0;
+
+// テスト用の .xlsx ファイルをメモリ上に作る。
+// sheets はシート名と、_TestMakeGrid と同じ形式のセルの値の組。セルはインライン文字列で書き込む。
+// 値は空白も含めてそのまま書き込む（空の値のセルだけは作らない）。
+// ただし "$0" のように '$' で始まる値は、その番号の共有文字列を参照するセルにする。
+// shared_strings が nullptr でなければ、その内容を xl/sharedStrings.xml として書き込む
+static std::string _TestMakeXlsx(const std::vector<std::pair<std::string, std::string>> &sheets, const char *shared_strings=nullptr) {
+	std::string wb = "<workbook xmlns:r=\"r\"><sheets>";
+	std::string rels = "<Relationships>";
+	for (size_t i=0; i<sheets.size(); i++) {
+		wb += K::str_sprintf("<sheet name=\"%s\" sheetId=\"%d\" r:id=\"rId%d\"/>", sheets[i].first.c_str(), (int)i+1, (int)i+1);
+		rels += K::str_sprintf("<Relationship Id=\"rId%d\" Target=\"worksheets/sheet%d.xml\"/>", (int)i+1, (int)i+1);
+	}
+	wb += "</sheets></workbook>";
+	rels += "</Relationships>";
+
+	std::string bin;
+	KOutputStream output = KOutputStream::fromMemory(&bin);
+	KZipper zw(output);
+	zw.addEntry("xl/workbook.xml", wb.data(), (int)wb.size(), nullptr, 0);
+	zw.addEntry("xl/_rels/workbook.xml.rels", rels.data(), (int)rels.size(), nullptr, 0);
+	if (shared_strings) {
+		zw.addEntry("xl/sharedStrings.xml", shared_strings, -1, nullptr, 0);
+	}
+	for (size_t i=0; i<sheets.size(); i++) {
+		std::string xml = "<worksheet><sheetData><row r=\"1\">";
+		int col = 0;
+		int row = 0;
+		std::string val;
+		for (const char *p=sheets[i].second.c_str(); ; p++) {
+			if (*p == '\t' || *p == '\n' || *p == '\0') {
+				if (!val.empty()) {
+					std::string ref = KDataGrid::encodeCellCoord(col, row);
+					if (val[0] == '$') {
+						xml += "<c r=\"" + ref + "\" t=\"s\"><v>" + val.substr(1) + "</v></c>";
+					} else {
+						xml += "<c r=\"" + ref + "\" t=\"inlineStr\"><is><t>" + val + "</t></is></c>";
 					}
-					if (has_cell) s += ", ";
-					std::string ss = str;
-					_EscapeString(ss);
-					s += ss;
-					has_cell = true;
+					val.clear();
+				}
+				if (*p == '\0') break;
+				if (*p == '\t') {
+					col++;
+				} else {
+					col = 0;
+					row++;
+					xml += K::str_sprintf("</row><row r=\"%d\">", row+1);
 				}
-			}
-			if (has_cell) {
-				s += "\n";
 			} else {
-				blank_lines++;
+				val += *p;
 			}
 		}
+		xml += "</row></sheetData></worksheet>";
+		std::string name = K::str_sprintf("xl/worksheets/sheet%d.xml", (int)i+1);
+		zw.addEntry(name.c_str(), xml.data(), (int)xml.size(), nullptr, 0);
 	}
-	return s;
+	zw.finalize(nullptr, 0);
+	output.close();
+	return bin;
 }
 
-#pragma endregion // KExcelFile
-
-
-
-
+// 差分
+static void Test_excel_diff() {
+	KDataGrid a, b;
+	KExcelSheetDiff sd;
+
+	// 行の挿入。挿入した行だけが追加になり、後ろの行は行番号がずれても変更なし
+	_TestMakeGrid(a, "a\nb\nc");
+	_TestMakeGrid(b, "a\nx\nb\nc");
+	K__VERIFY(KExcelFile::diffSheet(a, b, &sd));
+	K__VERIFY(sd.unchanged_rows == 3);
+	K__VERIFY(sd.moved_rows.empty());
+	K__VERIFY(sd.cells.size() == 1);
+	K__VERIFY(sd.cells[0].type == KExcelDiff_ADDED);
+	K__VERIFY(sd.cells[0].col == 0 && sd.cells[0].old_row == -1 && sd.cells[0].new_row == 1);
+	K__VERIFY(sd.cells[0].old_value == "" && sd.cells[0].new_value == "x");
+
+	// 隣り合う行の入れ替え。一方だけが移動になる
+	_TestMakeGrid(a, "a\nb\nc");
+	_TestMakeGrid(b, "a\nc\nb");
+	K__VERIFY(KExcelFile::diffSheet(a, b, &sd));
+	K__VERIFY(sd.unchanged_rows == 2);
+	K__VERIFY(sd.moved_rows.size() == 1);
+	K__VERIFY(sd.cells.empty());
+	const KExcelRowMove &mv = sd.moved_rows[0];
+	K__VERIFY((mv.old_row == 1 && mv.new_row == 2) || (mv.old_row == 2 && mv.new_row == 1));
+
+	// セルの変更
+	_TestMakeGrid(a, "a\tb\nc\td");
+	_TestMakeGrid(b, "a\tB\nc\td");
+	K__VERIFY(KExcelFile::diffSheet(a, b, &sd));
+	K__VERIFY(sd.unchanged_rows == 1);
+	K__VERIFY(sd.moved_rows.empty());
+	K__VERIFY(sd.cells.size() == 1);
+	K__VERIFY(sd.cells[0].type == KExcelDiff_CHANGED);
+	K__VERIFY(sd.cells[0].col == 1 && sd.cells[0].old_row == 0 && sd.cells[0].new_row == 0);
+	K__VERIFY(sd.cells[0].old_value == "b" && sd.cells[0].new_value == "B");
+
+	// 同じ内容なら差分なし
+	K__VERIFY(!KExcelFile::diffSheet(a, a, &sd));
+	K__VERIFY(sd.unchanged_rows == 2);
+
+	// 空のシートとの比較
+	_TestMakeGrid(a, "");
+	_TestMakeGrid(b, "p\tq");
+	K__VERIFY(KExcelFile::diffSheet(a, b, &sd));
+	K__VERIFY(sd.cells.size() == 2);
+	K__VERIFY(sd.cells[0].type == KExcelDiff_ADDED && sd.cells[0].col == 0 && sd.cells[0].new_value == "p");
+	K__VERIFY(sd.cells[1].type == KExcelDiff_ADDED && sd.cells[1].col == 1 && sd.cells[1].new_value == "q");
+	K__VERIFY(KExcelFile::diffSheet(b, a, &sd));
+	K__VERIFY(sd.cells.size() == 2);
+	K__VERIFY(sd.cells[0].type == KExcelDiff_REMOVED && sd.cells[0].old_row == 0 && sd.cells[0].new_row == -1 && sd.cells[0].old_value == "p");
+	K__VERIFY(sd.cells[1].type == KExcelDiff_REMOVED && sd.cells[1].old_value == "q");
+	K__VERIFY(!KExcelFile::diffSheet(a, a, &sd));
+	K__VERIFY(sd.unchanged_rows == 0);
+
+	// ブック単位。シートは名前で対応付け、古いブックにだけあるシートは末尾に並ぶ
+	std::string old_bin = _TestMakeXlsx({{"S1", "a"}, {"S2", "p\tq"}});
+	std::string new_bin = _TestMakeXlsx({{"S3", "z"}, {"S1", "a"}});
+	KExcelFile old_file, new_file;
+	K__VERIFY(old_file.loadFromMemory(old_bin.data(), old_bin.size(), "old.xlsx"));
+	K__VERIFY(new_file.loadFromMemory(new_bin.data(), new_bin.size(), "new.xlsx"));
+	KExcelDiff d;
+	K__VERIFY(KExcelFile::diff(old_file, new_file, &d));
+	K__VERIFY(d.sheets.size() == 2);
+	K__VERIFY(d.sheets[0].name == "S3" && d.sheets[0].old_sheet == -1 && d.sheets[0].new_sheet == 0);
+	K__VERIFY(d.sheets[0].cells.size() == 1 && d.sheets[0].cells[0].type == KExcelDiff_ADDED && d.sheets[0].cells[0].new_value == "z");
+	K__VERIFY(d.sheets[1].name == "S2" && d.sheets[1].old_sheet == 1 && d.sheets[1].new_sheet == -1);
+	K__VERIFY(d.sheets[1].cells.size() == 2);
+	K__VERIFY(d.sheets[1].cells[0].type == KExcelDiff_REMOVED && d.sheets[1].cells[0].old_value == "p");
+	K__VERIFY(d.sheets[1].cells[1].type == KExcelDiff_REMOVED && d.sheets[1].cells[1].old_value == "q");
+	K__VERIFY(!KExcelFile::diff(old_file, old_file, &d));
+}
 
+// 遅延ロード。
+// 読み取った内容は一度に読み取った場合と同じになり、unloadSheet で破棄したシートは次のアクセスで読み直す
+static void Test_excel_lazy() {
+	std::string bin = _TestMakeXlsx({{"S1", "a\tb\n\tc"}, {"S2", "x\ny\nz"}});
+	KXlsxLoadParams params;
+	params.lazy = true;
+	KExcelFile eager, lazy;
+	K__VERIFY(eager.loadFromMemory(bin.data(), bin.size(), "eager.xlsx"));
+	K__VERIFY(lazy.loadFromMemory(bin.data(), bin.size(), "lazy.xlsx", &params));
+	K__VERIFY(lazy.getSheetCount() == 2);
+	K__VERIFY(lazy.getSheetName(1) == "S2");
+	K__VERIFY(!lazy.isSheetLoaded(0) && !lazy.isSheetLoaded(1)); // シート名だけなら読み取らない
+
+	KExcelSheetDiff sd;
+	for (int i=0; i<2; i++) {
+		K__VERIFY(eager.isSheetLoaded(i));
+		K__VERIFY(!KExcelFile::diffSheet(eager.getSheet(i), lazy.getSheet(i), &sd));
+		K__VERIFY(lazy.isSheetLoaded(i));
+	}
+	K__VERIFY(lazy.getDataString(0, 1, 1) == "c");
+
+	lazy.unloadSheet(0);
+	K__VERIFY(!lazy.isSheetLoaded(0));
+	K__VERIFY(lazy.isSheetLoaded(1));
+	K__VERIFY(lazy.getDataString(0, 0, 0) == "a");
+	K__VERIFY(lazy.isSheetLoaded(0));
+	K__VERIFY(!KExcelFile::diffSheet(eager.getSheet(0), lazy.getSheet(0), &sd));
+
+	// 複数のスレッドから同時にアクセスしても、各シートは一度だけ読み取られる
+	{
+		KExcelFile shared;
+		K__VERIFY(shared.loadFromMemory(bin.data(), bin.size(), "shared.xlsx", &params));
+		std::vector<std::thread> threads;
+		std::atomic<int> ok(0);
+		for (int t=0; t<4; t++) {
+			threads.emplace_back([&shared, &ok, t]() {
+				if (shared.getDataString(t % 2, 0, 0) == ((t % 2) ? "x" : "a")) ok++;
+			});
+		}
+		for (auto &th : threads) th.join();
+		K__VERIFY(ok == 4);
+	}
 
+	// 一度に読み取った場合は読み直せないので、破棄しない
+	eager.unloadSheet(0);
+	K__VERIFY(eager.isSheetLoaded(0));
+	K__VERIFY(eager.getDataString(0, 0, 0) == "a");
+
+	// 壊れたシート。_TestMakeXlsx はセルの値をエスケープしないので、終了タグの不一致を作れる。
+	// 一度に読み取る場合はロード自体が失敗し、遅延ロードの場合はそのシートの読み取りと書き出しが失敗する
+	{
+		std::string bad = _TestMakeXlsx({{"S1", "a"}, {"S2", "x\n</bad>"}});
+		KExcelFile ef;
+		K__VERIFY(!ef.loadFromMemory(bad.data(), bad.size(), "bad.xlsx"));
+		K__VERIFY(ef.loadFromMemory(bad.data(), bad.size(), "bad.xlsx", &params));
+		K__VERIFY(ef.loadSheet(0));
+		K__VERIFY(!ef.loadSheet(1));
+		K__VERIFY(ef.isSheetLoaded(1));
+		K__VERIFY(!ef.loadSheet(1)); // 読み取り済みでも失敗を返す
+		std::string out;
+		KOutputStream output = KOutputStream::fromMemory(&out);
+		CTextWriter writer(output);
+		K__VERIFY(ef.exportSheetTo(0, &writer));
+		K__VERIFY(!ef.exportSheetTo(1, &writer));
+		K__VERIFY(!ef.exportTo(&writer));
+	}
 
+	// 壊れた共有文字列テーブル。
+	// 途中までしか読み取れないと、それ以降の文字列を参照するセルが空になるので、ロードもシートの読み取りも失敗とする
+	{
+		std::string good = _TestMakeXlsx({{"S1", "$0\t$1"}}, "<sst><si><t>A</t></si><si><t>B</t></si></sst>");
+		KExcelFile ef;
+		K__VERIFY(ef.loadFromMemory(good.data(), good.size(), "good.xlsx"));
+		K__VERIFY(ef.getDataString(0, 0, 0) == "A" && ef.getDataString(0, 1, 0) == "B");
+
+		std::string bad = _TestMakeXlsx({{"S1", "$0\t$1"}}, "<sst><si><t>A</t></si></bad><si><t>B</t></si></sst>");
+		K__VERIFY(!ef.loadFromMemory(bad.data(), bad.size(), "bad.xlsx"));
+		K__VERIFY(ef.loadFromMemory(bad.data(), bad.size(), "bad.xlsx", &params));
+		K__VERIFY(!ef.loadSheet(0));
+		K__VERIFY(ef.getDataString(0, 0, 0) == "A");
+	}
+}
 
+// セルを一つずつ記録する
+class CTestCellRecorder: public KXlsxCallback {
+public:
+	std::string m_Cells;
+	virtual void onCell(int col, int row, const std::string &s) override {
+		m_Cells += KDataGrid::encodeCellCoord(col, row) + "=[" + s + "]\n";
+	}
+};
 
-namespace Test {
+// KXlsxFile::scanFromStream で得たセルと、ロードしたシートを KDataGrid::scanCells で得たセルは同じになる。
+// 前後の空白は取り除き、空白だけの値はセルが無いものとする
+static void Test_excel_scan() {
+	std::string bin = _TestMakeXlsx(
+		{{"S1", " a \t  \t$0\t$1\t$2\nb\t\t12"}},
+		"<sst><si><t> shared </t></si><si><t>   </t></si><si><t>plain</t></si></sst>"
+	);
+	const char *expected =
+		"A1=[a]\n"
+		"C1=[shared]\n"
+		"E1=[plain]\n"
+		"A2=[b]\n"
+		"C2=[12]\n";
+
+	CTestCellRecorder scanned;
+	KInputStream file = KInputStream::fromMemory(bin.data(), (int)bin.size());
+	K__VERIFY(KXlsxFile::scanFromStream(file, "scan.xlsx", &scanned));
+	K__VERIFY(scanned.m_Cells == expected);
+
+	std::vector<KDataGrid> sheets;
+	K__VERIFY(KXlsxFile::loadFromMemory(bin.data(), bin.size(), "scan.xlsx", sheets));
+	K__VERIFY(sheets.size() == 1);
+	CTestCellRecorder loaded;
+	sheets[0].scanCells(&loaded);
+	K__VERIFY(loaded.m_Cells == expected);
+}
 
 void Test_excel(const std::string &filename) {
+	Test_excel_escape();
+	Test_excel_writers();
+	Test_excel_diff();
+	Test_excel_lazy();
+	Test_excel_scan();
+
 	KExcelFile ef;
 	ef.loadFromFileName(filename);
 	std::string xml = ef.exportXmlString();
@@ -2,6 +2,7 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 #include "KDataGrid.h"
 
 namespace Kamilo {
@@ -12,12 +13,243 @@ class CCoreExcelReader; // internal class
 class CCoreExcelReader2; // internal class
 
 
+/// KXlsxFile::scanFromStream でセルを受け取るためのコールバック
+class KXlsxCallback: public KDataGridCallback {
+public:
+	/// シートの読み取りを開始するときに呼ばれる。
+	/// この後、シート内の値が入っているセルについて onCell が呼ばれる
+	/// index ワークブック内でのシート番号（ゼロ起算）。KXlsxLoadParams::sheet_filter で除外されたシートも数える
+	/// name  シート名
+	virtual void onSheet(int index, const std::string &name) {}
+};
+
+
+/// KXlsxStats に記録するシートごとの統計
+struct KXlsxSheetStats {
+	KXlsxSheetStats() {
+		xml_bytes = 0;
+		xml_nodes = 0;
+		cells = 0;
+		arena_bytes = 0;
+		inflate_sec = 0;
+		parse_sec = 0;
+	}
+	std::string name;   ///< シート名
+	int64_t xml_bytes;  ///< 展開後のワークシート XML のバイト数
+	int64_t xml_nodes;  ///< XML のトークン数（開始タグ、終了タグ、テキスト）
+	int64_t cells;      ///< 値の入っているセルの数
+	size_t arena_bytes; ///< シートの文字列バッファのバイト数 (KDataGrid::getArenaSize)。KXlsxFile::scanFromStream では 0
+	double inflate_sec; ///< 展開にかかった秒数
+	double parse_sec;   ///< XML の解析とセルの格納にかかった秒数。展開の時間は含まない
+};
+
+
+/// .XLSX ファイルの読み取りにかかった時間と、処理した量。
+/// KXlsxLoadParams::stats を指定したときにだけ集計する。
+/// 読み取るたびに値を加算し、sheets の末尾に追加するので、複数のファイルの合計を取ることもできる
+struct KXlsxStats {
+	KXlsxStats() {
+		clear();
+	}
+	void clear() {
+		open_sec = 0;
+		workbook_sec = 0;
+		shared_strings_sec = 0;
+		sheets_sec = 0;
+		inflated_bytes = 0;
+		xml_nodes = 0;
+		cells = 0;
+		shared_strings = 0;
+		peak_arena_bytes = 0;
+		sheets.clear();
+	}
+	double open_sec;           ///< ZIP のセントラルディレクトリの読み取りにかかった秒数
+	double workbook_sec;       ///< シート一覧 (workbook.xml とリレーションシップ) の読み取りにかかった秒数
+	double shared_strings_sec; ///< 共有文字列テーブルの展開と解析にかかった秒数
+	double sheets_sec;         ///< 全シートの展開と解析にかかった秒数。複数のスレッドで読み取った場合は経過時間
+	int64_t inflated_bytes;    ///< 展開したバイト数の合計
+	int64_t xml_nodes;         ///< ワークシートの XML のトークン数の合計
+	int64_t cells;             ///< 値の入っているセルの数の合計
+	int64_t shared_strings;    ///< 共有文字列の数
+	size_t peak_arena_bytes;   ///< 同時にメモリ上にあった文字列バッファ（共有文字列テーブルと各シート）の最大バイト数
+	std::vector<KXlsxSheetStats> sheets; ///< 読み取ったシートごとの統計。読み取った順に並ぶ
+};
+
+
+/// .XLSX ファイルのロード方法
+struct KXlsxLoadParams {
+	KXlsxLoadParams() {
+		num_threads = 1;
+		lazy = false;
+		used_strings_only = false;
+		stats = nullptr;
+	}
+
+	/// シートの展開と解析に使うスレッド数。
+	/// 1 ならば呼び出し元のスレッドだけで処理する。0 以下ならば CPU の論理コア数を使う。
+	/// 複数のスレッドを使った場合でも、ロード結果のシートはワークブック内の順番通りに並ぶ
+	int num_threads;
+
+	/// 読み取るシートの名前。空ならば全てのシートを読み取る。
+	/// シート名そのもの、または "Data*" のようなワイルドカードを含むパターンを指定する。
+	/// どれか一つにでも一致したシートだけを展開・解析し、それ以外のシートは展開すらしない
+	std::vector<std::string> sheet_filter;
+
+	/// 遅延ロードする。
+	/// KExcelFile でのみ有効。ロード時にはシート一覧だけを読み取り、
+	/// シートの中身はそのシートに初めてアクセスしたときに読み取る。
+	/// ファイルは KExcelFile::clear() するまで開いたままになる。
+	/// getSheet() や getDataString() などの const な関数もシートを読み取って内部の状態を書き換えるが、
+	/// 読み取りは排他制御しているので、複数のスレッドから同時に呼び出してもよい（読み取り中のシートへのアクセスは読み終わるまで待つ）。
+	/// ただし unloadSheet() は、破棄するシートを他のスレッドが使っていない時に呼ぶこと
+	bool lazy;
+
+	/// 共有文字列テーブルのうち、読み取るシートが参照している文字列だけを格納する。
+	/// 先に読み取るシートを一通り走査して参照している文字列 ID を集め、
+	/// 共有文字列テーブルではそれ以外の文字列の展開とコピーを省く（空文字列として扱う）。
+	/// シートを二度走査することになるので、sheet_filter で一部のシートだけを読み取る場合に向いている。
+	/// 遅延ロードの場合も、ロード時に読み取る可能性のある全てのシートを走査し、共有文字列テーブルは一度だけ作る。
+	/// 走査できないシートがあった場合は、この指定を無視して共有文字列テーブルを全て読み取る
+	bool used_strings_only;
+
+	/// 読み取りの統計を記録する先。nullptr ならば何も記録せず、時間の計測も行わない。
+	/// 遅延ロードした場合は、シートを読み取るたびにここに記録するので、KExcelFile を破棄するまで有効にしておくこと
+	KXlsxStats *stats;
+};
+
+
+/// KExcelWriter の出力形式
+enum KExcelFormat {
+	KExcelFormat_TEXT,  ///< KExcelFile::exportText と同じ形式。値の入っているセルだけを行ごとに ", " 区切りで並べる
+	KExcelFormat_CSV,   ///< RFC 4180 形式の CSV。改行は CRLF
+	KExcelFormat_TSV,   ///< タブ区切り。値に含まれる \, タブ, CR, LF は \\, \t, \r, \n にエスケープする。改行は LF
+	KExcelFormat_JSONL, ///< JSON Lines。値の入っている行ごとに {"sheet":"Sheet1","row":1,"cells":{"A":"...","C":"..."}} を1行書く
+	KExcelFormat_XML,   ///< KExcelFile::exportXmlString と同じ形式
+};
+
+
+/// KExcelWriter の書き出し方法
+struct KExcelWriterParams {
+	KExcelWriterParams() {
+		format = KExcelFormat_TEXT;
+		sheet_column = false;
+		validate_utf8 = false;
+	}
+
+	/// 出力形式
+	KExcelFormat format;
+
+	/// CSV と TSV で、各行の先頭にシート名の列を加える。
+	/// 複数のシートを一つのファイルに書き出しても、どのシートの行なのか区別できるようにする
+	bool sheet_column;
+
+	/// 書き出す文字列が UTF-8 として正しいかどうかを、エスケープと同じ走査で検査する。
+	/// 不正なバイトは U+FFFD に置き換えて書き出し、置き換えた文字列の数を書き出しの終了時に警告する
+	bool validate_utf8;
+};
+
+
+/// シートを書き出す先。
+/// KExcelFile::exportTo が beginBook, シートごとに (beginSheet, onCell..., endSheet), endBook の順に呼ぶ。
+/// onCell は行優先の順番で、値の入っているセルについてだけ呼ばれる
+class KExcelWriter: public KDataGridCallback {
+public:
+	/// 指定した形式で output に書き出す KExcelWriter を作る。
+	/// 書き出す内容は一定量たまるごとにまとめて output に書き込むので、出力全体をメモリ上に保持しない。
+	/// output は KExcelWriter を破棄するまで開いておくこと
+	/// params: 書き出し方法。nullptr ならデフォルト値を使う
+	static std::shared_ptr<KExcelWriter> create(KOutputStream &output, const KExcelWriterParams *params=nullptr);
+
+	virtual ~KExcelWriter() {}
+
+	/// 書き出しを開始する。numsheets はこれから書き出すシートの数
+	virtual void beginBook(int numsheets) {}
+
+	/// シートの書き出しを開始する。
+	/// left, top, cols, rows にはシート内で値の入っているセルの範囲が入る（ゼロ起算）。値が一つもなければ全て 0
+	virtual void beginSheet(const std::string &name, int left, int top, int cols, int rows) {}
+
+	/// シートの書き出しを終了する
+	virtual void endSheet() {}
+
+	/// 書き出しを終了する。
+	/// 書き込んでいない内容を全て出力先に書き込み、全ての書き込みに成功していれば true を返す
+	virtual bool endBook() { return true; }
+};
+
+
+/// KExcelCellDiff の種類
+enum KExcelDiffType {
+	KExcelDiff_ADDED,   ///< 新しいシートにだけ値がある
+	KExcelDiff_REMOVED, ///< 古いシートにだけ値がある
+	KExcelDiff_CHANGED, ///< 両方に値があり、文字列が異なる
+};
+
+
+/// セル単位の差分
+struct KExcelCellDiff {
+	KExcelCellDiff() {
+		type = KExcelDiff_CHANGED;
+		col = 0;
+		old_row = -1;
+		new_row = -1;
+	}
+	KExcelDiffType type;
+	int col;               ///< 列番号（ゼロ起算）
+	int old_row;           ///< 古いシートでの行番号（ゼロ起算）。行ごと追加された場合は -1
+	int new_row;           ///< 新しいシートでの行番号（ゼロ起算）。行ごと削除された場合は -1
+	std::string old_value; ///< 古いシートでの値。KExcelDiff_ADDED では空文字列
+	std::string new_value; ///< 新しいシートでの値。KExcelDiff_REMOVED では空文字列
+};
+
+
+/// 内容を変えずに移動した行
+struct KExcelRowMove {
+	int old_row; ///< 古いシートでの行番号（ゼロ起算）
+	int new_row; ///< 新しいシートでの行番号（ゼロ起算）
+};
+
+
+/// シート単位の差分
+struct KExcelSheetDiff {
+	KExcelSheetDiff() {
+		old_sheet = -1;
+		new_sheet = -1;
+		unchanged_rows = 0;
+	}
+	bool empty() const {
+		return moved_rows.empty() && cells.empty();
+	}
+	std::string name; ///< シート名
+	int old_sheet;    ///< 古いブックでのシート番号（ゼロ起算）。シートが追加された場合は -1
+	int new_sheet;    ///< 新しいブックでのシート番号（ゼロ起算）。シートが削除された場合は -1
+	int unchanged_rows; ///< 内容も前後の順序も変わっていない行の数。行の挿入や削除で行番号だけがずれた行も含む
+	std::vector<KExcelRowMove> moved_rows; ///< 内容は同じだが、前後の行との順序が入れ替わった行。新しい行番号の昇順
+	std::vector<KExcelCellDiff> cells;     ///< 追加、削除、変更されたセル。おおむね新しい行番号の順に並ぶ
+};
+
+
+/// ブック単位の差分。KExcelFile::diff で得る
+struct KExcelDiff {
+	bool empty() const {
+		return sheets.empty();
+	}
+	std::vector<KExcelSheetDiff> sheets; ///< 差分のあるシート。新しいブックのシート順に並び、削除されたシートは末尾に並ぶ
+};
+
+
 class KXlsxFile {
 public:
 	/// .XLSX ファイルをロードする
-	static bool loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result);
-	static bool loadFromFileName(const std::string &filename, std::vector<KDataGrid> &result);
-	static bool loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result);
+	/// params: ロード方法。nullptr ならデフォルト値を使う
+	static bool loadFromStream(KInputStream &file, const std::string &xlsx_name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params=nullptr);
+	static bool loadFromFileName(const std::string &filename, std::vector<KDataGrid> &result, const KXlsxLoadParams *params=nullptr);
+	static bool loadFromMemory(const void *bin, size_t size, const std::string &name, std::vector<KDataGrid> &result, const KXlsxLoadParams *params=nullptr);
+
+	/// .XLSX ファイルを読みながら、値の入っているセルを順番に cb に渡す。
+	/// ワークシートの DOM や KDataGrid を作らないため、巨大なシートでもメモリ使用量が増えない
+	/// params->num_threads は無視する。シートは常に呼び出し元のスレッドで順番に読み取る
+	static bool scanFromStream(KInputStream &file, const std::string &xlsx_name, KXlsxCallback *cb, const KXlsxLoadParams *params=nullptr);
 };
 
 
@@ -43,9 +275,10 @@ public:
 	std::string getFileName() const;
 
 	/// .XLSX ファイルをロードする
-	bool loadFromStream(KInputStream &file, const std::string &xlsx_name);
-	bool loadFromFileName(const std::string &name);
-	bool loadFromMemory(const void *bin, size_t size, const std::string &name);
+	/// params: ロード方法。nullptr ならデフォルト値を使う
+	bool loadFromStream(KInputStream &file, const std::string &xlsx_name, const KXlsxLoadParams *params=nullptr);
+	bool loadFromFileName(const std::string &name, const KXlsxLoadParams *params=nullptr);
+	bool loadFromMemory(const void *bin, size_t size, const std::string &name, const KXlsxLoadParams *params=nullptr);
 
 	/// シート数を返す
 	int getSheetCount() const;
@@ -74,10 +307,19 @@ public:
 
 	/// 文字列を完全一致で検索する。みつかったらセルの行列番号を row, col にセットして true を返す
 	/// 空文字列を検索することはできない。
+	/// シートの索引を使うので、2回目以降の検索ではセルを調べ直さない (KDataGrid::findCell)
 	/// col: 見つかったセルの列番号（ゼロ起算）
 	/// row: 見つかったセルの行番号（ゼロ起算）
 	bool getCellByText(int sheet, const std::string &s, int *col, int *row) const;
 
+	/// 全てのシートから文字列を完全一致で検索する。
+	/// シート番号の小さい順に調べ、最初に見つかったセルのシート番号と行列番号をセットして true を返す
+	/// ※遅延ロードした場合 (KXlsxLoadParams::lazy) は、見つかったシートまでの全てのシートを読み取って索引を作る。
+	///   見つからなければブック全体を読み取ることになり、読み取ったシートは unloadSheet() するまでメモリに残る。
+	///   探すシートが分かっている場合は getCellByText() を使うこと
+	/// sheet: 見つかったセルのシート番号（ゼロ起算）
+	bool getCellByTextInBook(const std::string &s, int *sheet, int *col, int *row) const;
+
 	/// 全てのセルを巡回する
 	/// sheet   : シート番号（ゼロ起算）
 	/// cb      : セル巡回時に呼ばれるコールバックオブジェクト
@@ -85,12 +327,56 @@ public:
 	
 	/// セル文字列を XML 形式でエクスポートする
 	std::string exportXmlString(bool with_header=true, bool with_comment=true);
+
+	/// セル文字列をテキスト形式でエクスポートする。
+	/// 値の入っているセルだけを行ごとに ", " 区切りで出力する。
+	/// 出力を一定量ずつ output に書き込むので、出力全体をメモリ上に保持しない
+	/// @see KExcelFormat_TEXT
+	bool exportText(KOutputStream &output);
 	std::string exportText();
 
+	/// 全てのシートを順番に writer に書き出す。
+	/// 全ての書き込みに成功すれば true を返す
+	bool exportTo(KExcelWriter *writer);
+
+	/// sheet 番目のシートだけを writer に書き出す。
+	/// シートごとに別のファイルに書き出す場合に使う
+	bool exportSheetTo(int sheet, KExcelWriter *writer);
+
+	/// old_file から new_file への変更点をセル単位で比較する。
+	/// シートは名前で対応付ける。行はハッシュ値 (KDataGrid::getRowHashes) で比べるので、
+	/// 変更されていない行はセルの文字列を取り出さずに読み飛ばし、移動しただけの行は KExcelSheetDiff::moved_rows に入る。
+	/// 遅延ロードしたブックの場合は、この時点で全てのシートを読み取る。
+	/// 差分があれば true を返す
+	static bool diff(const KExcelFile &old_file, const KExcelFile &new_file, KExcelDiff *result);
+
+	/// 二つのシートの変更点をセル単位で比較する。
+	/// result の name, old_sheet, new_sheet は変更しない。差分があれば true を返す
+	static bool diffSheet(const KDataGrid &old_sheet, const KDataGrid &new_sheet, KExcelSheetDiff *result);
+
+	/// シートを得る。
+	/// 遅延ロードした場合 (KXlsxLoadParams::lazy) は、この時点でシートを読み取る。
+	/// getSheets() は全てのシートを読み取る
 	const std::vector<KDataGrid> & getSheets() const;
 	const KDataGrid & getSheet(int i) const;
 	const KDataGrid * findSheet(const std::string &name) const;
 
+	/// シートの中身を読み取り済みなら true を返す
+	bool isSheetLoaded(int sheet) const;
+
+	/// 遅延ロードした場合、シートの中身をまだ読み取っていなければここで読み取る。
+	/// シートが壊れていて読み取りに失敗した場合は false を返す（シートは読み取れた所までの内容になる）。
+	/// 遅延ロードしていない場合は、ロード時に全てのシートを読み取り済みなので常に true を返す。
+	/// exportTo() や exportSheetTo() は、読み取りに失敗したシートがあれば false を返す
+	bool loadSheet(int sheet) const;
+
+	/// 遅延ロードした場合、読み取り済みのシートの中身を破棄してメモリを解放する。
+	/// 次にアクセスしたときに改めて読み取る。
+	/// 共有文字列テーブルは他のシートを読み取るときにも使うので、clear() するまで解放しない。
+	/// 遅延ロードしていない場合は何もしない
+	/// ※破棄したシートについて、以前に getSheet() などで得たポインタや参照は無効になる
+	void unloadSheet(int sheet);
+
 private:
 #if 0
 	std::shared_ptr<CCoreExcelReader> m_Impl;
@@ -92,7 +92,7 @@ void KCorePng__write_cb(void *context, void *data, int size) {
 bool KCorePng::readsize(KInputStream &file, int *w, int *h) {
 	const int SIZE = 24;
 	char buf[SIZE] = {0};
-	int pos = file.tell();
+	int64_t pos = file.tell();
 	bool ret = false;
 	if (file.read(buf, SIZE) == SIZE) {
 		if (readsize(buf, SIZE, w, h)) {
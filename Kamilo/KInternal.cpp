@@ -271,7 +271,7 @@ void K::print2(const char *file_u8, int line, const char *fmt_u8, ...) {
 
 
 void K::print(const char *fmt_u8, ...) {
-	static int s_RecursiveGuard = 0; // 再帰呼び出し防止
+	static thread_local int s_RecursiveGuard = 0; // 再帰呼び出し防止。別のスレッドからの呼び出しは再帰ではないのでスレッドごとに持つ
 	char u8[OUTPUT_STRING_SIZE] = {0};
 	K__vsprintf__va_args(u8, sizeof(u8), fmt_u8);
 
@@ -285,7 +285,7 @@ void K::print(const char *fmt_u8, ...) {
 	}
 }
 void K::printW(const wchar_t *wfmt, ...) {
-	static int s_RecursiveGuard = 0; // 再帰呼び出し防止
+	static thread_local int s_RecursiveGuard = 0; // 再帰呼び出し防止。別のスレッドからの呼び出しは再帰ではないのでスレッドごとに持つ
 
 	wchar_t ws[OUTPUT_STRING_SIZE] = {0};
 	va_list args;
@@ -588,6 +588,25 @@ bool K::fileGetTimeStamp(const std::string &path_u8, time_t *out_time_cma) {
 	return false;
 }
 
+/// パスで指定されたファイルのバイト数と最終更新日時を得る。
+/// ファイルを開かずに調べるため、fileGetSize と fileGetTimeStamp を続けて呼ぶより速い。
+/// ファイルが存在しない場合やディレクトリの場合は false を返す
+bool K::fileGetSizeAndTime(const std::string &path_u8, int64_t *out_size, time_t *out_mtime) {
+	std::wstring wpath = _ToWin32PathW(path_u8);
+	//
+	// ファイルを開かず、ディレクトリエントリの情報だけを読む
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExW(wpath.c_str(), GetFileExInfoStandard, &data)) {
+		return false;
+	}
+	if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		return false;
+	}
+	if (out_size) *out_size = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	if (out_mtime) *out_mtime = _FILETIME_to_timet(&data.ftLastWriteTime);
+	return true;
+}
+
 static std::vector<std::wstring> _FileGetListW(const wchar_t *wdir, bool dir_only) {
 	// 検索パターンを作成
 	wchar_t wpattern[MAX_PATH] = {0};
@@ -203,6 +203,7 @@ public:
 	static time_t fileGetTimeStamp_Creation(const std::string &path_u8) { time_t cma[3]; fileGetTimeStamp(path_u8, cma); return cma[0]; }
 	static time_t fileGetTimeStamp_Modify(const std::string &path_u8)   { time_t cma[3]; fileGetTimeStamp(path_u8, cma); return cma[1]; }
 	static time_t fileGetTimeStamp_Access(const std::string &path_u8)   { time_t cma[3]; fileGetTimeStamp(path_u8, cma); return cma[2]; }
+	static bool fileGetSizeAndTime(const std::string &path_u8, int64_t *out_size, time_t *out_mtime); ///< ファイルのバイト数と最終更新日時を得る。ファイルを開かずに調べるので速い。2GB を超えるファイルにも使える
 	static bool fileCopy(const std::string &src_u8, const std::string &dst_u8, bool overwrite); ///< ファイルをコピーする
 	static bool fileMakeDir(const std::string &dir_u8); ///< ディレクトリを作成する
 	static bool fileRemove(const std::string &path_u8); ///< ファイルを削除する
@@ -63,11 +63,19 @@ public:
 		} else {
 			// 圧縮データ
 			std::string zbuf = KZlib::compress_zlib(data, size, PAC_COMPRESS_LEVEL);
-			m_Output.writeUint32(0); // Hash
-			m_Output.writeUint32(size); // 元データサイズ
-			m_Output.writeUint32(zbuf.size()); // pacファイル内でのデータサイズ
-			m_Output.writeUint32(0); // Flags
-			m_Output.write(zbuf.data(), zbuf.size());
+			uint32_t hdr[4];
+			hdr[0] = 0; // Hash
+			hdr[1] = (uint32_t)size; // 元データサイズ
+			hdr[2] = (uint32_t)zbuf.size(); // pacファイル内でのデータサイズ
+			hdr[3] = 0; // Flags
+			KOutputSpan spans[] = {
+				{hdr, (int)sizeof(hdr)},
+				{zbuf.data(), (int)zbuf.size()},
+			};
+			if (m_Output.writeSpans(spans, 2) != spans[0].size + spans[1].size) {
+				K__ERROR("Failed to write pac entry");
+				return false;
+			}
 		}
 		return true;
 	}
@@ -77,8 +85,8 @@ KPacFileWriter::KPacFileWriter() {
 	m_Impl = nullptr;
 }
 KPacFileWriter KPacFileWriter::fromFileName(const std::string &filename) {
-	KOutputStream file;
-	file.openFileName(filename);
+	// エントリーごとに小さな書き込みが続くので、まとめて書き込む
+	KOutputStream file = KOutputStream::fromFileNameBuffered(filename);
 	return fromStream(file);
 }
 KPacFileWriter KPacFileWriter::fromStream(KOutputStream &output) {
@@ -145,8 +145,17 @@ KArchive * KArchive::createFolderReader(const std::string &dir) {
 
 
 #pragma region CZipArchive
+// ASCII 文字だけで構成されているか？
+static bool _IsAscii(const std::string &s) {
+	for (size_t i=0; i<s.size(); i++) {
+		if ((unsigned char)s[i] >= 0x80) return false;
+	}
+	return true;
+}
+
 class CZipArchive: public KArchive {
 	std::unordered_map<std::string, std::string> m_Cache;
+	std::unordered_map<std::string, int> m_AnsiNames; // UTF8 以外で記録されているファイル名を UTF8 に変換したものからインデックスを得る
 	KUnzipper m_Unzipper;
 	std::string m_Password;
 	std::string m_TmpString;
@@ -158,6 +167,20 @@ public:
 			return;
 		}
 		m_Password = password;
+
+		// UTF8 以外で記録されているファイル名は、ここで一度だけ UTF8 に変換して索引を作る。
+		// UTF8 または ASCII だけのファイル名は KUnzipper::findEntry でそのまま探せる
+		for (int i=0; i<m_Unzipper.getEntryCount(); i++) {
+			if (m_Unzipper.getEntryParamInt(i, KUnzipper::WITH_UTF8)) {
+				continue;
+			}
+			std::string rawname;
+			m_Unzipper.getEntryName(i, &rawname);
+			if (_IsAscii(rawname)) {
+				continue;
+			}
+			m_AnsiNames.emplace(K::strAnsiToUtf8(rawname, ""), i);
+		}
 	}
 	virtual bool contains(const std::string &filename) override {
 		KInputStream r = createFileReader(filename);
@@ -165,15 +188,11 @@ public:
 	}
 	virtual KInputStream createFileReader(const std::string &filename) override {
 		if (m_Cache.find(filename) == m_Cache.end()) {
-			KInputStream file;
-			for (int i=0; i<m_Unzipper.getEntryCount(); i++) {
-				const char *s = getFileName(i);
-				if (K::pathCompare(s, filename, false, false) == 0) {
-					std::string bin;
-					m_Unzipper.getEntryData(i, m_Password.c_str(), &bin);
-					m_Cache[filename] = bin;
-					break;
-				}
+			int i = findEntry(filename);
+			if (i >= 0) {
+				std::string bin;
+				m_Unzipper.getEntryData(i, m_Password.c_str(), &bin);
+				m_Cache[filename] = bin;
 			}
 		}
 
@@ -187,6 +206,13 @@ public:
 	virtual int getFileCount() override {
 		return m_Unzipper.getEntryCount();
 	}
+	int findEntry(const std::string &filename) const {
+		auto it = m_AnsiNames.find(filename);
+		if (it != m_AnsiNames.end()) {
+			return it->second;
+		}
+		return m_Unzipper.findEntry(filename);
+	}
 	virtual const char * getFileName(int index) override {
 		std::string rawname;
 		m_Unzipper.getEntryName(index, &rawname);
@@ -1,8 +1,40 @@
 ﻿#include "KStream.h"
 #include "KInternal.h"
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h> // CreateFileMappingW, MapViewOfFile
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 namespace Kamilo {
 
 
+// 2GB を超えるファイルでも正しく動作する ftell, fseek
+static int64_t _FileTell(FILE *fp) {
+	#ifdef _WIN32
+	return _ftelli64(fp);
+	#else
+	return (int64_t)ftello(fp);
+	#endif
+}
+static int _FileSeek(FILE *fp, int64_t pos, int origin) {
+	#ifdef _WIN32
+	return _fseeki64(fp, pos, origin);
+	#else
+	return fseeko(fp, (off_t)pos, origin);
+	#endif
+}
+
+
 class CFileReadImpl: public KInputStream::Impl {
 public:
 	FILE *m_File;
@@ -17,24 +49,24 @@ public:
 			fclose(m_File);
 		}
 	}
-	virtual int tell() override {
-		return ftell(m_File);
+	virtual int64_t tell() override {
+		return _FileTell(m_File);
 	}
 	virtual int read(void *data, int size) override {
 		if (data) {
 			return fread(data, 1, size, m_File);
 		} else {
-			return fseek(m_File, size, SEEK_CUR);
+			return _FileSeek(m_File, size, SEEK_CUR);
 		}
 	}
-	virtual void seek(int pos) override {
-		fseek(m_File, pos, SEEK_SET);
+	virtual void seek(int64_t pos) override {
+		_FileSeek(m_File, pos, SEEK_SET);
 	}
-	virtual int size() {
-		int i=ftell(m_File);
-		fseek(m_File, 0, SEEK_END);
-		int n=ftell(m_File);
-		fseek(m_File, i, SEEK_SET);
+	virtual int64_t size() override {
+		int64_t i=_FileTell(m_File);
+		_FileSeek(m_File, 0, SEEK_END);
+		int64_t n=_FileTell(m_File);
+		_FileSeek(m_File, i, SEEK_SET);
 		return n; 
 	}
 	virtual bool eof() override {
@@ -62,24 +94,30 @@ public:
 		m_Name = name;
 	}
 	virtual ~CFileWriteImpl() {
-		if (m_File) {
-			fclose(m_File);
+		if (!close()) {
+			K__ERROR("Failed to close file: %s", m_Name.c_str()); // 戻り値を確認できないので、ここで知らせる
 		}
 	}
-	virtual int tell() override {
-		return ftell(m_File);
+	virtual int64_t tell() override {
+		return _FileTell(m_File);
 	}
 	virtual int write(const void *data, int size) override {
 		return fwrite(data, 1, size, m_File);
 	}
-	virtual void seek(int pos) override {
-		fseek(m_File, pos, SEEK_SET);
+	virtual void seek(int64_t pos) override {
+		_FileSeek(m_File, pos, SEEK_SET);
 	}
-	virtual void close() override {
+	virtual bool flush() override {
+		return m_File && fflush(m_File) == 0;
+	}
+	virtual bool close() override {
+		bool ok = true;
 		if (m_File) {
-			fclose(m_File);
+			// fclose はライブラリのバッファに残っている内容を書き込むので、ここで初めて書き込みに失敗することがある
+			ok = fclose(m_File) == 0;
 			m_File = nullptr;
 		}
+		return ok;
 	}
 	virtual bool isOpen() override {
 		return m_File != nullptr;
@@ -87,13 +125,185 @@ public:
 };
 
 
+// 書き込みバッファ付きの出力。
+// 書き込んだ内容を block_size バイトずつまとめて m_Inner に書き込む。
+// async の場合は書き込み用のスレッドを作り、二つのバッファを交互に使う
+class CBufferedWriteImpl: public KOutputStream::Impl {
+	std::shared_ptr<KOutputStream::Impl> m_Inner;
+	size_t m_BlockSize;
+	std::vector<char> m_Front; // 書き込んだ内容をためているバッファ
+	size_t m_FrontLen;
+	int64_t m_InnerPos; // m_Front の先頭に対応する m_Inner 上の位置
+	std::atomic<bool> m_Failed;
+	bool m_Closed;
+
+	// async の場合だけ使う
+	bool m_Async;
+	std::vector<char> m_Back; // 書き込み用のスレッドが m_Inner に書き込んでいるバッファ
+	size_t m_BackLen;
+	bool m_Pending; // m_Back の書き込みが終わっていない
+	bool m_Quit;
+	std::thread m_Thread;
+	std::mutex m_Mutex;
+	std::condition_variable m_Cond;
+public:
+	CBufferedWriteImpl(const std::shared_ptr<KOutputStream::Impl> &inner, const KOutputBufferParams &params) {
+		m_Inner = inner;
+		m_BlockSize = (size_t)std::max(params.block_size, 4096);
+		m_Front.resize(m_BlockSize);
+		m_FrontLen = 0;
+		m_InnerPos = m_Inner->tell();
+		m_Failed = false;
+		m_Closed = false;
+		m_Async = params.async;
+		m_BackLen = 0;
+		m_Pending = false;
+		m_Quit = false;
+		if (m_Async) {
+			m_Back.resize(m_BlockSize);
+			m_Thread = std::thread(&CBufferedWriteImpl::threadMain, this);
+		}
+	}
+	virtual ~CBufferedWriteImpl() {
+		if (!m_Closed && !close()) {
+			K__ERROR("Failed to write buffered output"); // 戻り値を確認できないので、ここで知らせる
+		}
+	}
+	virtual int64_t tell() override {
+		return m_InnerPos + (int64_t)m_FrontLen;
+	}
+	virtual int write(const void *data, int size) override {
+		if (m_Closed || m_Failed || size <= 0) return 0;
+		const char *p = (const char *)data;
+		size_t n = (size_t)size;
+		if (!m_Async && n >= m_BlockSize) {
+			// バッファより大きな書き込みは、たまっている分を書き込んでから直接書き込む
+			// （async ではバッファに分けてコピーし、書き込み用のスレッドに任せる）
+			submit();
+			writeInner(p, n);
+			m_InnerPos += n;
+			return m_Failed ? 0 : size;
+		}
+		while (n > 0) {
+			size_t k = std::min(n, m_BlockSize - m_FrontLen);
+			memcpy(m_Front.data() + m_FrontLen, p, k);
+			m_FrontLen += k;
+			p += k;
+			n -= k;
+			if (m_FrontLen == m_BlockSize) {
+				submit();
+			}
+		}
+		return size;
+	}
+	virtual int writeSpans(const KOutputSpan *spans, int count) override {
+		if (m_Closed || m_Failed) return 0;
+		int total = 0;
+		for (int i=0; i<count; i++) {
+			total += std::max(spans[i].size, 0);
+		}
+		if (!m_Async && (size_t)total >= m_BlockSize) {
+			// 合計がバッファより大きければ、たまっている分を書き込んでから全ての断片をまとめて m_Inner に渡す
+			submit();
+			if (m_Inner->writeSpans(spans, count) != total) {
+				m_Failed = true;
+			}
+			m_InnerPos += total;
+			return m_Failed ? 0 : total;
+		}
+		// 小さな断片はバッファに続けてコピーする
+		int n = 0;
+		for (int i=0; i<count; i++) {
+			n += write(spans[i].data, spans[i].size);
+		}
+		return n;
+	}
+	virtual void seek(int64_t pos) override {
+		if (m_Closed) return;
+		flush();
+		m_Inner->seek(pos);
+		m_InnerPos = m_Inner->tell();
+	}
+	virtual bool flush() override {
+		if (m_Closed) return !m_Failed;
+		submit();
+		waitPending();
+		// m_Inner 側のバッファ (FILE * など) に残っている内容も書き込む
+		if (!m_Failed && !m_Inner->flush()) {
+			m_Failed = true;
+		}
+		return !m_Failed;
+	}
+	virtual bool close() override {
+		if (m_Closed) return !m_Failed;
+		flush();
+		if (m_Async) {
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Quit = true;
+			}
+			m_Cond.notify_all();
+			m_Thread.join();
+		}
+		if (!m_Inner->close()) {
+			m_Failed = true;
+		}
+		m_Closed = true;
+		return !m_Failed;
+	}
+	virtual bool isOpen() override {
+		return !m_Closed && m_Inner->isOpen();
+	}
+private:
+	void writeInner(const char *data, size_t size) {
+		if (size > 0 && m_Inner->write(data, (int)size) != (int)size) {
+			m_Failed = true;
+		}
+	}
+	// たまっている内容を書き込む。async の場合は書き込み用のスレッドに渡す
+	void submit() {
+		if (m_FrontLen == 0) return;
+		if (m_Async) {
+			waitPending();
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Front.swap(m_Back);
+			m_BackLen = m_FrontLen;
+			m_Pending = true;
+			m_Cond.notify_all();
+		} else {
+			writeInner(m_Front.data(), m_FrontLen);
+		}
+		m_InnerPos += m_FrontLen;
+		m_FrontLen = 0;
+	}
+	// 書き込み用のスレッドが m_Back を書き終えるまで待つ
+	void waitPending() {
+		if (!m_Async) return;
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Cond.wait(lock, [this]() { return !m_Pending; });
+	}
+	void threadMain() {
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		while (1) {
+			m_Cond.wait(lock, [this]() { return m_Pending || m_Quit; });
+			if (!m_Pending) break; // m_Quit
+			lock.unlock();
+			writeInner(m_Back.data(), m_BackLen);
+			lock.lock();
+			m_Pending = false;
+			m_Cond.notify_all();
+		}
+	}
+};
+
+
 class CMemoryReadImpl: public KInputStream::Impl {
 	void *m_Ptr;
-	int m_Size;
-	int m_Pos;
+	int64_t m_Size;
+	int64_t m_Pos;
 	bool m_IsCopy;
 public:
-	CMemoryReadImpl(const void *p, int size, bool copy) {
+	CMemoryReadImpl(const void *p, int64_t size, bool copy) {
 		if (copy) {
 			m_Ptr = malloc(size);
 			memcpy(m_Ptr, p, size);
@@ -110,7 +320,7 @@ public:
 			free(m_Ptr);
 		}
 	}
-	virtual int tell() override {
+	virtual int64_t tell() override {
 		return m_Pos;
 	}
 	virtual int read(void *data, int size) override {
@@ -119,7 +329,7 @@ public:
 		if (m_Pos + size <= m_Size) {
 			n = size;
 		} else if (m_Pos < m_Size) {
-			n = m_Size - m_Pos;
+			n = (int)(m_Size - m_Pos);
 		}
 		if (n > 0) {
 			if (data) memcpy(data, (uint8_t*)m_Ptr + m_Pos, n); // data=nullptr だと単なるシークになる
@@ -128,7 +338,7 @@ public:
 		}
 		return 0;
 	}
-	virtual void seek(int pos) override {
+	virtual void seek(int64_t pos) override {
 		if (pos < 0) {
 			m_Pos = 0;
 		} else if (pos < m_Size) {
@@ -137,7 +347,7 @@ public:
 			m_Pos = m_Size;
 		}
 	}
-	virtual int size() override {
+	virtual int64_t size() override {
 		return m_Size;
 	}
 	virtual bool eof() override {
@@ -152,19 +362,125 @@ public:
 	virtual bool isOpen() override {
 		return m_Ptr != nullptr;
 	}
+	virtual const void * data() override {
+		return m_Ptr;
+	}
+};
+
+
+// ファイルをメモリにマップして読み取る。
+// 読み取りは CMemoryReadImpl と同じで、マップした範囲を直接参照する
+class CFileMappedReadImpl: public CMemoryReadImpl {
+public:
+	struct MAPPING {
+		void *ptr;
+		size_t size;
+	#ifdef _WIN32
+		HANDLE file;
+		HANDLE mapping;
+	#endif
+	};
+
+	// ファイル全体を読み取り専用でマップする。
+	// 空のファイルと、アドレス空間に収まらない大きさのファイルはマップしない
+	static bool map(const std::string &filename, MAPPING *out) {
+		K__ASSERT(out);
+		#ifdef _WIN32
+		{
+			std::wstring wname = K::strUtf8ToWide(filename);
+			HANDLE file = ::CreateFileW(wname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size;
+			if (!::GetFileSizeEx(file, &size) || size.QuadPart <= 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+				::CloseHandle(file);
+				return false;
+			}
+			HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping == nullptr) {
+				::CloseHandle(file);
+				return false;
+			}
+			void *ptr = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (ptr == nullptr) {
+				::CloseHandle(mapping);
+				::CloseHandle(file);
+				return false;
+			}
+			out->ptr = ptr;
+			out->size = (size_t)size.QuadPart;
+			out->file = file;
+			out->mapping = mapping;
+			return true;
+		}
+		#else
+		{
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (::fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+				::close(fd);
+				return false;
+			}
+			void *ptr = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd); // マップした範囲はファイルを閉じても有効
+			if (ptr == MAP_FAILED) {
+				return false;
+			}
+			out->ptr = ptr;
+			out->size = (size_t)st.st_size;
+			return true;
+		}
+		#endif
+	}
+	static void unmap(MAPPING &m) {
+		if (m.ptr == nullptr) {
+			return;
+		}
+		#ifdef _WIN32
+		{
+			::UnmapViewOfFile(m.ptr);
+			::CloseHandle(m.mapping);
+			::CloseHandle(m.file);
+		}
+		#else
+		{
+			::munmap(m.ptr, m.size);
+		}
+		#endif
+		m.ptr = nullptr;
+		m.size = 0;
+	}
+
+	explicit CFileMappedReadImpl(const MAPPING &m): CMemoryReadImpl(m.ptr, (int64_t)m.size, false) {
+		m_Mapping = m;
+	}
+	virtual ~CFileMappedReadImpl() {
+		unmap(m_Mapping);
+	}
+	virtual void close() override {
+		CMemoryReadImpl::close();
+		unmap(m_Mapping);
+	}
+
+private:
+	MAPPING m_Mapping;
 };
 
 
 class CMemoryWriteImpl: public KOutputStream::Impl {
 	std::string *m_Buf;
-	int m_Pos;
+	size_t m_Pos;
 public:
 	explicit CMemoryWriteImpl(std::string *dest) {
 		m_Buf = dest;
 		m_Pos = 0;
 	}
-	virtual int tell() override {
-		return m_Pos;
+	virtual int64_t tell() override {
+		return (int64_t)m_Pos;
 	}
 	virtual int write(const void *data, int size) {
 		if (m_Buf == nullptr) return 0;
@@ -173,19 +489,20 @@ public:
 		m_Pos += size;
 		return size;
 	}
-	virtual void seek(int pos) override {
+	virtual void seek(int64_t pos) override {
 		if (m_Buf == nullptr) return;
 		if (pos < 0) {
 			m_Pos = 0;
-		} else if (pos < (int)m_Buf->size()) {
-			m_Pos = pos;
+		} else if ((uint64_t)pos < m_Buf->size()) {
+			m_Pos = (size_t)pos;
 		} else {
 			m_Pos = m_Buf->size();
 		}
 	}
-	virtual void close() override {
+	virtual bool close() override {
 		m_Buf = nullptr;
 		m_Pos = 0;
+		return true;
 	}
 	virtual bool isOpen() override {
 		return m_Buf != nullptr;
@@ -202,6 +519,13 @@ KInputStream KInputStream::fromFileName(const std::string &filename) {
 	}
 	return KInputStream(impl);
 }
+KInputStream KInputStream::fromFileNameMapped(const std::string &filename) {
+	CFileMappedReadImpl::MAPPING m;
+	if (CFileMappedReadImpl::map(filename, &m)) {
+		return KInputStream(new CFileMappedReadImpl(m));
+	}
+	return fromFileName(filename);
+}
 KInputStream KInputStream::fromMemory(const void *data, int size) {
 	Impl *impl = nullptr;
 	if (data && size > 0) {
@@ -254,6 +578,18 @@ bool KInputStream::openFileName(const std::string &filename) {
 	}
 	return false;
 }
+bool KInputStream::openFileNameMapped(const std::string &filename) {
+	close();
+
+	CFileMappedReadImpl::MAPPING m;
+	if (CFileMappedReadImpl::map(filename, &m)) {
+		Impl *impl = new CFileMappedReadImpl(m);
+		if (_open(impl)) {
+			return true;
+		}
+	}
+	return openFileName(filename);
+}
 bool KInputStream::openMemory(const void *data, int size) {
 	close();
 
@@ -276,7 +612,7 @@ bool KInputStream::openMemoryCopy(const void *data, int size) {
 	}
 	return false;
 }
-int KInputStream::tell() {
+int64_t KInputStream::tell() {
 	if (m_Impl) {
 		return m_Impl->tell();
 	}
@@ -288,12 +624,12 @@ int KInputStream::read(void *data, int size) {
 	}
 	return 0;
 }
-void KInputStream::seek(int pos) {
+void KInputStream::seek(int64_t pos) {
 	if (m_Impl) {
 		m_Impl->seek(pos);
 	}
 }
-int KInputStream::size() {
+int64_t KInputStream::size() {
 	if (m_Impl) {
 		return m_Impl->size();
 	}
@@ -311,6 +647,12 @@ void KInputStream::close() {
 bool KInputStream::isOpen() {
 	return m_Impl && m_Impl->isOpen();
 }
+const void * KInputStream::data() {
+	if (m_Impl) {
+		return m_Impl->data();
+	}
+	return nullptr;
+}
 uint16_t KInputStream::readUint16() {
 	const int size = 2;
 	uint16_t val = 0;
@@ -327,9 +669,22 @@ uint32_t KInputStream::readUint32() {
 	}
 	return 0;
 }
+uint64_t KInputStream::readUint64() {
+	const int size = 8;
+	uint64_t val = 0;
+	if (read(&val, size) == size) {
+		return val;
+	}
+	return 0;
+}
 std::string KInputStream::readBin(int readsize) {
 	if (readsize < 0) {
-		readsize = size(); // 現在位置から終端までのサイズ
+		int64_t n = size() - tell(); // 現在位置から終端までのサイズ
+		if (n > INT_MAX) {
+			K__ERROR("Too large to read at once");
+			return std::string();
+		}
+		readsize = (int)n;
 	}
 	if (readsize > 0) {
 		std::string bin(readsize, '\0');
@@ -355,6 +710,21 @@ KOutputStream KOutputStream::fromMemory(std::string *dest) {
 	Impl *impl = new CMemoryWriteImpl(dest); // No copy
 	return KOutputStream(impl);
 }
+KOutputStream KOutputStream::fromFileNameBuffered(const std::string &filename, const KOutputBufferParams *params, const char *mode) {
+	KOutputStream file = fromFileName(filename, mode);
+	if (!file.isOpen()) {
+		return file;
+	}
+	return fromStreamBuffered(file, params);
+}
+KOutputStream KOutputStream::fromStreamBuffered(KOutputStream &output, const KOutputBufferParams *params) {
+	if (output.m_Impl == nullptr) {
+		return KOutputStream();
+	}
+	KOutputBufferParams def;
+	if (params == nullptr) params = &def;
+	return KOutputStream(new CBufferedWriteImpl(output.m_Impl, *params));
+}
 
 KOutputStream::KOutputStream() {
 	m_Impl = nullptr;
@@ -404,22 +774,24 @@ bool KOutputStream::openMemory(std::string *dest) {
 	}
 	return false;
 }
-void KOutputStream::close() {
+bool KOutputStream::close() {
+	bool ok = true;
 	if (m_Impl) {
-		m_Impl->close();
+		ok = m_Impl->close();
 		m_Impl = nullptr;
 	}
+	return ok;
 }
 bool KOutputStream::isOpen() {
 	return m_Impl && m_Impl->isOpen();
 }
-int KOutputStream::tell() {
+int64_t KOutputStream::tell() {
 	if (m_Impl) {
 		return m_Impl->tell();
 	}
 	return 0;
 }
-void KOutputStream::seek(int pos) {
+void KOutputStream::seek(int64_t pos) {
 	if (m_Impl) {
 		m_Impl->seek(pos);
 	}
@@ -430,12 +802,27 @@ int KOutputStream::write(const void *data, int size) {
 	}
 	return 0;
 }
+int KOutputStream::writeSpans(const KOutputSpan *spans, int count) {
+	if (m_Impl) {
+		return m_Impl->writeSpans(spans, count);
+	}
+	return 0;
+}
+bool KOutputStream::flush() {
+	if (m_Impl) {
+		return m_Impl->flush();
+	}
+	return false;
+}
 int KOutputStream::writeUint16(uint16_t value) {
 	return write(&value, sizeof(value));
 }
 int KOutputStream::writeUint32(uint32_t value) {
 	return write(&value, sizeof(value));
 }
+int KOutputStream::writeUint64(uint64_t value) {
+	return write(&value, sizeof(value));
+}
 int KOutputStream::writeString(const std::string &s) {
 	if (s.empty()) {
 		return 0;
@@ -478,6 +865,32 @@ void Test_stream() {
 		K__ASSERT(w.write("def", 3) == 3);
 		K__ASSERT(s.compare("abc def") == 0);
 	}
+	for (int async=0; async<2; async++) {
+		// 書き込みバッファ付き。バッファをまたぐ書き込みと、バッファより大きな書き込みを確認する
+		std::string s;
+		KOutputStream mem = KOutputStream::fromMemory(&s);
+		KOutputBufferParams params;
+		params.block_size = 4096;
+		params.async = async != 0;
+		KOutputStream w = KOutputStream::fromStreamBuffered(mem, &params);
+		std::string expected;
+		for (int i=0; i<1000; i++) {
+			std::string line = K::str_sprintf("line %d\n", i);
+			KOutputSpan spans[] = {{"[", 1}, {line.data(), (int)line.size()}};
+			K__VERIFY(w.writeSpans(spans, 2) == 1 + (int)line.size());
+			expected += "[" + line;
+		}
+		std::string big(10000, 'x');
+		K__VERIFY(w.write(big.data(), (int)big.size()) == (int)big.size());
+		expected += big;
+		KOutputSpan bigspans[] = {{"<", 1}, {big.data(), (int)big.size()}, {">", 1}};
+		K__VERIFY(w.writeSpans(bigspans, 3) == 2 + (int)big.size());
+		expected += "<" + big + ">";
+		K__VERIFY(w.tell() == (int64_t)expected.size());
+		K__VERIFY(w.flush());
+		K__VERIFY(s == expected);
+		w.close();
+	}
 }
 
 } // namespace Test
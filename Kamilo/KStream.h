@@ -8,6 +8,11 @@ namespace Kamilo {
 class KInputStream {
 public:
 	static KInputStream fromFileName(const std::string &filename);
+
+	/// ファイルをメモリにマップして開く。
+	/// ファイルの内容を読み取りバッファにコピーしないため、data() で内容を直接参照できる。
+	/// マップできない場合（空のファイルや、アドレス空間に収まらないファイルなど）は fromFileName と同じ方法で開く
+	static KInputStream fromFileNameMapped(const std::string &filename);
 	static KInputStream fromMemory(const void *data, int size);
 	static KInputStream fromMemoryCopy(const void *data, int size);
 
@@ -15,12 +20,13 @@ public:
 	public:
 		virtual ~Impl() {}
 		virtual int read(void *buf, int size) = 0;
-		virtual int tell() = 0;
-		virtual int size() = 0;
-		virtual void seek(int pos) = 0;
+		virtual int64_t tell() = 0;
+		virtual int64_t size() = 0;
+		virtual void seek(int64_t pos) = 0;
 		virtual bool eof() = 0;
 		virtual void close() = 0;
 		virtual bool isOpen() = 0;
+		virtual const void * data() { return nullptr; }
 	};
 
 	KInputStream();
@@ -29,18 +35,20 @@ public:
 
 	bool _open(Impl *impl);
 	bool openFileName(const std::string &filename);
+	bool openFileNameMapped(const std::string &filename);
 	bool openMemory(const void *data, int size);
 	bool openMemoryCopy(const void *data, int size);
 
-	/// 読み取り位置。先頭からのオフセットバイト数
-	int tell();
+	/// 読み取り位置。先頭からのオフセットバイト数。
+	/// 2GB を超えるファイルも扱えるよう、位置とサイズは 64 ビットで表す
+	int64_t tell();
 	
 	/// 読み取り位置を設定する。先頭からのオフセットバイト数で指定する
 	/// 0 <= pos <= size()
-	void seek(int pos);
+	void seek(int64_t pos);
 
 	/// 先頭から末尾までのバイト数
-	int size();
+	int64_t size();
 
 	/// sizeバイトを読み取って data にコピーする。
 	/// data が NULLの場合は単なるシークになる
@@ -48,11 +56,17 @@ public:
 
 	uint16_t readUint16();
 	uint32_t readUint32();
+	uint64_t readUint64();
 	std::string readBin(int readsize=-1);
 
 	/// アクセス可能な範囲の終端に達しているか
 	bool eof();
 
+	/// 先頭から末尾までの内容が連続したメモリ上にある場合（メモリから開いた場合、ファイルをマップした場合）、
+	/// その先頭アドレスを返す。そうでなければ nullptr を返す。
+	/// 得られたポインタは、このストリームを閉じるまで有効。読み取り位置には影響しない
+	const void * data();
+
 	void close();
 	bool isOpen();
 
@@ -60,19 +74,59 @@ private:
 	std::shared_ptr<Impl> m_Impl;
 };
 
+/// KOutputStream::fromFileNameBuffered の書き込み方法
+struct KOutputBufferParams {
+	KOutputBufferParams() {
+		block_size = 1024 * 1024;
+		async = false;
+	}
+
+	/// 書き込みバッファのバイト数。
+	/// 書き込んだ内容はバッファが一杯になるまでためておき、一度にまとめてファイルに書き込む
+	int block_size;
+
+	/// ファイルへの書き込みを専用のスレッドで行う。
+	/// バッファを二つ用意して交互に使い、一方をファイルに書き込んでいる間にもう一方へ次の内容をためる。
+	/// 書き込みの失敗は後から分かるので、最後に flush() の戻り値を確認すること
+	bool async;
+};
+
+/// KOutputStream::writeSpans で書き込む内容の一片
+struct KOutputSpan {
+	const void *data;
+	int size;
+};
+
 class KOutputStream {
 public:
 	static KOutputStream fromFileName(const std::string &filename, const char *mode="wb");
 	static KOutputStream fromMemory(std::string *dest);
 
+	/// 書き込みバッファを使ってファイルを開く。
+	/// 小さな書き込みを何度も繰り返しても、ファイルへは params->block_size バイトずつまとめて書き込む。
+	/// params: 書き込み方法。nullptr ならデフォルト値を使う
+	static KOutputStream fromFileNameBuffered(const std::string &filename, const KOutputBufferParams *params=nullptr, const char *mode="wb");
+
+	/// output への書き込みに書き込みバッファを付けたストリームを返す。
+	/// 返したストリームを閉じると output も閉じる
+	static KOutputStream fromStreamBuffered(KOutputStream &output, const KOutputBufferParams *params=nullptr);
+
 	class Impl {
 	public:
 		virtual ~Impl() {}
 		virtual int write(const void *buf, int size) = 0;
-		virtual int tell() = 0;
-		virtual void seek(int pos) = 0;
-		virtual void close() = 0;
+		virtual int64_t tell() = 0;
+		virtual void seek(int64_t pos) = 0;
+		virtual bool close() = 0; // 閉じる。閉じるときの書き込みも含めて、それまでの書き込みが全て成功していれば true
 		virtual bool isOpen() = 0;
+		virtual int writeSpans(const KOutputSpan *spans, int count) {
+			int total = 0;
+			for (int i=0; i<count; i++) {
+				total += write(spans[i].data, spans[i].size);
+			}
+			return total;
+		}
+		virtual bool flush() { return true; }
 	};
 
 	KOutputStream();
@@ -82,27 +136,41 @@ public:
 	bool openFileName(const std::string &filename, const char *mode="wb");
 	bool openMemory(std::string *dest);
 
-	/// 読み取り位置。先頭からのオフセットバイト数
-	int tell();
+	/// 書き込み位置。先頭からのオフセットバイト数
+	int64_t tell();
 
-	/// 読み取り位置を設定する。先頭からのオフセットバイト数で指定する
+	/// 書き込み位置を設定する。先頭からのオフセットバイト数で指定する
 	/// 0 <= pos <= size()
-	void seek(int pos);
+	void seek(int64_t pos);
 
 	/// 現在の書き込み位置にデータを書き込む
 	int write(const void *data, int size);
 
+	/// 複数のデータを続けて書き込む。書き込んだバイト数の合計を返す。
+	/// ヘッダと本体のように別々の場所にあるデータを、一度の呼び出しで書き込む
+	int writeSpans(const KOutputSpan *spans, int count);
+
+	/// 書き込みバッファにたまっている内容をファイルに書き込む。
+	/// それまでの書き込みが全て成功していれば true を返す
+	bool flush();
+
 	/// 16ビット符号なし整数値を書き込む
 	int writeUint16(uint16_t value);
 
 	/// 32ビット符号なし整数値を書き込む
 	int writeUint32(uint32_t value);
 
+	/// 64ビット符号なし整数値を書き込む
+	int writeUint64(uint64_t value);
+
 	/// ヌル終端文字列を書き込む。
 	/// 文字コードなどは一切考慮せず s で指定されたままのバイナリを書き込む
 	int writeString(const std::string &s);
 
-	void close();
+	/// 閉じる。
+	/// バッファに残っている内容は閉じるときに書き込むので、書き込みの失敗を全て確かめるには戻り値を確認すること。
+	/// 閉じるときの書き込みも含めて、それまでの書き込みが全て成功していれば true を返す
+	bool close();
 	bool isOpen();
 
 private:
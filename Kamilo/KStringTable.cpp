@@ -0,0 +1,168 @@
+﻿#include "KStringTable.h"
+#include <string.h>
+#include "KInternal.h"
+
+namespace Kamilo {
+
+#pragma region KStringTable
+uint64_t KStringTable::hash(const void *data, size_t size, uint64_t h) {
+	const uint8_t *p = (const uint8_t *)data;
+	for (size_t i=0; i<size; i++) {
+		h = (h ^ p[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+KStringTable::KStringTable() {
+	m_Interning = false;
+	clear();
+}
+void KStringTable::clear() {
+	m_Arena.clear();
+	m_Entries.clear();
+	m_Interned.clear();
+	m_BuildStart = 0;
+	m_Building = false;
+}
+bool KStringTable::empty() const {
+	return size() == 0;
+}
+int KStringTable::size() const {
+	return (int)m_Entries.size();
+}
+size_t KStringTable::getArenaSize() const {
+	return m_Arena.size();
+}
+void KStringTable::reserve(int count, size_t bytes) {
+	m_Entries.reserve(count);
+	m_Arena.reserve(bytes + count);
+}
+int KStringTable::add(const char *s, size_t len) {
+	beginString();
+	appendString(s, len);
+	return endString();
+}
+int KStringTable::add(const std::string &s) {
+	return add(s.data(), s.size());
+}
+void KStringTable::beginString() {
+	K__ASSERT(!m_Building);
+	m_Building = true;
+	m_BuildStart = m_Arena.size();
+}
+void KStringTable::appendString(const char *s, size_t len) {
+	K__ASSERT(m_Building);
+	if (s && len > 0) {
+		m_Arena.append(s, len);
+	}
+}
+int KStringTable::endString() {
+	K__ASSERT(m_Building);
+	m_Building = false;
+	// 位置と長さは 32 ビットで管理している。ヌル文字を含めて収まらなければ追加しない
+	if (m_Arena.size() >= 0xFFFFFFFF) {
+		K__ERROR("KStringTable: string arena exceeds 4GB");
+		m_Arena.resize(m_BuildStart);
+		return -1;
+	}
+	ENTRY e;
+	e.offset = (uint32_t)m_BuildStart;
+	e.len = (uint32_t)(m_Arena.size() - m_BuildStart);
+	if (m_Interning) {
+		// 連結し終えた文字列が既にあれば、追加した部分をバッファから取り除いて既存の位置を使う
+		const char *s = m_Arena.data() + m_BuildStart;
+		uint64_t h = hash(s, e.len);
+		auto it = m_Interned.find(h);
+		if (it == m_Interned.end()) {
+			m_Interned[h] = size();
+		} else {
+			const ENTRY &dup = m_Entries[it->second];
+			if (dup.len == e.len && memcmp(m_Arena.data() + dup.offset, s, e.len) == 0) {
+				m_Arena.resize(m_BuildStart);
+				m_Entries.push_back(dup);
+				return size() - 1;
+			}
+			// ハッシュ値だけが一致した別の文字列。まとめずにそのまま追加する
+		}
+	}
+	m_Arena.push_back('\0');
+	m_Entries.push_back(e);
+	return size() - 1;
+}
+const char * KStringTable::getString(int id, size_t *p_len) const {
+	if (id < 0 || size() <= id) {
+		if (p_len) *p_len = 0;
+		return "";
+	}
+	const ENTRY &e = m_Entries[id];
+	if (p_len) *p_len = e.len;
+	return m_Arena.c_str() + e.offset;
+}
+size_t KStringTable::getLength(int id) const {
+	if (id < 0 || size() <= id) {
+		return 0;
+	}
+	return m_Entries[id].len;
+}
+void KStringTable::setInterning(bool enable) {
+	K__ASSERT(!m_Building);
+	if (m_Interning == enable) {
+		return;
+	}
+	m_Interning = enable;
+	if (enable) {
+		// 既にある文字列も重複を調べる対象にする
+		m_Interned.clear();
+		for (int i=0; i<size(); i++) {
+			const ENTRY &e = m_Entries[i];
+			uint64_t h = hash(m_Arena.data() + e.offset, e.len);
+			if (m_Interned.find(h) == m_Interned.end()) {
+				m_Interned[h] = i;
+			}
+		}
+	} else {
+		m_Interned.clear();
+		m_Interned.rehash(0);
+	}
+}
+#pragma endregion // KStringTable
+
+
+namespace Test {
+void Test_stringtable() {
+	KStringTable tbl;
+	K__VERIFY(tbl.empty());
+	K__VERIFY(tbl.add("abc") == 0);
+	K__VERIFY(tbl.add("") == 1);
+	tbl.beginString();
+	tbl.appendString("xy", 2);
+	tbl.appendString("z", 1);
+	K__VERIFY(tbl.endString() == 2);
+	K__VERIFY(tbl.size() == 3);
+
+	size_t len = 0;
+	K__VERIFY(strcmp(tbl.getString(0, &len), "abc") == 0 && len == 3);
+	K__VERIFY(strcmp(tbl.getString(1, &len), "") == 0 && len == 0);
+	K__VERIFY(strcmp(tbl.getString(2, &len), "xyz") == 0 && len == 3);
+	K__VERIFY(strcmp(tbl.getString(3, &len), "") == 0 && len == 0); // 範囲外
+	K__VERIFY(tbl.getLength(2) == 3);
+	K__VERIFY(tbl.getArenaSize() == 4 + 1 + 4);
+
+	// 重複する文字列をまとめる
+	tbl.setInterning(true);
+	K__VERIFY(tbl.add("abc") == 3);
+	tbl.beginString();
+	tbl.appendString("x", 1);
+	tbl.appendString("yz", 2);
+	K__VERIFY(tbl.endString() == 4);
+	K__VERIFY(tbl.add("abcd") == 5);
+	K__VERIFY(tbl.getArenaSize() == 4 + 1 + 4 + 5);
+	K__VERIFY(tbl.getString(3) == tbl.getString(0));
+	K__VERIFY(strcmp(tbl.getString(4, &len), "xyz") == 0 && len == 3);
+	K__VERIFY(strcmp(tbl.getString(5, &len), "abcd") == 0 && len == 4);
+	tbl.setInterning(false);
+	K__VERIFY(tbl.add("abc") == 6);
+	K__VERIFY(tbl.getArenaSize() == 4 + 1 + 4 + 5 + 4);
+}
+} // Test
+
+} // namespace
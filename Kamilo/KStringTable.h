@@ -0,0 +1,87 @@
+﻿#pragma once
+#include <inttypes.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Kamilo {
+
+/// 0 起算の連番 ID で参照する文字列テーブル
+///
+/// 全ての文字列を一つのバッファにヌル文字区切りで詰めて格納し、
+/// 各文字列の開始位置だけをインデックスとして持つ。
+/// std::unordered_map<int, std::string> などと違い、文字列ごとのメモリ確保が発生しない。
+/// xlsx の共有文字列テーブル (xl/sharedStrings.xml) のように、
+/// 大量の文字列を追加した後は読み取るだけ、という使い方を想定している。
+/// setInterning(true) にすると、同じ内容の文字列はバッファを共有する。
+/// ※文字列を追加するとバッファが再確保されるため、getString() で得たポインタは次の追加までしか有効でない
+class KStringTable {
+public:
+	/// hash() の初期値
+	static constexpr uint64_t HASH_BASIS = 14695981039346656037ULL;
+
+	/// FNV-1a (64bit) でハッシュ値を求める。
+	/// h に前回の戻り値を渡すと、続きのデータとしてハッシュ値に混ぜる
+	static uint64_t hash(const void *data, size_t size, uint64_t h=HASH_BASIS);
+
+	KStringTable();
+
+	void clear();
+	bool empty() const;
+
+	/// 文字列の個数
+	int size() const;
+
+	/// 格納している文字列の合計バイト数（区切りのヌル文字を含む）
+	size_t getArenaSize() const;
+
+	/// あらかじめ領域を確保しておく
+	/// count: 文字列の個数
+	/// bytes: 文字列の合計バイト数
+	void reserve(int count, size_t bytes);
+
+	/// 文字列を末尾に追加し、その文字列の ID を返す
+	int add(const char *s, size_t len);
+	int add(const std::string &s);
+
+	/// 複数の断片を連結して一つの文字列として追加する。
+	/// beginString() の後に appendString() で断片を追加し、endString() で確定する。
+	/// endString() は追加した文字列の ID を返す。
+	/// バッファ全体が 4GB を超える場合は追加せずに -1 を返す（add() も同じ）
+	void beginString();
+	void appendString(const char *s, size_t len);
+	int endString();
+
+	/// 文字列を得る。戻り値はヌル終端している。
+	/// 範囲外の ID を指定した場合は "" を返す
+	/// p_len: nullptr でなければ文字列のバイト数（ヌル文字を含まない）をセットする
+	const char * getString(int id, size_t *p_len=nullptr) const;
+
+	/// 文字列のバイト数（ヌル文字を含まない）を返す。範囲外の ID を指定した場合は 0 を返す
+	size_t getLength(int id) const;
+
+	/// 重複する文字列をまとめる。
+	/// 有効にすると、add() や endString() で既にある文字列と同じ内容の文字列を追加したとき、
+	/// バッファには追加せずに既存の文字列と同じ位置を指す ID を返す。ID は重複の有無にかかわらず連番のままになる。
+	/// 重複を調べるための表は、無効にするか clear() するまで保持する
+	void setInterning(bool enable);
+
+private:
+	struct ENTRY {
+		uint32_t offset; // m_Arena 内での開始位置
+		uint32_t len;    // バイト数（ヌル文字を含まない）
+	};
+	std::string m_Arena;          // 全ての文字列をヌル文字区切りで格納する
+	std::vector<ENTRY> m_Entries; // 各文字列の位置。重複をまとめた場合は、同じ位置を指す ID が複数できる
+	std::unordered_map<uint64_t, int> m_Interned; // 文字列のハッシュ値 --> そのハッシュ値を持つ最初の文字列の ID
+	size_t m_BuildStart;          // beginString() した時点での m_Arena のサイズ
+	bool m_Building;              // beginString() から endString() の間なら true
+	bool m_Interning;             // 重複する文字列をまとめる
+};
+
+
+namespace Test {
+void Test_stringtable();
+}
+
+} // namespace
@@ -1,5 +1,6 @@
 ﻿#include "KTable.h"
 
+#include <limits.h>
 #include <string>
 #include <vector>
 #include "KExcel.h"
@@ -173,6 +174,19 @@ public:
 		return m_Grid.getCell(1+col, 1+row, p_val);
 	}
 	bool queryDataInt(int col, int row, int *p_val) const {
+		// 数値セルならば文字列を経由せずに値を得る。
+		// onTableNumericText は文字列の前処理なので、数値セルには適用しない
+		double num = 0;
+		if (m_Grid.getCellNumber(1+col, 1+row, &num)) {
+			if (num < INT_MIN || INT_MAX < num) {
+				return false;
+			}
+			// 実数を整数として取り出す。
+			// 1 のつもりが 0.9999999999998 のように記録されている場合を考慮して、ゼロから遠ざかる方向に少しずらしてから整数化する
+			if (p_val) *p_val = (int)(num + (num < 0 ? -0.000001 : 0.000001));
+			return true;
+		}
+
 		std::string s;
 		if (!queryDataString(col, row, &s)) {
 			return false;
@@ -209,6 +223,13 @@ public:
 		return false;
 	}
 	bool queryDataFloat(int col, int row, float *p_val) const {
+		// 数値セルならば文字列を経由せずに値を得る
+		double num = 0;
+		if (m_Grid.getCellNumber(1+col, 1+row, &num)) {
+			if (p_val) *p_val = (float)num;
+			return true;
+		}
+
 		std::string s;
 		if (!queryDataString(col, row, &s)) {
 			return false;
@@ -0,0 +1,723 @@
+﻿#include "KXmlReader.h"
+#include <string.h>
+#include "KInternal.h"
+
+// テキストの走査に使う SIMD 命令。
+// AVX2 を有効にしてビルドした場合は 32 バイト、x64 などで SSE2 が使える場合は 16 バイトずつ調べる。
+// どちらも使えなければ 1 バイトずつ調べる
+#if defined(__AVX2__)
+#	include <immintrin.h>
+#	define K_XML_SIMD 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define K_XML_SIMD 16
+#else
+#	define K_XML_SIMD 0
+#endif
+#if K_XML_SIMD && defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+namespace Kamilo {
+
+static bool _IsXmlSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// s から始まる文字列が prefix で始まっているか調べる
+static bool _StartsWith(const char *s, const char *end, const char *prefix, size_t prefix_len) {
+	return (size_t)(end - s) >= prefix_len && memcmp(s, prefix, prefix_len) == 0;
+}
+
+// [s, end) の範囲から部分文字列 sub を探す
+static const char * _FindStr(const char *s, const char *end, const char *sub, size_t sub_len) {
+	while (s < end) {
+		const char *p = (const char *)memchr(s, sub[0], end - s);
+		if (p == nullptr) return nullptr;
+		if (_StartsWith(p, end, sub, sub_len)) return p;
+		s = p + 1;
+	}
+	return nullptr;
+}
+
+#if K_XML_SIMD == 32
+typedef __m256i XVEC;
+static XVEC _VecLoad(const char *s) { return _mm256_loadu_si256((const __m256i *)s); }
+static XVEC _VecSet(char c) { return _mm256_set1_epi8(c); }
+static uint32_t _VecMatch(XVEC v, XVEC c) { return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c)); }
+#elif K_XML_SIMD == 16
+typedef __m128i XVEC;
+static XVEC _VecLoad(const char *s) { return _mm_loadu_si128((const __m128i *)s); }
+static XVEC _VecSet(char c) { return _mm_set1_epi8(c); }
+static uint32_t _VecMatch(XVEC v, XVEC c) { return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c)); }
+#endif
+
+#if K_XML_SIMD
+// 立っている最下位ビットの位置。x は 0 以外であること
+static int _LowestBit(uint32_t x) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+#endif
+
+// [s, end) から '<' を探す。見つからなければ end を返す。
+// 見つけた位置より前に '&' も '\r' も無ければ *p_plain を true にする（実体参照の展開も改行コードの変換も要らない）
+static const char * _ScanText(const char *s, const char *end, bool *p_plain) {
+	bool plain = true;
+#if K_XML_SIMD
+	const XVEC lt = _VecSet('<');
+	const XVEC amp = _VecSet('&');
+	const XVEC cr = _VecSet('\r');
+	while (end - s >= K_XML_SIMD) {
+		XVEC v = _VecLoad(s);
+		uint32_t m_lt = _VecMatch(v, lt);
+		uint32_t m_special = _VecMatch(v, amp) | _VecMatch(v, cr);
+		if (m_lt) {
+			uint32_t before = (m_lt & (0u - m_lt)) - 1; // 最初の '<' より手前のビット
+			*p_plain = plain && (m_special & before) == 0;
+			return s + _LowestBit(m_lt);
+		}
+		if (m_special) {
+			plain = false;
+		}
+		s += K_XML_SIMD;
+	}
+#endif
+	const char *p = (const char *)memchr(s, '<', end - s);
+	if (p == nullptr) p = end;
+	if (plain) {
+		plain = memchr(s, '&', p - s) == nullptr && memchr(s, '\r', p - s) == nullptr;
+	}
+	*p_plain = plain;
+	return p;
+}
+
+// [s, end) から '&' または '\r' を探す。見つからなければ end を返す
+static const char * _FindSpecial(const char *s, const char *end) {
+#if K_XML_SIMD
+	const XVEC amp = _VecSet('&');
+	const XVEC cr = _VecSet('\r');
+	while (end - s >= K_XML_SIMD) {
+		XVEC v = _VecLoad(s);
+		uint32_t m = _VecMatch(v, amp) | _VecMatch(v, cr);
+		if (m) {
+			return s + _LowestBit(m);
+		}
+		s += K_XML_SIMD;
+	}
+#endif
+	while (s < end && *s != '&' && *s != '\r') {
+		s++;
+	}
+	return s;
+}
+
+// Unicode のコードポイントを UTF-8 に変換して out に追加する
+static void _AppendUtf8(unsigned long cp, std::string &out) {
+	if (cp < 0x80) {
+		out += (char)cp;
+	} else if (cp < 0x800) {
+		out += (char)(0xC0 | (cp >> 6));
+		out += (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		out += (char)(0xE0 | (cp >> 12));
+		out += (char)(0x80 | ((cp >> 6) & 0x3F));
+		out += (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x110000) {
+		out += (char)(0xF0 | (cp >> 18));
+		out += (char)(0x80 | ((cp >> 12) & 0x3F));
+		out += (char)(0x80 | ((cp >> 6) & 0x3F));
+		out += (char)(0x80 | (cp & 0x3F));
+	}
+}
+
+// 実体参照 &name; を展開する。展開できなければ false を返す
+// name: '&' と ';' の間の文字列
+static bool _DecodeEntity(const char *name, size_t len, std::string &out) {
+	if (len >= 2 && name[0] == '#') {
+		// 文字参照 &#65; &#x41;
+		unsigned long cp = 0;
+		if (name[1] == 'x' || name[1] == 'X') {
+			if (len < 3) return false;
+			for (size_t i=2; i<len; i++) {
+				char c = name[i];
+				int d;
+				if ('0' <= c && c <= '9') d = c - '0';
+				else if ('a' <= c && c <= 'f') d = c - 'a' + 10;
+				else if ('A' <= c && c <= 'F') d = c - 'A' + 10;
+				else return false;
+				cp = cp * 16 + d;
+				if (cp >= 0x110000) return false; // 桁が多すぎる値は途中で桁あふれするので、範囲外になった時点でやめる
+			}
+		} else {
+			for (size_t i=1; i<len; i++) {
+				char c = name[i];
+				if (c < '0' || '9' < c) return false;
+				cp = cp * 10 + (c - '0');
+				if (cp >= 0x110000) return false;
+			}
+		}
+		if (cp == 0) return false;
+		if (0xD800 <= cp && cp <= 0xDFFF) return false; // サロゲートは文字として使えない
+		_AppendUtf8(cp, out);
+		return true;
+	}
+	switch (len) {
+	case 2:
+		if (memcmp(name, "lt", 2) == 0) { out += '<'; return true; }
+		if (memcmp(name, "gt", 2) == 0) { out += '>'; return true; }
+		break;
+	case 3:
+		if (memcmp(name, "amp", 3) == 0) { out += '&'; return true; }
+		break;
+	case 4:
+		if (memcmp(name, "quot", 4) == 0) { out += '"'; return true; }
+		if (memcmp(name, "apos", 4) == 0) { out += '\''; return true; }
+		break;
+	}
+	return false;
+}
+
+
+#pragma region KXmlReader
+void KXmlReader::decodeText(const char *s, size_t len, std::string &out) {
+	const char *end = s + len;
+	while (s < end) {
+		// 変換の必要な文字が現れるまでまとめてコピーする
+		const char *p = _FindSpecial(s, end);
+		out.append(s, p - s);
+		if (p >= end) {
+			break;
+		}
+		if (*p == '\r') {
+			// 改行コード \r\n および \r を \n に統一する
+			out += '\n';
+			p++;
+			if (p < end && *p == '\n') p++;
+			s = p;
+			continue;
+		}
+		// 実体参照
+		const char *semi = (const char *)memchr(p, ';', end - p);
+		if (semi && _DecodeEntity(p + 1, semi - p - 1, out)) {
+			s = semi + 1;
+		} else {
+			// 展開できない。そのまま残す
+			out += '&';
+			s = p + 1;
+		}
+	}
+}
+
+KXmlReader::KXmlReader() {
+	open(nullptr, 0);
+}
+KXmlReader::KXmlReader(const char *xml_u8, size_t size) {
+	open(xml_u8, size);
+}
+KXmlReader::KXmlReader(KInputStream &input, int chunk_size) {
+	open(input, chunk_size);
+}
+void KXmlReader::open(const char *xml_u8, size_t size) {
+	m_Pos = xml_u8;
+	m_End = xml_u8 ? xml_u8 + size : nullptr;
+	if (m_Pos && size >= 3 && memcmp(m_Pos, "\xEF\xBB\xBF", 3) == 0) {
+		m_Pos += 3; // BOM
+	}
+	m_Token = TK_EOF;
+	m_Name.ptr = nullptr; m_Name.len = 0;
+	m_LocalName = m_Name;
+	m_Text = m_Name;
+	m_Attrs.clear();
+	m_StackNames.clear();
+	m_StackStart.clear();
+	m_Depth = 0;
+	m_IsEmpty = false;
+	m_IsCData = false;
+	m_IsPlain = false;
+	m_PendingClose = false;
+	m_Input = KInputStream();
+	m_Buf.clear();
+	m_ChunkSize = 0;
+	m_Streaming = false;
+	m_InputEnd = true;
+	m_NeedMore = false;
+}
+void KXmlReader::open(KInputStream &input, int chunk_size) {
+	open(nullptr, 0);
+	m_Input = input;
+	m_ChunkSize = (chunk_size > 0) ? chunk_size : DEFAULT_CHUNK_SIZE;
+	m_Streaming = true;
+	m_InputEnd = false;
+	m_Pos = m_End = m_Buf.data();
+	fill();
+	if (m_End - m_Pos >= 3 && memcmp(m_Pos, "\xEF\xBB\xBF", 3) == 0) {
+		m_Pos += 3; // BOM
+	}
+}
+KXmlReader::Token KXmlReader::getToken() const {
+	return m_Token;
+}
+int KXmlReader::getDepth() const {
+	return m_Depth;
+}
+KXmlReader::Token KXmlReader::error() {
+	m_Pos = m_End;
+	m_Token = TK_ERROR;
+	return m_Token;
+}
+// トークンの途中でバッファの終端に達した。
+// 入力ストリームにまだ続きがあれば、続きを読み取ってからトークンを読み直す。
+// 続きが無ければ構文エラーとする
+KXmlReader::Token KXmlReader::incomplete() {
+	if (m_Streaming && !m_InputEnd) {
+		m_NeedMore = true;
+		return TK_ERROR;
+	}
+	return error();
+}
+// 入力ストリームの続きを m_Buf に読み取る。
+// 処理済みの部分 (m_Pos より前) は捨てるので、m_Buf の大きさは未処理のブロックと処理中のトークンの分だけで済む
+bool KXmlReader::fill() {
+	if (!m_Streaming || m_InputEnd) {
+		return false;
+	}
+	size_t consumed = m_Pos - m_Buf.data();
+	m_Buf.erase(0, consumed);
+	size_t old_size = m_Buf.size();
+	m_Buf.resize(old_size + m_ChunkSize);
+	int n = m_Input.read(&m_Buf[old_size], m_ChunkSize);
+	if (n <= 0) {
+		n = 0;
+		m_InputEnd = true;
+	}
+	m_Buf.resize(old_size + n);
+	m_Pos = m_Buf.data();
+	m_End = m_Pos + m_Buf.size();
+	return n > 0;
+}
+void KXmlReader::setName(const char *s, size_t len) {
+	m_Name.ptr = s;
+	m_Name.len = len;
+	const char *colon = (const char *)memchr(s, ':', len);
+	if (colon) {
+		m_LocalName.ptr = colon + 1;
+		m_LocalName.len = len - (colon + 1 - s);
+	} else {
+		m_LocalName = m_Name;
+	}
+}
+// 開いている要素のタグ名は、バッファを読み直しても消えないように m_StackNames にコピーしておく
+void KXmlReader::pushElement(const char *name, size_t len) {
+	m_StackStart.push_back(m_StackNames.size());
+	m_StackNames.append(name, len);
+}
+void KXmlReader::popElement() {
+	m_StackNames.resize(m_StackStart.back());
+	m_StackStart.pop_back();
+}
+bool KXmlReader::isTopElement(const char *name, size_t len) const {
+	if (m_StackStart.empty()) return false;
+	size_t start = m_StackStart.back();
+	return m_StackNames.size() - start == len && memcmp(m_StackNames.data() + start, name, len) == 0;
+}
+KXmlReader::Token KXmlReader::next() {
+	if (m_Token == TK_ERROR) {
+		return TK_ERROR;
+	}
+	if (m_PendingClose) {
+		// 空要素タグ <tag/> に対応する終了タグ
+		m_PendingClose = false;
+		m_Depth = (int)m_StackStart.size();
+		popElement();
+		m_Attrs.clear();
+		m_Token = TK_CLOSE;
+		return m_Token;
+	}
+	m_IsEmpty = false;
+	m_IsCData = false;
+	m_IsPlain = false;
+	while (1) {
+		Token tk = nextToken();
+		if (!m_NeedMore) {
+			return tk;
+		}
+		// トークンが途中で切れている。続きを読み取って、同じ位置から読み直す
+		m_NeedMore = false;
+		fill();
+	}
+}
+KXmlReader::Token KXmlReader::nextToken() {
+	while (1) {
+		if (m_Streaming && !m_InputEnd && m_End - m_Pos < 9) {
+			// "<![CDATA[" を判別できるだけの文字数が無い
+			return incomplete();
+		}
+		if (m_Pos >= m_End) {
+			break;
+		}
+		if (*m_Pos != '<') {
+			// テキスト。'<' を探しながら、実体参照と CR の有無も調べておく
+			bool plain = true;
+			const char *p = _ScanText(m_Pos, m_End, &plain);
+			if (p == m_End && m_Streaming && !m_InputEnd) {
+				return incomplete(); // テキストの続きがある
+			}
+			if (m_StackStart.empty()) {
+				// ルート要素の外側にあるテキスト（改行など）は無視する
+				m_Pos = p;
+				continue;
+			}
+			m_Text.ptr = m_Pos;
+			m_Text.len = p - m_Pos;
+			m_Pos = p;
+			m_IsPlain = plain;
+			m_Depth = (int)m_StackStart.size();
+			m_Token = TK_TEXT;
+			return m_Token;
+		}
+		if (_StartsWith(m_Pos, m_End, "<?", 2)) {
+			// 処理命令 <?xml ... ?>
+			const char *p = _FindStr(m_Pos + 2, m_End, "?>", 2);
+			if (p == nullptr) return incomplete();
+			m_Pos = p + 2;
+			continue;
+		}
+		if (_StartsWith(m_Pos, m_End, "<!--", 4)) {
+			// コメント
+			const char *p = _FindStr(m_Pos + 4, m_End, "-->", 3);
+			if (p == nullptr) return incomplete();
+			m_Pos = p + 3;
+			continue;
+		}
+		if (_StartsWith(m_Pos, m_End, "<![CDATA[", 9)) {
+			// CDATA セクション
+			const char *s = m_Pos + 9;
+			const char *p = _FindStr(s, m_End, "]]>", 3);
+			if (p == nullptr) return incomplete();
+			m_Text.ptr = s;
+			m_Text.len = p - s;
+			m_Pos = p + 3;
+			m_IsCData = true;
+			m_IsPlain = true; // CDATA は無変換
+			m_Depth = (int)m_StackStart.size();
+			m_Token = TK_TEXT;
+			return m_Token;
+		}
+		if (_StartsWith(m_Pos, m_End, "<!", 2)) {
+			// DOCTYPE 宣言。内部サブセット [...] を含む場合がある
+			int bracket = 0;
+			const char *p = m_Pos + 2;
+			for (; p < m_End; p++) {
+				if (*p == '[') bracket++;
+				if (*p == ']') bracket--;
+				if (*p == '>' && bracket <= 0) break;
+			}
+			if (p >= m_End) return incomplete();
+			m_Pos = p + 1;
+			continue;
+		}
+		if (_StartsWith(m_Pos, m_End, "</", 2)) {
+			return parseEndTag();
+		}
+		return parseTag();
+	}
+	if (!m_StackStart.empty()) {
+		// 閉じていない要素がある
+		return error();
+	}
+	m_Token = TK_EOF;
+	return m_Token;
+}
+KXmlReader::Token KXmlReader::parseTag() {
+	// m_Pos は '<' を指している。
+	// バッファの終端に達した場合は incomplete() を返す。m_Pos はトークンを読み終えるまで動かさない
+	const char *p = m_Pos + 1;
+	const char *name = p;
+	while (p < m_End && !_IsXmlSpace(*p) && *p != '/' && *p != '>') {
+		p++;
+	}
+	if (p >= m_End) return incomplete();
+	if (p == name) return error();
+	setName(name, p - name);
+
+	// 属性
+	m_Attrs.clear();
+	while (1) {
+		while (p < m_End && _IsXmlSpace(*p)) p++;
+		if (p >= m_End) return incomplete();
+		if (*p == '>') {
+			p++;
+			break;
+		}
+		if (*p == '/') {
+			if (p + 1 >= m_End) return incomplete();
+			if (p[1] != '>') return error();
+			p += 2;
+			m_IsEmpty = true;
+			break;
+		}
+		ATTR attr;
+		attr.name.ptr = p;
+		while (p < m_End && !_IsXmlSpace(*p) && *p != '=' && *p != '>' && *p != '/') {
+			p++;
+		}
+		attr.name.len = p - attr.name.ptr;
+		while (p < m_End && _IsXmlSpace(*p)) p++;
+		if (p >= m_End) return incomplete();
+		if (attr.name.len == 0 || *p != '=') return error();
+		p++;
+		while (p < m_End && _IsXmlSpace(*p)) p++;
+		if (p >= m_End) return incomplete();
+		if (*p != '"' && *p != '\'') return error();
+		char quote = *p;
+		p++;
+		const char *q = (const char *)memchr(p, quote, m_End - p);
+		if (q == nullptr) return incomplete();
+		attr.value.ptr = p;
+		attr.value.len = q - p;
+		m_Attrs.push_back(attr);
+		p = q + 1;
+	}
+	m_Pos = p;
+	pushElement(m_Name.ptr, m_Name.len);
+	m_Depth = (int)m_StackStart.size();
+	m_PendingClose = m_IsEmpty;
+	m_Token = TK_OPEN;
+	return m_Token;
+}
+KXmlReader::Token KXmlReader::parseEndTag() {
+	// m_Pos は "</" を指している
+	const char *name = m_Pos + 2;
+	const char *p = name;
+	while (p < m_End && !_IsXmlSpace(*p) && *p != '>') {
+		p++;
+	}
+	size_t len = p - name;
+	while (p < m_End && _IsXmlSpace(*p)) p++;
+	if (p >= m_End) return incomplete();
+	if (len == 0 || *p != '>') return error();
+
+	// 開始タグと終了タグの対応を確認
+	if (!isTopElement(name, len)) return error();
+
+	setName(name, len);
+	m_Attrs.clear();
+	m_Pos = p + 1;
+	m_Depth = (int)m_StackStart.size();
+	popElement();
+	m_Token = TK_CLOSE;
+	return m_Token;
+}
+bool KXmlReader::hasTag(const char *tag) const {
+	if (m_Token != TK_OPEN && m_Token != TK_CLOSE) return false;
+	size_t len = strlen(tag);
+	return m_LocalName.len == len && memcmp(m_LocalName.ptr, tag, len) == 0;
+}
+std::string KXmlReader::getTag() const {
+	if (m_Token != TK_OPEN && m_Token != TK_CLOSE) return "";
+	return std::string(m_Name.ptr, m_Name.len);
+}
+bool KXmlReader::isEmptyElement() const {
+	return m_Token == TK_OPEN && m_IsEmpty;
+}
+bool KXmlReader::getAttrRaw(const char *name, const char **p_val, size_t *p_len) const {
+	size_t len = strlen(name);
+	for (size_t i=0; i<m_Attrs.size(); i++) {
+		const ATTR &attr = m_Attrs[i];
+		if (attr.name.len == len && memcmp(attr.name.ptr, name, len) == 0) {
+			if (p_val) *p_val = attr.value.ptr;
+			if (p_len) *p_len = attr.value.len;
+			return true;
+		}
+	}
+	return false;
+}
+bool KXmlReader::getAttr(const char *name, std::string *p_val) const {
+	const char *s = nullptr;
+	size_t len = 0;
+	if (getAttrRaw(name, &s, &len)) {
+		if (p_val) {
+			p_val->clear();
+			decodeText(s, len, *p_val);
+		}
+		return true;
+	}
+	return false;
+}
+const char * KXmlReader::getTextRaw(size_t *p_len) const {
+	if (m_Token != TK_TEXT) {
+		if (p_len) *p_len = 0;
+		return nullptr;
+	}
+	if (p_len) *p_len = m_Text.len;
+	return m_Text.ptr;
+}
+bool KXmlReader::isCData() const {
+	return m_Token == TK_TEXT && m_IsCData;
+}
+bool KXmlReader::isPlainText() const {
+	return m_Token == TK_TEXT && m_IsPlain;
+}
+void KXmlReader::appendText(std::string *p_val) const {
+	K__ASSERT(p_val);
+	if (m_Token != TK_TEXT) return;
+	if (m_IsPlain) {
+		p_val->append(m_Text.ptr, m_Text.len); // CDATA、または変換の必要な文字を含まない
+	} else {
+		decodeText(m_Text.ptr, m_Text.len, *p_val);
+	}
+}
+bool KXmlReader::readText(std::string *p_val) {
+	K__ASSERT(p_val);
+	p_val->clear();
+	if (m_Token != TK_OPEN) return false;
+	int depth = m_Depth;
+	while (1) {
+		Token tk = next();
+		switch (tk) {
+		case TK_TEXT:
+			if (m_Depth == depth) {
+				appendText(p_val);
+			}
+			break;
+		case TK_OPEN:
+			// 子要素の中のテキストは含めない
+			if (!skipElement()) return false;
+			break;
+		case TK_CLOSE:
+			if (m_Depth == depth) return true;
+			break;
+		default:
+			return false; // TK_EOF, TK_ERROR
+		}
+	}
+}
+bool KXmlReader::skipElement() {
+	if (m_Token != TK_OPEN) return false;
+	int depth = m_Depth;
+	while (1) {
+		Token tk = next();
+		if (tk == TK_CLOSE && m_Depth == depth) return true;
+		if (tk == TK_EOF || tk == TK_ERROR) return false;
+	}
+}
+#pragma endregion // KXmlReader
+
+
+namespace Test {
+void Test_xmlreader() {
+	const char *xml =
+		"<?xml version='1.0' encoding='utf-8'?>\n"
+		"<!-- comment -->"
+		"<x:root a='1' b=\"&lt;2&gt;\">"
+		"<item/>"
+		"<text>A&amp;B&#x41;&#66;\r\nC<sub>ignored</sub><![CDATA[<raw>]]></text>"
+		"</x:root>";
+	KXmlReader xr(xml, strlen(xml));
+	std::string s;
+	K__VERIFY(xr.next() == KXmlReader::TK_OPEN);
+	K__VERIFY(xr.hasTag("root"));
+	K__VERIFY(xr.getTag() == "x:root");
+	K__VERIFY(xr.getDepth() == 1);
+	K__VERIFY(xr.getAttr("a", &s) && s == "1");
+	K__VERIFY(xr.getAttr("b", &s) && s == "<2>");
+	K__VERIFY(!xr.getAttr("c", &s));
+
+	K__VERIFY(xr.next() == KXmlReader::TK_OPEN);
+	K__VERIFY(xr.hasTag("item"));
+	K__VERIFY(xr.isEmptyElement());
+	K__VERIFY(xr.getDepth() == 2);
+	K__VERIFY(xr.next() == KXmlReader::TK_CLOSE);
+	K__VERIFY(xr.hasTag("item"));
+	K__VERIFY(xr.getDepth() == 2);
+
+	K__VERIFY(xr.next() == KXmlReader::TK_OPEN);
+	K__VERIFY(xr.hasTag("text"));
+	K__VERIFY(xr.readText(&s));
+	K__VERIFY(s == "A&BAB\nC<raw>");
+	K__VERIFY(xr.getToken() == KXmlReader::TK_CLOSE);
+	K__VERIFY(xr.hasTag("text"));
+
+	K__VERIFY(xr.next() == KXmlReader::TK_CLOSE);
+	K__VERIFY(xr.hasTag("root"));
+	K__VERIFY(xr.getDepth() == 1);
+	K__VERIFY(xr.next() == KXmlReader::TK_EOF);
+
+	// SIMD で調べる長さを超えるテキスト。'&' と CR が '<' の前後どちらにあるかで結果が変わる
+	for (int n=0; n<80; n++) {
+		std::string pad(n, 'x');
+		std::string doc = "<a>" + pad + "<b/>&amp;" + pad + "</a>";
+		KXmlReader xr5(doc.data(), doc.size());
+		K__VERIFY(xr5.next() == KXmlReader::TK_OPEN);
+		if (n > 0) {
+			K__VERIFY(xr5.next() == KXmlReader::TK_TEXT && xr5.isPlainText() && xr5.getTextRaw(nullptr) == doc.data() + 3);
+		}
+		K__VERIFY(xr5.next() == KXmlReader::TK_OPEN && xr5.hasTag("b"));
+		K__VERIFY(xr5.next() == KXmlReader::TK_CLOSE);
+		K__VERIFY(xr5.next() == KXmlReader::TK_TEXT && !xr5.isPlainText());
+		s.clear();
+		xr5.appendText(&s);
+		K__VERIFY(s == "&" + pad);
+		std::string doc2 = "<a>" + pad + "\r\n" + pad + "</a>";
+		KXmlReader xr6(doc2.data(), doc2.size());
+		K__VERIFY(xr6.next() == KXmlReader::TK_OPEN);
+		K__VERIFY(xr6.next() == KXmlReader::TK_TEXT && !xr6.isPlainText());
+		s.clear();
+		xr6.appendText(&s);
+		K__VERIFY(s == pad + "\n" + pad);
+	}
+
+	// 文字参照。範囲外の値やサロゲートは展開せずにそのまま残す
+	{
+		struct { const char *src, *dst; } tests[] = {
+			{"&#65;&#x41;&#X10FFFF;", u8"AA\U0010FFFF"},
+			{"&#1114112;",            "&#1114112;"},   // 0x110000
+			{"&#4294967361;",         "&#4294967361;"}, // 32 ビットで桁あふれすると 0x41 になる
+			{"&#18446744073709551681;", "&#18446744073709551681;"}, // 64 ビットで桁あふれすると 0x41 になる
+			{"&#x100000041;",         "&#x100000041;"},
+			{"&#x10000000000000041;", "&#x10000000000000041;"},
+			{"&#xD800;&#57343;",      "&#xD800;&#57343;"},
+			{"&#xD7FF;&#xE000;",      u8"\uD7FF\uE000"},
+			{"&#0;&#x;",              "&#0;&#x;"},
+		};
+		for (auto &t : tests) {
+			std::string out;
+			KXmlReader::decodeText(t.src, strlen(t.src), out);
+			K__VERIFY(out == t.dst);
+		}
+	}
+
+	// 終了タグの不一致
+	const char *bad = "<a><b></a></b>";
+	KXmlReader xr2(bad, strlen(bad));
+	K__VERIFY(xr2.next() == KXmlReader::TK_OPEN);
+	K__VERIFY(xr2.next() == KXmlReader::TK_OPEN);
+	K__VERIFY(xr2.next() == KXmlReader::TK_ERROR);
+
+	// ストリームから少しずつ読み取っても、一度に読み取った場合と同じトークン列になる
+	for (int chunk=1; chunk<=16; chunk++) {
+		KXmlReader xr3(xml, strlen(xml));
+		KInputStream input = KInputStream::fromMemory(xml, (int)strlen(xml));
+		KXmlReader xr4(input, chunk);
+		while (1) {
+			KXmlReader::Token tk = xr3.next();
+			K__VERIFY(xr4.next() == tk);
+			if (tk == KXmlReader::TK_EOF || tk == KXmlReader::TK_ERROR) break;
+			K__VERIFY(xr4.getDepth() == xr3.getDepth());
+			K__VERIFY(xr4.getTag() == xr3.getTag());
+			std::string t3, t4;
+			xr3.appendText(&t3);
+			xr4.appendText(&t4);
+			K__VERIFY(t3 == t4);
+		}
+	}
+}
+} // Test
+
+} // namespace
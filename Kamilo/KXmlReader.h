@@ -0,0 +1,159 @@
+﻿#pragma once
+#include <string>
+#include <vector>
+#include "KStream.h"
+
+namespace Kamilo {
+
+/// XML を先頭から順番に読み進めるプル型のパーサ
+///
+/// KXmlElement と違って DOM を構築しないため、巨大な XML でもメモリ使用量が増えない。
+/// next() でトークン（開始タグ、終了タグ、テキスト）を一つずつ取り出して使う。
+/// 空要素タグ <tag/> は開始タグ TK_OPEN と終了タグ TK_CLOSE の組として返す。
+/// コメント、処理命令 <?...?>、DOCTYPE 宣言は読み飛ばす。
+/// ※入力テキストは UTF-8 であること。
+/// ※入力テキストはコピーしないので、読み取りが終わるまで入力テキストを破棄してはいけない
+///
+/// KInputStream から開いた場合は、入力を固定サイズのブロック単位で読み進める。
+/// メモリ上に置くのは未処理のブロックと処理中のトークンだけなので、巨大な XML を丸ごと読み込む必要がない。
+/// ※いずれの場合も、getAttrRaw や getTextRaw で得たポインタは次に next() を呼ぶまでしか有効でない
+/// @code
+/// KXmlReader xr(xml.data(), xml.size());
+/// for (KXmlReader::Token tk=xr.next(); tk!=KXmlReader::TK_EOF; tk=xr.next()) {
+///     if (tk == KXmlReader::TK_ERROR) break;
+///     if (tk == KXmlReader::TK_OPEN && xr.hasTag("v")) {
+///         std::string s;
+///         xr.readText(&s); // <v> の中身を得る。読み取り位置は </v> に移動する
+///     }
+/// }
+/// @endcode
+class KXmlReader {
+public:
+	enum Token {
+		TK_EOF,   ///< 終端に達した
+		TK_ERROR, ///< 構文エラー
+		TK_OPEN,  ///< 開始タグ <tag ...> または空要素タグ <tag .../>
+		TK_CLOSE, ///< 終了タグ </tag>
+		TK_TEXT,  ///< テキスト（CDATA セクションを含む）
+	};
+
+	/// 文字参照と定義済み実体参照（&amp; &#x41; など）を展開し、改行コードを \n に統一したものを out の末尾に追加する
+	static void decodeText(const char *s, size_t len, std::string &out);
+
+	/// KInputStream から読み取る場合の、一度に読み取るバイト数の既定値
+	static constexpr int DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+	KXmlReader();
+	KXmlReader(const char *xml_u8, size_t size);
+	KXmlReader(KInputStream &input, int chunk_size=DEFAULT_CHUNK_SIZE);
+
+	/// 読み取る XML テキストを設定し、読み取り位置を先頭に戻す
+	void open(const char *xml_u8, size_t size);
+
+	/// 入力ストリームの現在位置から XML テキストを読み取る。
+	/// chunk_size: 入力ストリームから一度に読み取るバイト数。
+	/// 一つのトークンがこれより大きい場合は、そのトークン全体が入るまでバッファを広げる
+	void open(KInputStream &input, int chunk_size=DEFAULT_CHUNK_SIZE);
+
+	/// 次のトークンに進む
+	Token next();
+
+	/// 現在のトークン
+	Token getToken() const;
+
+	/// 現在の要素の深さ。ルート要素の開始タグと終了タグが 1 になる。
+	/// テキストの場合は、そのテキストを含んでいる要素の深さを返す
+	int getDepth() const;
+
+	/// 現在のタグ名が tag と一致するか調べる。
+	/// 名前空間の接頭辞は無視する（"x:row" は "row" として扱う）
+	bool hasTag(const char *tag) const;
+
+	/// 現在のタグ名（名前空間の接頭辞を含む）
+	std::string getTag() const;
+
+	/// 現在のトークンが空要素タグ <tag/> ならば true
+	bool isEmptyElement() const;
+
+	/// 現在のタグの属性値を、無変換のまま得る。属性が存在しなければ false を返す
+	/// p_val: 属性値の先頭。ヌル終端していないことに注意
+	/// p_len: 属性値のバイト数
+	bool getAttrRaw(const char *name, const char **p_val, size_t *p_len) const;
+
+	/// 現在のタグの属性値を、実体参照を展開した状態で得る。属性が存在しなければ false を返す
+	bool getAttr(const char *name, std::string *p_val) const;
+
+	/// 現在のテキストを無変換のまま得る。
+	/// CDATA セクションの場合は <![CDATA[ と ]]> の間の部分を返す
+	const char * getTextRaw(size_t *p_len) const;
+
+	/// 現在のテキストが CDATA セクションならば true
+	bool isCData() const;
+
+	/// 現在のテキストが変換の必要な文字（実体参照の '&' と CR）を含まないか、CDATA セクションならば true。
+	/// その場合は getTextRaw で得たテキストがそのまま appendText の結果になる。
+	/// テキストを切り出すときに '<' と一緒に調べておくので、改めてテキストを走査する必要はない
+	bool isPlainText() const;
+
+	/// 現在のテキストを、実体参照を展開した状態で p_val の末尾に追加する
+	void appendText(std::string *p_val) const;
+
+	/// 現在の開始タグ（TK_OPEN）の要素に含まれるテキストを得る。
+	/// 子要素の中にあるテキストは含まない。
+	/// 読み取り位置は対応する終了タグに移動する
+	bool readText(std::string *p_val);
+
+	/// 現在の開始タグ（TK_OPEN）の要素を子要素ごと読み飛ばす。
+	/// 読み取り位置は対応する終了タグに移動する
+	bool skipElement();
+
+private:
+	struct SPAN {
+		const char *ptr;
+		size_t len;
+	};
+	struct ATTR {
+		SPAN name;
+		SPAN value;
+	};
+	Token error();
+	Token incomplete();
+	Token nextToken();
+	Token parseTag();
+	Token parseEndTag();
+	bool fill();
+	void setName(const char *s, size_t len);
+	void pushElement(const char *name, size_t len);
+	void popElement();
+	bool isTopElement(const char *name, size_t len) const;
+
+	const char *m_Pos;
+	const char *m_End;
+	Token m_Token;
+	SPAN m_Name;       // タグ名
+	SPAN m_LocalName;  // 名前空間接頭辞を除いたタグ名
+	SPAN m_Text;       // テキスト
+	std::vector<ATTR> m_Attrs;
+	std::string m_StackNames;         // 開いている要素のタグ名を連結したもの。
+	std::vector<size_t> m_StackStart; // 開いている要素のタグ名の m_StackNames 内での開始位置
+	int m_Depth;
+	bool m_IsEmpty;
+	bool m_IsCData;
+	bool m_IsPlain;      // テキストが変換の必要な文字を含まない
+	bool m_PendingClose; // 空要素タグの TK_CLOSE を返す必要がある
+
+	// KInputStream から読み取る場合にだけ使う
+	KInputStream m_Input;
+	std::string m_Buf;   // 入力から読み取った未処理のテキスト
+	int m_ChunkSize;
+	bool m_Streaming;    // KInputStream から読み取っている
+	bool m_InputEnd;     // 入力の終端まで読み取った
+	bool m_NeedMore;     // トークンの途中でバッファの終端に達した
+};
+
+
+namespace Test {
+void Test_xmlreader();
+}
+
+} // namespace
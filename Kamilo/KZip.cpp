@@ -2,7 +2,10 @@
 //
 #include <time.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <vector>
+#include <unordered_map>
+#include <mutex>
 #include "KStream.h"
 #include "KInternal.h"
 #include "KCrc32.h"
@@ -89,6 +92,43 @@ struct SZipEndOfCentralDirectoryRecord {
 };
 #pragma pack (pop)
 
+// ZIP64 終端レコード
+// 中央ディレクトリの位置やエントリ数が 32 ビット（エントリ数は 16 ビット）に収まらない場合に、
+// 終端レコードの直前に置かれる。
+//
+// ※この構造体はそのままファイルに書き込むため、
+// 各メンバーのサイズ、オフセットは ZIP の仕様と完全に一致している。
+// アラインメントに注意すること。
+#pragma pack (push, 1)
+struct SZipZip64EndOfCentralDirectoryRecord {
+	uint32_t signature;
+	uint64_t record_size; // このメンバーより後ろのバイト数
+	uint16_t version_made_by;
+	uint16_t version_needed_to_extract;
+	uint32_t disknum;
+	uint32_t startdisknum;
+	uint64_t diskdirentry;
+	uint64_t direntry;
+	uint64_t dirsize;
+	uint64_t startpos;
+};
+#pragma pack (pop)
+
+// ZIP64 終端レコードの位置を示すロケータ。
+// 存在する場合は、終端レコードの直前に置かれる
+//
+// ※この構造体はそのままファイルに書き込むため、
+// 各メンバーのサイズ、オフセットは ZIP の仕様と完全に一致している。
+// アラインメントに注意すること。
+#pragma pack (push, 1)
+struct SZipZip64EndOfCentralDirectoryLocator {
+	uint32_t signature;
+	uint32_t startdisknum;
+	uint64_t eocd64_offset; // ZIP64 終端レコードの位置（ZIPファイル先頭からのオフセット）
+	uint32_t totaldisks;
+};
+#pragma pack (pop)
+
 
 #if 0
 // データデスクリプタ
@@ -123,6 +163,7 @@ struct SZipDataDescriptor {
 #define ZIP_CRYPT_HEADER_SIZE           12         // 暗号ヘッダのバイト数
 #define ZIP_VERSION_UNCOMPRESS          10         // ver1.0 無圧縮
 #define ZIP_VERSION_DEFLATE             20         // ver2.0 Deflate 圧縮
+#define ZIP_VERSION_ZIP64               45         // ver4.5 ZIP64
 #define ZIP_COMPRESS_METHOD_UNCOMPRESS  0          // 圧縮方法: 無圧縮
 #define ZIP_COMPRESS_METHOD_DEFLATE     8          // 圧縮方法: Deflate
 #define ZIP_OPT_ENCRYPTED               0x0001     // bit  0 -- 暗号化されている
@@ -132,6 +173,12 @@ struct SZipDataDescriptor {
 #define ZIP_SIGN_PK0304                 0x04034B50 // ローカルファイルヘッダ
 #define ZIP_SIGN_PK0506                 0x06054B50 // 終端レコード
 #define ZIP_SIGN_PK0708                 0x08074B50 // データデスクリプタ http://www.tnksoft.com/reading/zipfile/pk0708.php
+#define ZIP_SIGN_PK0606                 0x06064B50 // ZIP64 終端レコード
+#define ZIP_SIGN_PK0607                 0x07064B50 // ZIP64 終端レコードのロケータ
+#define ZIP_EXTRA_ZIP64                 0x0001     // 拡張データの識別子: ZIP64 拡張情報
+#define ZIP_EXTRA_NTFS                  0x000A     // 拡張データの識別子: NTFS タイムスタンプ
+#define ZIP64_MARK16                    0xFFFF     // 16 ビットに収まらず、ZIP64 のフィールドに値があることを示す
+#define ZIP64_MARK32                    0xFFFFFFFF // 32 ビットに収まらず、ZIP64 のフィールドに値があることを示す
 #define ZIPEX_MAX_NAME                  256        // ZIP格納するエントリー名の最大数（自主的に科した制限で、ZIPの仕様とは無関係）
 #define ZIPEX_MAX_EXTRA                 16         // ZIPに格納する拡張データの最大数（自主的に科した制限で、ZIPの仕様とは無関係）
 #pragma endregion // ZipDef
@@ -239,7 +286,7 @@ private:
 struct SZipExtraBlock {
 	uint16_t sign;   // 識別子
 	uint16_t size;   // データバイト数
-	uint32_t offset; // データの位置（ZIPファイル先頭からのオフセット）
+	uint64_t offset; // データの位置（ZIPファイル先頭からのオフセット）
 
 	SZipExtraBlock() {
 		sign = 0;
@@ -251,8 +298,13 @@ struct SZipExtraBlock {
 struct SZipEntryBlock {
 	SZipLocalFileHeader lo_hdr;        // ローカルファイルヘッダ
 	SZipCentralDirectoryHeader cd_hdr; // 中央ディレクトリヘッダ
-	uint32_t lo_hdr_offset;            // ローカルファイルヘッダの位置（ZIPファイル先頭からのオフセット）
-	uint32_t dat_offset;               // 圧縮データの位置（ZIPファイル先頭からのオフセット）
+	uint64_t lo_hdr_offset;            // ローカルファイルヘッダの位置（ZIPファイル先頭からのオフセット）
+	uint64_t dat_offset;               // 圧縮データの位置（ZIPファイル先頭からのオフセット）
+
+	// 圧縮後と展開後のバイト数。
+	// 中央ディレクトリヘッダの値が ZIP64_MARK32 の場合は ZIP64 拡張情報の値が入っている
+	uint64_t compressed_size;
+	uint64_t uncompressed_size;
 
 	// ファイル名。
 	// 絶対パスやnullptrは指定できない。"../" や "./" などの上に登るようなパスも指定できない。
@@ -267,13 +319,15 @@ struct SZipEntryBlock {
 	time_t ctime;        // コンテンツの作成日時
 	uint32_t num_extras; // 拡張データ数
 	SZipExtraBlock extras[ZIPEX_MAX_EXTRA]; // 拡張データ
-	uint32_t comment_offset; // コメントがあるなら、その位置（ZIPファイル先頭からのオフセット）。なければ 0
+	uint64_t comment_offset; // コメントがあるなら、その位置（ZIPファイル先頭からのオフセット）。なければ 0
 
 	SZipEntryBlock() {
 		memset(&lo_hdr, 0, sizeof(lo_hdr));
 		memset(&cd_hdr, 0, sizeof(cd_hdr));
 		lo_hdr_offset = 0;
 		dat_offset = 0;
+		compressed_size = 0;
+		uncompressed_size = 0;
 		namebin[0] = 0;
 		atime = 0;
 		mtime = 0;
@@ -297,6 +351,7 @@ struct SZipEntryWritingParams {
 
 	SZipLocalFileHeader output_lo_hdr; // ローカルファイルヘッダ（Zip__WriteEntry の実行結果として設定される）
 	SZipCentralDirectoryHeader output_cd_hdr; // 中央ディレクトリヘッダ（Zip__WriteEntry の実行結果として設定される）
+	std::string output_cd_extra; // 中央ディレクトリヘッダに続く拡張データ（Zip__WriteEntry の実行結果として設定される）
 
 	SZipEntryWritingParams() {
 		atime = 0;
@@ -400,16 +455,25 @@ static bool Zip__WriteEntry(KOutputStream &output, SZipEntryWritingParams &param
 	params.output_lo_hdr = local_file_hdr;
 
 	// あとでローカルファイルヘッダの書き込み位置が必要になる
-	int header_pos = output.tell();
+	int64_t header_pos = output.tell();
 
 	// データの書き込み
-	output.write(&local_file_hdr, sizeof(local_file_hdr)); // ローカルファイルヘッダ
-	output.write(params.namebin.c_str(), local_file_hdr.file_name_length); // ファイル名
+	// ローカルファイルヘッダ、ファイル名、（暗号化ヘッダ）、データ
+	KOutputSpan spans[4];
+	int num_spans = 0;
+	spans[num_spans++] = {&local_file_hdr, (int)sizeof(local_file_hdr)};
+	spans[num_spans++] = {params.namebin.c_str(), (int)local_file_hdr.file_name_length};
 	if (!params.password.empty()) {
-		output.write(crypt_header, ZIP_CRYPT_HEADER_SIZE);
-		output.write(&encoded_data[0], encoded_data.size());
-	} else {
-		output.write(&encoded_data[0], encoded_data.size());
+		spans[num_spans++] = {crypt_header, ZIP_CRYPT_HEADER_SIZE};
+	}
+	spans[num_spans++] = {encoded_data.data(), (int)encoded_data.size()};
+	int total = 0;
+	for (int i=0; i<num_spans; i++) {
+		total += spans[i].size;
+	}
+	if (output.writeSpans(spans, num_spans) != total) {
+		ZIP_ERROR("Failed to write an entry");
+		return false;
 	}
 	// 中央ディレクトリ
 	// http://www.tvg.ne.jp/menyukko/cauldron/dtzipformat.html#rainbow
@@ -430,7 +494,22 @@ static bool Zip__WriteEntry(KOutputStream &output, SZipEntryWritingParams &param
 	central_dir_hdr.disk_number_start         = 0;
 	central_dir_hdr.internal_file_attributes  = 0;
 	central_dir_hdr.external_file_attributes  = params.file_attr;
-	central_dir_hdr.relative_offset_of_local_header = header_pos;
+	central_dir_hdr.relative_offset_of_local_header = (uint32_t)header_pos;
+
+	// ローカルファイルヘッダの位置が 32 ビットに収まらない場合は ZIP64 拡張情報に書く。
+	// データサイズは int に収まるので、サイズについては ZIP64 拡張情報を使う必要はない
+	params.output_cd_extra.clear();
+	if ((uint64_t)header_pos >= ZIP64_MARK32) {
+		uint16_t sign = ZIP_EXTRA_ZIP64;
+		uint16_t size = 8;
+		uint64_t offset = (uint64_t)header_pos;
+		params.output_cd_extra.append((const char *)&sign, 2);
+		params.output_cd_extra.append((const char *)&size, 2);
+		params.output_cd_extra.append((const char *)&offset, 8);
+		central_dir_hdr.version_needed_to_extract = ZIP_VERSION_ZIP64;
+		central_dir_hdr.extra_field_length = (uint16_t)params.output_cd_extra.size();
+		central_dir_hdr.relative_offset_of_local_header = ZIP64_MARK32;
+	}
 	params.output_cd_hdr = central_dir_hdr;
 	
 	return true;
@@ -441,33 +520,68 @@ static bool Zip__WriteEntry(KOutputStream &output, SZipEntryWritingParams &param
 static bool Zip__WriteCentralDirectoryHeader(KOutputStream &output, const SZipEntryWritingParams &params) {
 	K__ASSERT(!params.namebin.empty());
 	K__ASSERT(params.output_cd_hdr.file_name_length == params.namebin.size());
-	output.write(&params.output_cd_hdr, sizeof(SZipCentralDirectoryHeader));
-	output.write(params.namebin.c_str(), params.output_cd_hdr.file_name_length);
+	K__ASSERT(params.output_cd_hdr.extra_field_length == params.output_cd_extra.size());
+	KOutputSpan spans[] = {
+		{&params.output_cd_hdr, (int)sizeof(SZipCentralDirectoryHeader)},
+		{params.namebin.c_str(), (int)params.output_cd_hdr.file_name_length},
+		{params.output_cd_extra.data(), (int)params.output_cd_extra.size()},
+	};
+	int total = spans[0].size + spans[1].size + spans[2].size;
+	if (output.writeSpans(spans, 3) != total) {
+		ZIP_ERROR("Failed to write a Centeral Directory Record");
+		return false;
+	}
 	return true;
 }
 
 // 終端レコードを書き込む
+// 中央ディレクトリの位置やエントリ数が終端レコードに収まらない場合は、
+// ZIP64 終端レコードとそのロケータを終端レコードの直前に書き込む
 // cd_hdr_offset 中央ディレクトリヘッダの位置（すでに zip_write_central_directory_header によってファイルに書き込まれているものとする）
 // contents      コンテンツ配列（すでに Zip__WriteEntry によってファイルに書き込まれているものとする）
 // num_contents  コンテンツ数
 // comment       ZIPファイル全体に対するコメント文字列または nullptr
-static bool Zip__WriteEndOfCentralDirectoryHeaderAndComment(KOutputStream &output, size_t cd_hdr_offset, const SZipEntryWritingParams *contents, int num_contents, const char *comment, int commentsize) {
-	SZipEndOfCentralDirectoryRecord hdr;
-	hdr.signature    = ZIP_SIGN_PK0506;
-	hdr.disknum      = 0;
-	hdr.startdisknum = 0;
-	hdr.diskdirentry = (uint16_t)num_contents;
-	hdr.direntry     = (uint16_t)num_contents;
-	hdr.dirsize      = 0;
+static bool Zip__WriteEndOfCentralDirectoryHeaderAndComment(KOutputStream &output, int64_t cd_hdr_offset, const SZipEntryWritingParams *contents, int num_contents, const char *comment, int commentsize) {
 	// オフセットを計算
+	uint64_t dirsize = 0;
 	for (int i=0; i<num_contents; ++i) {
 		const SZipCentralDirectoryHeader *cd_hdr = &contents[i].output_cd_hdr;
-		hdr.dirsize += sizeof(SZipCentralDirectoryHeader);
-		hdr.dirsize += cd_hdr->file_name_length;
-		hdr.dirsize += cd_hdr->extra_field_length;
-		hdr.dirsize += cd_hdr->file_comment_length;
+		dirsize += sizeof(SZipCentralDirectoryHeader);
+		dirsize += cd_hdr->file_name_length;
+		dirsize += cd_hdr->extra_field_length;
+		dirsize += cd_hdr->file_comment_length;
+	}
+	bool zip64 = (num_contents >= ZIP64_MARK16) || ((uint64_t)cd_hdr_offset >= ZIP64_MARK32) || (dirsize >= ZIP64_MARK32);
+	if (zip64) {
+		int64_t eocd64_offset = output.tell();
+		SZipZip64EndOfCentralDirectoryRecord hdr64;
+		hdr64.signature                 = ZIP_SIGN_PK0606;
+		hdr64.record_size               = sizeof(hdr64) - 12; // signature と record_size 自身を含まない
+		hdr64.version_made_by           = ZIP_VERSION_ZIP64;
+		hdr64.version_needed_to_extract = ZIP_VERSION_ZIP64;
+		hdr64.disknum                   = 0;
+		hdr64.startdisknum              = 0;
+		hdr64.diskdirentry              = (uint64_t)num_contents;
+		hdr64.direntry                  = (uint64_t)num_contents;
+		hdr64.dirsize                   = dirsize;
+		hdr64.startpos                  = (uint64_t)cd_hdr_offset;
+		output.write(&hdr64, sizeof(hdr64));
+
+		SZipZip64EndOfCentralDirectoryLocator loc;
+		loc.signature     = ZIP_SIGN_PK0607;
+		loc.startdisknum  = 0;
+		loc.eocd64_offset = (uint64_t)eocd64_offset;
+		loc.totaldisks    = 1;
+		output.write(&loc, sizeof(loc));
 	}
-	hdr.startpos = cd_hdr_offset; // 中央ディレクトリの開始バイト位置
+	SZipEndOfCentralDirectoryRecord hdr;
+	hdr.signature    = ZIP_SIGN_PK0506;
+	hdr.disknum      = 0;
+	hdr.startdisknum = 0;
+	hdr.diskdirentry = (num_contents < ZIP64_MARK16) ? (uint16_t)num_contents : ZIP64_MARK16;
+	hdr.direntry     = hdr.diskdirentry;
+	hdr.dirsize      = (dirsize < ZIP64_MARK32) ? (uint32_t)dirsize : ZIP64_MARK32;
+	hdr.startpos     = ((uint64_t)cd_hdr_offset < ZIP64_MARK32) ? (uint32_t)cd_hdr_offset : ZIP64_MARK32; // 中央ディレクトリの開始バイト位置
 	hdr.comment_length = comment ? (uint16_t)commentsize : 0; // このヘッダに続くzipコメントのサイズ
 	output.write(&hdr, sizeof(hdr));
 
@@ -486,7 +600,7 @@ static bool Zip__WriteEndOfCentralDirectoryHeaderAndComment(KOutputStream &outpu
 // input の現在位置からの2バイトが value と等しいか調べる。
 // この関数は読み取りヘッダを移動しない
 static bool Unzip__CheckFileUint16(KInputStream &input, uint16_t value) {
-	int pos = input.tell();
+	int64_t pos = input.tell();
 	uint16_t data = input.readUint16();
 	input.seek(pos);
 	return data == value;
@@ -495,7 +609,7 @@ static bool Unzip__CheckFileUint16(KInputStream &input, uint16_t value) {
 // input の現在位置からの4バイトが value と等しいか調べる。
 // この関数は読み取りヘッダを移動しない
 static bool Unzip__CheckFileUint32(KInputStream &input, uint32_t value) {
-	int pos = input.tell();
+	int64_t pos = input.tell();
 	uint32_t data = input.readUint32();
 	input.seek(pos);
 	return data == value;
@@ -521,7 +635,7 @@ static bool Unzip__HasOption(const SZipEntryBlock *entry, uint32_t zip_opt) {
 }
 
 // 展開後のサイズ
-static size_t Unzip__GetUnzipSize(const SZipEntryBlock *entry) {
+static uint64_t Unzip__GetUnzipSize(const SZipEntryBlock *entry) {
 	K__ASSERT(entry);
 	// サイズ情報を見る時は必ず中央ディレクトリヘッダを見るようにする。
 
@@ -531,7 +645,17 @@ static size_t Unzip__GetUnzipSize(const SZipEntryBlock *entry) {
 	// ZIP_OPT_DATADESC フラグがあるならファイルデータ末尾にデータデスクリプタが存在し、そこにファイルサイズが書いてある。
 	// その場合、ローカルファイルヘッダの方にはデータサイズ 0 と記載される。
 	// ZIP_OPT_DATADESC フラグが無い場合、ファイルデータ末尾にデータデスクリプタは存在せず、ローカルファイルヘッダ側にデータサイズが記録されている
-	return entry->cd_hdr.uncompressed_size;
+	//
+	// 中央ディレクトリヘッダの値が ZIP64_MARK32 になっている場合は ZIP64 拡張情報の値を使う。
+	// どちらの場合も Unzip__ReadCenteralDirectoryHeaderAndEntry で entry->uncompressed_size にセット済み
+	return entry->uncompressed_size;
+}
+
+// getEntryData などでエントリ全体を一度に展開できる大きさかどうか。
+// KZlib::uncompress_raw などは int でサイズを扱うため、2GB を超えるエントリは openEntryStream で読む必要がある
+static bool Unzip__CanReadAtOnce(const SZipEntryBlock *entry) {
+	K__ASSERT(entry);
+	return entry->compressed_size <= INT_MAX && entry->uncompressed_size <= INT_MAX;
 }
 
 // コメントを得る
@@ -563,9 +687,10 @@ static size_t Unzip__GetExtra(KInputStream &input, const SZipExtraBlock *extra,
 }
 
 // コンテンツデータを復元する
-static bool Unzip__UnzipEntry(KInputStream &input, const SZipEntryBlock *entry, const char *password, std::string *output) {
+// 圧縮データ部分を無変換のまま読み取る
+static bool Unzip__ReadEntryRaw(KInputStream &input, const SZipEntryBlock *entry, std::string *compressed_data) {
 	K__ASSERT(entry);
-	K__ASSERT(output);
+	K__ASSERT(compressed_data);
 
 	// 圧縮データ部分に移動
 	input.seek(entry->dat_offset);
@@ -582,45 +707,92 @@ static bool Unzip__UnzipEntry(KInputStream &input, const SZipEntryBlock *entry,
 	// ローカルファイルヘッダ側にデータサイズが記録されている
 
 //	SZipLocalFileHeader hdr = entry->lo_hdr;
-	SZipCentralDirectoryHeader hdr = entry->cd_hdr;
-
-	if (hdr.compressed_size == 0) {
+	if (entry->compressed_size == 0) {
 		ZIP_ERROR("Invalid data size");
 		return false;
 	}
+	if (!Unzip__CanReadAtOnce(entry)) {
+		ZIP_ERROR("Too large entry");
+		return false;
+	}
 
-	std::string compressed_data(hdr.compressed_size, '\0');
-	input.read(&compressed_data[0], hdr.compressed_size);
+	int size = (int)entry->compressed_size;
+	compressed_data->resize(size);
+	input.read(&(*compressed_data)[0], size);
+	return true;
+}
 
-	void *data_ptr = nullptr;
-	int data_len = 0;
-	if (hdr.general_purpose_bit_flag & ZIP_OPT_ENCRYPTED) {
-		// 暗号化を解除
-		const uint8_t *crypt_header = (const uint8_t *)&compressed_data[0];
-		data_ptr = &compressed_data[ZIP_CRYPT_HEADER_SIZE];
-		data_len = hdr.compressed_size - ZIP_CRYPT_HEADER_SIZE;
-		CZipCrypt::decode(data_ptr, data_len, password, crypt_header);
-	} else {
-		// 暗号化なし
-		data_ptr = &compressed_data[0];
-		data_len = hdr.compressed_size;
+// 入力全体がメモリ上にある場合に、圧縮データ部分の先頭アドレスを得る。
+// 入力ストリームの読み取り位置を使わないので、排他制御は不要
+// input_data: 入力全体の先頭アドレス (KInputStream::data)
+// input_size: 入力全体のバイト数
+static bool Unzip__GetEntryRawPtr(const void *input_data, int64_t input_size, const SZipEntryBlock *entry, const void **compressed_data) {
+	K__ASSERT(input_data);
+	K__ASSERT(entry);
+	K__ASSERT(compressed_data);
+
+	if (entry->compressed_size == 0) {
+		ZIP_ERROR("Invalid data size");
+		return false;
+	}
+	if (entry->dat_offset + entry->compressed_size > (uint64_t)input_size) {
+		ZIP_ERROR("Invalid data size");
+		return false;
 	}
+	*compressed_data = (const uint8_t *)input_data + entry->dat_offset;
+	return true;
+}
+
+// 暗号化されていない圧縮データを展開する。
+// 入力ストリームにはアクセスしないため、複数のスレッドから同時に呼び出してもよい
+// Unzip__CanReadAtOnce が true であること
+static bool Unzip__InflateEntry(const SZipEntryBlock *entry, const void *data_ptr, int data_len, std::string *output) {
+	K__ASSERT(entry);
+	K__ASSERT(output);
+	K__ASSERT(Unzip__CanReadAtOnce(entry));
+
+	const SZipCentralDirectoryHeader &hdr = entry->cd_hdr;
+	int unzip_size = (int)entry->uncompressed_size;
 
 	if (hdr.compression_method) {
 		// 圧縮を解除
-		std::string input((const char*)data_ptr, data_len);
-		*output = KZlib::uncompress_raw(input, hdr.uncompressed_size);
-		K__ASSERT(output->size() == hdr.uncompressed_size);
+		*output = KZlib::uncompress_raw(data_ptr, data_len, unzip_size);
+		K__ASSERT((int)output->size() == unzip_size);
 		return true;
 		
 	} else {
 		// 無圧縮
-		output->resize(hdr.uncompressed_size);
-		memcpy(&(*output)[0], data_ptr, hdr.uncompressed_size);
+		if (data_len < unzip_size) {
+			ZIP_ERROR("Invalid data size");
+			return false;
+		}
+		output->assign((const char *)data_ptr, unzip_size);
 		return true;
 	}
 }
 
+// Unzip__ReadEntryRaw で読み取った圧縮データを展開する。
+// 入力ストリームにはアクセスしないため、複数のスレッドから同時に呼び出してもよい
+// compressed_data: 圧縮データ。暗号化されている場合はその場で復号するため、内容が書き換わる
+static bool Unzip__DecodeEntry(const SZipEntryBlock *entry, const char *password, std::string &compressed_data, std::string *output) {
+	K__ASSERT(entry);
+	K__ASSERT(output);
+
+	const SZipCentralDirectoryHeader &hdr = entry->cd_hdr;
+
+	if (hdr.general_purpose_bit_flag & ZIP_OPT_ENCRYPTED) {
+		// 暗号化を解除
+		const uint8_t *crypt_header = (const uint8_t *)&compressed_data[0];
+		void *data_ptr = &compressed_data[ZIP_CRYPT_HEADER_SIZE];
+		int data_len = (int)compressed_data.size() - ZIP_CRYPT_HEADER_SIZE;
+		CZipCrypt::decode(data_ptr, data_len, password, crypt_header);
+		return Unzip__InflateEntry(entry, data_ptr, data_len, output);
+	} else {
+		// 暗号化なし
+		return Unzip__InflateEntry(entry, compressed_data.data(), (int)compressed_data.size(), output);
+	}
+}
+
 // ZIPのヘッダで使用されている時刻形式を time_t に変換する
 // zdate: 更新月日
 // ztime: 更新時刻
@@ -655,14 +827,14 @@ static bool Unzip__ReadNtfsExtraField(KInputStream &input, time_t *ctime, time_t
 	K__ASSERT(ctime);
 	K__ASSERT(mtime);
 	K__ASSERT(atime);
-	if (Unzip__CheckFileUint16(input, 0x000A)) {
+	if (Unzip__CheckFileUint16(input, ZIP_EXTRA_NTFS)) {
 		// NTFS extra field for file attributes
 		// http://archimedespalimpsest.net/Documents/External/ZIPFileFormatSpecification_6.3.2.txt
 		uint16_t sign;
 		uint16_t size;
 		input.read(&sign, 2); // 2: [NTFS extra field sign]
 		input.read(&size, 2); // 2: [NTFS extra field size]
-		int ntfs_end = input.tell() + size;
+		int64_t ntfs_end = input.tell() + size;
 		{
 			// ここから NTFS extra field の中
 			// 4: [reseved]
@@ -704,6 +876,29 @@ static bool Unzip__ReadNtfsExtraField(KInputStream &input, time_t *ctime, time_t
 	return false;
 }
 
+// ZIP64 拡張情報 (識別子 ZIP_EXTRA_ZIP64) を読み取る。
+// 現在の読み取り位置が拡張情報のデータ部分の先頭を指していると仮定する。
+// 中央ディレクトリヘッダの値が ZIP64_MARK32 になっている項目だけが、
+// 展開後サイズ、圧縮後サイズ、ローカルファイルヘッダの位置の順に 8 バイトずつ格納されている。
+// 分割書庫には対応しないので、その後に続くディスク番号は読まない
+static void Unzip__ReadZip64ExtraField(KInputStream &input, uint16_t size, SZipEntryBlock *entry) {
+	K__ASSERT(entry);
+	const SZipCentralDirectoryHeader *cd = &entry->cd_hdr;
+	int remain = size;
+	if (cd->uncompressed_size == ZIP64_MARK32 && remain >= 8) {
+		entry->uncompressed_size = input.readUint64();
+		remain -= 8;
+	}
+	if (cd->compressed_size == ZIP64_MARK32 && remain >= 8) {
+		entry->compressed_size = input.readUint64();
+		remain -= 8;
+	}
+	if (cd->relative_offset_of_local_header == ZIP64_MARK32 && remain >= 8) {
+		entry->lo_hdr_offset = input.readUint64();
+		remain -= 8;
+	}
+}
+
 // 現在の読み取り位置が中央ディレクトリヘッダを指していると仮定し、中央ディレクトリヘッダとコンテンツ情報を読み取る
 static bool Unzip__ReadCenteralDirectoryHeaderAndEntry(KInputStream &input, SZipEntryBlock *entry) {
 	K__ASSERT(entry);
@@ -729,28 +924,12 @@ static bool Unzip__ReadCenteralDirectoryHeaderAndEntry(KInputStream &input, SZip
 	//   そこでローカルファイルヘッダは信用せず、
 	//   中央ディレクトリヘッダにあるローカルファイルヘッダ情報を使うようにする
 	//	entry->lo_hdr_offset = 0; <-- 先頭のローカルファイルヘッダは使わない
+	//
+	// サイズと位置が 32 ビットに収まらない場合は ZIP64 拡張情報に書いてあるので、
+	// 拡張データを読んだ後で上書きする
 	entry->lo_hdr_offset = cd->relative_offset_of_local_header;
-
-	// ついでにローカルファイルヘッダ自体も取得しておく
-	{
-		int p = input.tell();
-		input.seek(entry->lo_hdr_offset);
-		input.read(&entry->lo_hdr, sizeof(SZipLocalFileHeader));
-		input.seek(p);
-	}
-
-	// Data Descriptor の処理
-	if (entry->lo_hdr.general_purpose_bit_flag & ZIP_OPT_DATADESC) {
-		// Data Descriptor が存在する。
-		// この場合、Local file header の compressed_size, uncompressed_size は 0 になっている。
-		// （ランダムシークできないシステムのために、データを書き込んだ後に Data Descriptor という形でファイルサイズ情報を追加している）
-		// ローカルファイルヘッダのサイズ情報を補完しておく
-		entry->lo_hdr.compressed_size = cd->compressed_size;
-		entry->lo_hdr.uncompressed_size = cd->uncompressed_size;
-	}
-
-	// 圧縮データの先頭位置（ファイル先頭からのオフセット）
-	entry->dat_offset = entry->lo_hdr_offset + sizeof(SZipLocalFileHeader) + cd->file_name_length + cd->extra_field_length;
+	entry->compressed_size = cd->compressed_size;
+	entry->uncompressed_size = cd->uncompressed_size;
 
 	// タイムスタンプ
 	// ZIPには各コンテンツの最終更新日時だけが入っている。
@@ -773,18 +952,24 @@ static bool Unzip__ReadCenteralDirectoryHeaderAndEntry(KInputStream &input, SZip
 	// 拡張データ
 	entry->num_extras = 0;
 	if (cd->extra_field_length > 0) {
-		int extra_end = input.tell() + cd->extra_field_length;
+		int64_t extra_end = input.tell() + cd->extra_field_length;
 		while (input.tell() < extra_end) {
 			SZipExtraBlock extra;
+			int64_t extra_pos = input.tell();
 			input.read(&extra.sign, 2);
 			input.read(&extra.size, 2);
 			extra.offset = input.tell();
-			input.read(nullptr, extra.size); // SKIP
 
-			// 拡張データがファイルのタイムスタンプを表している場合、その時刻を取得する
-			if (extra.sign == 0x000A) {
+			if (extra.sign == ZIP_EXTRA_ZIP64) {
+				// サイズや位置が 32 ビットに収まらない
+				Unzip__ReadZip64ExtraField(input, extra.size, entry);
+			}
+			if (extra.sign == ZIP_EXTRA_NTFS) {
+				// 拡張データがファイルのタイムスタンプを表している場合、その時刻を取得する
+				input.seek(extra_pos);
 				Unzip__ReadNtfsExtraField(input, &entry->ctime, &entry->mtime, &entry->atime);
 			}
+			input.seek(extra.offset + extra.size); // 次の拡張データへ
 
 			if (entry->num_extras < ZIPEX_MAX_EXTRA) {
 				entry->extras[entry->num_extras] = extra;
@@ -804,6 +989,29 @@ static bool Unzip__ReadCenteralDirectoryHeaderAndEntry(KInputStream &input, SZip
 		input.read(nullptr, cd->file_comment_length); // SKIP
 	}
 
+	// ついでにローカルファイルヘッダ自体も取得しておく
+	{
+		int64_t p = input.tell();
+		input.seek(entry->lo_hdr_offset);
+		input.read(&entry->lo_hdr, sizeof(SZipLocalFileHeader));
+		input.seek(p);
+	}
+
+	// Data Descriptor の処理
+	if (entry->lo_hdr.general_purpose_bit_flag & ZIP_OPT_DATADESC) {
+		// Data Descriptor が存在する。
+		// この場合、Local file header の compressed_size, uncompressed_size は 0 になっている。
+		// （ランダムシークできないシステムのために、データを書き込んだ後に Data Descriptor という形でファイルサイズ情報を追加している）
+		// ローカルファイルヘッダのサイズ情報を補完しておく
+		entry->lo_hdr.compressed_size = cd->compressed_size;
+		entry->lo_hdr.uncompressed_size = cd->uncompressed_size;
+	}
+
+	// 圧縮データの先頭位置（ファイル先頭からのオフセット）
+	// 拡張データの長さはローカルファイルヘッダと中央ディレクトリヘッダで異なる場合があるため、
+	// ローカルファイルヘッダ側の値を使う
+	entry->dat_offset = entry->lo_hdr_offset + sizeof(SZipLocalFileHeader) + entry->lo_hdr.file_name_length + entry->lo_hdr.extra_field_length;
+
 	return true;
 }
 
@@ -812,10 +1020,15 @@ static bool Unzip__SeekToEndOfCentralDirectoryRecord(KInputStream &input) {
 	SZipEndOfCentralDirectoryRecord eocd;
 
 	// ファイル末尾からシークする
-	int offset = (int)(input.size() - sizeof(eocd));
+	int64_t filesize = input.size();
+	int64_t offset = filesize - (int64_t)sizeof(eocd);
+
+	// 終端レコードの後ろにはコメント（最大 0xFFFF バイト）しかないので、それより前は探さない
+	int64_t limit = offset - 0xFFFF;
+	if (limit < 0) limit = 0;
 
 	// 識別子を確認
-	while (offset > 0) {
+	while (offset >= limit) {
 		input.seek(offset);
 		if (input.readUint32() == ZIP_SIGN_PK0506) {
 			// 識別子が一致したら、終端レコード全体を読む。
@@ -823,7 +1036,7 @@ static bool Unzip__SeekToEndOfCentralDirectoryRecord(KInputStream &input) {
 			// 正しい終端レコードを見つけられたものとする
 			input.seek(offset);
 			input.read(&eocd, sizeof(eocd));
-			if (offset + sizeof(eocd) + eocd.comment_length == input.size()) {
+			if (offset + (int64_t)sizeof(eocd) + eocd.comment_length == filesize) {
 				// 辻褄が合う。OK
 				// レコード先頭に戻しておく
 				input.seek(offset);
@@ -845,12 +1058,33 @@ static bool Unzip__SeekToCentralDirectoryHeader(KInputStream &input) {
 	}
 
 	// 終端レコードを読む
+	int64_t eocd_offset = input.tell();
 	SZipEndOfCentralDirectoryRecord hdr;
 	input.read(&hdr, sizeof(SZipEndOfCentralDirectoryRecord));
 
-	// 終端レコードには中央ディレクトリヘッダの位置が記録されているので、その値を使ってシークする
+	// 終端レコードには中央ディレクトリヘッダの位置が記録されている
+	uint64_t cd_offset = hdr.startpos;
+
+	// 終端レコードの直前に ZIP64 終端レコードのロケータがあれば、
+	// ZIP64 終端レコードに記録されている 64 ビットの位置を使う
+	if (eocd_offset >= (int64_t)sizeof(SZipZip64EndOfCentralDirectoryLocator)) {
+		SZipZip64EndOfCentralDirectoryLocator loc;
+		input.seek(eocd_offset - sizeof(loc));
+		if (input.read(&loc, sizeof(loc)) == sizeof(loc) && loc.signature == ZIP_SIGN_PK0607) {
+			SZipZip64EndOfCentralDirectoryRecord hdr64;
+			input.seek(loc.eocd64_offset);
+			if (input.read(&hdr64, sizeof(hdr64)) == sizeof(hdr64) && hdr64.signature == ZIP_SIGN_PK0606) {
+				cd_offset = hdr64.startpos;
+			} else {
+				ZIP_ERROR("Failed to find a Zip64 End of Centeral Directory Record");
+				return false;
+			}
+		}
+	}
+
+	// その値を使ってシークする
 	input.seek(0);
-	input.seek(hdr.startpos);
+	input.seek(cd_offset);
 
 	// 中央ディレクトリヘッダの識別子を確認
 	if (!Unzip__CheckFileUint32(input, ZIP_SIGN_PK0102)) {
@@ -897,7 +1131,7 @@ class CZipWriterImpl {
 	std::vector<SZipEntryWritingParams> m_Entries;
 	std::string m_Password;
 	KOutputStream m_Output;
-	int m_CentralDirectoryHeaderOffset;
+	int64_t m_CentralDirectoryHeaderOffset;
 	int m_CompressLevel;
 public:
 	CZipWriterImpl() {
@@ -975,7 +1209,9 @@ public:
 		} 
 		params.password = m_Password.c_str();
 		params.level = m_CompressLevel;
-		Zip__WriteEntry(m_Output, params);
+		if (!Zip__WriteEntry(m_Output, params)) {
+			return false;
+		}
 
 		m_Entries.push_back(params);
 		return true;
@@ -1043,8 +1279,13 @@ void KZipper::finalize(const char *comment, int commentsize) {
 
 
 class CZipReaderImpl {
+	friend class CZipEntryReadImpl;
 	std::vector<SZipEntryBlock> m_Entries;
+	std::unordered_map<std::string, int> m_NameIndex; // ファイル名（ZIP に格納されているバイナリのまま）からインデックスを得る
+	std::mutex m_Mutex; // m_Input の読み取り位置を保護する
 	KInputStream m_Input;
+	const void *m_InputData; // m_Input の内容がメモリ上にある場合はその先頭アドレス (KInputStream::data)
+	int64_t m_InputSize;
 public:
 	CZipReaderImpl() {
 		clear();
@@ -1053,11 +1294,16 @@ public:
 	}
 	void clear() {
 		m_Entries.clear();
+		m_NameIndex.clear();
 		m_Input = KInputStream();
+		m_InputData = nullptr;
+		m_InputSize = 0;
 	}
 	void setInput(KInputStream &input) {
 		clear();
 		m_Input = input;
+		m_InputData = m_Input.data();
+		m_InputSize = m_InputData ? m_Input.size() : 0;
 		
 		// 中央ディレクトリヘッダまでシーク
 		Unzip__SeekToCentralDirectoryHeader(m_Input);
@@ -1068,6 +1314,20 @@ public:
 			Unzip__ReadCenteralDirectoryHeaderAndEntry(m_Input, &entry);
 			m_Entries.push_back(entry);
 		}
+
+		// ファイル名の索引を作っておく。
+		// 同名のファイルが複数ある場合は、先頭に近いものを優先する
+		m_NameIndex.reserve(m_Entries.size());
+		for (int i=0; i<(int)m_Entries.size(); i++) {
+			m_NameIndex.emplace(m_Entries[i].namebin, i);
+		}
+	}
+	int findEntry(const std::string &name_bin) const {
+		auto it = m_NameIndex.find(name_bin);
+		if (it != m_NameIndex.end()) {
+			return it->second;
+		}
+		return -1;
 	}
 	bool isOpen() {
 		return m_Input.isOpen();
@@ -1087,7 +1347,11 @@ public:
 		const SZipEntryBlock *entry = get_entry(file_index);
 		int size = 0;
 		if (entry) {
-			size = Unzip__GetComment(m_Input, entry, bin);
+			m_Mutex.lock();
+			{
+				size = Unzip__GetComment(m_Input, entry, bin);
+			}
+			m_Mutex.unlock();
 		}
 		return size;
 	}
@@ -1100,7 +1364,11 @@ public:
 				if (out_sign) {
 					*out_sign = extra->sign;
 				}
-				size = Unzip__GetExtra(m_Input, extra, out_bin);
+				m_Mutex.lock();
+				{
+					size = Unzip__GetExtra(m_Input, extra, out_bin);
+				}
+				m_Mutex.unlock();
 			}
 		}
 		return size;
@@ -1115,7 +1383,7 @@ public:
 		}
 		return false;
 	}
-	int getEntryParamInt(int file_index, KUnzipper::INFO info) {
+	int64_t getEntryParamInt64(int file_index, KUnzipper::INFO info) {
 		const SZipEntryBlock *entry = get_entry(file_index);
 		if (entry == nullptr) {
 			return 0;
@@ -1128,27 +1396,92 @@ public:
 			return Unzip__HasOption(entry, ZIP_OPT_UTF8) ? 1 : 0;
 
 		case KUnzipper::UNZIP_SIZE:
-			return Unzip__GetUnzipSize(entry);
+			return (int64_t)Unzip__GetUnzipSize(entry);
 
 		case KUnzipper::FILE_ATTR:
 			return entry->cd_hdr.external_file_attributes;
 
 		case KUnzipper::EXTRA_COUNT:
 			return entry->num_extras;
+
+		case KUnzipper::DATA_CRC32:
+			return entry->cd_hdr.data_crc32;
 		}
 		return 0;
 	}
 	bool getEntryData(int file_index, const char *password, std::string *bin) {
 		const SZipEntryBlock *entry = get_entry(file_index);
-		if (entry) {
-			return Unzip__UnzipEntry(m_Input, entry, password, bin);
+		if (entry == nullptr) {
+			return false;
 		}
-		return false;
+		if (!Unzip__CanReadAtOnce(entry)) {
+			ZIP_ERROR("Too large entry. Use KUnzipper::openEntryStream");
+			return false;
+		}
+		if (m_InputData && !Unzip__HasOption(entry, ZIP_OPT_ENCRYPTED)) {
+			// 入力全体がメモリ上にある（メモリストリームやマップしたファイル）。
+			// 圧縮データをコピーせずに直接展開する。読み取り位置を使わないのでロックも不要
+			const void *raw = nullptr;
+			if (!Unzip__GetEntryRawPtr(m_InputData, m_InputSize, entry, &raw)) {
+				return false;
+			}
+			return Unzip__InflateEntry(entry, raw, (int)entry->compressed_size, bin);
+		}
+
+		// 入力ストリームからの読み取りだけを排他にして、
+		// 時間のかかる展開処理はロックの外で行う
+		std::string compressed_data;
+		bool ok;
+		m_Mutex.lock();
+		{
+			ok = Unzip__ReadEntryRaw(m_Input, entry, &compressed_data);
+		}
+		m_Mutex.unlock();
+		if (!ok) {
+			return false;
+		}
+		return Unzip__DecodeEntry(entry, password, compressed_data, bin);
+	}
+	bool getEntryDataPtr(int file_index, const void **p_data, int *p_size) {
+		const SZipEntryBlock *entry = get_entry(file_index);
+		if (entry == nullptr || m_InputData == nullptr) {
+			return false;
+		}
+		if (Unzip__HasOption(entry, ZIP_OPT_ENCRYPTED) || entry->cd_hdr.compression_method != 0) {
+			return false; // 展開または復号が必要
+		}
+		if (!Unzip__CanReadAtOnce(entry)) {
+			return false; // サイズが int に収まらない
+		}
+		const void *raw = nullptr;
+		if (!Unzip__GetEntryRawPtr(m_InputData, m_InputSize, entry, &raw)) {
+			return false;
+		}
+		if (p_data) *p_data = raw;
+		if (p_size) *p_size = (int)entry->uncompressed_size;
+		return true;
 	}
 	int getComment(std::string *bin) {
-		return Unzip__GetZipFileComment(m_Input, bin);
+		int size = 0;
+		m_Mutex.lock();
+		{
+			size = Unzip__GetZipFileComment(m_Input, bin);
+		}
+		m_Mutex.unlock();
+		return size;
 	}
 private:
+	// 入力ストリームの offset バイト目から size バイトを読み取る
+	int read_input(int64_t offset, void *buf, int size) {
+		int n = 0;
+		m_Mutex.lock();
+		{
+			m_Input.seek(offset);
+			n = m_Input.read(buf, size);
+		}
+		m_Mutex.unlock();
+		return n;
+	}
 	const SZipEntryBlock * get_entry(int index) const {
 		if (0 <= index && index < (int)m_Entries.size()) {
 			return &m_Entries[index];
@@ -1158,6 +1491,180 @@ private:
 };
 
 
+// ZIP 内のファイルを少しずつ展開しながら読み取る入力ストリーム。
+// 圧縮データは固定サイズのブロック単位で読み取って展開するため、展開後のデータ全体をメモリ上に持たない。
+// 入力全体がメモリ上にある場合は、圧縮データのブロックもコピーせずに直接展開する
+class CZipEntryReadImpl: public KInputStream::Impl {
+	enum {
+		RAW_BLOCK_SIZE = 64 * 1024, // 一度に読み取る圧縮データのバイト数
+		MAPPED_BLOCK_SIZE = 1024 * 1024 * 1024, // 入力全体がメモリ上にある場合に、一度に渡す圧縮データの最大バイト数
+	};
+	std::shared_ptr<CZipReaderImpl> m_Zip;
+	SZipCentralDirectoryHeader m_Hdr;
+	std::string m_Password;
+	bool m_Encrypted;
+	uint64_t m_RawOffset;  // 圧縮データの位置（暗号化ヘッダの次）
+	uint64_t m_RawSize;    // 圧縮データのバイト数（暗号化ヘッダを除く）
+	uint64_t m_RawPos;     // 読み取り済みの圧縮データのバイト数
+	int64_t m_UnzipSize;   // 展開後のデータのバイト数
+	std::string m_Raw;     // 読み取った圧縮データのブロック
+	const char *m_Block;   // 無圧縮の場合の、まだ返していないデータの先頭
+	int m_BlockLen;        // 無圧縮の場合の、まだ返していないデータのバイト数
+	CZipCrypt m_Crypt;
+	KZlibInflater m_Inflater;
+	int64_t m_Pos;         // 展開後のデータでの読み取り位置
+	bool m_Open;
+public:
+	CZipEntryReadImpl(const std::shared_ptr<CZipReaderImpl> &zip, int file_index, const char *password) {
+		const SZipEntryBlock *entry = zip->get_entry(file_index);
+		K__ASSERT(entry);
+		m_Zip = zip;
+		m_Hdr = entry->cd_hdr;
+		m_Password = password ? password : "";
+		m_Encrypted = Unzip__HasOption(entry, ZIP_OPT_ENCRYPTED);
+		m_RawOffset = entry->dat_offset;
+		m_RawSize = entry->compressed_size;
+		m_UnzipSize = (int64_t)entry->uncompressed_size;
+		if (m_Encrypted) {
+			m_RawOffset += ZIP_CRYPT_HEADER_SIZE;
+			m_RawSize = (m_RawSize >= ZIP_CRYPT_HEADER_SIZE) ? m_RawSize - ZIP_CRYPT_HEADER_SIZE : 0;
+		}
+		m_Open = true;
+		restart();
+	}
+	virtual int64_t tell() override {
+		return m_Pos;
+	}
+	virtual int read(void *data, int size) override {
+		if (!m_Open) return 0;
+		int total = 0;
+		char skip[4096]; // data=nullptr の場合は単なるシークになる。読み捨てるためのバッファ
+		while (total < size && m_Pos < this->size()) {
+			char *dst = data ? (char *)data + total : skip;
+			int want = size - total;
+			if (data == nullptr && want > (int)sizeof(skip)) want = (int)sizeof(skip);
+			int n = readSome(dst, want);
+			if (n <= 0) break;
+			total += n;
+			m_Pos += n;
+		}
+		return total;
+	}
+	virtual void seek(int64_t pos) override {
+		if (!m_Open) return;
+		if (pos < 0) pos = 0;
+		if (pos > size()) pos = size();
+		if (pos < m_Pos) {
+			restart(); // 後ろには戻れないので、先頭から展開しなおす
+		}
+		while (m_Pos < pos) {
+			int64_t n = pos - m_Pos;
+			if (read(nullptr, (n < INT_MAX) ? (int)n : INT_MAX) <= 0) {
+				break;
+			}
+		}
+	}
+	virtual int64_t size() override {
+		return m_UnzipSize;
+	}
+	virtual bool eof() override {
+		return m_Pos >= size();
+	}
+	virtual void close() override {
+		m_Open = false;
+		m_Zip = nullptr;
+		m_Raw.clear();
+	}
+	virtual bool isOpen() override {
+		return m_Open;
+	}
+private:
+	void restart() {
+		m_RawPos = 0;
+		m_Pos = 0;
+		m_Block = nullptr;
+		m_BlockLen = 0;
+		m_Inflater.reset();
+		if (m_Encrypted) {
+			uint8_t crypt_header[ZIP_CRYPT_HEADER_SIZE];
+			memset(crypt_header, 0, sizeof(crypt_header));
+			m_Zip->read_input(m_RawOffset - ZIP_CRYPT_HEADER_SIZE, crypt_header, ZIP_CRYPT_HEADER_SIZE);
+			m_Crypt.decodeInit(m_Password.c_str(), crypt_header);
+		}
+	}
+
+	// 次の圧縮データのブロックを得る。データが無ければ false を返す
+	bool nextRawBlock(const char **p_data, int *p_size) {
+		uint64_t remain = m_RawSize - m_RawPos;
+		if (remain == 0) {
+			return false;
+		}
+		if (m_Zip->m_InputData && !m_Encrypted) {
+			// 入力全体がメモリ上にある。残りをコピーせずに渡す
+			if (m_RawOffset + m_RawSize > (uint64_t)m_Zip->m_InputSize) {
+				ZIP_ERROR("Invalid data size");
+				return false;
+			}
+			int block = (remain < MAPPED_BLOCK_SIZE) ? (int)remain : MAPPED_BLOCK_SIZE;
+			*p_data = (const char *)m_Zip->m_InputData + m_RawOffset + m_RawPos;
+			*p_size = block;
+			m_RawPos += block;
+			return true;
+		}
+		int block = (remain < RAW_BLOCK_SIZE) ? (int)remain : RAW_BLOCK_SIZE;
+		m_Raw.resize(block);
+		int n = m_Zip->read_input(m_RawOffset + m_RawPos, &m_Raw[0], block);
+		if (n != block) {
+			ZIP_ERROR("Invalid data size");
+			return false;
+		}
+		if (m_Encrypted) {
+			m_Crypt.decodeData(&m_Raw[0], block);
+		}
+		*p_data = m_Raw.data();
+		*p_size = block;
+		m_RawPos += block;
+		return true;
+	}
+
+	// 展開済みのデータを最大 size バイト得る
+	int readSome(char *dst, int size) {
+		if (m_Hdr.compression_method == 0) {
+			// 無圧縮。圧縮データのブロックをそのままコピーする
+			if (m_BlockLen == 0) {
+				if (!nextRawBlock(&m_Block, &m_BlockLen)) {
+					return 0;
+				}
+			}
+			int n = (size < m_BlockLen) ? size : m_BlockLen;
+			memcpy(dst, m_Block, n);
+			m_Block += n;
+			m_BlockLen -= n;
+			return n;
+		}
+		while (1) {
+			int n = m_Inflater.pull(dst, size);
+			if (n > 0) {
+				return n;
+			}
+			if (m_Inflater.failed()) {
+				ZIP_ERROR("Failed to inflate");
+				return 0;
+			}
+			if (!m_Inflater.needInput()) {
+				return 0; // 終端に達した
+			}
+			const char *block = nullptr;
+			int len = 0;
+			if (!nextRawBlock(&block, &len)) {
+				return 0;
+			}
+			m_Inflater.push(block, len);
+		}
+	}
+};
+
+
 #pragma region KUnzipper
 KUnzipper::KUnzipper() {
 	CZipReaderImpl *impl = new CZipReaderImpl();
@@ -1177,12 +1684,24 @@ bool KUnzipper::isOpen() {
 int KUnzipper::getEntryCount() const {
 	return m_Impl->getEntryCount();
 }
+int KUnzipper::findEntry(const std::string &name_bin) const {
+	return m_Impl->findEntry(name_bin);
+}
 int KUnzipper::getEntryName(int file_index, std::string *out_bin) {
 	return m_Impl->getEntryName(file_index, out_bin);
 }
 bool KUnzipper::getEntryData(int file_index, const char *password, std::string *out_bin) {
 	return m_Impl->getEntryData(file_index, password, out_bin);
 }
+KInputStream KUnzipper::openEntryStream(int file_index, const char *password) {
+	if (file_index < 0 || m_Impl->getEntryCount() <= file_index) {
+		return KInputStream();
+	}
+	return KInputStream(new CZipEntryReadImpl(m_Impl, file_index, password));
+}
+bool KUnzipper::getEntryDataPtr(int file_index, const void **p_data, int *p_size) {
+	return m_Impl->getEntryDataPtr(file_index, p_data, p_size);
+}
 int KUnzipper::getEntryComment(int file_index, std::string *out_bin) {
 	return m_Impl->getEntryComment(file_index, out_bin);
 }
@@ -1193,7 +1712,11 @@ bool KUnzipper::getEntryTimeStamp(int file_index, time_t *time_cma) {
 	return m_Impl->getEntryTimeStamp(file_index, time_cma);
 }
 int KUnzipper::getEntryParamInt(int file_index, INFO flag) {
-	return m_Impl->getEntryParamInt(file_index, flag);
+	int64_t val = m_Impl->getEntryParamInt64(file_index, flag);
+	return (val < INT_MAX) ? (int)val : INT_MAX;
+}
+int64_t KUnzipper::getEntryParamInt64(int file_index, INFO flag) {
+	return m_Impl->getEntryParamInt64(file_index, flag);
 }
 int KUnzipper::getComment(std::string *out_bin) {
 	return m_Impl->getComment(out_bin);
@@ -1206,7 +1729,121 @@ int KUnzipper::getComment(std::string *out_bin) {
 
 namespace Test {
 
+// 手作業で組み立てた ZIP64 形式の書庫を読む。
+// 中央ディレクトリヘッダのサイズと位置はすべて ZIP64_MARK32 になっていて、本当の値は ZIP64 拡張情報にだけ書いてある。
+// 終端レコードの中央ディレクトリ位置も ZIP64_MARK32 なので、ZIP64 終端レコードを読まないと中央ディレクトリが見つからない。
+// ローカルファイルヘッダの前には 4 バイトの詰め物を置いているので、位置を 0 と読み違えると展開に失敗する
+static void Test_zip64_read() {
+	static const uint8_t bin[] = {
+		// [0] 詰め物
+		'J','U','N','K',
+		// [4] ローカルファイルヘッダ (無圧縮, 1980-01-01, CRC32=0xF7D18982, サイズ 5)
+		0x50,0x4B,0x03,0x04, 0x0A,0x00, 0x00,0x00, 0x00,0x00, 0x00,0x00, 0x21,0x00,
+		0x82,0x89,0xD1,0xF7, 0x05,0x00,0x00,0x00, 0x05,0x00,0x00,0x00, 0x05,0x00, 0x00,0x00,
+		'a','.','t','x','t',
+		// [39] データ
+		'H','e','l','l','o',
+		// [44] 中央ディレクトリヘッダ (サイズと位置は ZIP64_MARK32, 拡張データ 28 バイト)
+		0x50,0x4B,0x01,0x02, 0x2D,0x00, 0x2D,0x00, 0x00,0x00, 0x00,0x00, 0x00,0x00, 0x21,0x00,
+		0x82,0x89,0xD1,0xF7, 0xFF,0xFF,0xFF,0xFF, 0xFF,0xFF,0xFF,0xFF, 0x05,0x00, 0x1C,0x00,
+		0x00,0x00, 0x00,0x00, 0x00,0x00, 0x20,0x00,0x00,0x00, 0xFF,0xFF,0xFF,0xFF,
+		'a','.','t','x','t',
+		// ZIP64 拡張情報 (展開後サイズ=5, 圧縮後サイズ=5, ローカルファイルヘッダ位置=4)
+		0x01,0x00, 0x18,0x00,
+		0x05,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		0x05,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		0x04,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		// [123] ZIP64 終端レコード (エントリ数 1, 中央ディレクトリ 79 バイト, 位置 44)
+		0x50,0x4B,0x06,0x06, 0x2C,0x00,0x00,0x00,0x00,0x00,0x00,0x00, 0x2D,0x00, 0x2D,0x00,
+		0x00,0x00,0x00,0x00, 0x00,0x00,0x00,0x00,
+		0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		0x01,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		0x4F,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		0x2C,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+		// [179] ZIP64 終端レコードのロケータ (ZIP64 終端レコードの位置 123)
+		0x50,0x4B,0x06,0x07, 0x00,0x00,0x00,0x00, 0x7B,0x00,0x00,0x00,0x00,0x00,0x00,0x00, 0x01,0x00,0x00,0x00,
+		// [199] 終端レコード (値はすべて ZIP64 終端レコードを参照)
+		0x50,0x4B,0x05,0x06, 0x00,0x00, 0x00,0x00, 0xFF,0xFF, 0xFF,0xFF,
+		0xFF,0xFF,0xFF,0xFF, 0xFF,0xFF,0xFF,0xFF, 0x00,0x00,
+	};
+	K__VERIFY(sizeof(bin) == 221);
+
+	KInputStream file = KInputStream::fromMemory(bin, sizeof(bin));
+	KUnzipper zr(file);
+	K__VERIFY(zr.getEntryCount() == 1);
+	K__VERIFY(zr.findEntry("a.txt") == 0);
+	K__VERIFY(zr.getEntryParamInt64(0, KUnzipper::UNZIP_SIZE) == 5);
+	K__VERIFY(zr.getEntryParamInt64(0, KUnzipper::DATA_CRC32) == 0xF7D18982);
+	K__VERIFY(zr.getEntryParamInt64(0, KUnzipper::FILE_ATTR) == 0x20);
+	K__VERIFY(zr.getEntryParamInt64(0, KUnzipper::EXTRA_COUNT) == 1);
+
+	uint16_t sign = 0;
+	std::string extra;
+	K__VERIFY(zr.getEntryExtra(0, 0, &sign, &extra) == 24);
+	K__VERIFY(sign == ZIP_EXTRA_ZIP64);
+
+	// データの位置は ZIP64 拡張情報のローカルファイルヘッダ位置から求まる
+	const void *ptr = nullptr;
+	int size = 0;
+	K__VERIFY(zr.getEntryDataPtr(0, &ptr, &size));
+	K__VERIFY((const uint8_t *)ptr - bin == 39);
+	K__VERIFY(size == 5);
+
+	std::string data;
+	K__VERIFY(zr.getEntryData(0, nullptr, &data));
+	K__VERIFY(data.compare("Hello") == 0);
+}
+
+// エントリ数が 16 ビットに収まらない書庫を書いて読み戻す。
+// 終端レコードのエントリ数は ZIP64_MARK16 になり、ZIP64 終端レコードとロケータが書き込まれる
+static void Test_zip64_write() {
+	const int num = 70000;
+	std::string bin;
+	{
+		KOutputStream output = KOutputStream::fromMemory(&bin);
+		KZipper zw(output);
+		zw.setCompressLevel(0);
+		char name[32];
+		for (int i=0; i<num; i++) {
+			snprintf(name, sizeof(name), "%d.txt", i);
+			K__VERIFY(zw.addEntry(name, name, -1, nullptr, 0));
+		}
+		zw.finalize(nullptr, 0);
+	}
+
+	// 末尾は ZIP64 終端レコード (56 バイト)、ロケータ (20 バイト)、終端レコード (22 バイト) の順
+	K__VERIFY(bin.size() > 56 + 20 + 22);
+	const char *eocd = bin.data() + bin.size() - sizeof(SZipEndOfCentralDirectoryRecord);
+	const char *loc  = eocd - sizeof(SZipZip64EndOfCentralDirectoryLocator);
+	const char *eocd64 = loc - sizeof(SZipZip64EndOfCentralDirectoryRecord);
+	SZipEndOfCentralDirectoryRecord hdr;
+	SZipZip64EndOfCentralDirectoryLocator hdrloc;
+	SZipZip64EndOfCentralDirectoryRecord hdr64;
+	memcpy(&hdr, eocd, sizeof(hdr));
+	memcpy(&hdrloc, loc, sizeof(hdrloc));
+	memcpy(&hdr64, eocd64, sizeof(hdr64));
+	K__VERIFY(hdr.signature == ZIP_SIGN_PK0506);
+	K__VERIFY(hdr.direntry == ZIP64_MARK16);
+	K__VERIFY(hdrloc.signature == ZIP_SIGN_PK0607);
+	K__VERIFY(hdrloc.eocd64_offset == (uint64_t)(eocd64 - bin.data()));
+	K__VERIFY(hdr64.signature == ZIP_SIGN_PK0606);
+	K__VERIFY(hdr64.direntry == (uint64_t)num);
+	K__VERIFY(hdr64.startpos == hdr.startpos); // 書庫が小さいので 32 ビットの位置もそのまま有効
+
+	KInputStream file = KInputStream::fromMemory(bin.data(), (int)bin.size());
+	KUnzipper zr(file);
+	K__VERIFY(zr.getEntryCount() == num);
+	std::string name, data;
+	zr.getEntryName(0, &name); zr.getEntryData(0, nullptr, &data); K__VERIFY(name.compare("0.txt") == 0); K__VERIFY(data.compare("0.txt") == 0);
+	zr.getEntryName(65535, &name); zr.getEntryData(65535, nullptr, &data); K__VERIFY(name.compare("65535.txt") == 0); K__VERIFY(data.compare("65535.txt") == 0);
+	zr.getEntryName(num-1, &name); zr.getEntryData(num-1, nullptr, &data); K__VERIFY(name.compare("69999.txt") == 0); K__VERIFY(data.compare("69999.txt") == 0);
+	K__VERIFY(zr.findEntry("12345.txt") == 12345);
+}
+
 void Test_zip(const char *output_dir) {
+	Test_zip64_read();
+	Test_zip64_write();
+
 	const std::string name1 = K::pathJoin(output_dir, "Test_zip(plain).zip");
 	const std::string name2 = K::pathJoin(output_dir, "Test_zip(password).zip");
 	const std::string name3 = K::pathJoin(output_dir, "Test_zip(each_file_has_deferent_passwords).zip");
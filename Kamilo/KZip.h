@@ -57,6 +57,7 @@ public:
 		UNZIP_SIZE,    // 展開後のデータサイズ
 		FILE_ATTR,     // ファイル属性
 		EXTRA_COUNT,   // 拡張情報の個数
+		DATA_CRC32,    // 展開後のデータの CRC32 値。中身を展開せずに変更を検出できる。getEntryParamInt64 で得る
 	};
 
 	KUnzipper();
@@ -66,6 +67,12 @@ public:
 
 	int getEntryCount() const;
 
+	/// ファイル名からインデックスを得る。見つからなければ -1 を返す。
+	/// ファイル名は ZIP に格納されているバイナリのまま、大小文字を区別して比較する。
+	/// 索引は open() のときに作るので、エントリ数に関係なく一定時間で探せる
+	/// @see getEntryName()
+	int findEntry(const std::string &name_bin) const;
+
 	/// ファイル名を得る。
 	/// ※文字コードは考慮しない。ZIPに格納されているバイナリをそのまま返す
 	/// out_bin を nullptr にした場合はサイズだけ返す
@@ -74,9 +81,23 @@ public:
 
 	/// ファイルを展開する
 	/// out_bin を nullptr にした場合はサイズだけ返す
+	/// 圧縮前または圧縮後のサイズが 2GB を超えるファイルは一度に展開できないため、openEntryStream を使う
+	/// 入力ストリームの読み取りは排他制御しているので、複数のスレッドから同時に呼び出してもよい。
+	/// 展開処理そのものはロックの外で行うため、別々のエントリであれば並列に展開される
 	/// @see getEntryParamInt(), UNZIP_SIZE
 	bool getEntryData(int file_index, const char *password, std::string *out_bin);
 
+	/// ファイルを少しずつ展開しながら読み取る入力ストリームを得る。
+	/// getEntryData と違い、展開後のデータ全体をメモリ上に置かない。
+	/// 後方へのシークは先頭から展開しなおすため遅い。
+	/// 得られたストリームは、この KUnzipper を破棄した後も使える
+	KInputStream openEntryStream(int file_index, const char *password);
+
+	/// 無圧縮かつ暗号化されていないファイルの内容を、コピーせずに直接参照する。
+	/// 入力ストリームの内容がメモリ上にある場合 (KInputStream::data) にだけ成功する。
+	/// 得られたポインタは入力ストリームを閉じるまで有効
+	bool getEntryDataPtr(int file_index, const void **p_data, int *p_size);
+
 	/// ファイルのコメントを得る。
 	/// ※文字コードは考慮しない。ZIPに格納されているバイナリをそのまま返す
 	/// out_bin を nullptr にした場合はサイズだけ返す
@@ -91,9 +112,13 @@ public:
 	/// Create, Modify, Access の順で時刻が格納される。
 	bool getEntryTimeStamp(int file_index, time_t *time_cma);
 
-	/// ファイル情報を得る
+	/// ファイル情報を得る。
+	/// int に収まらない値（2GB を超える UNZIP_SIZE など）は INT_MAX を返す
 	int getEntryParamInt(int file_index, INFO flag);
 
+	/// ファイル情報を 64 ビットで得る。ZIP64 形式の大きなファイルのサイズを得る場合に使う
+	int64_t getEntryParamInt64(int file_index, INFO flag);
+
 	/// このZIPファイルのコメントを得る。
 	/// @note コメントは単なるバイト列であることに注意
 	/// out_bin を nullptr にした場合はサイズだけ返す
@@ -1,5 +1,6 @@
 ﻿#include "KZlib.h"
 #include <assert.h>
+#include "KInternal.h"
 
 #if 0
 	// libz を使う
@@ -125,4 +126,97 @@ std::string KZlib::uncompress_raw(const std::string &bin, int maxoutsize) {
 	return _Uncompress(bin.data(), bin.size(), maxoutsize, -MAX_WBITS);
 }
 
+
+
+class CZlibInflaterImpl {
+	z_stream m_Strm;
+	int m_WindowBits;
+	bool m_Finished;
+	bool m_Failed;
+public:
+	explicit CZlibInflaterImpl(int window_bits) {
+		m_WindowBits = window_bits;
+		memset(&m_Strm, 0, sizeof(m_Strm));
+		m_Finished = false;
+		m_Failed = inflateInit2(&m_Strm, m_WindowBits) != Z_OK;
+	}
+	~CZlibInflaterImpl() {
+		inflateEnd(&m_Strm);
+	}
+	void reset() {
+		inflateEnd(&m_Strm);
+		memset(&m_Strm, 0, sizeof(m_Strm));
+		m_Finished = false;
+		m_Failed = inflateInit2(&m_Strm, m_WindowBits) != Z_OK;
+	}
+	void push(const void *data, int size) {
+		K__ASSERT(m_Strm.avail_in == 0); // 前回の入力を消費しきってから追加すること
+		m_Strm.next_in = (Bytef*)data;
+		m_Strm.avail_in = size;
+	}
+	int pull(void *out, int size) {
+		if (m_Finished || m_Failed || size <= 0) {
+			return 0;
+		}
+		m_Strm.next_out = (Bytef*)out;
+		m_Strm.avail_out = size;
+		int result = inflate(&m_Strm, Z_NO_FLUSH);
+		int n = size - (int)m_Strm.avail_out;
+		if (result == Z_STREAM_END) {
+			m_Finished = true;
+		} else if (result == Z_BUF_ERROR) {
+			// 入力不足で先に進めない。エラーではない
+		} else if (result != Z_OK) {
+			m_Failed = true;
+		}
+		return n;
+	}
+	bool needInput() const {
+		return !m_Finished && !m_Failed && m_Strm.avail_in == 0;
+	}
+	bool finished() const {
+		return m_Finished;
+	}
+	bool failed() const {
+		return m_Failed;
+	}
+	size_t getTotalOut() const {
+		return (size_t)m_Strm.total_out;
+	}
+};
+
+
+#pragma region KZlibInflater
+KZlibInflater::KZlibInflater(Format format) {
+	int window_bits = -MAX_WBITS;
+	switch (format) {
+	case RAW:  window_bits = -MAX_WBITS; break;
+	case ZLIB: window_bits = MAX_WBITS; break;
+	case GZIP: window_bits = MAX_WBITS+16; break;
+	}
+	m_Impl = std::make_shared<CZlibInflaterImpl>(window_bits);
+}
+void KZlibInflater::reset() {
+	m_Impl->reset();
+}
+void KZlibInflater::push(const void *data, int size) {
+	m_Impl->push(data, size);
+}
+int KZlibInflater::pull(void *out, int size) {
+	return m_Impl->pull(out, size);
+}
+bool KZlibInflater::needInput() const {
+	return m_Impl->needInput();
+}
+bool KZlibInflater::finished() const {
+	return m_Impl->finished();
+}
+bool KZlibInflater::failed() const {
+	return m_Impl->failed();
+}
+size_t KZlibInflater::getTotalOut() const {
+	return m_Impl->getTotalOut();
+}
+#pragma endregion // KZlibInflater
+
 } // namespace
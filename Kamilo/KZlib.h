@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include <string>
+#include <memory>
 
 namespace Kamilo {
 
@@ -27,4 +28,60 @@ public:
 	static std::string uncompress_raw(const void *data, int size, int maxoutsize);
 };
 
+
+class CZlibInflaterImpl;
+
+/// 圧縮データを少しずつ展開する。
+///
+/// KZlib::uncompress_raw などと違い、展開後のデータ全体を入れるバッファを必要としない。
+/// push() で圧縮データを渡し、pull() で展開済みのデータを固定サイズのブロック単位で取り出す。
+/// pull() が 0 を返したときに needInput() が true ならば、次の圧縮データを push() する
+/// @code
+/// KZlibInflater inf(KZlibInflater::RAW);
+/// inf.push(data, size);
+/// char buf[4096];
+/// while (1) {
+///     int n = inf.pull(buf, sizeof(buf));
+///     if (n > 0) { ...buf の n バイトを使う... ; continue; }
+///     if (inf.needInput()) { ...次の圧縮データを push する... ; continue; }
+///     break; // 終端に達したか、エラー (failed)
+/// }
+/// @endcode
+class KZlibInflater {
+public:
+	enum Format {
+		RAW,  ///< ヘッダ無し
+		ZLIB, ///< zlib ヘッダ
+		GZIP, ///< gzip ヘッダ
+	};
+
+	explicit KZlibInflater(Format format=RAW);
+
+	/// 展開状態を初期化し、最初から展開しなおせるようにする
+	void reset();
+
+	/// 圧縮データを追加する。
+	/// data はコピーしないので、pull() で全て消費されるまで (needInput() が true になるまで) 破棄してはいけない
+	void push(const void *data, int size);
+
+	/// 展開済みのデータを最大 size バイト取り出し、取り出したバイト数を返す。
+	/// 入力が足りない場合、終端に達した場合、エラーが発生した場合は 0 を返す
+	int pull(void *out, int size);
+
+	/// 追加した圧縮データを全て消費していて、次の圧縮データが必要ならば true
+	bool needInput() const;
+
+	/// 圧縮データの終端まで展開したら true
+	bool finished() const;
+
+	/// 壊れた圧縮データを検出したか、展開の準備 (inflateInit2) に失敗したら true
+	bool failed() const;
+
+	/// これまでに取り出した展開済みデータのバイト数
+	size_t getTotalOut() const;
+
+private:
+	std::shared_ptr<CZlibInflaterImpl> m_Impl;
+};
+
 }
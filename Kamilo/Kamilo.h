@@ -60,6 +60,7 @@
 #include "KSound.h"
 #include "KStorage.h"
 #include "KString.h"
+#include "KStringTable.h"
 #include "KSpriteDrawable.h"
 #include "KSystem.h"
 #include "KTable.h"
@@ -74,6 +75,7 @@
 #include "KZlib.h"
 #include "KZip.h"
 #include "KXml.h"
+#include "KXmlReader.h"
 
 
 #ifndef KENG_DISABLE_PRAGMA_LINK
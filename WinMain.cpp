@@ -1,7 +0,0 @@
-﻿#include <Windows.h>
-#include <GameMain.h>
-
-int WINAPI WinMain(HINSTANCE hCurrInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
-	GameMain(lpCmdLine);
-	return 0;
-}
@@ -0,0 +1,5 @@
+﻿#include <GameMain.h>
+
+int main(int argc, char **argv) {
+	return GameMain(argc, argv);
+}